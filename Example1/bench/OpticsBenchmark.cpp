@@ -0,0 +1,461 @@
+// optics-bench: micro and macro benchmarks for the ray-optics core
+//
+//   optics-bench [options]
+//     --quick                  small sweep for CI smoke runs
+//     --max-rays <n>           largest ray count of the trace sweep (default 10^7)
+//     --max-surfaces <n>       largest surface count of the trace sweep (default 256)
+//     --threads <n>            tracing threads, 0 = all cores (default 1)
+//     --memory-budget-mb <n>   skip trace sweep points whose ray paths would not fit (default 4096)
+//     -o <file>                write results as JSON (default optics-bench.json)
+#include "RayOptics.h"
+#include "OpticsSource.h"
+#include "RayPaths.h"
+#include "PrecisionTrace.h"
+#include "IrradianceDetector.h"
+#include "ParaxialSystem.h"
+#include "LensOptimizer.h"
+#include "SpotAnalysis.h"
+#include "TracePool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace Optics;
+
+// Count heap traffic so traces can report bytes allocated per ray
+// Every replaceable form is overridden in matching pairs, over-aligned types (CompiledSurface) included
+namespace {
+    std::atomic<size_t> allocatedBytes{ 0 };
+    std::atomic<size_t> allocationCount{ 0 };
+
+    void* countedAllocate(size_t size, size_t alignment)
+    {
+        allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+        allocationCount.fetch_add(1, std::memory_order_relaxed);
+        void* p;
+        if (alignment <= alignof(std::max_align_t))
+            p = std::malloc(size ? size : 1);
+        else {
+            // aligned_alloc needs a size that is a multiple of the alignment
+            size_t rounded = (size + alignment - 1) / alignment * alignment;
+#ifdef _MSC_VER
+            p = _aligned_malloc(rounded ? rounded : alignment, alignment);
+#else
+            p = std::aligned_alloc(alignment, rounded ? rounded : alignment);
+#endif
+        }
+        if (!p)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    void countedFree(void* p, size_t alignment) noexcept
+    {
+#ifdef _MSC_VER
+        if (alignment > alignof(std::max_align_t)) {
+            _aligned_free(p);
+            return;
+        }
+#else
+        (void)alignment;
+#endif
+        std::free(p);
+    }
+}
+
+void* operator new(size_t size) { return countedAllocate(size, 0); }
+void* operator new[](size_t size) { return countedAllocate(size, 0); }
+void* operator new(size_t size, std::align_val_t alignment) { return countedAllocate(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return countedAllocate(size, (size_t)alignment); }
+
+void operator delete(void* p) noexcept { countedFree(p, 0); }
+void operator delete[](void* p) noexcept { countedFree(p, 0); }
+void operator delete(void* p, size_t) noexcept { countedFree(p, 0); }
+void operator delete[](void* p, size_t) noexcept { countedFree(p, 0); }
+void operator delete(void* p, std::align_val_t alignment) noexcept { countedFree(p, (size_t)alignment); }
+void operator delete[](void* p, std::align_val_t alignment) noexcept { countedFree(p, (size_t)alignment); }
+void operator delete(void* p, size_t, std::align_val_t alignment) noexcept { countedFree(p, (size_t)alignment); }
+void operator delete[](void* p, size_t, std::align_val_t alignment) noexcept { countedFree(p, (size_t)alignment); }
+
+namespace {
+
+    using Clock = std::chrono::steady_clock;
+
+    double secondsSince(Clock::time_point start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    // Keep results alive so the optimiser cannot drop the measured work
+    volatile double benchmarkSink = 0;
+
+    struct KernelResult {
+        std::string name;
+        size_t calls;
+        double seconds;
+    };
+
+    struct TraceResult {
+        size_t rays;
+        size_t surfaces;
+        bool skipped;
+        double seconds;
+        size_t hits;
+        size_t bytes;
+        size_t allocations;
+    };
+
+    // Alternating entrance/exit surfaces forming thin biconvex lenses along +x
+    std::vector<SphereLens> makeLensStack(size_t surfaces)
+    {
+        std::vector<SphereLens> lenses;
+        for (size_t i = 0; i < surfaces; i++) {
+            bool entrance = i % 2 == 0;
+            double x = (double)(i / 2) * 10.0 + (entrance ? 0.0 : 2.0);
+            lenses.emplace_back(NodeWeft::Vec2{ x, 0 }, entrance ? 400.0 : -400.0, 1.5, entrance, 0.004);
+        }
+        return lenses;
+    }
+
+    SourceDescription makeSource(size_t rays)
+    {
+        SourceDescription source;
+        source.sourceType = SourceDescription::ParallelSource;
+        source.rayCount = (int)rays;
+        source.apertureX = -1;
+        source.apertureSize = 6;
+        source.parallelAngle = 1;
+        source.parallelStartOffset = 10;
+        return source;
+    }
+
+    // Run body in rounds until minSeconds have passed, returns calls and time
+    template<typename Body>
+    KernelResult runKernel(const std::string& name, size_t callsPerRound, double minSeconds, Body body)
+    {
+        size_t calls = 0;
+        Clock::time_point start = Clock::now();
+        double seconds = 0;
+        do {
+            body();
+            calls += callsPerRound;
+            seconds = secondsSince(start);
+        } while (seconds < minSeconds);
+        std::cerr << "  " << name << ": " << seconds * 1e9 / calls << " ns/call\n";
+        return KernelResult{ name, calls, seconds };
+    }
+
+    std::vector<KernelResult> runKernelBenchmarks(double minSeconds)
+    {
+        std::vector<KernelResult> results;
+        const size_t count = 4096;
+        SphereLens entrance(NodeWeft::Vec2{ 0, 0 }, 40.0, 1.5, true, 0.004);
+        SphereLens exit(NodeWeft::Vec2{ 4, 0 }, -40.0, 1.5, false, 0.004);
+
+        std::vector<Ray> source;
+        generateSourceRays(makeSource(count), source);
+
+        std::cerr << "kernels\n";
+        // drop the recorded hit again after each call, capacity stays so nothing is reallocated
+        std::vector<Ray> rays = source;
+        results.push_back(runKernel("intersectAndUpdateRay", count, minSeconds, [&]() {
+            size_t hits = 0;
+            for (auto& r : rays) {
+                if (intersectAndUpdateRay(r, entrance, 1.0)) {
+                    r.path.pop_back();
+                    r.hits.pop_back();
+                    hits++;
+                }
+            }
+            benchmarkSink = benchmarkSink + (double)hits;
+        }));
+
+        // refractRay needs the hit recorded by intersectAndUpdateRay, refract a fresh copy each round
+        std::vector<Ray> hitRays = source;
+        for (auto& r : hitRays)
+            intersectAndUpdateRay(r, entrance, 1.0);
+        results.push_back(runKernel("refractRay", count, minSeconds, [&]() {
+            size_t refracted = 0;
+            for (auto& r : hitRays) {
+                NodeWeft::Vec2 direction = r.direction;
+                refracted += refractRay(r, entrance);
+                r.direction = direction;
+            }
+            benchmarkSink = benchmarkSink + (double)refracted;
+        }));
+
+        results.push_back(runKernel("fresnelReflectance", count, minSeconds, [&]() {
+            double sum = 0;
+            for (auto& r : hitRays)
+                sum += fresnelReflectance(r.direction, r.hits.back().normal, 1.0, 1.5);
+            benchmarkSink = benchmarkSink + sum;
+        }));
+
+        std::vector<Ray> spectrum(count);
+        for (size_t i = 0; i < count; i++)
+            spectrum[i].wavelength = 380.0 + 320.0 * (double)i / count;
+        results.push_back(runKernel("Ray::getWavelengthColor", count, minSeconds, [&]() {
+            unsigned sum = 0;
+            for (auto& r : spectrum) {
+                NodeWeft::tRGB c = r.getWavelengthColor();
+                sum += c.r + c.g + c.b;
+            }
+            benchmarkSink = benchmarkSink + sum;
+        }));
+
+        // the same spread of wavelengths as a 64-bin spectral source, drawn in bins
+        WavelengthPalette palette;
+        results.push_back(runKernel("WavelengthPalette (64 bins)", count, minSeconds, [&]() {
+            unsigned sum = 0;
+            for (size_t i = 0; i < count; i++) {
+                NodeWeft::tRGB c = palette(380.0 + 5.0 * (i * 64 / count), 1.0);
+                sum += c.r + c.g + c.b;
+            }
+            benchmarkSink = benchmarkSink + sum;
+        }));
+
+        // only the state a kernel overwrites is restored between calls
+        RayBatch batch;
+        batch.load(source, 0, source.size());
+        RayBatch loaded = batch;
+        results.push_back(runKernel("intersectBatch", count, minSeconds, [&]() {
+            std::copy(loaded.originX.begin(), loaded.originX.end(), batch.originX.begin());
+            std::copy(loaded.originY.begin(), loaded.originY.end(), batch.originY.begin());
+            benchmarkSink = benchmarkSink + (double)intersectBatch(batch, entrance, 0, count);
+        }));
+
+        // the same surface as a conic and as an asphere, Newton iteration for the latter
+        SphereLens conic = entrance;
+        conic.surfaceType = SphereLens::ConicSurface;
+        conic.conicConstant = -0.5;
+        results.push_back(runKernel("intersectBatch (conic)", count, minSeconds, [&]() {
+            std::copy(loaded.originX.begin(), loaded.originX.end(), batch.originX.begin());
+            std::copy(loaded.originY.begin(), loaded.originY.end(), batch.originY.begin());
+            benchmarkSink = benchmarkSink + (double)intersectBatch(batch, conic, 0, count);
+        }));
+        SphereLens asphere = conic;
+        asphere.surfaceType = SphereLens::AsphericSurface;
+        asphere.asphericCoefficients[0] = 1e-6;
+        results.push_back(runKernel("intersectBatch (asphere)", count, minSeconds, [&]() {
+            std::copy(loaded.originX.begin(), loaded.originX.end(), batch.originX.begin());
+            std::copy(loaded.originY.begin(), loaded.originY.end(), batch.originY.begin());
+            benchmarkSink = benchmarkSink + (double)intersectBatch(batch, asphere, 0, count);
+        }));
+
+        intersectBatch(loaded, entrance, 0, count);
+        batch = loaded;
+        results.push_back(runKernel("refractBatch", count, minSeconds, [&]() {
+            std::copy(loaded.directionX.begin(), loaded.directionX.end(), batch.directionX.begin());
+            std::copy(loaded.directionY.begin(), loaded.directionY.end(), batch.directionY.begin());
+            std::copy(loaded.mediumIndex.begin(), loaded.mediumIndex.end(), batch.mediumIndex.begin());
+            benchmarkSink = benchmarkSink + (double)refractBatch(batch, entrance, 0, count);
+        }));
+
+        // 64 spectral bins through a dispersive surface, n(wavelength) is looked up per bin
+        SourceDescription white = makeSource((std::max)(count / 64, (size_t)1));
+        white.spectrum = SourceDescription::D65Spectrum;
+        white.spectralBins = 64;
+        std::vector<Ray> whiteRays;
+        generateSourceRays(white, whiteRays);
+        SphereLens flint = entrance;
+        flint.dispersiveCoefficient = 10000;
+        RayBatch whiteLoaded;
+        whiteLoaded.load(whiteRays, 0, whiteRays.size());
+        intersectBatch(whiteLoaded, flint, 0, whiteRays.size());
+        RayBatch whiteBatch = whiteLoaded;
+        results.push_back(runKernel("refractBatch (64 spectral bins)", whiteRays.size(), minSeconds, [&]() {
+            std::copy(whiteLoaded.directionX.begin(), whiteLoaded.directionX.end(), whiteBatch.directionX.begin());
+            std::copy(whiteLoaded.directionY.begin(), whiteLoaded.directionY.end(), whiteBatch.directionY.begin());
+            std::copy(whiteLoaded.mediumIndex.begin(), whiteLoaded.mediumIndex.end(), whiteBatch.mediumIndex.begin());
+            benchmarkSink = benchmarkSink + (double)refractBatch(whiteBatch, flint, 0, whiteRays.size());
+        }));
+
+        // paraxial preview through a 16-surface stack, one matrix product per ray
+        ParaxialSystem paraxial;
+        paraxial.setLenses(makeLensStack(16));
+        rays = source;
+        results.push_back(runKernel("ParaxialSystem::trace (16 surfaces)", count, minSeconds, [&]() {
+            paraxial.trace(rays);
+            for (auto& r : rays) {
+                r.path.resize(1);
+                r.hits.clear();
+            }
+            benchmarkSink = benchmarkSink + rays[0].direction.y;
+        }));
+
+        // one optimizer candidate per call: copy of the shared source batch, trace and merit
+        std::vector<RayState> states(source.begin(), source.end());
+        LensOptimizer optimizer(states, { entrance, exit }, { LensVariable{ 1, LensVariable::CurvatureRadius, exit.radius - 1, exit.radius + 1 } }, MeritSettings());
+        results.push_back(runKernel("LensOptimizer design (2 surfaces)", count, minSeconds, [&]() {
+            benchmarkSink = benchmarkSink + optimizer.gridSweep(1).rmsRadius;
+        }));
+
+        // the same fan generated, traced and reduced block by block without storing it
+        RayStream stream(makeSource(count));
+        stream.addStage(std::make_shared<const std::vector<SphereLens>>(std::vector<SphereLens>{ entrance, exit }));
+        results.push_back(runKernel("RayStream spot (2 surfaces)", count, minSeconds, [&]() {
+            SpotAnalyzer analyzer(exit.center.x + 50);
+            analyzer.add(stream);
+            benchmarkSink = benchmarkSink + analyzer.result().total.rmsRadius;
+        }));
+
+        // the same trace with paths in an arena, reset and refilled every call like a re-bake
+        SegmentList<Ray> sourceList;
+        sourceList.append(std::vector<Ray>(source));
+        RayPaths paths;
+        results.push_back(runKernel("traceRayPaths (2 surfaces)", count, minSeconds, [&]() {
+            paths.assign(sourceList);
+            traceRayPaths(paths, { entrance, exit });
+            benchmarkSink = benchmarkSink + paths.state(count - 1).origin.x;
+        }));
+
+        // path-free trace through a 16-surface stack in each precision, restarted from the source every call
+        std::vector<SphereLens> stack = makeLensStack(16);
+        std::vector<RayState> traced(states.size());
+        const char* precisionNames[] = { "double", "float", "mixed" };
+        for (int precision : { DoublePrecision, FloatPrecision, MixedPrecision }) {
+            results.push_back(runKernel(std::string("traceRayStates ") + precisionNames[precision] + " (16 surfaces)", count, minSeconds, [&]() {
+                std::copy(states.begin(), states.end(), traced.begin());
+                traceRayStates(traced, stack, 1, precision);
+                benchmarkSink = benchmarkSink + traced[count - 1].direction.y;
+            }));
+        }
+
+        // irradiance profile of the source fan on a 512-bin detector line, one histogram per worker
+        results.push_back(runKernel("IrradianceDetector (512 bins)", count, minSeconds, [&]() {
+            IrradianceDetector detector(NodeWeft::Vec2{ exit.center.x + 50, -50 }, NodeWeft::Vec2{ exit.center.x + 50, 50 }, 512);
+            detector.add(states);
+            benchmarkSink = benchmarkSink + detector.result().power;
+        }));
+
+        // sanity check that the second surface is reachable so the trace sweep measures real hits
+        rays = source;
+        traceRays(rays, { entrance, exit });
+        benchmarkSink = benchmarkSink + (double)rays.back().hits.size();
+        return results;
+    }
+
+    TraceResult runTrace(size_t rayCount, size_t surfaceCount, int threadCount, size_t memoryBudget)
+    {
+        TraceResult result{ rayCount, surfaceCount, false, 0, 0, 0, 0 };
+        // path point + hit record per surface, plus vector growth slack
+        size_t estimatedBytes = rayCount * (sizeof(Ray) + surfaceCount * (sizeof(NodeWeft::Vec2) + sizeof(RayHit)) * 2);
+        if (estimatedBytes > memoryBudget) {
+            result.skipped = true;
+            return result;
+        }
+
+        std::vector<SphereLens> lenses = makeLensStack(surfaceCount);
+        std::vector<Ray> rays;
+        generateSourceRays(makeSource(rayCount), rays);
+
+        size_t bytesBefore = allocatedBytes.load();
+        size_t allocationsBefore = allocationCount.load();
+        Clock::time_point start = Clock::now();
+        traceRays(rays, lenses, threadCount);
+        result.seconds = secondsSince(start);
+        result.bytes = allocatedBytes.load() - bytesBefore;
+        result.allocations = allocationCount.load() - allocationsBefore;
+
+        for (auto& r : rays)
+            result.hits += r.hits.size();
+        return result;
+    }
+
+    void writeJson(const std::string& path, const std::vector<KernelResult>& kernels, const std::vector<TraceResult>& traces, int threadCount)
+    {
+        std::ofstream os(path);
+        os << "{\n  \"threads\": " << TracePool::resolveThreadCount(threadCount) << ",\n";
+        os << "  \"kernels\": [";
+        for (size_t i = 0; i < kernels.size(); i++) {
+            const KernelResult& k = kernels[i];
+            os << (i ? "," : "") << "\n    { \"name\": \"" << k.name << "\", \"calls\": " << k.calls
+                << ", \"seconds\": " << k.seconds << ", \"ns_per_call\": " << k.seconds * 1e9 / k.calls << " }";
+        }
+        os << "\n  ],\n  \"traces\": [";
+        for (size_t i = 0; i < traces.size(); i++) {
+            const TraceResult& t = traces[i];
+            os << (i ? "," : "") << "\n    { \"rays\": " << t.rays << ", \"surfaces\": " << t.surfaces;
+            if (t.skipped)
+                os << ", \"skipped\": true }";
+            else {
+                os << ", \"seconds\": " << t.seconds
+                    << ", \"rays_per_sec\": " << t.rays / t.seconds
+                    << ", \"hits\": " << t.hits
+                    << ", \"ns_per_hit\": " << (t.hits ? t.seconds * 1e9 / t.hits : 0.0)
+                    << ", \"bytes_per_ray\": " << (double)t.bytes / t.rays
+                    << ", \"allocations_per_ray\": " << (double)t.allocations / t.rays << " }";
+            }
+        }
+        os << "\n  ]\n}\n";
+    }
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    size_t maxRays = 10000000, maxSurfaces = 256, memoryBudgetMB = 4096;
+    int threadCount = 1;
+    double minKernelSeconds = 0.2;
+    std::string outputPath = "optics-bench.json";
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                std::cerr << "missing value for " << arg << "\n";
+                std::exit(2);
+            }
+            return argv[++i];
+        };
+        if (arg == "--quick") {
+            maxRays = 100000;
+            maxSurfaces = 16;
+            minKernelSeconds = 0.02;
+        }
+        else if (arg == "--max-rays")
+            maxRays = std::strtoull(next(), nullptr, 10);
+        else if (arg == "--max-surfaces")
+            maxSurfaces = std::strtoull(next(), nullptr, 10);
+        else if (arg == "--threads")
+            threadCount = std::atoi(next());
+        else if (arg == "--memory-budget-mb")
+            memoryBudgetMB = std::strtoull(next(), nullptr, 10);
+        else if (arg == "-o")
+            outputPath = next();
+        else {
+            std::cerr << "usage: optics-bench [--quick] [--max-rays <n>] [--max-surfaces <n>] [--threads <n>]\n"
+                         "                    [--memory-budget-mb <n>] [-o <file>]\n";
+            return arg == "-h" || arg == "--help" ? 0 : 2;
+        }
+    }
+
+    std::vector<KernelResult> kernels = runKernelBenchmarks(minKernelSeconds);
+
+    std::cerr << "traces (rays x surfaces)\n";
+    std::vector<TraceResult> traces;
+    for (size_t rays = 1000; rays <= maxRays; rays *= 10) {
+        for (size_t surfaces = 1; surfaces <= maxSurfaces; surfaces *= 4) {
+            traces.push_back(runTrace(rays, surfaces, threadCount, memoryBudgetMB << 20));
+            const TraceResult& t = traces.back();
+            if (t.skipped)
+                std::cerr << "  " << rays << " x " << surfaces << ": skipped, over memory budget\n";
+            else
+                std::cerr << "  " << rays << " x " << surfaces << ": " << t.rays / t.seconds << " rays/s, "
+                          << (t.hits ? t.seconds * 1e9 / t.hits : 0.0) << " ns/hit, "
+                          << (double)t.bytes / t.rays << " B/ray\n";
+        }
+    }
+
+    writeJson(outputPath, kernels, traces, threadCount);
+    std::cerr << "results written to " << outputPath << "\n";
+    return 0;
+}
@@ -0,0 +1,321 @@
+// optics-trace: headless batch tracer for .nwproj projects
+//
+//   optics-trace <project.nwproj> [options]
+//     --node <name>        trace only this Optics Refract, Spot Analysis, Optics Detector or Lens Optimizer node (default: all Optics Refract nodes)
+//     --threads <n>        worker threads, 0 = all cores (default 0)
+//     --rays <n>           override the ray count of every source
+//     --format json|csv    output format (default json)
+//     --no-paths           only write ray endpoints and directions
+//     --detector-csv <file> write the irradiance profiles of Optics Detector nodes as CSV
+//     --profile <file>     write a Chrome trace of the run and print per-node statistics
+//     -o <file>            output file (default stdout)
+#include "ProjectFile.h"
+#include "OpticsProfiler.h"
+#include "OpticsAllocationCounter.h" // counts bytes allocated per node for --profile
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+using namespace OpticsCli;
+
+namespace {
+
+    void printUsage()
+    {
+        std::cerr <<
+            "usage: optics-trace <project.nwproj> [--node <name>] [--threads <n>] [--rays <n>]\n"
+            "                    [--format json|csv] [--no-paths] [--detector-csv <file>] [--profile <file>] [-o <file>]\n";
+    }
+
+    std::string jsonEscape(const std::string& s)
+    {
+        std::string out;
+        for (char ch : s) {
+            if (ch == '"' || ch == '\\')
+                out += '\\';
+            out += ch;
+        }
+        return out;
+    }
+
+    std::string formatNumber(double v)
+    {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.17g", v);
+        return buffer;
+    }
+
+    void writeSpotResult(std::ostream& os, const Optics::SpotResult& r)
+    {
+        os << "{ \"wavelength\": " << formatNumber(r.wavelength) << ", \"rays\": " << r.rays
+            << ", \"centroid\": " << formatNumber(r.centroid) << ", \"rmsRadius\": " << formatNumber(r.rmsRadius)
+            << ", \"bestFocus\": " << formatNumber(r.bestFocus) << ", \"bestFocusRms\": " << formatNumber(r.bestFocusRms) << " }";
+    }
+
+    void writeSpot(std::ostream& os, const Optics::SpotAnalysis& spot)
+    {
+        os << "\n        { \"planeX\": " << formatNumber(spot.planeX) << ", \"skippedRays\": " << spot.skippedRays
+            << ", \"longitudinalChromatic\": " << formatNumber(spot.longitudinalChromatic) << ",\n          \"total\": ";
+        writeSpotResult(os, spot.total);
+        os << ",\n          \"wavelengths\": [";
+        for (size_t k = 0; k < spot.wavelengths.size(); k++)
+            writeSpotResult(os << (k ? ", " : ""), spot.wavelengths[k]);
+        os << "] }";
+    }
+
+    void writeDetector(std::ostream& os, const Optics::IrradianceProfile& profile)
+    {
+        os << "\n        { \"start\": [" << formatNumber(profile.start.x) << ", " << formatNumber(profile.start.y)
+            << "], \"end\": [" << formatNumber(profile.end.x) << ", " << formatNumber(profile.end.y)
+            << "], \"binWidth\": " << formatNumber(profile.binWidth) << ", \"rays\": " << profile.rays
+            << ", \"missedRays\": " << profile.missedRays << ", \"power\": " << formatNumber(profile.power)
+            << ", \"peak\": " << formatNumber(profile.peak) << ",\n          \"irradiance\": [";
+        for (size_t i = 0; i < profile.binCount(); i++)
+            os << (i ? ", " : "") << formatNumber(profile.total[i]);
+        os << "],\n          \"wavelengths\": [";
+        for (size_t k = 0; k < profile.wavelengths.size(); k++) {
+            os << (k ? ", " : "") << "{ \"wavelength\": " << formatNumber(profile.wavelengths[k]) << ", \"irradiance\": [";
+            for (size_t i = 0; i < profile.binCount(); i++)
+                os << (i ? ", " : "") << formatNumber(profile.spectral[k][i]);
+            os << "] }";
+        }
+        os << "] }";
+    }
+
+    void writeOptimization(std::ostream& os, const OptimizerResult& result)
+    {
+        static const char* parameterNames[] = { "Position X", "Position Y", "Curvature Radius", "Refractive Index" };
+        os << "\n        { \"merit\": " << formatNumber(result.best.merit) << ", \"rmsRadius\": " << formatNumber(result.best.rmsRadius)
+            << ", \"transmission\": " << formatNumber(result.best.transmission) << ", \"evaluations\": " << result.evaluations
+            << ",\n          \"values\": [";
+        for (size_t k = 0; k < result.variables.size(); k++) {
+            os << (k ? ", " : "") << "{ \"lens\": " << result.variables[k].lens << ", \"parameter\": \"" << parameterNames[result.variables[k].parameter]
+                << "\", \"value\": " << formatNumber(result.best.values[k]) << " }";
+        }
+        os << "] }";
+    }
+
+    // Final states of the path-free rays, the stored ones then the streams generated block by block
+    template<typename Function>
+    void forEachState(const OpticsScene& scene, int threadCount, Function f)
+    {
+        for (auto& s : scene.states)
+            f(s);
+        std::vector<Optics::RayState> block;
+        for (auto& stream : scene.streams) {
+            for (size_t begin = 0; begin < stream.size(); begin += Optics::RayStream::blockSize) {
+                stream.generate(begin, begin + Optics::RayStream::blockSize, block, threadCount);
+                for (auto& s : block)
+                    f(s);
+            }
+        }
+    }
+
+    void writeJson(std::ostream& os, const std::vector<std::pair<std::string, OpticsScene>>& results, bool writePaths, int threadCount)
+    {
+        os << "{\n  \"nodes\": [";
+        for (size_t n = 0; n < results.size(); n++) {
+            const OpticsScene& scene = results[n].second;
+            os << (n ? "," : "") << "\n    {\n      \"name\": \"" << jsonEscape(results[n].first) << "\",\n";
+            os << "      \"lensCount\": " << scene.lenses.size() << ",\n";
+            if (!scene.spots.empty()) {
+                os << "      \"spots\": [";
+                for (size_t k = 0; k < scene.spots.size(); k++)
+                    writeSpot(os << (k ? "," : ""), scene.spots[k]);
+                os << "\n      ],\n";
+            }
+            if (!scene.detectors.empty()) {
+                os << "      \"detectors\": [";
+                for (size_t k = 0; k < scene.detectors.size(); k++)
+                    writeDetector(os << (k ? "," : ""), scene.detectors[k]);
+                os << "\n      ],\n";
+            }
+            if (!scene.optimizations.empty()) {
+                os << "      \"optimizations\": [";
+                for (size_t k = 0; k < scene.optimizations.size(); k++)
+                    writeOptimization(os << (k ? "," : ""), scene.optimizations[k]);
+                os << "\n      ],\n";
+            }
+            os << "      \"rays\": [";
+            for (size_t i = 0; i < scene.rays.size(); i++) {
+                const Optics::Ray& r = scene.rays[i];
+                NodeWeft::Vec2 end = r.getOrigin();
+                os << (i ? "," : "") << "\n        { \"wavelength\": " << formatNumber(r.wavelength)
+                    << ", \"intensity\": " << formatNumber(r.intensity)
+                    << ", \"end\": [" << formatNumber(end.x) << ", " << formatNumber(end.y) << "]"
+                    << ", \"direction\": [" << formatNumber(r.direction.x) << ", " << formatNumber(r.direction.y) << "]";
+                if (writePaths) {
+                    os << ", \"path\": [";
+                    for (size_t k = 0; k < r.path.size(); k++)
+                        os << (k ? ", " : "") << "[" << formatNumber(r.path[k].x) << ", " << formatNumber(r.path[k].y) << "]";
+                    os << "]";
+                }
+                os << " }";
+            }
+            // path-free rays only have their final state
+            size_t i = scene.rays.size();
+            forEachState(scene, threadCount, [&](const Optics::RayState& r) {
+                os << (i++ ? "," : "") << "\n        { \"wavelength\": " << formatNumber(r.wavelength)
+                    << ", \"intensity\": " << formatNumber(r.intensity)
+                    << ", \"end\": [" << formatNumber(r.origin.x) << ", " << formatNumber(r.origin.y) << "]"
+                    << ", \"direction\": [" << formatNumber(r.direction.x) << ", " << formatNumber(r.direction.y) << "]"
+                    << ", \"hits\": " << r.hitCount << " }";
+            });
+            os << "\n      ]\n    }";
+        }
+        os << "\n  ]\n}\n";
+    }
+
+    // One row per path vertex, or one row per ray endpoint without paths
+    void writeCsv(std::ostream& os, const std::vector<std::pair<std::string, OpticsScene>>& results, bool writePaths, int threadCount)
+    {
+        os << "node,ray,vertex,x,y,dirX,dirY,wavelength,intensity\n";
+        for (auto& result : results) {
+            for (size_t i = 0; i < result.second.rays.size(); i++) {
+                const Optics::Ray& r = result.second.rays[i];
+                size_t first = writePaths ? 0 : (r.path.empty() ? 0 : r.path.size() - 1);
+                for (size_t k = first; k < r.path.size(); k++) {
+                    os << result.first << ',' << i << ',' << k << ','
+                        << formatNumber(r.path[k].x) << ',' << formatNumber(r.path[k].y) << ','
+                        << formatNumber(r.direction.x) << ',' << formatNumber(r.direction.y) << ','
+                        << formatNumber(r.wavelength) << ',' << formatNumber(r.intensity) << '\n';
+                }
+            }
+            // path-free rays: one row at their last vertex, numbered by hit count like path rows
+            size_t i = result.second.rays.size();
+            forEachState(result.second, threadCount, [&](const Optics::RayState& r) {
+                os << result.first << ',' << i++ << ',' << r.hitCount << ','
+                    << formatNumber(r.origin.x) << ',' << formatNumber(r.origin.y) << ','
+                    << formatNumber(r.direction.x) << ',' << formatNumber(r.direction.y) << ','
+                    << formatNumber(r.wavelength) << ',' << formatNumber(r.intensity) << '\n';
+            });
+        }
+    }
+
+    // One row per bin and wavelength, wavelength 0 for the sum over all wavelengths
+    void writeDetectorCsv(std::ostream& os, const std::vector<std::pair<std::string, OpticsScene>>& results)
+    {
+        os << "node,detector," << Optics::irradianceCsvColumns << '\n';
+        for (auto& result : results) {
+            const std::vector<Optics::IrradianceProfile>& detectors = result.second.detectors;
+            for (size_t d = 0; d < detectors.size(); d++)
+                Optics::writeIrradianceCsv(os, detectors[d], result.first + ',' + std::to_string(d) + ',');
+        }
+    }
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    std::string projectPath, nodeName, outputPath, profilePath, detectorCsvPath, format = "json";
+    bool writePaths = true;
+    TraceSettings settings;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                std::cerr << "missing value for " << arg << "\n";
+                std::exit(2);
+            }
+            return argv[++i];
+        };
+        if (arg == "--node")
+            nodeName = next();
+        else if (arg == "--threads")
+            settings.threadCount = std::atoi(next());
+        else if (arg == "--rays")
+            settings.rayCountOverride = std::atoi(next());
+        else if (arg == "--format")
+            format = next();
+        else if (arg == "--no-paths")
+            writePaths = false;
+        else if (arg == "--detector-csv")
+            detectorCsvPath = next();
+        else if (arg == "--profile")
+            profilePath = next();
+        else if (arg == "-o")
+            outputPath = next();
+        else if (arg == "-h" || arg == "--help") {
+            printUsage();
+            return 0;
+        }
+        else if (projectPath.empty() && arg[0] != '-')
+            projectPath = arg;
+        else {
+            std::cerr << "unknown argument " << arg << "\n";
+            printUsage();
+            return 2;
+        }
+    }
+    if (projectPath.empty() || (format != "json" && format != "csv")) {
+        printUsage();
+        return 2;
+    }
+
+    OpticsProject project;
+    std::string error;
+    if (!project.load(projectPath, error)) {
+        std::cerr << "optics-trace: " << error << "\n";
+        return 1;
+    }
+
+    std::vector<std::string> targets = nodeName.empty() ? project.nodesOfClass("Optics Refract") : std::vector<std::string>{ nodeName };
+    if (targets.empty()) {
+        std::cerr << "optics-trace: no Optics Refract node in " << projectPath << "\n";
+        return 1;
+    }
+
+    Optics::Profiler& profiler = Optics::Profiler::instance();
+    if (!profilePath.empty())
+        profiler.setEnabled(true);
+
+    std::vector<std::pair<std::string, OpticsScene>> results;
+    for (auto& name : targets) {
+        results.emplace_back(name, OpticsScene());
+        Optics::ProfileCounterScope counters;
+        {
+            OPTICS_PROFILE_SCOPE("evaluate", "bake");
+            if (!project.evaluate(name, settings, results.back().second, error)) {
+                std::cerr << "optics-trace: " << error << "\n";
+                return 1;
+            }
+        }
+        if (!profilePath.empty()) {
+            Optics::RayStatistics rays;
+            rays.add(results.back().second.rays);
+            std::wstring statistics = Optics::formatBakeStatistics(counters, rays);
+            std::cerr << name << ": " << std::string(statistics.begin(), statistics.end()) << "\n";
+        }
+    }
+    if (!profilePath.empty() && !profiler.writeChromeTrace(profilePath)) {
+        std::cerr << "optics-trace: cannot write " << profilePath << "\n";
+        return 1;
+    }
+
+    if (!detectorCsvPath.empty()) {
+        std::ofstream csv(detectorCsvPath, std::ios::binary);
+        writeDetectorCsv(csv, results);
+        if (!csv.good()) {
+            std::cerr << "optics-trace: cannot write " << detectorCsvPath << "\n";
+            return 1;
+        }
+    }
+
+    std::ofstream file;
+    if (!outputPath.empty()) {
+        file.open(outputPath, std::ios::binary);
+        if (!file) {
+            std::cerr << "optics-trace: cannot write " << outputPath << "\n";
+            return 1;
+        }
+    }
+    std::ostream& os = outputPath.empty() ? std::cout : file;
+    if (format == "json")
+        writeJson(os, results, writePaths, settings.threadCount);
+    else
+        writeCsv(os, results, writePaths, settings.threadCount);
+    return os.good() ? 0 : 1;
+}
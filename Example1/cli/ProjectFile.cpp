@@ -0,0 +1,515 @@
+#include "ProjectFile.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+namespace OpticsCli {
+
+    const JsonValue* JsonValue::find(const std::string& key) const
+    {
+        for (auto& m : members)
+            if (m.first == key)
+                return &m.second;
+        return nullptr;
+    }
+
+    namespace {
+
+        class JsonParser {
+        public:
+            JsonParser(const std::string& s) : src(s) {}
+
+            bool parse(JsonValue& value, std::string& error)
+            {
+                // skip UTF-8 byte order mark
+                if (src.compare(0, 3, "\xEF\xBB\xBF") == 0)
+                    pos = 3;
+                if (!parseValue(value, 0)) {
+                    error = "JSON syntax error at offset " + std::to_string(pos);
+                    return false;
+                }
+                return true;
+            }
+
+        private:
+            void skipSpace()
+            {
+                while (pos < src.size() && (src[pos] == ' ' || src[pos] == '\t' || src[pos] == '\n' || src[pos] == '\r'))
+                    pos++;
+            }
+
+            bool parseString(std::string& out)
+            {
+                if (src[pos] != '"')
+                    return false;
+                pos++;
+                while (pos < src.size() && src[pos] != '"') {
+                    char ch = src[pos++];
+                    if (ch == '\\' && pos < src.size()) {
+                        char esc = src[pos++];
+                        switch (esc) {
+                        case 'n': out += '\n'; break;
+                        case 't': out += '\t'; break;
+                        case 'r': out += '\r'; break;
+                        case 'b': out += '\b'; break;
+                        case 'f': out += '\f'; break;
+                        case 'u': {
+                            if (pos + 4 > src.size())
+                                return false;
+                            unsigned code = (unsigned)std::strtoul(src.substr(pos, 4).c_str(), nullptr, 16);
+                            pos += 4;
+                            // encode as UTF-8, surrogate pairs are not combined
+                            if (code < 0x80)
+                                out += (char)code;
+                            else if (code < 0x800) {
+                                out += (char)(0xC0 | (code >> 6));
+                                out += (char)(0x80 | (code & 0x3F));
+                            }
+                            else {
+                                out += (char)(0xE0 | (code >> 12));
+                                out += (char)(0x80 | ((code >> 6) & 0x3F));
+                                out += (char)(0x80 | (code & 0x3F));
+                            }
+                            break;
+                        }
+                        default: out += esc; break;
+                        }
+                    }
+                    else
+                        out += ch;
+                }
+                if (pos >= src.size())
+                    return false;
+                pos++;
+                return true;
+            }
+
+            bool parseValue(JsonValue& value, int depth)
+            {
+                if (depth > 256)
+                    return false;
+                skipSpace();
+                if (pos >= src.size())
+                    return false;
+
+                char ch = src[pos];
+                if (ch == '"') {
+                    value.type = JsonValue::String;
+                    return parseString(value.text);
+                }
+                if (ch == '{') {
+                    value.type = JsonValue::Object;
+                    pos++;
+                    skipSpace();
+                    if (pos < src.size() && src[pos] == '}') {
+                        pos++;
+                        return true;
+                    }
+                    while (true) {
+                        skipSpace();
+                        std::string key;
+                        if (pos >= src.size() || !parseString(key))
+                            return false;
+                        skipSpace();
+                        if (pos >= src.size() || src[pos] != ':')
+                            return false;
+                        pos++;
+                        value.members.emplace_back(key, JsonValue());
+                        if (!parseValue(value.members.back().second, depth + 1))
+                            return false;
+                        skipSpace();
+                        if (pos >= src.size())
+                            return false;
+                        if (src[pos] == ',') {
+                            pos++;
+                            continue;
+                        }
+                        if (src[pos] != '}')
+                            return false;
+                        pos++;
+                        return true;
+                    }
+                }
+                if (ch == '[') {
+                    value.type = JsonValue::Array;
+                    pos++;
+                    skipSpace();
+                    if (pos < src.size() && src[pos] == ']') {
+                        pos++;
+                        return true;
+                    }
+                    while (true) {
+                        value.elements.emplace_back();
+                        if (!parseValue(value.elements.back(), depth + 1))
+                            return false;
+                        skipSpace();
+                        if (pos >= src.size())
+                            return false;
+                        if (src[pos] == ',') {
+                            pos++;
+                            continue;
+                        }
+                        if (src[pos] != ']')
+                            return false;
+                        pos++;
+                        return true;
+                    }
+                }
+
+                // numbers and literals are kept as text
+                size_t start = pos;
+                while (pos < src.size() && src[pos] != ',' && src[pos] != '}' && src[pos] != ']'
+                    && src[pos] != ' ' && src[pos] != '\n' && src[pos] != '\r' && src[pos] != '\t')
+                    pos++;
+                value.text = src.substr(start, pos - start);
+                value.type = value.text == "null" ? JsonValue::Null : JsonValue::String;
+                return pos > start;
+            }
+
+            const std::string& src;
+            size_t pos{ 0 };
+        };
+
+        constexpr int maxGraphDepth = 4096;
+
+    } // namespace
+
+    bool parseJson(const std::string& source, JsonValue& value, std::string& error)
+    {
+        JsonParser parser(source);
+        return parser.parse(value, error);
+    }
+
+    bool OpticsProject::load(const std::string& path, std::string& error)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            error = "cannot open " + path;
+            return false;
+        }
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        if (!parseJson(buffer.str(), root, error))
+            return false;
+
+        const JsonValue* project = root.find("Project");
+        const JsonValue* scene = project ? project->find("Scene") : nullptr;
+        const JsonValue* nodeList = scene ? scene->find("node") : nullptr;
+        if (!nodeList || nodeList->type != JsonValue::Object) {
+            error = path + " has no Project/Scene/node section";
+            return false;
+        }
+
+        for (auto& m : nodeList->members) {
+            Node node;
+            node.data = &m.second;
+            if (const JsonValue* className = m.second.find("className"))
+                node.className = className->text;
+            if (const JsonValue* inputs = m.second.find("InputNode")) {
+                for (auto& pin : inputs->members) {
+                    // pin names are "pin0", "pin1", ...
+                    size_t pinIndex = (size_t)std::atoi(pin.first.c_str() + 3);
+                    if (node.inputs.size() <= pinIndex)
+                        node.inputs.resize(pinIndex + 1);
+                    if (pin.second.type == JsonValue::Object && !pin.second.members.empty())
+                        node.inputs[pinIndex] = pin.second.members.front().first;
+                }
+            }
+            nodeOrder.push_back(m.first);
+            nodes[m.first] = node;
+        }
+        return true;
+    }
+
+    std::vector<std::string> OpticsProject::nodesOfClass(const std::string& className) const
+    {
+        std::vector<std::string> result;
+        for (auto& name : nodeOrder)
+            if (nodes.at(name).className == className)
+                result.push_back(name);
+        return result;
+    }
+
+    const OpticsProject::Node* OpticsProject::findNode(const std::string& name) const
+    {
+        auto it = nodes.find(name);
+        return it == nodes.end() ? nullptr : &it->second;
+    }
+
+    double OpticsProject::getDouble(const Node& node, const std::string& param, double fallback, int component) const
+    {
+        const JsonValue* p = node.data->find(param);
+        const JsonValue* v = p ? p->find("id" + std::to_string(component)) : nullptr;
+        return v ? std::atof(v->text.c_str()) : fallback;
+    }
+
+    bool OpticsProject::getBool(const Node& node, const std::string& param, bool fallback) const
+    {
+        const JsonValue* p = node.data->find(param);
+        const JsonValue* v = p ? p->find("data") : nullptr;
+        return v ? v->text != "0" : fallback;
+    }
+
+    bool OpticsProject::evaluate(const std::string& nodeName, const TraceSettings& settings, OpticsScene& scene, std::string& error) const
+    {
+        struct Evaluator {
+            const OpticsProject& project;
+            const TraceSettings& settings;
+            std::string& error;
+
+            bool run(const std::string& name, OpticsScene& out, int depth)
+            {
+                const Node* node = project.findNode(name);
+                if (!node) {
+                    error = "unknown node '" + name + "'";
+                    return false;
+                }
+                if (depth > maxGraphDepth) {
+                    error = "node graph is too deep or cyclic at '" + name + "'";
+                    return false;
+                }
+                auto input = [&](size_t pin) { return pin < node->inputs.size() ? node->inputs[pin] : std::string(); };
+                auto inputClass = [&](size_t pin) {
+                    const Node* n = project.findNode(input(pin));
+                    return n ? n->className : std::string();
+                };
+
+                if (node->className == "Optics Source") {
+                    if (!input(0).empty()) {
+                        if (inputClass(0) != "Optics Source") {
+                            error = name + ": only accepts a source node as input";
+                            return false;
+                        }
+                        if (!run(input(0), out, depth + 1))
+                            return false;
+                    }
+                    Optics::SourceDescription source;
+                    source.sourceType = (int)project.getDouble(*node, "Source Type", source.sourceType);
+                    source.rayCount = (int)project.getDouble(*node, "Ray Count", source.rayCount);
+                    if (settings.rayCountOverride > 0)
+                        source.rayCount = settings.rayCountOverride;
+                    source.wavelength = project.getDouble(*node, "Wavelength (nm)", source.wavelength);
+                    source.apertureX = project.getDouble(*node, "Aperture X", source.apertureX);
+                    source.apertureSize = project.getDouble(*node, "Aperture Size", source.apertureSize);
+                    source.center.x = project.getDouble(*node, "Center", source.center.x, 0);
+                    source.center.y = project.getDouble(*node, "Center", source.center.y, 1);
+                    source.parallelAngle = project.getDouble(*node, "Angle", source.parallelAngle);
+                    source.parallelStartOffset = project.getDouble(*node, "Start Offset", source.parallelStartOffset);
+                    source.sampling = (int)project.getDouble(*node, "Sampling", source.sampling);
+                    source.storage = (int)project.getDouble(*node, "Ray Storage", source.storage);
+                    source.coarseRayCount = (int)project.getDouble(*node, "Coarse Ray Count", source.coarseRayCount);
+                    source.positionTolerance = project.getDouble(*node, "Position Tolerance", source.positionTolerance);
+                    source.angleTolerance = project.getDouble(*node, "Angle Tolerance", source.angleTolerance);
+                    source.spectrum = (int)project.getDouble(*node, "Spectrum", source.spectrum);
+                    source.spectralBins = (int)project.getDouble(*node, "Spectral Bins", source.spectralBins);
+                    source.spectralRange.x = project.getDouble(*node, "Spectral Range (nm)", source.spectralRange.x, 0);
+                    source.spectralRange.y = project.getDouble(*node, "Spectral Range (nm)", source.spectralRange.y, 1);
+                    source.temperature = project.getDouble(*node, "Temperature (K)", source.temperature);
+                    for (int i = 1; i <= 6; i++) {
+                        std::string point = "Spectrum Point " + std::to_string(i);
+                        NodeWeft::Vec2 p{ project.getDouble(*node, point, 0, 0), project.getDouble(*node, point, 0, 1) };
+                        if (p.x > 0)
+                            source.customSpectrum.push_back(p);
+                    }
+                    // adaptive sampling traces against the lenses on the second pin, like the editor
+                    OpticsScene optics;
+                    if (source.sampling == Optics::SourceDescription::AdaptiveSampling && !input(1).empty() && !run(input(1), optics, depth + 1))
+                        return false;
+                    if (Optics::generatesOnDemand(source))
+                        out.streams.emplace_back(source);
+                    else if (source.sampling == Optics::SourceDescription::AdaptiveSampling && !optics.lenses.empty())
+                        Optics::generateAdaptiveSourceRays(source, optics.lenses, out.rays, settings.threadCount);
+                    else
+                        Optics::generateSourceRays(source, out.rays);
+                    return true;
+                }
+                if (node->className == "Optics Lens") {
+                    if (!input(0).empty()) {
+                        if (inputClass(0) != "Optics Lens") {
+                            error = name + ": only accepts a lens node as input";
+                            return false;
+                        }
+                        if (!run(input(0), out, depth + 1))
+                            return false;
+                    }
+                    Optics::SphereLens lens{ NodeWeft::Vec2{ project.getDouble(*node, "Position X", 0), project.getDouble(*node, "Position Y", 0) },
+                        project.getDouble(*node, "Curvature Radius", 10),
+                        project.getDouble(*node, "Refractive Index", 1.5),
+                        project.getBool(*node, "Is Entrance", true),
+                        project.getDouble(*node, "Dispersive Coefficient", 0) };
+                    lens.surfaceType = (int)project.getDouble(*node, "Surface Type", lens.surfaceType);
+                    lens.conicConstant = project.getDouble(*node, "Conic Constant", lens.conicConstant);
+                    lens.asphericCoefficients[0] = project.getDouble(*node, "A4", 0);
+                    lens.asphericCoefficients[1] = project.getDouble(*node, "A6", 0);
+                    lens.asphericCoefficients[2] = project.getDouble(*node, "A8", 0);
+                    lens.semiAperture = project.getDouble(*node, "Semi-Aperture", lens.semiAperture);
+                    lens.isMirror = project.getBool(*node, "Mirror", false);
+                    out.lenses.push_back(lens);
+                    return true;
+                }
+                if (node->className == "Optics Refract") {
+                    OpticsScene light, optics;
+                    if (!input(0).empty() && !run(input(0), light, depth + 1))
+                        return false;
+                    if (!input(1).empty() && !run(input(1), optics, depth + 1))
+                        return false;
+                    // like the editor, an unconnected or empty input gives an empty result
+                    if ((light.rays.empty() && light.states.empty() && light.streams.empty()) || optics.lenses.empty())
+                        return true;
+                    out.spots = std::move(light.spots);
+                    out.detectors = std::move(light.detectors);
+                    out.optimizations = std::move(light.optimizations);
+                    // generated rays are traced in sequence without paths when they are pulled
+                    auto stage = std::make_shared<const std::vector<Optics::SphereLens>>(optics.lenses);
+                    out.streams = std::move(light.streams);
+                    for (auto& stream : out.streams)
+                        stream.addStage(stage);
+                    // like the editor, only refracting spheres are traced non-sequentially or with the index
+                    bool spherical = std::all_of(optics.lenses.begin(), optics.lenses.end(), Optics::isSphericalRefractor);
+                    bool sequential = (int)project.getDouble(*node, "Trace Mode", 0) == 0 || !spherical;
+                    if (!project.getBool(*node, "Record Paths", true) && sequential && (int)project.getDouble(*node, "Engine", 0) != 1) {
+                        for (auto& r : light.rays)
+                            light.states.emplace_back(r);
+                        Optics::traceRayStates(light.states, optics.lenses, settings.threadCount, (int)project.getDouble(*node, "Trace Precision", 0));
+                        out.states = std::move(light.states);
+                        out.lenses = std::move(optics.lenses);
+                        return true;
+                    }
+                    // path-free input rays start again from their last hit
+                    for (auto& s : light.states)
+                        light.rays.emplace_back(s.origin, s.direction, s.wavelength, s.intensity);
+                    // batch runs have no drag to preview, only an explicit Paraxial engine uses the matrices
+                    if ((int)project.getDouble(*node, "Engine", 0) == 1 && Optics::ParaxialSystem::isApplicable(optics.lenses)) {
+                        Optics::ParaxialSystem paraxial;
+                        paraxial.setLenses(optics.lenses);
+                        paraxial.trace(light.rays, settings.threadCount);
+                    }
+                    else if (!sequential) {
+                        Optics::NonSequentialSettings nonSequential;
+                        nonSequential.rouletteThreshold = project.getDouble(*node, "Roulette Threshold", nonSequential.rouletteThreshold);
+                        nonSequential.maxDepth = (int)project.getDouble(*node, "Max Depth", nonSequential.maxDepth);
+                        nonSequential.threadCount = settings.threadCount;
+                        std::vector<Optics::Ray> traced;
+                        Optics::traceNonSequential(light.rays, Optics::LensSystem(optics.lenses), nonSequential, traced);
+                        light.rays = std::move(traced);
+                    }
+                    // results are identical either way, the index is only used when switched on ("Surface Index" = On)
+                    else if ((int)project.getDouble(*node, "Surface Index", 0) == 2 && spherical) {
+                        Optics::SurfaceIndex index;
+                        index.update(optics.lenses);
+                        Optics::traceRaysIndexed(light.rays, Optics::LensSystem(optics.lenses), index, settings.threadCount);
+                    }
+                    else {
+                        Optics::traceRays(light.rays, optics.lenses, settings.threadCount);
+                    }
+                    out.rays = std::move(light.rays);
+                    out.lenses = std::move(optics.lenses);
+                    return true;
+                }
+                if (node->className == "Lens Optimizer") {
+                    OpticsScene light, optics;
+                    if (!input(0).empty() && !run(input(0), light, depth + 1))
+                        return false;
+                    if (!input(1).empty() && !run(input(1), optics, depth + 1))
+                        return false;
+                    if ((light.rays.empty() && light.states.empty() && light.streams.empty()) || optics.lenses.empty())
+                        return true;
+                    OptimizerResult result;
+                    for (int i = 1; i <= 3; i++) {
+                        std::string slot = "Variable " + std::to_string(i);
+                        int parameter = (int)project.getDouble(*node, slot, 0);
+                        if (parameter < 1 || parameter > 4)
+                            continue; // off
+                        double a = project.getDouble(*node, slot + " Range", 0, 0), b = project.getDouble(*node, slot + " Range", 0, 1);
+                        result.variables.push_back(Optics::LensVariable{ (size_t)project.getDouble(*node, slot + " Lens", 0), parameter - 1, (std::min)(a, b), (std::max)(a, b) });
+                    }
+                    Optics::MeritSettings merit;
+                    merit.planeX = project.getDouble(*node, "Plane X", merit.planeX);
+                    merit.lostRayPenalty = project.getDouble(*node, "Lost Ray Penalty", merit.lostRayPenalty);
+                    Optics::NelderMeadSettings nelderMead;
+                    nelderMead.maxIterations = (int)project.getDouble(*node, "Max Iterations", nelderMead.maxIterations);
+
+                    // same search as the editor: grid sweep, Nelder-Mead, or Nelder-Mead from the best grid point
+                    std::vector<Optics::RayState> source(light.states);
+                    for (auto& r : light.rays)
+                        source.emplace_back(r);
+                    // generated rays are sampled, every design traces all of the source
+                    std::vector<Optics::RayState> sample = Optics::sampleStreams(light.streams, Optics::LensOptimizer::maxStreamSample, settings.threadCount);
+                    source.insert(source.end(), sample.begin(), sample.end());
+                    Optics::LensOptimizer optimizer(source, optics.lenses, result.variables, merit);
+                    if (optimizer.getVariables().size() != result.variables.size()) {
+                        error = name + ": variables need an existing lens and a non-empty range";
+                        return false;
+                    }
+                    int mode = (int)project.getDouble(*node, "Mode", 2);
+                    int gridSteps = (int)project.getDouble(*node, "Grid Steps", 16);
+                    int maxSteps = Optics::LensOptimizer::maxGridSteps(result.variables.size(), source.size());
+                    if (mode != 1 && gridSteps > maxSteps) {
+                        error = name + ": Grid Steps " + std::to_string(gridSteps) + " gives too many designs, at most "
+                            + std::to_string(maxSteps) + " steps with " + std::to_string(result.variables.size()) + " variables and "
+                            + std::to_string(source.size()) + " rays";
+                        return false;
+                    }
+                    if (mode == 1)
+                        result.best = optimizer.nelderMead(optimizer.initialValues(), nelderMead, settings.threadCount);
+                    else {
+                        result.best = optimizer.gridSweep(gridSteps, settings.threadCount);
+                        if (mode == 2)
+                            result.best = optimizer.nelderMead(result.best.values, nelderMead, settings.threadCount);
+                    }
+                    result.evaluations = optimizer.getEvaluationCount();
+
+                    out.lenses = optimizer.apply(result.best.values);
+                    for (auto& s : light.states)
+                        light.rays.emplace_back(s.origin, s.direction, s.wavelength, s.intensity);
+                    Optics::traceRays(light.rays, out.lenses, settings.threadCount);
+                    out.rays = std::move(light.rays);
+                    auto stage = std::make_shared<const std::vector<Optics::SphereLens>>(out.lenses);
+                    out.streams = std::move(light.streams);
+                    for (auto& stream : out.streams)
+                        stream.addStage(stage);
+                    out.spots = std::move(light.spots);
+                    out.detectors = std::move(light.detectors);
+                    out.optimizations = std::move(light.optimizations);
+                    out.optimizations.push_back(result);
+                    return true;
+                }
+                if (node->className == "Spot Analysis") {
+                    if (!input(0).empty() && !run(input(0), out, depth + 1))
+                        return false;
+                    Optics::SpotAnalyzer analyzer(project.getDouble(*node, "Plane X", 100));
+                    analyzer.add(out.rays, settings.threadCount);
+                    analyzer.add(out.states, settings.threadCount);
+                    for (auto& stream : out.streams)
+                        analyzer.add(stream, settings.threadCount);
+                    out.spots.push_back(analyzer.result());
+                    return true;
+                }
+                if (node->className == "Optics Detector") {
+                    if (!input(0).empty() && !run(input(0), out, depth + 1))
+                        return false;
+                    NodeWeft::Vec2 start{ project.getDouble(*node, "Start", 100, 0), project.getDouble(*node, "Start", -10, 1) };
+                    NodeWeft::Vec2 end{ project.getDouble(*node, "End", 100, 0), project.getDouble(*node, "End", 10, 1) };
+                    if (start.x == end.x && start.y == end.y) {
+                        error = name + ": Start and End are the same point";
+                        return false;
+                    }
+                    Optics::IrradianceDetector detector(start, end, (size_t)project.getDouble(*node, "Bin Count", 256));
+                    detector.add(out.rays, settings.threadCount);
+                    detector.add(out.states, settings.threadCount);
+                    for (auto& stream : out.streams)
+                        detector.add(stream, settings.threadCount);
+                    out.detectors.push_back(detector.result());
+                    return true;
+                }
+                error = name + ": unsupported node class '" + node->className + "'";
+                return false;
+            }
+        };
+
+        Evaluator evaluator{ *this, settings, error };
+        return evaluator.run(nodeName, scene, 0);
+    }
+
+} // namespace OpticsCli
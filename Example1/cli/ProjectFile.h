@@ -0,0 +1,86 @@
+#pragma once
+#include "RayOptics.h"
+#include "OpticsSource.h"
+#include "RayStream.h"
+#include "SurfaceIndex.h"
+#include "NonSequentialTrace.h"
+#include "ParaxialSystem.h"
+#include "SpotAnalysis.h"
+#include "LensOptimizer.h"
+#include "PrecisionTrace.h"
+#include "IrradianceDetector.h"
+#include <map>
+#include <string>
+#include <vector>
+
+namespace OpticsCli {
+
+    // Minimal JSON tree, enough for .nwproj files
+    struct JsonValue {
+        enum Type {
+            Null = 0,
+            String,
+            Object,
+            Array,
+        };
+        Type type{ Null };
+        std::string text;                                       // strings, numbers and literals
+        std::vector<std::pair<std::string, JsonValue>> members; // object members in file order
+        std::vector<JsonValue> elements;                        // array elements
+
+        const JsonValue* find(const std::string& key) const;
+    };
+
+    bool parseJson(const std::string& source, JsonValue& value, std::string& error);
+
+    // Best design found by a Lens Optimizer node
+    struct OptimizerResult {
+        std::vector<Optics::LensVariable> variables;
+        Optics::DesignResult best;
+        size_t evaluations{ 0 };
+    };
+
+    // Rays and lenses produced by a node, the headless counterpart of OpticsData
+    struct OpticsScene {
+        std::vector<Optics::Ray> rays;
+        std::vector<Optics::RayState> states;   // rays traced with "Record Paths" off
+        std::vector<Optics::RayStream> streams; // rays generated and traced as they are written or analysed
+        std::vector<Optics::SphereLens> lenses;
+        std::vector<Optics::SpotAnalysis> spots;    // one per Spot Analysis node on the way
+        std::vector<Optics::IrradianceProfile> detectors;   // one per Optics Detector node on the way
+        std::vector<OptimizerResult> optimizations; // one per Lens Optimizer node on the way
+    };
+
+    struct TraceSettings {
+        int threadCount{ 0 };       // 0 = all cores
+        int rayCountOverride{ 0 };  // replaces every source's ray count when > 0
+    };
+
+    // Node graph of a .nwproj project, evaluated the same way the editor bakes it
+    class OpticsProject {
+    public:
+        bool load(const std::string& path, std::string& error);
+
+        // Names of all nodes of a class, in file order
+        std::vector<std::string> nodesOfClass(const std::string& className) const;
+
+        // Evaluate the output of a node and everything upstream of it
+        bool evaluate(const std::string& nodeName, const TraceSettings& settings, OpticsScene& scene, std::string& error) const;
+
+    private:
+        struct Node {
+            std::string className;
+            const JsonValue* data{ nullptr };
+            std::vector<std::string> inputs;    // upstream node name per pin, empty if unconnected
+        };
+
+        const Node* findNode(const std::string& name) const;
+        double getDouble(const Node& node, const std::string& param, double fallback, int component = 0) const;
+        bool getBool(const Node& node, const std::string& param, bool fallback) const;
+
+        JsonValue root;
+        std::vector<std::string> nodeOrder;
+        std::map<std::string, Node> nodes;
+    };
+
+} // namespace OpticsCli
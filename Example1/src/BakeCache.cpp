@@ -0,0 +1,597 @@
+#include "BakeCache.h"
+#include "OpticsProfiler.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <type_traits>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Optics {
+
+    namespace {
+
+        const char fileMagic[8] = { 'N', 'W', 'B', 'A', 'K', 'E', 0, 0 };
+        const uint32_t fileVersion = 4;     // bump when the layout or the tracing results change
+
+        // File layout: Header, then the arrays below in this order, each a multiple of 8 bytes except the
+        // arena surfaces, which come last
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t reserved;
+            uint64_t key;
+            uint64_t rayCount, pathPointCount, hitCount, stateCount, lensCount, outlineCount, outlinePointCount;
+            // arenas: their lens lists back to back, one StateRecord per ray, the span points of the double
+            // and of the float arenas in ray order, then the surface of every span point
+            uint64_t arenaCount, arenaLensCount, arenaRayCount, arenaPointCount, arenaFloatPointCount;
+        };
+        struct PointRecord {
+            double x, y;
+        };
+        struct FloatPointRecord {
+            float x, y;
+        };
+        struct ArenaRecord {
+            uint32_t precision, lensCount;
+            uint64_t rayCount;
+        };
+        struct RayRecord {
+            double directionX, directionY, wavelength, intensity;
+            uint32_t pathCount, hitCount;   // points and hits of this ray, stored back to back
+        };
+        struct HitRecord {
+            double pointX, pointY, normalX, normalY, distance, indexBefore, indexAfter;
+        };
+        struct StateRecord {
+            double originX, originY, directionX, directionY, wavelength, intensity;
+            uint64_t hitCount;
+        };
+        struct LensRecord {
+            double centerX, centerY, radius, refractiveIndex, dispersiveCoefficient;
+            uint64_t isEntrance;
+            double conicConstant, asphericCoefficients[3], semiAperture;
+            uint32_t surfaceType, isMirror;
+        };
+        static_assert(std::is_trivially_copyable<RayRecord>::value && sizeof(RayRecord) % 8 == 0, "records are written as raw bytes");
+        static_assert(sizeof(Header) % 8 == 0 && sizeof(StateRecord) % 8 == 0 && sizeof(LensRecord) % 8 == 0
+            && sizeof(ArenaRecord) % 8 == 0 && sizeof(FloatPointRecord) % 8 == 0, "arrays stay 8-byte aligned");
+
+        LensRecord toRecord(const SphereLens& l)
+        {
+            return LensRecord{ l.center.x, l.center.y, l.radius, l.refractiveIndex, l.dispersiveCoefficient, l.isEntrance ? 1u : 0u,
+                l.conicConstant, { l.asphericCoefficients[0], l.asphericCoefficients[1], l.asphericCoefficients[2] }, l.semiAperture,
+                (uint32_t)l.surfaceType, l.isMirror ? 1u : 0u };
+        }
+
+        SphereLens fromRecord(const LensRecord& l)
+        {
+            SphereLens loaded(NodeWeft::Vec2{ l.centerX, l.centerY }, l.radius, l.refractiveIndex, l.isEntrance != 0, l.dispersiveCoefficient);
+            loaded.surfaceType = (int)l.surfaceType;
+            loaded.conicConstant = l.conicConstant;
+            std::copy(l.asphericCoefficients, l.asphericCoefficients + 3, loaded.asphericCoefficients);
+            loaded.semiAperture = l.semiAperture;
+            loaded.isMirror = l.isMirror != 0;
+            return loaded;
+        }
+
+        // Read-only view of a whole file
+        class MappedFile {
+        public:
+            explicit MappedFile(const std::string& path)
+            {
+#ifdef _WIN32
+                file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+                if (file == INVALID_HANDLE_VALUE)
+                    return;
+                LARGE_INTEGER fileSize;
+                if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+                    return;
+                mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                if (!mapping)
+                    return;
+                data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                size = data ? (size_t)fileSize.QuadPart : 0;
+#else
+                int fd = open(path.c_str(), O_RDONLY);
+                if (fd < 0)
+                    return;
+                struct stat info;
+                if (fstat(fd, &info) == 0 && info.st_size > 0) {
+                    void* p = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (p != MAP_FAILED) {
+                        data = (const unsigned char*)p;
+                        size = (size_t)info.st_size;
+                    }
+                }
+                close(fd);
+#endif
+            }
+            ~MappedFile()
+            {
+#ifdef _WIN32
+                if (data)
+                    UnmapViewOfFile(data);
+                if (mapping)
+                    CloseHandle(mapping);
+                if (file != INVALID_HANDLE_VALUE)
+                    CloseHandle(file);
+#else
+                if (data)
+                    munmap((void*)data, size);
+#endif
+            }
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+
+            const unsigned char* data{ nullptr };
+            size_t size{ 0 };
+
+        private:
+#ifdef _WIN32
+            HANDLE file{ INVALID_HANDLE_VALUE };
+            HANDLE mapping{ nullptr };
+#endif
+        };
+
+        // Sequential reader over the mapped bytes, fails instead of reading past the end
+        struct Reader {
+            const unsigned char* p;
+            const unsigned char* end;
+
+            template<typename T>
+            const T* take(uint64_t count)
+            {
+                if (count > (uint64_t)(end - p) / sizeof(T))
+                    return nullptr;
+                const T* items = (const T*)p;
+                p += count * sizeof(T);
+                return items;
+            }
+        };
+
+        template<typename T>
+        void writeArray(std::ofstream& os, const std::vector<T>& items)
+        {
+            if (!items.empty())
+                os.write((const char*)items.data(), items.size() * sizeof(T));
+        }
+
+    } // namespace
+
+    BakeKey::BakeKey(const char* nodeClass) : hash(14695981039346656037ull)
+    {
+        addBytes(&fileVersion, sizeof(fileVersion));
+        addBytes(nodeClass, std::strlen(nodeClass) + 1);
+    }
+
+    void BakeKey::addBytes(const void* data, size_t size)
+    {
+        const unsigned char* bytes = (const unsigned char*)data;
+        for (size_t i = 0; i < size; i++)
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+
+    BakeKey& BakeKey::add(double value)
+    {
+        addBytes(&value, sizeof(value));
+        return *this;
+    }
+
+    BakeKey& BakeKey::add(int value)
+    {
+        addBytes(&value, sizeof(value));
+        return *this;
+    }
+
+    BakeKey& BakeKey::add(bool value)
+    {
+        unsigned char b = value ? 1 : 0;
+        addBytes(&b, 1);
+        return *this;
+    }
+
+    BakeKey& BakeKey::add(const NodeWeft::Vec2& value)
+    {
+        return add(value.x).add(value.y);
+    }
+
+    BakeKey& BakeKey::addUpstream(uint64_t key)
+    {
+        valid = valid && key != 0;
+        addBytes(&key, sizeof(key));
+        return *this;
+    }
+
+    BakeCache& BakeCache::instance()
+    {
+        static BakeCache cache;
+        return cache;
+    }
+
+    BakeCache::BakeCache()
+    {
+        // the writer thread records profile scopes until it is joined in the destructor,
+        // constructing the profiler first makes it outlive the cache
+        Profiler::instance();
+        const char* path = std::getenv("OPTICS_BAKE_CACHE");
+        if (path && std::string(path) == "off")
+            return;
+        std::error_code error;
+        if (path && *path)
+            setDirectory(path);
+        else
+            setDirectory((std::filesystem::temp_directory_path(error) / "node-weft-optics-cache").string());
+    }
+
+    BakeCache::~BakeCache()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopWriter = true;
+        }
+        queueCondition.notify_one();
+        if (writer.joinable())
+            writer.join();
+    }
+
+    void BakeCache::setDirectory(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        directory.clear();
+        std::error_code error;
+        if (!path.empty() && (std::filesystem::create_directories(path, error) || std::filesystem::is_directory(path, error)))
+            directory = path;
+    }
+
+    std::string BakeCache::pathOf(uint64_t key) const
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.nwbake", (unsigned long long)key);
+        return (std::filesystem::path(directory) / name).string();
+    }
+
+    bool BakeCache::load(uint64_t key, BakeRecord& record)
+    {
+        OPTICS_PROFILE_SCOPE("BakeCache::load", "bake");
+        if (!enabled() || key == 0)
+            return false;
+        std::string path = pathOf(key);
+        MappedFile file(path);
+        if (!file.data)
+            return false;
+
+        Reader reader{ file.data, file.data + file.size };
+        const Header* header = reader.take<Header>(1);
+        if (!header || std::memcmp(header->magic, fileMagic, sizeof(fileMagic)) != 0 || header->version != fileVersion || header->key != key)
+            return false;
+        const RayRecord* rays = reader.take<RayRecord>(header->rayCount);
+        const PointRecord* points = reader.take<PointRecord>(header->pathPointCount);
+        const HitRecord* hits = reader.take<HitRecord>(header->hitCount);
+        const StateRecord* states = reader.take<StateRecord>(header->stateCount);
+        const LensRecord* lenses = reader.take<LensRecord>(header->lensCount);
+        const uint64_t* outlineSizes = reader.take<uint64_t>(header->outlineCount);
+        const PointRecord* outlinePoints = reader.take<PointRecord>(header->outlinePointCount);
+        const ArenaRecord* arenas = reader.take<ArenaRecord>(header->arenaCount);
+        const LensRecord* arenaLenses = reader.take<LensRecord>(header->arenaLensCount);
+        const StateRecord* arenaRays = reader.take<StateRecord>(header->arenaRayCount);
+        const PointRecord* arenaPoints = reader.take<PointRecord>(header->arenaPointCount);
+        const FloatPointRecord* arenaFloatPoints = reader.take<FloatPointRecord>(header->arenaFloatPointCount);
+        const uint32_t* arenaSurfaces = reader.take<uint32_t>(header->arenaPointCount + header->arenaFloatPointCount);
+        if (!rays || !points || !hits || !states || !lenses || !outlineSizes || !outlinePoints
+            || !arenas || !arenaLenses || !arenaRays || !arenaPoints || !arenaFloatPoints || !arenaSurfaces)
+            return false; // shorter than its header says
+
+        // the per-ray counts must add up to the array sizes before anything is built
+        uint64_t pointTotal = 0, hitTotal = 0, outlineTotal = 0;
+        for (uint64_t i = 0; i < header->rayCount; i++) {
+            pointTotal += rays[i].pathCount;
+            hitTotal += rays[i].hitCount;
+        }
+        for (uint64_t i = 0; i < header->outlineCount; i++)
+            outlineTotal += outlineSizes[i];
+        if (pointTotal != header->pathPointCount || hitTotal != header->hitCount || outlineTotal != header->outlinePointCount)
+            return false;
+        uint64_t arenaLensTotal = 0, arenaRayTotal = 0, arenaPointTotal[2] = { 0, 0 };
+        for (uint64_t a = 0; a < header->arenaCount; a++) {
+            if (arenas[a].precision > RayPaths::FloatPoints || arenas[a].rayCount > header->arenaRayCount - arenaRayTotal)
+                return false;
+            for (uint64_t i = arenaRayTotal; i < arenaRayTotal + arenas[a].rayCount; i++)
+                arenaPointTotal[arenas[a].precision] += arenaRays[i].hitCount;
+            arenaLensTotal += arenas[a].lensCount;
+            arenaRayTotal += arenas[a].rayCount;
+        }
+        if (arenaLensTotal != header->arenaLensCount || arenaRayTotal != header->arenaRayCount
+            || arenaPointTotal[RayPaths::DoublePoints] != header->arenaPointCount || arenaPointTotal[RayPaths::FloatPoints] != header->arenaFloatPointCount)
+            return false;
+
+        auto toVec2 = [](double x, double y) { return NodeWeft::Vec2{ x, y }; };
+        std::vector<Ray> loadedRays(header->rayCount);
+        for (uint64_t i = 0; i < header->rayCount; i++) {
+            const RayRecord& source = rays[i];
+            Ray& r = loadedRays[i];
+            r.direction = toVec2(source.directionX, source.directionY);
+            r.wavelength = source.wavelength;
+            r.intensity = source.intensity;
+            r.path.resize(source.pathCount);
+            for (uint32_t k = 0; k < source.pathCount; k++, points++)
+                r.path[k] = toVec2(points->x, points->y);
+            r.hits.resize(source.hitCount);
+            for (uint32_t k = 0; k < source.hitCount; k++, hits++)
+                r.hits[k] = RayHit(toVec2(hits->pointX, hits->pointY), toVec2(hits->normalX, hits->normalY), hits->distance, hits->indexBefore, hits->indexAfter);
+        }
+        std::vector<RayState> loadedStates(header->stateCount);
+        for (uint64_t i = 0; i < header->stateCount; i++) {
+            RayState& s = loadedStates[i];
+            s.origin = toVec2(states[i].originX, states[i].originY);
+            s.direction = toVec2(states[i].directionX, states[i].directionY);
+            s.wavelength = states[i].wavelength;
+            s.intensity = states[i].intensity;
+            s.hitCount = (uint32_t)states[i].hitCount;
+        }
+        std::vector<SphereLens> loadedLenses;
+        loadedLenses.reserve(header->lensCount);
+        for (uint64_t i = 0; i < header->lensCount; i++)
+            loadedLenses.push_back(fromRecord(lenses[i]));
+        std::vector<std::vector<NodeWeft::Vec2>> loadedOutlines(header->outlineCount);
+        for (uint64_t i = 0; i < header->outlineCount; i++) {
+            loadedOutlines[i].reserve(outlineSizes[i]);
+            for (uint64_t k = 0; k < outlineSizes[i]; k++, outlinePoints++)
+                loadedOutlines[i].push_back(toVec2(outlinePoints->x, outlinePoints->y));
+        }
+
+        // arenas are rebuilt block by block, each block's spans are sized once and copied in ray order
+        std::vector<std::shared_ptr<const RayPaths>> loadedPaths;
+        for (uint64_t a = 0; a < header->arenaCount; a++) {
+            auto paths = std::make_shared<RayPaths>();
+            int precision = (int)arenas[a].precision;
+            paths->precision = precision;
+            for (uint32_t i = 0; i < arenas[a].lensCount; i++)
+                paths->lenses.push_back(fromRecord(*arenaLenses++));
+            size_t rayCount = (size_t)arenas[a].rayCount;
+            paths->entries.resize(rayCount);
+            paths->blocks.resize((rayCount + RayPaths::blockSize - 1) / RayPaths::blockSize);
+            for (size_t b = 0; b < paths->blocks.size(); b++) {
+                size_t begin = b * RayPaths::blockSize, end = (std::min)(rayCount, begin + RayPaths::blockSize);
+                size_t blockPoints = 0;
+                for (size_t i = begin; i < end; i++)
+                    blockPoints += (size_t)arenaRays[i].hitCount;
+                RayPaths::Block& block = paths->blocks[b];
+                block.resize(blockPoints, precision);
+                size_t offset = 0;
+                for (size_t i = begin; i < end; i++) {
+                    const StateRecord& source = arenaRays[i];
+                    RayPaths::Entry& e = paths->entries[i];
+                    e.origin = toVec2(source.originX, source.originY);
+                    e.direction = toVec2(source.directionX, source.directionY);
+                    e.wavelength = source.wavelength;
+                    e.intensity = source.intensity;
+                    e.firstPoint = (uint32_t)offset;
+                    e.hitCount = (uint32_t)source.hitCount;
+                    offset += e.hitCount;
+                }
+                if (precision == RayPaths::FloatPoints) {
+                    for (size_t k = 0; k < blockPoints; k++, arenaFloatPoints++)
+                        block.floatPoints[k] = RayPaths::FloatPoint{ arenaFloatPoints->x, arenaFloatPoints->y };
+                }
+                else {
+                    for (size_t k = 0; k < blockPoints; k++, arenaPoints++)
+                        block.points[k] = toVec2(arenaPoints->x, arenaPoints->y);
+                }
+                std::copy_n(arenaSurfaces, blockPoints, block.surfaces.begin());
+                arenaSurfaces += blockPoints;
+            }
+            arenaRays += rayCount;
+            loadedPaths.push_back(std::move(paths));
+        }
+
+        record = BakeRecord();
+        record.paths = std::move(loadedPaths);
+        record.rays.append(std::move(loadedRays));
+        record.states.append(std::move(loadedStates));
+        record.lenses.append(std::move(loadedLenses));
+        record.lensOutlines.append(std::move(loadedOutlines));
+
+        // recently used entries survive eviction
+        std::error_code error;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+        return true;
+    }
+
+    bool BakeCache::store(uint64_t key, const BakeRecord& record)
+    {
+        OPTICS_PROFILE_SCOPE("BakeCache::store", "bake");
+        if (!enabled() || key == 0)
+            return false;
+
+        // flatten into the file's arrays
+        Header header{};
+        std::memcpy(header.magic, fileMagic, sizeof(fileMagic));
+        header.version = fileVersion;
+        header.key = key;
+        std::vector<RayRecord> rays;
+        std::vector<PointRecord> points;
+        std::vector<HitRecord> hits;
+        rays.reserve(record.rays.size());
+        auto addRay = [&](const Ray& r) {
+            rays.push_back(RayRecord{ r.direction.x, r.direction.y, r.wavelength, r.intensity, (uint32_t)r.path.size(), (uint32_t)r.hits.size() });
+            for (auto& p : r.path)
+                points.push_back(PointRecord{ p.x, p.y });
+            for (auto& h : r.hits)
+                hits.push_back(HitRecord{ h.point.x, h.point.y, h.normal.x, h.normal.y, h.distance, h.refractiveIndexBefore, h.refractiveIndexAfter });
+        };
+        record.rays.forEach(addRay);
+        std::vector<StateRecord> states;
+        states.reserve(record.states.size());
+        record.states.forEach([&](const RayState& s) {
+            states.push_back(StateRecord{ s.origin.x, s.origin.y, s.direction.x, s.direction.y, s.wavelength, s.intensity, s.hitCount });
+        });
+        std::vector<LensRecord> lenses;
+        record.lenses.forEach([&](const SphereLens& l) { lenses.push_back(toRecord(l)); });
+        std::vector<uint64_t> outlineSizes;
+        std::vector<PointRecord> outlinePoints;
+        record.lensOutlines.forEach([&](const std::vector<NodeWeft::Vec2>& outline) {
+            outlineSizes.push_back(outline.size());
+            for (auto& p : outline)
+                outlinePoints.push_back(PointRecord{ p.x, p.y });
+        });
+        // arenas keep their layout, the spans are written without the gaps a block may have
+        std::vector<ArenaRecord> arenas;
+        std::vector<LensRecord> arenaLenses;
+        std::vector<StateRecord> arenaRays;
+        std::vector<PointRecord> arenaPoints;
+        std::vector<FloatPointRecord> arenaFloatPoints;
+        std::vector<uint32_t> arenaSurfaces;
+        for (auto& p : record.paths) {
+            arenas.push_back(ArenaRecord{ (uint32_t)p->precision, (uint32_t)p->lenses.size(), p->size() });
+            for (auto& l : p->lenses)
+                arenaLenses.push_back(toRecord(l));
+            for (size_t i = 0; i < p->size(); i++) {
+                const RayPaths::Entry& e = p->entries[i];
+                const RayPaths::Block& block = p->blocks[i / RayPaths::blockSize];
+                arenaRays.push_back(StateRecord{ e.origin.x, e.origin.y, e.direction.x, e.direction.y, e.wavelength, e.intensity, e.hitCount });
+                for (uint32_t k = e.firstPoint; k < e.firstPoint + e.hitCount; k++) {
+                    if (p->precision == RayPaths::FloatPoints)
+                        arenaFloatPoints.push_back(FloatPointRecord{ block.floatPoints[k].x, block.floatPoints[k].y });
+                    else
+                        arenaPoints.push_back(PointRecord{ block.points[k].x, block.points[k].y });
+                    arenaSurfaces.push_back(block.surfaces[k]);
+                }
+            }
+        }
+        header.rayCount = rays.size();
+        header.pathPointCount = points.size();
+        header.hitCount = hits.size();
+        header.stateCount = states.size();
+        header.lensCount = lenses.size();
+        header.outlineCount = outlineSizes.size();
+        header.outlinePointCount = outlinePoints.size();
+        header.arenaCount = arenas.size();
+        header.arenaLensCount = arenaLenses.size();
+        header.arenaRayCount = arenaRays.size();
+        header.arenaPointCount = arenaPoints.size();
+        header.arenaFloatPointCount = arenaFloatPoints.size();
+        uint64_t bytes = sizeof(header) + rays.size() * sizeof(RayRecord) + (points.size() + outlinePoints.size() + arenaPoints.size()) * sizeof(PointRecord)
+            + hits.size() * sizeof(HitRecord) + (states.size() + arenaRays.size()) * sizeof(StateRecord) + (lenses.size() + arenaLenses.size()) * sizeof(LensRecord)
+            + outlineSizes.size() * sizeof(uint64_t) + arenas.size() * sizeof(ArenaRecord) + arenaFloatPoints.size() * sizeof(FloatPointRecord)
+            + arenaSurfaces.size() * sizeof(uint32_t);
+        if (bytes > maxBytes)
+            return false;
+
+        // written under a temporary name and renamed, so readers never see a partial file
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string path = pathOf(key);
+        std::string temporary = path + ".tmp";
+        {
+            std::ofstream os(temporary, std::ios::binary | std::ios::trunc);
+            if (!os)
+                return false;
+            os.write((const char*)&header, sizeof(header));
+            writeArray(os, rays);
+            writeArray(os, points);
+            writeArray(os, hits);
+            writeArray(os, states);
+            writeArray(os, lenses);
+            writeArray(os, outlineSizes);
+            writeArray(os, outlinePoints);
+            writeArray(os, arenas);
+            writeArray(os, arenaLenses);
+            writeArray(os, arenaRays);
+            writeArray(os, arenaPoints);
+            writeArray(os, arenaFloatPoints);
+            writeArray(os, arenaSurfaces);
+            if (!os)
+                return false;
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary, path, error);
+        if (error) {
+            std::filesystem::remove(temporary, error);
+            return false;
+        }
+        evict();
+        return true;
+    }
+
+    void BakeCache::storeInBackground(uint64_t key, const BakeRecord& record)
+    {
+        if (!enabled() || key == 0)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            auto same = std::find_if(pendingStores.begin(), pendingStores.end(), [&](const auto& p) { return p.first == key; });
+            if (same != pendingStores.end())
+                same->second = record;
+            else {
+                if (pendingStores.size() >= maxPendingStores)
+                    pendingStores.pop_front();
+                pendingStores.emplace_back(key, record);
+            }
+            if (!writer.joinable())
+                writer = std::thread([this]() { writerLoop(); });
+        }
+        queueCondition.notify_one();
+    }
+
+    void BakeCache::writerLoop()
+    {
+        // one store at a time in queue order, the queue is drained before stopping
+        while (true) {
+            std::pair<uint64_t, BakeRecord> next;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueCondition.wait(lock, [&]() { return stopWriter || !pendingStores.empty(); });
+                if (pendingStores.empty())
+                    return;
+                next = std::move(pendingStores.front());
+                pendingStores.pop_front();
+            }
+            store(next.first, next.second);
+        }
+    }
+
+    void BakeCache::evict()
+    {
+        struct Entry {
+            std::filesystem::path path;
+            std::filesystem::file_time_type time;
+            uint64_t size;
+        };
+        std::vector<Entry> entries;
+        uint64_t total = 0;
+        std::error_code error;
+        for (auto& item : std::filesystem::directory_iterator(directory, error)) {
+            if (item.path().extension() != ".nwbake")
+                continue;
+            Entry e{ item.path(), item.last_write_time(error), item.file_size(error) };
+            if (error)
+                continue;
+            total += e.size;
+            entries.push_back(e);
+        }
+        if (total <= maxBytes)
+            return;
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.time < b.time; });
+        for (auto& e : entries) {
+            if (total <= maxBytes)
+                break;
+            if (std::filesystem::remove(e.path, error))
+                total -= e.size;
+        }
+    }
+
+} // namespace Optics
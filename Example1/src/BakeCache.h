@@ -0,0 +1,90 @@
+#pragma once
+#include "RayOptics.h"
+#include "RayPaths.h"
+#include "SegmentList.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace Optics {
+
+    // Content key of a bake: FNV-1a over the node class, its parameters and the keys of its inputs
+    // Nodes whose output cannot be reproduced from these (e.g. a cancelled bake) report key 0
+    class BakeKey {
+    public:
+        explicit BakeKey(const char* nodeClass);
+
+        BakeKey& add(double value);
+        BakeKey& add(int value);
+        BakeKey& add(bool value);
+        BakeKey& add(const NodeWeft::Vec2& value);
+        BakeKey& addUpstream(uint64_t key);     // 0 makes the whole key 0
+
+        uint64_t value() const { return valid ? hash : 0; }
+
+    private:
+        void addBytes(const void* data, size_t size);
+        uint64_t hash;
+        bool valid{ true };
+    };
+
+    // Contents of one cache entry, loaded as one segment per list
+    struct BakeRecord {
+        SegmentList<Ray> rays;
+        SegmentList<RayState> states;
+        SegmentList<SphereLens> lenses;
+        SegmentList<std::vector<NodeWeft::Vec2>> lensOutlines;
+        std::vector<std::shared_ptr<const RayPaths>> paths;    // stored and loaded as arenas
+    };
+
+    // Bake results on disk, one file per key in a flat binary layout (a header with counts, then one
+    // array per record type) that is memory-mapped for loading. Loading copies the arrays in one pass
+    // without parsing: arenas get one point and one surface list per block of 1024 rays, a Ray owns its
+    // path and hit vectors so rays from the other tracers are still built one by one
+    // The directory comes from OPTICS_BAKE_CACHE, "off" disables the cache, the default is a folder
+    // in the temporary directory. The least recently used files are removed above the size limit
+    class BakeCache {
+    public:
+        static BakeCache& instance();
+
+        bool enabled() const { return !directory.empty(); }
+        const std::string& getDirectory() const { return directory; }
+        void setDirectory(const std::string& path);     // empty disables the cache
+        void setMaxBytes(uint64_t bytes) { maxBytes = bytes; }
+
+        bool load(uint64_t key, BakeRecord& record);
+        bool store(uint64_t key, const BakeRecord& record);     // entries larger than the size limit are not stored
+
+        // Queue a store for the writer thread, the record's segments are immutable and shared with the caller
+        // A pending store of the same key is replaced, beyond maxPendingStores the oldest pending one is dropped
+        // Pending stores are written before the cache is destroyed at exit
+        void storeInBackground(uint64_t key, const BakeRecord& record);
+
+        static constexpr size_t maxPendingStores = 16;
+
+        BakeCache(const BakeCache&) = delete;
+        BakeCache& operator=(const BakeCache&) = delete;
+
+    private:
+        BakeCache();
+        ~BakeCache();
+        std::string pathOf(uint64_t key) const;
+        void evict();
+        void writerLoop();
+
+        std::mutex mutex;       // stores and evictions, loads only read whole files
+        std::string directory;
+        uint64_t maxBytes{ uint64_t(2) << 30 };
+
+        std::mutex queueMutex;
+        std::condition_variable queueCondition;
+        std::deque<std::pair<uint64_t, BakeRecord>> pendingStores;
+        std::thread writer;     // started by the first background store
+        bool stopWriter{ false };
+    };
+
+} // namespace Optics
@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace Optics {
+
+    // Fixed-capacity multi-producer multi-consumer queue without locks
+    // Every cell carries a sequence number telling whether it is ready to be written or read,
+    // so producers and consumers only contend on one atomic position each
+    // tryPush fails when the queue is full and tryPop when it is empty, neither ever allocates
+    template<typename T>
+    class BoundedQueue {
+    public:
+        // capacity is rounded up to a power of two
+        explicit BoundedQueue(size_t capacity)
+        {
+            size_t size = 2;
+            while (size < capacity)
+                size *= 2;
+            mask = size - 1;
+            cells.reset(new Cell[size]);
+            for (size_t i = 0; i < size; i++)
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        size_t capacity() const { return mask + 1; }
+
+        // Approximate number of queued items
+        size_t sizeApprox() const
+        {
+            size_t tail = enqueuePos.load(std::memory_order_relaxed);
+            size_t head = dequeuePos.load(std::memory_order_relaxed);
+            return tail > head ? tail - head : 0;
+        }
+
+        // Move item into the queue, returns false (item untouched) when the queue is full
+        bool tryPush(T& item)
+        {
+            size_t pos = enqueuePos.load(std::memory_order_relaxed);
+            Cell* cell;
+            while (true) {
+                cell = &cells[pos & mask];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t diff = (std::ptrdiff_t)sequence - (std::ptrdiff_t)pos;
+                if (diff == 0) {
+                    if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0)
+                    return false;
+                else
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+            cell->data = std::move(item);
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Move the oldest item out, returns false when the queue is empty
+        bool tryPop(T& item)
+        {
+            size_t pos = dequeuePos.load(std::memory_order_relaxed);
+            Cell* cell;
+            while (true) {
+                cell = &cells[pos & mask];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t diff = (std::ptrdiff_t)sequence - (std::ptrdiff_t)(pos + 1);
+                if (diff == 0) {
+                    if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0)
+                    return false;
+                else
+                    pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+            item = std::move(cell->data);
+            cell->sequence.store(pos + mask + 1, std::memory_order_release);
+            return true;
+        }
+
+        BoundedQueue(const BoundedQueue&) = delete;
+        BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            T data;
+        };
+
+        std::unique_ptr<Cell[]> cells;
+        size_t mask{ 0 };
+        alignas(64) std::atomic<size_t> enqueuePos{ 0 };
+        alignas(64) std::atomic<size_t> dequeuePos{ 0 };
+    };
+
+} // namespace Optics
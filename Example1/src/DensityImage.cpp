@@ -0,0 +1,194 @@
+#include "DensityImage.h"
+#include "OpticsProfiler.h"
+#include "TracePool.h"
+#include <algorithm>
+#include <cmath>
+
+namespace Optics {
+
+    namespace {
+
+        struct Bounds {
+            double minX{ 1e300 }, minY{ 1e300 }, maxX{ -1e300 }, maxY{ -1e300 };
+            void add(const NodeWeft::Vec2& p)
+            {
+                minX = (std::min)(minX, p.x);
+                minY = (std::min)(minY, p.y);
+                maxX = (std::max)(maxX, p.x);
+                maxY = (std::max)(maxY, p.y);
+            }
+        };
+
+        // Liang-Barsky clip of a + t*d, t in [t0, t1], against the box
+        bool clipSegment(const NodeWeft::Vec2& a, const NodeWeft::Vec2& d, const Bounds& box, double& t0, double& t1)
+        {
+            const double p[4] = { -d.x, d.x, -d.y, d.y };
+            const double q[4] = { a.x - box.minX, box.maxX - a.x, a.y - box.minY, box.maxY - a.y };
+            for (int i = 0; i < 4; i++) {
+                if (p[i] == 0) {
+                    if (q[i] < 0)
+                        return false;
+                    continue;
+                }
+                double t = q[i] / p[i];
+                if (p[i] < 0)
+                    t0 = (std::max)(t0, t);
+                else
+                    t1 = (std::min)(t1, t);
+            }
+            return t0 < t1;
+        }
+
+        // Path access shared by Ray lists and arenas
+        struct RayListView {
+            const std::vector<Ray>& rays;
+            size_t size() const { return rays.size(); }
+            size_t pointCount(size_t i) const { return rays[i].path.size(); }
+            NodeWeft::Vec2 point(size_t i, size_t k) const { return rays[i].path[k]; }
+            RayState state(size_t i) const { return RayState(rays[i]); }
+        };
+        struct RayPathsView {
+            const RayPaths& paths;
+            size_t size() const { return paths.size(); }
+            size_t pointCount(size_t i) const { return paths.hitCount(i) + 1; }
+            NodeWeft::Vec2 point(size_t i, size_t k) const { return paths.point(i, k); }
+            RayState state(size_t i) const { return paths.state(i); }
+        };
+
+    } // namespace
+
+    void DensityImage::build(const SegmentList<Ray>& rays, int resolution, int threadCount)
+    {
+        build(rays, {}, resolution, threadCount);
+    }
+
+    void DensityImage::build(const SegmentList<Ray>& rays, const std::vector<std::shared_ptr<const RayPaths>>& paths, int resolution, int threadCount)
+    {
+        OPTICS_PROFILE_SCOPE("DensityImage::build", "display");
+        *this = DensityImage();
+        size_t pathRays = 0;
+        for (auto& p : paths)
+            pathRays += p->size();
+        if ((rays.empty() && pathRays == 0) || resolution <= 0)
+            return;
+
+        // bounds of all path points, padded so the extended final directions stay visible
+        Bounds box;
+        rays.forEach([&](const Ray& r) {
+            for (auto& p : r.path)
+                box.add(p);
+        });
+        for (auto& p : paths) {
+            for (size_t i = 0; i < p->size(); i++)
+                for (size_t k = 0; k <= p->hitCount(i); k++)
+                    box.add(p->point(i, k));
+        }
+        double extent = (std::max)({ box.maxX - box.minX, box.maxY - box.minY, 1.0 });
+        double padding = extent * 0.25;
+        box.minX -= padding;
+        box.minY -= padding;
+        box.maxX += padding;
+        box.maxY += padding;
+
+        cellSize = (std::max)(box.maxX - box.minX, box.maxY - box.minY) / resolution;
+        width = (std::max)(1, (int)std::ceil((box.maxX - box.minX) / cellSize));
+        height = (std::max)(1, (int)std::ceil((box.maxY - box.minY) / cellSize));
+        minCorner = NodeWeft::Vec2{ box.minX, box.minY };
+        const size_t cellCount = (size_t)width * height;
+        const double farDistance = extent + padding * 4;
+        const double step = cellSize * 0.5;
+
+        red.assign(cellCount, 0);
+        green.assign(cellCount, 0);
+        blue.assign(cellCount, 0);
+        weight.assign(cellCount, 0);
+
+        // the grid is split into bands of rows, each band is accumulated by one worker walking all rays, so the
+        // image needs no per-thread copies and every cell sums its rays in input order whatever the thread count
+        TracePool& pool = TracePool::instance();
+        const int threads = pool.participantCount(height, 1, threadCount);
+        const int bandCount = threads > 1 ? (std::min)(height, threads * 4) : 1;
+        pool.parallelFor(bandCount, 1, threadCount, [&](size_t bandBegin, size_t bandEnd, int) {
+            for (size_t band = bandBegin; band < bandEnd; band++) {
+                const int rowBegin = (int)(band * height / bandCount), rowEnd = (int)((band + 1) * height / bandCount);
+                // a cell wider on each side, the row of each sample decides which band adds it
+                Bounds bandBox = box;
+                bandBox.minY = box.minY + (rowBegin - 1) * cellSize;
+                bandBox.maxY = box.minY + (rowEnd + 1) * cellSize;
+
+                auto addSegment = [&](const NodeWeft::Vec2& a, const NodeWeft::Vec2& d, double length, const NodeWeft::tRGB& color, double intensity) {
+                    double t0 = 0, t1 = length;
+                    if (length <= 0 || !clipSegment(a, d, box, t0, t1))
+                        return;
+                    // sample at half-cell steps, each sample adds the length it stands for
+                    // the samples are placed along the whole clipped segment, the band only picks its own
+                    int samples = (std::max)(1, (int)std::ceil((t1 - t0) / step));
+                    double ds = (t1 - t0) / samples;
+                    double b0 = t0, b1 = t1;
+                    if (!clipSegment(a, d, bandBox, b0, b1))
+                        return;
+                    int first = (std::max)(0, (int)std::floor((b0 - t0) / ds - 0.5));
+                    int last = (std::min)(samples, (int)std::ceil((b1 - t0) / ds - 0.5) + 1);
+                    float w = (float)(intensity * ds / cellSize);
+                    for (int k = first; k < last; k++) {
+                        double t = t0 + (k + 0.5) * ds;
+                        int cx = (int)((a.x + d.x * t - box.minX) / cellSize);
+                        int cy = (int)((a.y + d.y * t - box.minY) / cellSize);
+                        if (cx < 0 || cy < rowBegin || cx >= width || cy >= rowEnd)
+                            continue;
+                        size_t cell = (size_t)cy * width + cx;
+                        red[cell] += color.r * w;
+                        green[cell] += color.g * w;
+                        blue[cell] += color.b * w;
+                        weight[cell] += w;
+                    }
+                };
+
+                WavelengthPalette palette;
+                auto accumulate = [&](const auto& list) {
+                    for (size_t i = 0; i < list.size(); i++) {
+                        size_t points = list.pointCount(i);
+                        if (points == 0)
+                            continue;
+                        RayState r = list.state(i);
+                        if (r.intensity <= 0)
+                            continue;
+                        // full-brightness colour, the intensity only enters through the weight
+                        NodeWeft::tRGB color = palette(r.wavelength);
+                        NodeWeft::Vec2 previous = list.point(i, 0);
+                        for (size_t k = 1; k < points; k++) {
+                            NodeWeft::Vec2 p = list.point(i, k);
+                            NodeWeft::Vec2 d = p - previous;
+                            double length = NodeWeft::length(d);
+                            if (length > 0)
+                                addSegment(previous, d * (1.0 / length), length, color, r.intensity);
+                            previous = p;
+                        }
+                        addSegment(previous, r.direction, farDistance, color, r.intensity);
+                    }
+                };
+                for (auto& segment : rays.segments())
+                    accumulate(RayListView{ *segment });
+                for (auto& p : paths)
+                    accumulate(RayPathsView{ *p });
+            }
+        });
+        for (float w : weight)
+            maxWeight = (std::max)(maxWeight, w);
+    }
+
+    NodeWeft::tRGB DensityImage::getCellColor(int x, int y, double& brightness) const
+    {
+        size_t cell = (size_t)y * width + x;
+        float w = weight[cell];
+        if (w <= 0 || maxWeight <= 0) {
+            brightness = 0;
+            return NodeWeft::tRGB{ 0, 0, 0 };
+        }
+        // square root tone curve keeps sparse regions visible next to caustics
+        brightness = std::sqrt(w / maxWeight);
+        auto channel = [&](float sum) { return (uint8_t)(std::min)(255.0f, sum / w); };
+        return NodeWeft::tRGB{ channel(red[cell]), channel(green[cell]), channel(blue[cell]) };
+    }
+
+} // namespace Optics
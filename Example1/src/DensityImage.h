@@ -0,0 +1,31 @@
+#pragma once
+#include "RayOptics.h"
+#include "RayPaths.h"
+#include "SegmentList.h"
+
+namespace Optics {
+
+    // Ray density accumulated on a regular grid, used to draw scenes with too many rays for one line each
+    // Every ray segment adds its wavelength colour and intensity, weighted by the length it covers in a cell
+    struct DensityImage {
+        int width{ 0 }, height{ 0 };
+        double cellSize{ 1 };
+        NodeWeft::Vec2 minCorner{ 0,0 };        // world position of the lower-left corner of cell (0, 0)
+        std::vector<float> red, green, blue;    // intensity-weighted colour sums (0-255 scale)
+        std::vector<float> weight;              // summed intensity per cell
+        float maxWeight{ 0 };
+
+        // Rasterize all ray paths, the final direction of each ray is followed to the image border
+        // Threads share the one grid, each accumulating its own bands of rows, so the image is the same for any threadCount
+        // resolution is the number of cells along the longer side of the ray bounding box
+        void build(const SegmentList<Ray>& rays, int resolution, int threadCount);
+        // Same over rays and the paths of traced arenas
+        void build(const SegmentList<Ray>& rays, const std::vector<std::shared_ptr<const RayPaths>>& paths, int resolution, int threadCount);
+
+        // Averaged colour of a cell and its brightness in [0, 1] relative to the densest cell
+        NodeWeft::tRGB getCellColor(int x, int y, double& brightness) const;
+
+        bool empty() const { return maxWeight <= 0; }
+    };
+
+} // namespace Optics
@@ -0,0 +1,163 @@
+#include "IncrementalTrace.h"
+#include "OpticsProfiler.h"
+#include <algorithm>
+#include <cstring>
+
+namespace Optics {
+
+    namespace {
+
+        // FNV-1a over the raw bytes of a value
+        template<typename T>
+        void hashValue(uint64_t& hash, const T& value)
+        {
+            unsigned char bytes[sizeof(T)];
+            std::memcpy(bytes, &value, sizeof(T));
+            for (unsigned char b : bytes)
+                hash = (hash ^ b) * 1099511628211ull;
+        }
+
+        constexpr size_t checkpointBytesPerRay = sizeof(double) * 3 + sizeof(uint32_t);
+        constexpr size_t checkpointOriginBytesPerRay = sizeof(double) * 2; // float paths only
+
+    } // namespace
+
+    uint64_t IncrementalTracer::hashRays(const TraceInput& input)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        auto hashRay = [&](const NodeWeft::Vec2& direction, double wavelength, double intensity) {
+            hashValue(hash, direction.x);
+            hashValue(hash, direction.y);
+            hashValue(hash, wavelength);
+            hashValue(hash, intensity);
+        };
+        input.rays.forEach([&](const Ray& r) {
+            hashValue(hash, r.path.size());
+            for (auto& p : r.path) {
+                hashValue(hash, p.x);
+                hashValue(hash, p.y);
+            }
+            hashRay(r.direction, r.wavelength, r.intensity);
+        });
+        for (auto& paths : input.paths) {
+            for (size_t i = 0; i < paths->size(); i++) {
+                size_t count = paths->hitCount(i);
+                hashValue(hash, count + 1);
+                for (size_t k = 0; k <= count; k++) {
+                    NodeWeft::Vec2 p = paths->point(i, k);
+                    hashValue(hash, p.x);
+                    hashValue(hash, p.y);
+                }
+                RayState s = paths->state(i);
+                hashRay(s.direction, s.wavelength, s.intensity);
+            }
+        }
+        // states are told apart from rays by the separate count
+        hashValue(hash, input.states.size());
+        input.states.forEach([&](const RayState& s) {
+            hashValue(hash, s.origin.x);
+            hashValue(hash, s.origin.y);
+            hashRay(s.direction, s.wavelength, s.intensity);
+        });
+        return hash;
+    }
+
+    void IncrementalTracer::clear()
+    {
+        valid = false;
+        tracedLenses.clear();
+        traced.reset();
+        checkpoints.clear();
+    }
+
+    size_t IncrementalTracer::firstChangedSurface(const std::vector<SphereLens>& lenses) const
+    {
+        size_t firstChanged = 0;
+        size_t common = (std::min)(lenses.size(), tracedLenses.size());
+        while (firstChanged < common && sameLens(lenses[firstChanged], tracedLenses[firstChanged]))
+            firstChanged++;
+        return firstChanged;
+    }
+
+    size_t IncrementalTracer::restartSurfaceFor(const TraceInput& input, const std::vector<SphereLens>& lenses, int precision) const
+    {
+        if (!valid || input.size() != inputCount || precision != inputPrecision || hashRays(input) != inputHash)
+            return 0;
+        size_t firstChanged = firstChangedSurface(lenses);
+        if (firstChanged == lenses.size() && lenses.size() == tracedLenses.size())
+            return lenses.size();
+        auto resume = std::upper_bound(checkpoints.begin(), checkpoints.end(), firstChanged,
+            [](size_t surface, const TraceCheckpoint& c) { return surface < c.surface; });
+        return resume != checkpoints.begin() ? (resume - 1)->surface : 0;
+    }
+
+    std::shared_ptr<const RayPaths> IncrementalTracer::trace(const TraceInput& input, const std::vector<SphereLens>& lenses, int threadCount,
+        int precision, const TraceProgressFunction& progress)
+    {
+        OPTICS_PROFILE_SCOPE("IncrementalTracer::trace", "trace");
+        uint64_t hash = hashRays(input);
+        if (!valid || hash != inputHash || input.size() != inputCount || precision != inputPrecision) {
+            // the arena outlives the cache, it is reset and reused below
+            valid = false;
+            tracedLenses.clear();
+            checkpoints.clear();
+            inputHash = hash;
+            inputCount = input.size();
+            inputPrecision = precision;
+        }
+
+        // first surface that differs from the cached trace
+        size_t firstChanged = 0;
+        if (valid) {
+            firstChanged = firstChangedSurface(lenses);
+            if (firstChanged == lenses.size() && lenses.size() == tracedLenses.size()) {
+                restartSurface = lenses.size();
+                return traced;
+            }
+        }
+
+        // resume from the latest checkpoint at or before the change, drop everything after it
+        auto resume = std::upper_bound(checkpoints.begin(), checkpoints.end(), firstChanged,
+            [](size_t surface, const TraceCheckpoint& c) { return surface < c.surface; });
+        const TraceCheckpoint* from = nullptr;
+        if (resume != checkpoints.begin()) {
+            // copy on write, earlier results may still be shared by node outputs
+            if (traced.use_count() > 1)
+                traced = std::make_shared<RayPaths>(*traced);
+            checkpoints.erase(resume, checkpoints.end());
+            from = &checkpoints.back();
+            traced->restore(*from);
+        }
+        else {
+            // start from the input in the previous arena, unless a node output still holds it
+            checkpoints.clear();
+            if (!traced || traced.use_count() > 1)
+                traced = std::make_shared<RayPaths>();
+            traced->assign(input, precision);
+        }
+        restartSurface = from ? from->surface : 0;
+
+        // checkpoint every surface when it fits the budget, otherwise every stride-th surface
+        size_t bytesPerRay = checkpointBytesPerRay + (precision == RayPaths::FloatPoints ? checkpointOriginBytesPerRay : 0);
+        size_t bytesPerCheckpoint = (std::max)((size_t)1, input.size() * bytesPerRay);
+        size_t maxCheckpoints = (std::max)((size_t)1, checkpointBudget / bytesPerCheckpoint);
+        size_t stride = (lenses.size() + maxCheckpoints) / maxCheckpoints;
+
+        // from points into checkpoints, which may grow, so trace from a copy
+        TraceCheckpoint start;
+        if (from)
+            start = *from;
+        if (!traceRayPaths(*traced, lenses, from ? &start : nullptr, threadCount, stride, &checkpoints, progress)) {
+            // the arena keeps its memory for the next assign
+            valid = false;
+            tracedLenses.clear();
+            checkpoints.clear();
+            return nullptr;
+        }
+
+        tracedLenses = lenses;
+        valid = true;
+        return traced;
+    }
+
+} // namespace Optics
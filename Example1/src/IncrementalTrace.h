@@ -0,0 +1,47 @@
+#pragma once
+#include "RayPaths.h"
+#include "SegmentList.h"
+#include <memory>
+
+namespace Optics {
+
+    // Re-traces only what changed since the previous call
+    // Tracing is sequential along the lens list, so while the input rays stay the same, the ray
+    // states before the first edited (or added/removed) surface are reused from saved checkpoints
+    class IncrementalTracer {
+    public:
+        // Trace input rays through lenses, the result is shared with the tracer's cache
+        // and stays valid after later calls (the cache is copied before it is changed while shared)
+        // A full re-trace reuses the arena of the previous result once no output holds it anymore
+        // Arenas in the input are traced further as they are, without expanding them to Ray
+        // A trace stopped by progress (see traceRayPaths) returns nullptr and leaves nothing to restart from
+        std::shared_ptr<const RayPaths> trace(const TraceInput& input, const std::vector<SphereLens>& lenses, int threadCount,
+            int precision = RayPaths::DoublePoints, const TraceProgressFunction& progress = nullptr);
+
+        // Surface the last trace restarted from (lens count if nothing was traced)
+        size_t getRestartSurface() const { return restartSurface; }
+        // Surface a trace of input would restart from, 0 when it traces everything
+        size_t restartSurfaceFor(const TraceInput& input, const std::vector<SphereLens>& lenses, int precision = RayPaths::DoublePoints) const;
+
+        // Upper bound on checkpoint memory, a coarser checkpoint stride is used above it
+        void setCheckpointBudget(size_t bytes) { checkpointBudget = bytes; }
+
+        void clear();
+
+    private:
+        static uint64_t hashRays(const TraceInput& input);
+        // First surface that differs from the cached trace, lens count if none does
+        size_t firstChangedSurface(const std::vector<SphereLens>& lenses) const;
+
+        uint64_t inputHash{ 0 };
+        size_t inputCount{ 0 };
+        int inputPrecision{ RayPaths::DoublePoints };
+        bool valid{ false };
+        std::vector<SphereLens> tracedLenses;
+        std::shared_ptr<RayPaths> traced;
+        std::vector<TraceCheckpoint> checkpoints;   // sorted by surface
+        size_t restartSurface{ 0 };
+        size_t checkpointBudget{ size_t(512) << 20 };
+    };
+
+} // namespace Optics
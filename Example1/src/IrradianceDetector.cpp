@@ -0,0 +1,200 @@
+#include "IrradianceDetector.h"
+#include "OpticsProfiler.h"
+#include "TracePool.h"
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+
+namespace Optics {
+
+    NodeWeft::Vec2 IrradianceProfile::binCenter(size_t bin) const
+    {
+        double f = (bin + 0.5) / binCount();
+        return NodeWeft::Vec2{ start.x + (end.x - start.x) * f, start.y + (end.y - start.y) * f };
+    }
+
+    IrradianceDetector::IrradianceDetector(const NodeWeft::Vec2& start, const NodeWeft::Vec2& end, size_t binCount)
+        : start(start), edge(end - start), binCount((std::max)(binCount, (size_t)1))
+    {
+    }
+
+    bool IrradianceDetector::crossing(const NodeWeft::Vec2& origin, const NodeWeft::Vec2& direction, double maxT, double& s) const
+    {
+        // origin + t direction = start + s edge, by Cramer's rule on the 2x2 system
+        const NodeWeft::Vec2& d = direction;
+        const NodeWeft::Vec2& e = edge;
+        double denominator = d.x * e.y - d.y * e.x;
+        double wx = start.x - origin.x, wy = start.y - origin.y;
+        double t = (wx * e.y - wy * e.x) / denominator;
+        s = (wx * d.y - wy * d.x) / denominator;
+        // also false for segments parallel to the detector, where t and s are not finite
+        return t > 0 && t <= maxT && s >= 0 && s < 1;
+    }
+
+    void IrradianceDetector::Partial::add(const RayState& r, const IrradianceDetector& detector)
+    {
+        double s;
+        if (!detector.crossing(r.origin, r.direction, std::numeric_limits<double>::infinity(), s)) {
+            missed++;
+            return;
+        }
+        addHit(r, s, detector);
+    }
+
+    void IrradianceDetector::Partial::addHit(const RayState& r, double s, const IrradianceDetector& detector)
+    {
+        if (r.intensity <= 0) {
+            missed++;
+            return;
+        }
+        if (!last || lastWavelength != r.wavelength) {
+            std::vector<double>& bins = wavelengths[r.wavelength];
+            bins.resize(detector.binCount, 0.0);
+            last = &bins;
+            lastWavelength = r.wavelength;
+        }
+        size_t bin = (std::min)((size_t)(s * detector.binCount), detector.binCount - 1);
+        (*last)[bin] += r.intensity;
+        rays++;
+    }
+
+    void IrradianceDetector::Partial::merge(const Partial& p)
+    {
+        for (auto& w : p.wavelengths) {
+            std::vector<double>& bins = wavelengths[w.first];
+            bins.resize(w.second.size(), 0.0);
+            for (size_t i = 0; i < bins.size(); i++)
+                bins[i] += w.second[i];
+        }
+        rays += p.rays;
+        missed += p.missed;
+        last = nullptr;
+    }
+
+    namespace {
+
+        RayState stateOf(const std::vector<RayState>& states, size_t i) { return states[i]; }
+        RayState stateOf(const std::vector<Ray>& rays, size_t i) { return RayState(rays[i]); }
+        RayState stateOf(const RayPaths& paths, size_t i) { return paths.state(i); }
+
+        // path points before the final direction, states have only their origin
+        size_t pointCount(const std::vector<RayState>&, size_t) { return 1; }
+        size_t pointCount(const std::vector<Ray>& rays, size_t i) { return rays[i].path.size(); }
+        size_t pointCount(const RayPaths& paths, size_t i) { return paths.hitCount(i) + 1; }
+        NodeWeft::Vec2 pointOf(const std::vector<RayState>& states, size_t i, size_t) { return states[i].origin; }
+        NodeWeft::Vec2 pointOf(const std::vector<Ray>& rays, size_t i, size_t k) { return rays[i].path[k]; }
+        NodeWeft::Vec2 pointOf(const RayPaths& paths, size_t i, size_t k) { return paths.point(i, k); }
+
+        std::string formatNumber(double v)
+        {
+            char buffer[32];
+            std::snprintf(buffer, sizeof(buffer), "%.17g", v);
+            return buffer;
+        }
+
+    } // namespace
+
+    template<typename Items>
+    void IrradianceDetector::addItems(const Items& items, int threadCount)
+    {
+        OPTICS_PROFILE_SCOPE("IrradianceDetector::add", "analysis");
+        TracePool& pool = TracePool::instance();
+        const size_t chunkSize = 16384;
+        std::vector<Partial> partials(pool.participantCount(items.size(), chunkSize, threadCount));
+        pool.parallelFor(items.size(), chunkSize, threadCount, [&](size_t begin, size_t end, int worker) {
+            Partial& partial = partials[worker];
+            for (size_t i = begin; i < end; i++) {
+                RayState r = stateOf(items, i);
+                // the first crossing along the path, a detector between two surfaces sees the rays in flight
+                size_t points = pointCount(items, i);
+                double s;
+                bool hit = false;
+                NodeWeft::Vec2 previous = pointOf(items, i, 0);
+                for (size_t k = 1; k < points && !hit; k++) {
+                    NodeWeft::Vec2 p = pointOf(items, i, k);
+                    hit = crossing(previous, p - previous, 1.0, s);
+                    previous = p;
+                }
+                if (hit)
+                    partial.addHit(r, s, *this);
+                else
+                    partial.add(r, *this);
+            }
+        });
+        // merge in worker order, bins are sums so only rounding depends on the scheduling
+        for (auto& p : partials)
+            merged.merge(p);
+    }
+
+    void IrradianceDetector::add(const std::vector<RayState>& states, int threadCount)
+    {
+        addItems(states, threadCount);
+    }
+
+    void IrradianceDetector::add(const std::vector<Ray>& rays, int threadCount)
+    {
+        addItems(rays, threadCount);
+    }
+
+    void IrradianceDetector::add(const RayPaths& paths, int threadCount)
+    {
+        addItems(paths, threadCount);
+    }
+
+    void IrradianceDetector::add(const RayStream& stream, int threadCount)
+    {
+        OPTICS_PROFILE_SCOPE("IrradianceDetector::add", "analysis");
+        std::vector<Partial> partials(stream.participantCount(threadCount));
+        stream.forEachBlock(threadCount, [&](const std::vector<RayState>& states, int worker) {
+            Partial& partial = partials[worker];
+            for (const RayState& s : states)
+                partial.add(s, *this);
+        });
+        for (auto& p : partials)
+            merged.merge(p);
+    }
+
+    IrradianceProfile IrradianceDetector::result() const
+    {
+        IrradianceProfile profile;
+        profile.start = start;
+        profile.end = start + edge;
+        profile.binWidth = length(edge) / binCount;
+        profile.total.assign(binCount, 0.0);
+        profile.rays = merged.rays;
+        profile.missedRays = merged.missed;
+
+        // intensity per bin to intensity per unit length
+        double scale = profile.binWidth > 0 ? 1.0 / profile.binWidth : 0.0;
+        for (auto& w : merged.wavelengths) {
+            profile.wavelengths.push_back(w.first);
+            profile.spectral.push_back(w.second);
+            for (size_t i = 0; i < binCount; i++) {
+                profile.power += w.second[i];
+                profile.total[i] += w.second[i];
+                profile.spectral.back()[i] *= scale;
+            }
+        }
+        for (double& bin : profile.total) {
+            bin *= scale;
+            profile.peak = (std::max)(profile.peak, bin);
+        }
+        return profile;
+    }
+
+    void writeIrradianceCsv(std::ostream& os, const IrradianceProfile& profile, const std::string& rowPrefix)
+    {
+        auto writeBins = [&](double wavelength, const std::vector<double>& bins) {
+            for (size_t i = 0; i < bins.size(); i++) {
+                NodeWeft::Vec2 center = profile.binCenter(i);
+                os << rowPrefix << i << ',' << formatNumber(profile.binPosition(i)) << ','
+                    << formatNumber(center.x) << ',' << formatNumber(center.y) << ','
+                    << formatNumber(wavelength) << ',' << formatNumber(bins[i]) << '\n';
+            }
+        };
+        writeBins(0, profile.total);
+        for (size_t k = 0; k < profile.wavelengths.size(); k++)
+            writeBins(profile.wavelengths[k], profile.spectral[k]);
+    }
+
+} // namespace Optics
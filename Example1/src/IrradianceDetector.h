@@ -0,0 +1,72 @@
+#pragma once
+#include "RayOptics.h"
+#include "RayPaths.h"
+#include "RayStream.h"
+#include <map>
+#include <ostream>
+#include <string>
+
+namespace Optics {
+
+    // Binned irradiance along a detector line, per wavelength and over all wavelengths
+    struct IrradianceProfile {
+        NodeWeft::Vec2 start{ 0, 0 }, end{ 0, 0 };
+        double binWidth{ 0 };                           // length of the detector per bin
+        std::vector<double> total;                      // intensity per unit length, by bin from start to end
+        std::vector<double> wavelengths;                // by increasing wavelength
+        std::vector<std::vector<double>> spectral;      // spectral[k][bin] for wavelengths[k]
+        size_t rays{ 0 };                               // rays that hit the detector
+        size_t missedRays{ 0 };
+        double power{ 0 };                              // intensity of the rays that hit
+        double peak{ 0 };                               // largest total bin
+
+        size_t binCount() const { return total.size(); }
+        // Distance of the bin center from start, and the bin center itself
+        double binPosition(size_t bin) const { return (bin + 0.5) * binWidth; }
+        NodeWeft::Vec2 binCenter(size_t bin) const;
+    };
+
+    // Columns written by writeIrradianceCsv
+    constexpr const char* irradianceCsvColumns = "bin,position,x,y,wavelength,irradiance";
+    // One row per bin and wavelength, wavelength 0 for the sum over all wavelengths, each row starting with rowPrefix
+    void writeIrradianceCsv(std::ostream& os, const IrradianceProfile& profile, const std::string& rowPrefix = "");
+
+    // Irradiance detector: each ray's path is intersected with the line from start to end, segment by segment
+    // and then along its final direction, and its intensity added to the bin of the first crossing. States
+    // have no path, only their final direction is intersected. Rays are histogrammed in parallel into one
+    // partial histogram per worker, merged when the result is read, and no per-ray data is kept
+    class IrradianceDetector {
+    public:
+        IrradianceDetector(const NodeWeft::Vec2& start, const NodeWeft::Vec2& end, size_t binCount);
+
+        void add(const std::vector<RayState>& states, int threadCount = 1);
+        void add(const std::vector<Ray>& rays, int threadCount = 1);
+        void add(const RayPaths& paths, int threadCount = 1);
+        // Pulled block by block, the stream's rays are never stored
+        void add(const RayStream& stream, int threadCount = 1);
+
+        IrradianceProfile result() const;
+
+    private:
+        struct Partial {
+            std::map<double, std::vector<double>> wavelengths;     // intensity per bin
+            size_t rays{ 0 }, missed{ 0 };
+            std::vector<double>* last{ nullptr };       // rays mostly come in runs of one wavelength
+            double lastWavelength{ 0 };
+
+            void add(const RayState& r, const IrradianceDetector& detector);
+            // r crossed the detector at s, 0 at start and 1 at end
+            void addHit(const RayState& r, double s, const IrradianceDetector& detector);
+            void merge(const Partial& p);
+        };
+        template<typename Items>
+        void addItems(const Items& items, int threadCount);
+        // Where origin + t direction, 0 < t <= maxT, crosses the detector line, false if it does not
+        bool crossing(const NodeWeft::Vec2& origin, const NodeWeft::Vec2& direction, double maxT, double& s) const;
+
+        NodeWeft::Vec2 start, edge;     // edge = end - start
+        size_t binCount;
+        Partial merged;
+    };
+
+} // namespace Optics
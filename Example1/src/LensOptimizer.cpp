@@ -0,0 +1,260 @@
+#include "LensOptimizer.h"
+#include "OpticsProfiler.h"
+#include "SpotAnalysis.h"
+#include "TracePool.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+
+namespace Optics {
+
+    double LensVariable::get(const SphereLens& l) const
+    {
+        switch (parameter) {
+        case PositionX: return l.center.x;
+        case PositionY: return l.center.y;
+        case CurvatureRadius: return l.radius;
+        default: return l.refractiveIndex;
+        }
+    }
+
+    void LensVariable::set(SphereLens& l, double value) const
+    {
+        switch (parameter) {
+        case PositionX: l.center.x = value; break;
+        case PositionY: l.center.y = value; break;
+        case CurvatureRadius: l.radius = value; break;
+        default: l.refractiveIndex = value; break;
+        }
+    }
+
+    LensOptimizer::LensOptimizer(const std::vector<RayState>& sourceStates, const std::vector<SphereLens>& lenses,
+        const std::vector<LensVariable>& variables, const MeritSettings& merit)
+        : lenses(lenses), merit(merit)
+    {
+        source.load(sourceStates, 0, sourceStates.size());
+        for (auto& s : sourceStates)
+            sourceIntensity += (std::max)(s.intensity, 0.0);
+        // variables on missing lenses or with an empty range cannot move
+        for (auto& v : variables) {
+            if (v.lens < lenses.size() && v.maximum > v.minimum)
+                this->variables.push_back(v);
+        }
+    }
+
+    std::vector<double> LensOptimizer::initialValues() const
+    {
+        std::vector<double> values;
+        for (auto& v : variables)
+            values.push_back(v.clamp(v.get(lenses[v.lens])));
+        return values;
+    }
+
+    std::vector<SphereLens> LensOptimizer::apply(const std::vector<double>& values) const
+    {
+        std::vector<SphereLens> result = lenses;
+        for (size_t i = 0; i < variables.size() && i < values.size(); i++)
+            variables[i].set(result[variables[i].lens], variables[i].clamp(values[i]));
+        return result;
+    }
+
+    void LensOptimizer::evaluate(DesignResult& design, Workspace& workspace) const
+    {
+        workspace.lenses = lenses;
+        for (size_t i = 0; i < variables.size(); i++) {
+            design.values[i] = variables[i].clamp(design.values[i]);
+            variables[i].set(workspace.lenses[variables[i].lens], design.values[i]);
+        }
+
+        // copying the source keeps the vectors' capacity, the batch is only allocated once per worker
+        RayBatch& batch = workspace.batch;
+        batch = source;
+        const size_t count = batch.size();
+        workspace.hitCount.assign(count, 0);
+        for (const SphereLens& l : workspace.lenses) {
+            if (intersectBatch(batch, l, 0, count) == 0)
+                continue;
+            for (size_t j = 0; j < count; j++)
+                workspace.hitCount[j] += batch.hitMask[j];
+            refractBatch(batch, l, 0, count);
+        }
+
+        SpotMoments moments;
+        for (size_t j = 0; j < count; j++) {
+            if (workspace.hitCount[j] != workspace.lenses.size() || batch.directionX[j] <= 0 || batch.intensity[j] <= 0)
+                continue;
+            double slope = batch.directionY[j] / batch.directionX[j];
+            moments.add(batch.originY[j] + slope * (merit.planeX - batch.originX[j]), slope, batch.intensity[j]);
+        }
+        design.transmission = sourceIntensity > 0 ? moments.weight / sourceIntensity : 0;
+        design.rmsRadius = moments.rmsRadius(0);
+        design.merit = moments.weight > 0 ? design.rmsRadius + merit.lostRayPenalty * (1 - design.transmission) : std::numeric_limits<double>::infinity();
+    }
+
+    void LensOptimizer::evaluate(std::vector<DesignResult>& designs, int threadCount)
+    {
+        OPTICS_PROFILE_SCOPE("LensOptimizer::evaluate", "trace");
+        OPTICS_PROFILE_COUNT(RaysTraced, designs.size() * source.size());
+        TracePool& pool = TracePool::instance();
+        std::vector<Workspace> workspaces(pool.participantCount(designs.size(), 1, threadCount));
+        pool.parallelFor(designs.size(), 1, threadCount, [&](size_t begin, size_t end, int worker) {
+            for (size_t i = begin; i < end && !cancelled(); i++) {
+                designs[i].values.resize(variables.size());
+                evaluate(designs[i], workspaces[worker]);
+            }
+        });
+        evaluations += designs.size();
+    }
+
+    int LensOptimizer::maxGridSteps(size_t variableCount, size_t rayCount)
+    {
+        if (variableCount == 0)
+            return INT_MAX; // a single design whatever the steps
+        size_t maxDesigns = rayCount > 0 ? (std::min)(maxGridDesigns, (std::max)(maxGridRayTraces / rayCount, (size_t)1)) : maxGridDesigns;
+        int steps = 1;
+        while (true) {
+            size_t designs = 1;
+            for (size_t i = 0; i < variableCount && designs <= maxDesigns; i++)
+                designs *= steps + 1;
+            if (designs > maxDesigns)
+                return steps;
+            steps++;
+        }
+    }
+
+    DesignResult LensOptimizer::gridSweep(int steps, int threadCount)
+    {
+        OPTICS_PROFILE_SCOPE("LensOptimizer::gridSweep", "trace");
+        steps = (std::min)((std::max)(steps, 1), maxGridSteps(variables.size(), source.size()));
+        size_t total = 1;
+        for (size_t i = 0; i < variables.size(); i++)
+            total *= steps;
+
+        // designs are decoded from their index, only the best of each worker is kept
+        auto valuesAt = [&](size_t index) {
+            std::vector<double> values(variables.size());
+            for (size_t i = 0; i < variables.size(); i++) {
+                const LensVariable& v = variables[i];
+                int step = (int)(index % steps);
+                index /= steps;
+                values[i] = steps == 1 ? (v.minimum + v.maximum) * 0.5 : v.minimum + (v.maximum - v.minimum) * step / (steps - 1);
+            }
+            return values;
+        };
+        struct Best {
+            DesignResult design;
+            size_t index{ SIZE_MAX };
+        };
+        TracePool& pool = TracePool::instance();
+        int participants = pool.participantCount(total, 1, threadCount);
+        std::vector<Workspace> workspaces(participants);
+        std::vector<Best> best(participants);
+        pool.parallelFor(total, 1, threadCount, [&](size_t begin, size_t end, int worker) {
+            for (size_t i = begin; i < end && !cancelled(); i++) {
+                DesignResult design;
+                design.values = valuesAt(i);
+                evaluate(design, workspaces[worker]);
+                Best& b = best[worker];
+                if (b.index == SIZE_MAX || design.merit < b.design.merit || (design.merit == b.design.merit && i < b.index))
+                    b = Best{ design, i };
+            }
+        });
+        evaluations += total;
+
+        Best result;
+        for (auto& b : best) {
+            if (b.index != SIZE_MAX && (result.index == SIZE_MAX || b.design.merit < result.design.merit || (b.design.merit == result.design.merit && b.index < result.index)))
+                result = b;
+        }
+        return result.design;
+    }
+
+    DesignResult LensOptimizer::nelderMead(const std::vector<double>& start, const NelderMeadSettings& settings, int threadCount)
+    {
+        OPTICS_PROFILE_SCOPE("LensOptimizer::nelderMead", "trace");
+        const size_t n = variables.size();
+        auto makeDesign = [&](const std::vector<double>& values) {
+            DesignResult d;
+            d.values = values;
+            d.values.resize(n);
+            return d;
+        };
+        if (n == 0) {
+            std::vector<DesignResult> single{ makeDesign(start) };
+            evaluate(single, threadCount);
+            return single[0];
+        }
+
+        // initial simplex: the start and one step along each variable, towards the inside of its range
+        std::vector<DesignResult> simplex{ makeDesign(start) };
+        for (size_t i = 0; i < n; i++) {
+            const LensVariable& v = variables[i];
+            DesignResult d = makeDesign(start);
+            double step = (v.maximum - v.minimum) * settings.initialStep;
+            double x = v.clamp(d.values[i]);
+            d.values[i] = x + step <= v.maximum ? x + step : x - step;
+            simplex.push_back(d);
+        }
+        evaluate(simplex, threadCount);
+
+        auto byMerit = [](const DesignResult& a, const DesignResult& b) { return a.merit < b.merit; };
+        // point = centroid + t * (worst - centroid)
+        auto along = [&](const std::vector<double>& centroid, const std::vector<double>& worst, double t) {
+            DesignResult d = makeDesign(centroid);
+            for (size_t i = 0; i < n; i++)
+                d.values[i] = variables[i].clamp(centroid[i] + t * (worst[i] - centroid[i]));
+            return d;
+        };
+
+        for (int iteration = 0; iteration < settings.maxIterations && !cancelled(); iteration++) {
+            std::stable_sort(simplex.begin(), simplex.end(), byMerit);
+            const DesignResult& best = simplex.front();
+            const DesignResult& worst = simplex.back();
+
+            // converged when merits and vertices agree within the tolerance
+            bool converged = std::abs(worst.merit - best.merit) <= settings.tolerance * (std::max)(std::abs(best.merit), 1e-12)
+                || (std::isinf(best.merit) && std::isinf(worst.merit));
+            for (size_t v = 1; converged && v <= n; v++) {
+                for (size_t i = 0; converged && i < n; i++)
+                    converged = std::abs(simplex[v].values[i] - best.values[i]) <= settings.tolerance * (variables[i].maximum - variables[i].minimum);
+            }
+            if (converged)
+                break;
+
+            std::vector<double> centroid(n, 0.0);
+            for (size_t v = 0; v < n; v++) {
+                for (size_t i = 0; i < n; i++)
+                    centroid[i] += simplex[v].values[i] / n;
+            }
+            // reflection, expansion, outside and inside contraction
+            std::vector<DesignResult> trial{ along(centroid, worst.values, -1), along(centroid, worst.values, -2),
+                along(centroid, worst.values, -0.5), along(centroid, worst.values, 0.5) };
+            evaluate(trial, threadCount);
+            const DesignResult &reflected = trial[0], &expanded = trial[1], &outside = trial[2], &inside = trial[3];
+
+            const DesignResult* accepted = nullptr;
+            if (reflected.merit < best.merit)
+                accepted = expanded.merit < reflected.merit ? &expanded : &reflected;
+            else if (reflected.merit < simplex[n - 1].merit)
+                accepted = &reflected;
+            else if (reflected.merit < worst.merit)
+                accepted = outside.merit <= reflected.merit ? &outside : nullptr;
+            else
+                accepted = inside.merit < worst.merit ? &inside : nullptr;
+            if (accepted) {
+                simplex.back() = *accepted;
+                continue;
+            }
+
+            // shrink towards the best vertex
+            std::vector<DesignResult> shrunk;
+            for (size_t v = 1; v <= n; v++)
+                shrunk.push_back(along(best.values, simplex[v].values, 0.5));
+            evaluate(shrunk, threadCount);
+            std::copy(shrunk.begin(), shrunk.end(), simplex.begin() + 1);
+        }
+        return *std::min_element(simplex.begin(), simplex.end(), byMerit);
+    }
+
+} // namespace Optics
@@ -0,0 +1,102 @@
+#pragma once
+#include "RayOptics.h"
+#include <functional>
+#include <limits>
+
+namespace Optics {
+
+    // One lens parameter the optimizer may change, kept within [minimum, maximum]
+    struct LensVariable {
+        enum ParameterEnum {
+            PositionX = 0,
+            PositionY,
+            CurvatureRadius,
+            RefractiveIndex,
+        };
+        size_t lens{ 0 };           // index into the lens list
+        int parameter{ CurvatureRadius };
+        double minimum{ 0 }, maximum{ 0 };
+
+        double get(const SphereLens& l) const;
+        void set(SphereLens& l, double value) const;
+        double clamp(double value) const { return value < minimum ? minimum : (value > maximum ? maximum : value); }
+    };
+
+    // Merit of a design: RMS spot radius of all wavelengths together at planeX, plus a penalty
+    // for the share of source intensity that misses a surface or does not reach the plane
+    struct MeritSettings {
+        double planeX{ 100 };
+        double lostRayPenalty{ 1 };     // added per unit of lost intensity fraction, in scene units
+    };
+
+    struct DesignResult {
+        std::vector<double> values;     // one per variable
+        double merit{ std::numeric_limits<double>::infinity() };
+        double rmsRadius{ 0 };
+        double transmission{ 0 };       // intensity fraction reaching the plane through every surface
+    };
+
+    struct NelderMeadSettings {
+        int maxIterations{ 200 };
+        double tolerance{ 1e-6 };       // relative to the merit and to each variable's range
+        double initialStep{ 0.1 };      // simplex size as a fraction of each variable's range
+    };
+
+    // Evaluates lens designs against one source loaded once into a read-only RayBatch
+    // Designs are traced in parallel, one design per task with per-worker scratch batches,
+    // so results do not depend on the thread count
+    class LensOptimizer {
+    public:
+        LensOptimizer(const std::vector<RayState>& source, const std::vector<SphereLens>& lenses,
+            const std::vector<LensVariable>& variables, const MeritSettings& merit);
+
+        const std::vector<LensVariable>& getVariables() const { return variables; }
+        size_t getEvaluationCount() const { return evaluations; }
+
+        // Current variable values of the base lenses, and the lenses of a design
+        std::vector<double> initialValues() const;
+        std::vector<SphereLens> apply(const std::vector<double>& values) const;
+
+        void evaluate(std::vector<DesignResult>& designs, int threadCount = 1);
+
+        // Every combination of steps values per variable, evenly spaced over its range
+        // Returns the best design, the lowest index wins ties
+        // steps is reduced to maxGridSteps for the source, so the sweep stays within maxGridDesigns and maxGridRayTraces
+        DesignResult gridSweep(int steps, int threadCount = 1);
+
+        static constexpr size_t maxGridDesigns = 1 << 16;
+        // designs times source rays of a grid, every design traces every ray
+        static constexpr size_t maxGridRayTraces = size_t(1) << 32;
+        // Largest steps whose grid over variableCount variables stays within maxGridDesigns,
+        // and within maxGridRayTraces for a source of rayCount rays
+        static int maxGridSteps(size_t variableCount, size_t rayCount = 0);
+        // Largest source for the optimizer, generated rays are sampled down to it
+        static constexpr size_t maxStreamSample = 1 << 16;
+
+        // Bounded Nelder-Mead from start, the reflection, expansion and both contraction
+        // points of an iteration are evaluated together
+        DesignResult nelderMead(const std::vector<double>& start, const NelderMeadSettings& settings, int threadCount = 1);
+
+        // Checked before every design, once it returns true the remaining designs are skipped and the searches
+        // return early with a meaningless result
+        void setCancelCheck(std::function<bool()> check) { cancelCheck = std::move(check); }
+
+    private:
+        struct Workspace {
+            RayBatch batch;
+            std::vector<uint32_t> hitCount;
+            std::vector<SphereLens> lenses;
+        };
+        void evaluate(DesignResult& design, Workspace& workspace) const;
+        bool cancelled() const { return cancelCheck && cancelCheck(); }
+
+        RayBatch source;
+        double sourceIntensity{ 0 };
+        std::vector<SphereLens> lenses;
+        std::vector<LensVariable> variables;
+        MeritSettings merit;
+        size_t evaluations{ 0 };
+        std::function<bool()> cancelCheck;
+    };
+
+} // namespace Optics
@@ -0,0 +1,104 @@
+#include "LensSystem.h"
+#include <algorithm>
+#include <cmath>
+
+namespace Optics {
+
+    LensSystem::LensSystem(const std::vector<SphereLens>& lenses)
+        : lenses(lenses), surfaces(lenses.size(), CompiledSurface{})
+    {
+        for (size_t i = 0; i < lenses.size(); i++) {
+            const SphereLens& l = lenses[i];
+            CompiledSurface& s = surfaces[i];
+            s.circleX = l.center.x + l.radius;
+            s.circleY = l.center.y;
+            s.radiusSquared = l.radius * l.radius;
+            s.normalSign = l.radius > 0 ? 1.0 : -1.0;
+            s.refractiveIndex = l.refractiveIndex;
+            s.dispersiveCoefficient = l.dispersiveCoefficient;
+            s.indexAfter = l.isEntrance ? l.refractiveIndex : 1.0;
+            s.convex = l.radius > 0;
+            s.concave = l.radius < 0;
+            s.isEntrance = l.isEntrance;
+        }
+    }
+
+    bool LensSystem::matches(const std::vector<SphereLens>& other) const
+    {
+        return other.size() == lenses.size() && std::equal(other.begin(), other.end(), lenses.begin(), sameLens);
+    }
+
+    // Same operation order as intersectAndUpdateRay on the SphereLens, only the setup is read from the record
+    bool intersectAndUpdateRay(Ray& ray, const CompiledSurface& surface, double refractiveIndexBefore)
+    {
+        NodeWeft::Vec2 rayOrigin = ray.getOrigin();
+        NodeWeft::Vec2 oc = rayOrigin - NodeWeft::Vec2{ surface.circleX, surface.circleY };
+
+        double a = NodeWeft::dot(ray.direction, ray.direction);
+        double b = 2.0 * NodeWeft::dot(oc, ray.direction);
+        double c = NodeWeft::dot(oc, oc) - surface.radiusSquared;
+
+        double discriminant = b * b - 4 * a * c;
+        if (discriminant < 0)
+            return false;
+
+        double sqrtDisc = std::sqrt(discriminant);
+        double t1 = (-b - sqrtDisc) / (2.0 * a);
+        double t2 = (-b + sqrtDisc) / (2.0 * a);
+
+        bool isHit = false;
+        double t = 0.0;
+        NodeWeft::Vec2 hitPoint;
+        if (t1 > 0.0001) {
+            t = t1;
+            hitPoint = ray.pointAt(t1);
+            isHit = surface.onSurface(hitPoint.x);
+        }
+        if (!isHit && t2 > 0.0001) {
+            t = t2;
+            hitPoint = ray.pointAt(t2);
+            isHit = surface.onSurface(hitPoint.x);
+        }
+        if (!isHit)
+            return false;
+
+        ray.addHit(hitPoint, surface.normalAt(hitPoint), refractiveIndexBefore, surface.indexAfter, t);
+        return true;
+    }
+
+    bool refractRay(Ray& ray, const CompiledSurface& surface)
+    {
+        const RayHit* lastHit = ray.getLastHit();
+        if (!lastHit)
+            return false;
+
+        // The glass side varies with wavelength, the air side is the hit's base index
+        double n1, n2;
+        if (surface.isEntrance) {
+            n1 = lastHit->refractiveIndexBefore;
+            n2 = surface.refractiveIndexAt(ray.wavelength);
+        }
+        else {
+            n1 = surface.refractiveIndexAt(ray.wavelength);
+            n2 = lastHit->refractiveIndexAfter;
+        }
+        double eta = n1 / n2;
+
+        NodeWeft::Vec2 normal = lastHit->normal;
+        double cosI = -NodeWeft::dot(ray.direction, normal);
+        if (cosI < 0) {
+            cosI = -cosI;
+            normal = -normal;
+        }
+
+        double sinT2 = eta * eta * (1.0 - cosI * cosI);
+        if (sinT2 > 1.0)
+            return false;
+
+        double cosT = std::sqrt(1.0 - sinT2);
+        NodeWeft::Vec2 refractedDir = ray.direction * eta + normal * (eta * cosI - cosT);
+        ray.direction = NodeWeft::normalize(refractedDir);
+        return true;
+    }
+
+} // namespace Optics
@@ -0,0 +1,63 @@
+#pragma once
+#include "RayOptics.h"
+
+namespace Optics {
+
+    // Everything the per-ray tracers derive from a spherical SphereLens, computed once per lens change
+    // and packed into one cache line, so testing a ray against a surface reads a single line
+    struct alignas(64) CompiledSurface {
+        double circleX, circleY;        // center of the circle, center + (radius, 0)
+        double radiusSquared;
+        double normalSign;              // getNormalAt points away from the circle center for radius > 0
+        double refractiveIndex;         // glass index and Cauchy coefficient, see getRefractiveIndexAtWavelength
+        double dispersiveCoefficient;
+        double indexAfter;              // base index of the medium after the surface, glass when entering, air when exiting
+        uint8_t convex;                 // radius > 0: hits lie on the -x side of circleX
+        uint8_t concave;                // radius < 0: hits lie on the +x side, neither for radius 0
+        uint8_t isEntrance;
+
+        // Same arithmetic as SphereLens::getRefractiveIndexAtWavelength
+        double refractiveIndexAt(double wavelength) const {
+            if (wavelength <= 0.0)
+                return refractiveIndex;
+            double wavelengthMicrons = wavelength / 1000.0;
+            return refractiveIndex + (dispersiveCoefficient / (wavelengthMicrons * wavelengthMicrons));
+        }
+
+        // Same arithmetic as SphereLens::getNormalAt
+        NodeWeft::Vec2 normalAt(const NodeWeft::Vec2& point) const {
+            return NodeWeft::normalize(point - NodeWeft::Vec2{ circleX, circleY }) * normalSign;
+        }
+
+        // True if a point on the circle is on the half the surface occupies
+        bool onSurface(double x) const { return (convex && x < circleX) || (concave && x > circleX); }
+    };
+    static_assert(sizeof(CompiledSurface) == 64, "one cache line per surface");
+
+    // Lens list compiled for traceRaysIndexed and traceNonSequential, meant to be kept and shared while only
+    // the rays change. The sequential batch kernels (traceRays, IncrementalTracer, traceRayStates) read
+    // SphereLens directly, once per block. Records are made for spherical refractors only, the two tracers
+    // that read them do not handle other surfaces
+    class LensSystem {
+    public:
+        LensSystem() = default;
+        explicit LensSystem(const std::vector<SphereLens>& lenses);
+
+        // True when lenses are the ones this system was compiled from
+        bool matches(const std::vector<SphereLens>& lenses) const;
+
+        size_t size() const { return surfaces.size(); }
+        bool empty() const { return surfaces.empty(); }
+        const CompiledSurface& operator[](size_t i) const { return surfaces[i]; }
+        const std::vector<SphereLens>& getLenses() const { return lenses; }
+
+    private:
+        std::vector<SphereLens> lenses;
+        std::vector<CompiledSurface> surfaces;      // over-aligned, allocated on 64-byte boundaries
+    };
+
+    // intersectAndUpdateRay and refractRay on a compiled surface, with the same results
+    bool intersectAndUpdateRay(Ray& ray, const CompiledSurface& surface, double refractiveIndexBefore = 1.0);
+    bool refractRay(Ray& ray, const CompiledSurface& surface);
+
+} // namespace Optics
@@ -0,0 +1,291 @@
+#include "NonSequentialTrace.h"
+#include "BoundedQueue.h"
+#include "OpticsProfiler.h"
+#include "TracePool.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+namespace Optics {
+
+    namespace {
+        // Ray in flight with the random state and branch history of its path
+        struct PendingRay {
+            Ray ray;
+            uint64_t rng{ 0 };
+            uint64_t branch{ 0 };       // bit k set when interaction k reflected
+            uint32_t source{ 0 };
+            uint32_t depth{ 0 };
+            uint32_t reflections{ 0 };
+        };
+
+        struct EscapedRay {
+            uint32_t source;
+            uint64_t branch;
+            uint32_t depth;
+            Ray ray;
+        };
+
+        struct WorkerState {
+            std::vector<EscapedRay> escaped;
+            NonSequentialStats stats;
+        };
+
+        uint64_t splitMix(uint64_t& state)
+        {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+
+        double uniform(uint64_t& state)
+        {
+            return (double)(splitMix(state) >> 11) * (1.0 / 9007199254740992.0);
+        }
+
+        // Distance to the surface along the ray, same hit rules as intersectAndUpdateRay
+        bool surfaceHitDistance(const NodeWeft::Vec2& origin, const NodeWeft::Vec2& direction, const CompiledSurface& surface, double& t)
+        {
+            NodeWeft::Vec2 oc = origin - NodeWeft::Vec2{ surface.circleX, surface.circleY };
+            double a = NodeWeft::dot(direction, direction);
+            double b = 2.0 * NodeWeft::dot(oc, direction);
+            double c = NodeWeft::dot(oc, oc) - surface.radiusSquared;
+            double discriminant = b * b - 4 * a * c;
+            if (discriminant < 0)
+                return false;
+
+            double sqrtDisc = std::sqrt(discriminant);
+            double roots[2] = { (-b - sqrtDisc) / (2.0 * a), (-b + sqrtDisc) / (2.0 * a) };
+            for (double root : roots) {
+                if (root <= 0.0001)
+                    continue;
+                if (surface.onSurface(origin.x + direction.x * root)) {
+                    t = root;
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+
+    void traceNonSequential(const std::vector<Ray>& sources, const LensSystem& system,
+        const NonSequentialSettings& settings, std::vector<Ray>& output, NonSequentialStats* stats,
+        const SurfaceIndex* index)
+    {
+        OPTICS_PROFILE_SCOPE("traceNonSequential", "trace");
+        const uint32_t maxDepth = (uint32_t)(std::min)((std::max)(settings.maxDepth, 1), 64);
+
+        BoundedQueue<PendingRay> queue((std::max)(settings.queueCapacity, (size_t)2));
+        // source rays not yet finished plus rays in the queue or being followed,
+        // every child is counted before its parent is released so this only reaches 0 at the end
+        std::atomic<size_t> outstanding{ sources.size() };
+        std::atomic<size_t> nextSource{ 0 };
+
+        TracePool& pool = TracePool::instance();
+        int participants = pool.participantCount(sources.size(), 64, settings.threadCount);
+        std::vector<WorkerState> workers(participants);
+        for (auto& w : workers)
+            w.stats.energyByReflections.assign(maxDepth + 1, 0.0);
+        const size_t shareTarget = participants > 1 ? (std::min)(queue.capacity(), (size_t)participants * 16) : 0;
+
+        // Russian roulette on a new path weight, the survivor carries the threshold weight
+        // the threshold is relative to the path's source ray, whose intensity may be a spectral bin or an
+        // adaptive sampling weight, so every source ray's paths are followed to the same relative depth
+        auto survives = [&](double& weight, const PendingRay& p, uint64_t& rng, NonSequentialStats& s) {
+            const double threshold = settings.rouletteThreshold * sources[p.source].intensity;
+            if (weight >= threshold)
+                return true;
+            if (weight > 0 && uniform(rng) * threshold < weight) {
+                weight = threshold;
+                return true;
+            }
+            s.rouletteKills++;
+            return false;
+        };
+
+        // Follow one path until it leaves the system or dies, reflected branches go to the queue
+        // or, when it is full, onto the local stack
+        auto follow = [&](PendingRay& p, std::vector<PendingRay>& stack, std::vector<uint32_t>& candidates, WorkerState& w) {
+            NonSequentialStats& s = w.stats;
+            while (true) {
+                NodeWeft::Vec2 origin = p.ray.getOrigin();
+                NodeWeft::Vec2 direction = p.ray.direction;
+
+                // nearest surface along the ray
+                double nearest = 0;
+                const CompiledSurface* surface = nullptr;
+                auto test = [&](const CompiledSurface& l) {
+                    double t;
+                    s.surfaceTests++;
+                    if (surfaceHitDistance(origin, direction, l, t) && (!surface || t < nearest)) {
+                        nearest = t;
+                        surface = &l;
+                    }
+                };
+                if (index) {
+                    index->query(origin, direction, 0, candidates);
+                    for (uint32_t i : candidates)
+                        test(system[i]);
+                }
+                else {
+                    for (size_t i = 0; i < system.size(); i++)
+                        test(system[i]);
+                }
+
+                if (!surface) {
+                    s.outputRays++;
+                    s.escapedEnergy += p.ray.intensity;
+                    s.energyByReflections[(std::min)(p.reflections, maxDepth)] += p.ray.intensity;
+                    w.escaped.push_back(EscapedRay{ p.source, p.branch, p.depth, std::move(p.ray) });
+                    return;
+                }
+                if (p.depth >= maxDepth) {
+                    s.depthLimited++;
+                    s.truncatedEnergy += p.ray.intensity;
+                    return;
+                }
+                s.interactions++;
+
+                // media on both sides, the surface normal points to the -x side
+                NodeWeft::Vec2 point = origin + direction * nearest;
+                NodeWeft::Vec2 normal = surface->normalAt(point);
+                double glass = surface->refractiveIndexAt(p.ray.wavelength);
+                double front = surface->isEntrance ? 1.0 : glass;
+                double back = surface->isEntrance ? glass : 1.0;
+                double cosI = -NodeWeft::dot(direction, normal);
+                NodeWeft::Vec2 facing = normal;
+                bool fromFront = cosI >= 0;
+                if (!fromFront) {
+                    cosI = -cosI;
+                    facing = -normal;
+                }
+                double n1 = fromFront ? front : back;
+                double n2 = fromFront ? back : front;
+                double eta = n1 / n2;
+                double sinT2 = eta * eta * (1.0 - cosI * cosI);
+                NodeWeft::Vec2 reflected = NodeWeft::normalize(direction + facing * (2.0 * cosI));
+                uint64_t bit = 1ull << p.depth;
+                p.depth++;
+
+                if (sinT2 > 1.0) {
+                    // total internal reflection keeps the whole weight
+                    s.totalInternalReflections++;
+                    p.ray.addHit(point, normal, n1, n1, nearest);
+                    p.ray.direction = reflected;
+                    p.branch |= bit;
+                    p.reflections++;
+                    continue;
+                }
+
+                double reflectance = fresnelReflectance(direction, normal, n1, n2);
+                double weightR = p.ray.intensity * reflectance;
+                double weightT = p.ray.intensity - weightR;
+                uint64_t rngR = splitMix(p.rng);
+                bool keepR = survives(weightR, p, rngR, s);
+                bool keepT = survives(weightT, p, p.rng, s);
+
+                if (keepR) {
+                    PendingRay child{ p.ray, rngR, p.branch | bit, p.source, p.depth, p.reflections + 1 };
+                    child.ray.addHit(point, normal, n1, n1, nearest);
+                    child.ray.direction = reflected;
+                    child.ray.intensity = weightR;
+                    // share the branch only while other threads may run short of work,
+                    // following it locally keeps its path data in cache
+                    bool shared = false;
+                    if (queue.sizeApprox() < shareTarget) {
+                        outstanding.fetch_add(1, std::memory_order_relaxed);
+                        shared = queue.tryPush(child);
+                        if (shared)
+                            s.peakQueueSize = (std::max)(s.peakQueueSize, queue.sizeApprox());
+                        else
+                            outstanding.fetch_sub(1, std::memory_order_relaxed);
+                    }
+                    if (!shared)
+                        stack.push_back(std::move(child));
+                }
+                if (!keepT)
+                    return;
+                double cosT = std::sqrt(1.0 - sinT2);
+                p.ray.addHit(point, normal, n1, n2, nearest);
+                p.ray.direction = NodeWeft::normalize(direction * eta + facing * (eta * cosI - cosT));
+                p.ray.intensity = weightT;
+            }
+        };
+
+        pool.parallelFor(participants, 1, settings.threadCount, [&](size_t begin, size_t end, int worker) {
+            WorkerState& w = workers[worker];
+            std::vector<PendingRay> stack;
+            std::vector<uint32_t> candidates;
+            for (size_t k = begin; k < end; k++) {
+                PendingRay item;
+                while (true) {
+                    // drain the shared queue first so other threads can keep pushing
+                    if (!queue.tryPop(item)) {
+                        size_t s = nextSource.fetch_add(1, std::memory_order_relaxed);
+                        if (s >= sources.size()) {
+                            if (outstanding.load(std::memory_order_acquire) == 0)
+                                break;
+                            std::this_thread::yield();
+                            continue;
+                        }
+                        uint64_t rng = settings.seed ^ ((uint64_t)s * 0xD1B54A32D192ED03ull);
+                        item = PendingRay{ sources[s], splitMix(rng), 0, (uint32_t)s, 0, 0 };
+                    }
+                    stack.push_back(std::move(item));
+                    while (!stack.empty()) {
+                        PendingRay p = std::move(stack.back());
+                        stack.pop_back();
+                        follow(p, stack, candidates, w);
+                    }
+                    outstanding.fetch_sub(1, std::memory_order_release);
+                }
+            }
+        });
+
+        // order escaped rays by source ray and branch so the result is the same for any thread count
+        std::vector<EscapedRay*> escaped;
+        for (auto& w : workers)
+            for (auto& e : w.escaped)
+                escaped.push_back(&e);
+        std::sort(escaped.begin(), escaped.end(), [](const EscapedRay* a, const EscapedRay* b) {
+            if (a->source != b->source)
+                return a->source < b->source;
+            if (a->branch != b->branch)
+                return a->branch < b->branch;
+            return a->depth < b->depth;
+        });
+        output.reserve(output.size() + escaped.size());
+        for (EscapedRay* e : escaped)
+            output.push_back(std::move(e->ray));
+
+        NonSequentialStats total;
+        total.energyByReflections.assign(maxDepth + 1, 0.0);
+        total.sourceRays = sources.size();
+        for (auto& r : sources)
+            total.sourceEnergy += r.intensity;
+        for (auto& w : workers) {
+            const NonSequentialStats& s = w.stats;
+            total.outputRays += s.outputRays;
+            total.surfaceTests += s.surfaceTests;
+            total.interactions += s.interactions;
+            total.totalInternalReflections += s.totalInternalReflections;
+            total.rouletteKills += s.rouletteKills;
+            total.depthLimited += s.depthLimited;
+            total.peakQueueSize = (std::max)(total.peakQueueSize, s.peakQueueSize);
+            total.escapedEnergy += s.escapedEnergy;
+            total.truncatedEnergy += s.truncatedEnergy;
+            for (size_t i = 0; i < total.energyByReflections.size(); i++)
+                total.energyByReflections[i] += s.energyByReflections[i];
+        }
+        OPTICS_PROFILE_COUNT(RaysTraced, total.sourceRays);
+        OPTICS_PROFILE_COUNT(SurfaceTests, total.surfaceTests);
+        OPTICS_PROFILE_COUNT(Hits, total.interactions);
+        OPTICS_PROFILE_COUNT(Misses, total.surfaceTests - (std::min)(total.interactions, total.surfaceTests));
+        OPTICS_PROFILE_COUNT(TotalInternalReflections, total.totalInternalReflections);
+        if (stats)
+            *stats = total;
+    }
+
+} // namespace Optics
@@ -0,0 +1,47 @@
+#pragma once
+#include "LensSystem.h"
+#include "SurfaceIndex.h"
+#include <cstdint>
+
+namespace Optics {
+
+    // Settings of a non-sequential Monte Carlo trace
+    struct NonSequentialSettings {
+        int maxDepth{ 32 };                 // surface interactions per path, at most 64
+        double rouletteThreshold{ 1e-3 };   // paths weaker than this share of their source ray play Russian roulette
+        size_t queueCapacity{ 4096 };       // rays in flight shared between threads
+        uint64_t seed{ 1 };
+        int threadCount{ 1 };               // 0 = all cores
+    };
+
+    struct NonSequentialStats {
+        size_t sourceRays{ 0 };
+        size_t outputRays{ 0 };             // paths that left the system
+        size_t surfaceTests{ 0 };           // ray-surface intersection tests
+        size_t interactions{ 0 };           // surface hits over all paths
+        size_t totalInternalReflections{ 0 };
+        size_t rouletteKills{ 0 };
+        size_t depthLimited{ 0 };           // paths stopped at maxDepth
+        size_t peakQueueSize{ 0 };
+        double sourceEnergy{ 0 };
+        double escapedEnergy{ 0 };
+        double truncatedEnergy{ 0 };        // weight of the paths stopped at maxDepth
+
+        // Escaped energy by number of reflections on the path, 0 = direct light, 2 = first-order ghosts
+        std::vector<double> energyByReflections;
+    };
+
+    // Trace rays through the lenses in any order: at every hit the ray splits into a reflected and a
+    // refracted child weighted by Fresnel reflectance, total internal reflection keeps the reflected one only
+    // A surface separates air and glass, its entrance side faces -x (air for an entrance surface, glass for an exit)
+    // Rays leaving the system are appended to output with their full path, ordered by source ray, and their
+    // intensity scaled by the path weight. Paths below the roulette threshold times their source ray's intensity
+    // survive with probability weight / threshold and carry the threshold weight on, so the expected energy is unchanged
+    // Rays in flight wait in a fixed-size queue, a thread that finds it full follows the new branch itself,
+    // so memory stays bounded whatever the branching. Results do not depend on the thread count
+    // If index is given it must be up to date with system.getLenses(), it only narrows the surfaces tested per segment
+    void traceNonSequential(const std::vector<Ray>& sources, const LensSystem& system,
+        const NonSequentialSettings& settings, std::vector<Ray>& output, NonSequentialStats* stats = nullptr,
+        const SurfaceIndex* index = nullptr);
+
+} // namespace Optics
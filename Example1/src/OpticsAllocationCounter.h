@@ -0,0 +1,64 @@
+#pragma once
+#include "OpticsProfiler.h"
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Replaces the global operator new and delete of the program so the BytesAllocated profile counter sees
+// heap traffic: include this header in exactly one source file of an executable (the editor and optics-trace
+// do). Bytes are added to the ProfileCounterScope current on the allocating thread, nothing is counted
+// outside a scope, and the replacement compiles to plain malloc/free when profiling is compiled out
+// optics-bench has its own counting replacement and does not include this
+
+namespace OpticsAllocationCounter {
+
+    inline void* allocate(size_t size, size_t alignment)
+    {
+#if RAYOPTICS_PROFILING
+        Optics::countAllocation(size);
+#endif
+        void* p;
+        if (alignment <= alignof(std::max_align_t))
+            p = std::malloc(size ? size : 1);
+        else {
+            // aligned_alloc needs a size that is a multiple of the alignment
+            size_t rounded = (size + alignment - 1) / alignment * alignment;
+#ifdef _MSC_VER
+            p = _aligned_malloc(rounded ? rounded : alignment, alignment);
+#else
+            p = std::aligned_alloc(alignment, rounded ? rounded : alignment);
+#endif
+        }
+        if (!p)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    inline void release(void* p, size_t alignment) noexcept
+    {
+#ifdef _MSC_VER
+        if (alignment > alignof(std::max_align_t)) {
+            _aligned_free(p);
+            return;
+        }
+#else
+        (void)alignment;
+#endif
+        std::free(p);
+    }
+
+} // namespace OpticsAllocationCounter
+
+void* operator new(size_t size) { return OpticsAllocationCounter::allocate(size, 0); }
+void* operator new[](size_t size) { return OpticsAllocationCounter::allocate(size, 0); }
+void* operator new(size_t size, std::align_val_t alignment) { return OpticsAllocationCounter::allocate(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return OpticsAllocationCounter::allocate(size, (size_t)alignment); }
+
+void operator delete(void* p) noexcept { OpticsAllocationCounter::release(p, 0); }
+void operator delete[](void* p) noexcept { OpticsAllocationCounter::release(p, 0); }
+void operator delete(void* p, size_t) noexcept { OpticsAllocationCounter::release(p, 0); }
+void operator delete[](void* p, size_t) noexcept { OpticsAllocationCounter::release(p, 0); }
+void operator delete(void* p, std::align_val_t alignment) noexcept { OpticsAllocationCounter::release(p, (size_t)alignment); }
+void operator delete[](void* p, std::align_val_t alignment) noexcept { OpticsAllocationCounter::release(p, (size_t)alignment); }
+void operator delete(void* p, size_t, std::align_val_t alignment) noexcept { OpticsAllocationCounter::release(p, (size_t)alignment); }
+void operator delete[](void* p, size_t, std::align_val_t alignment) noexcept { OpticsAllocationCounter::release(p, (size_t)alignment); }
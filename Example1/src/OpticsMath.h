@@ -0,0 +1,33 @@
+#pragma once
+// Vec2/tRGB math used by the optics core
+// GUI builds share Node-Weft's types so rays can be handed to the viewport directly,
+// headless builds (RAYOPTICS_HEADLESS) get the same subset without any Node-Weft dependency
+#ifndef RAYOPTICS_HEADLESS
+#include "mathStructure.h"
+#else
+#include <cmath>
+#include <cstdint>
+
+namespace NodeWeft {
+    struct Vec2 {
+        double x, y;
+    };
+
+    inline Vec2 operator+(const Vec2& a, const Vec2& b) { return Vec2{ a.x + b.x, a.y + b.y }; }
+    inline Vec2 operator-(const Vec2& a, const Vec2& b) { return Vec2{ a.x - b.x, a.y - b.y }; }
+    inline Vec2 operator-(const Vec2& a) { return Vec2{ -a.x, -a.y }; }
+    inline Vec2 operator*(const Vec2& a, double s) { return Vec2{ a.x * s, a.y * s }; }
+    inline Vec2 operator*(double s, const Vec2& a) { return Vec2{ a.x * s, a.y * s }; }
+    inline Vec2 operator/(const Vec2& a, double s) { return Vec2{ a.x / s, a.y / s }; }
+    inline Vec2& operator+=(Vec2& a, const Vec2& b) { a.x += b.x; a.y += b.y; return a; }
+    inline Vec2& operator-=(Vec2& a, const Vec2& b) { a.x -= b.x; a.y -= b.y; return a; }
+
+    inline double dot(const Vec2& a, const Vec2& b) { return a.x * b.x + a.y * b.y; }
+    inline double length(const Vec2& a) { return std::sqrt(dot(a, a)); }
+    inline Vec2 normalize(const Vec2& a) { return a / length(a); }
+
+    struct tRGB {
+        uint8_t r, g, b;
+    };
+}
+#endif
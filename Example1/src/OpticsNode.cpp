@@ -1,39 +1,214 @@
 #include "OpticsNode.h"
+#include "OpticsAllocationCounter.h" // the editor's operator new, counts bytes allocated per bake
+#include <filesystem>
+#include <fstream>
 
 OpticsData& OpticsData::operator+=(const OpticsData& b)
 {
-	rays.insert(rays.end(), b.rays.begin(), b.rays.end());
-	lenses.insert(lenses.end(), b.lenses.begin(), b.lenses.end());
+	rays.append(b.rays);
+	states.append(b.states);
+	streams.append(b.streams);
+	paths.insert(paths.end(), b.paths.begin(), b.paths.end());
+	bakeKey = 0; // the node that combines data sets its own key
+	pending = pending || b.pending;
+	revision = max(revision, b.revision);
+	lenses.append(b.lenses);
+	lensOutlines.append(b.lensOutlines);
+	densityImage.reset();
+	streamSample.reset();
 	return *this;
 }
 
-void OpticsData::displayOnViewport(NodeAssistUI& ui)
+vector<Vec2> OpticsData::tessellateLens(const SphereLens& l)
 {
-	for (auto& r : rays) {
+	vector<Vec2> points;
+	const int segments = 36;
+	if (l.surfaceType != SphereLens::SphericalSurface) {
+		// sampled over the semi-aperture, unlimited surfaces are drawn as far as a sphere of the same radius
+		double limit = l.semiAperture > 0 ? l.semiAperture : abs(l.radius);
+		for (int i = 0; i <= segments; i++) {
+			double h = limit * (2.0 * i / segments - 1.0), slope;
+			double sag = surfaceSag(l, h, slope);
+			if (isfinite(sag))
+				points.push_back(l.center + Vec2{ sag,h });
+		}
+		return points;
+	}
+	Vec2 center = l.center + Vec2{ l.radius,0 };
+	for (int i = 0; i <= segments; i++) {
+		double angle = (double)i / segments * 3.14159;
+		Vec2 pointOnLens = center + Vec2{ -sin(angle),cos(angle) } * l.radius;
+		points.push_back(pointOnLens);
+	}
+	return points;
+}
+
+vector<RayState> OpticsData::flattenStates() const
+{
+	return traceInput().toStates();
+}
+
+TraceInput OpticsData::traceInput() const
+{
+	TraceInput input;
+	input.rays = rays;
+	input.paths = paths;
+	input.states = states;
+	return input;
+}
+
+uint64_t OpticsData::nextRevision()
+{
+	// only the UI thread replaces outputs
+	static uint64_t revision = 0;
+	return ++revision;
+}
+
+size_t OpticsData::pathRayCount() const
+{
+	size_t count = 0;
+	for (auto& p : paths)
+		count += p->size();
+	return count;
+}
+
+void OpticsData::displayOnViewport(NodeAssistUI& ui, const OpticsDisplaySettings& settings)
+{
+	OPTICS_PROFILE_SCOPE("OpticsData::displayOnViewport", "display");
+	bool useDensity = settings.displayMode == OpticsDisplaySettings::DensityDisplay
+		|| (settings.displayMode == OpticsDisplaySettings::AutoDisplay && rays.size() + pathRayCount() > OpticsDisplaySettings::densityRayThreshold);
+
+	// streams are far too large to draw, a traced subset of up to densityRayThreshold rays is generated once
+	if (!streams.empty() && !streamSample) {
+		auto sample = make_shared<vector<RayState>>();
+		size_t perStream = OpticsDisplaySettings::densityRayThreshold / streams.size();
+		streams.forEach([&](const RayStream& stream) {
+			vector<RayState> part = stream.sample(perStream, 0);
+			sample->insert(sample->end(), part.begin(), part.end());
+		});
+		streamSample = sample;
+	}
+	size_t stateStride = settings.displayMode == OpticsDisplaySettings::LineDisplay ? 1 : states.size() / OpticsDisplaySettings::densityRayThreshold + 1;
+
+	// spectral sources have few distinct wavelengths, each colour is computed once per draw
+	// line brightness is the intensity over the brightest line of the same wavelength, so spectral bin weights
+	// do not make the outer bins vanish and a source whose weights are all small still draws at full brightness
+	WavelengthPalette palette;
+	if (!useDensity) {
+		rays.forEach([&](const Ray& r) { palette.addIntensity(r.wavelength, r.intensity); });
+		for (auto& p : paths) {
+			for (size_t i = 0; i < p->size(); i++) {
+				RayState s = p->state(i);
+				palette.addIntensity(s.wavelength, s.intensity);
+			}
+		}
+	}
+	size_t stateIndex = 0;
+	states.forEach([&](const RayState& s) {
+		if (stateIndex++ % stateStride == 0)
+			palette.addIntensity(s.wavelength, s.intensity);
+	});
+	if (streamSample) {
+		for (const RayState& s : *streamSample)
+			palette.addIntensity(s.wavelength, s.intensity);
+	}
+
+	if (!useDensity) {
+		rays.forEach([&](const Ray& r) {
+			AssistPlot2D::Line line;
+			line.color = palette.normalized(r.wavelength, r.intensity);
+			line.points = r.path;
+			line.extendDirection = r.direction;
+			ui.assistPlot2D.lines.push_back(line);
+		});
+		for (auto& p : paths) {
+			for (size_t i = 0; i < p->size(); i++) {
+				RayState s = p->state(i);
+				AssistPlot2D::Line line;
+				line.color = palette.normalized(s.wavelength, s.intensity);
+				line.points.reserve(s.hitCount + 1);
+				for (size_t k = 0; k <= s.hitCount; k++)
+					line.points.push_back(p->point(i, k));
+				line.extendDirection = s.direction;
+				ui.assistPlot2D.lines.push_back(line);
+			}
+		}
+	}
+	else {
+		if (!densityImage || densityResolution != settings.densityResolution) {
+			densityImage = make_shared<DensityImage>();
+			densityImage->build(rays, paths, settings.densityResolution, 0);
+			densityResolution = settings.densityResolution;
+		}
+		// draw the image row by row, neighbouring cells of the same colour share one line
+		const DensityImage& image = *densityImage;
+		const tRGB background{ 255,255,255 }; // blend towards the default viewport colour
+		for (int y = 0; y < image.height; y++) {
+			double rowY = image.minCorner.y + (y + 0.5) * image.cellSize;
+			int runStart = -1;
+			tRGB runColor{ 0,0,0 };
+			for (int x = 0; x <= image.width; x++) {
+				bool filled = false;
+				tRGB color{ 0,0,0 };
+				if (x < image.width) {
+					double brightness;
+					tRGB cell = image.getCellColor(x, y, brightness);
+					filled = brightness > 0;
+					auto blend = [&](uint8_t c, uint8_t bg) { return (uint8_t)(bg + (c - bg) * brightness); };
+					color = tRGB{ blend(cell.r, background.r), blend(cell.g, background.g), blend(cell.b, background.b) };
+				}
+				bool sameRun = filled && runStart >= 0 && color.r == runColor.r && color.g == runColor.g && color.b == runColor.b;
+				if (runStart >= 0 && !sameRun) {
+					AssistPlot2D::Line line;
+					line.color = runColor;
+					line.points = { Vec2{ image.minCorner.x + runStart * image.cellSize, rowY }, Vec2{ image.minCorner.x + x * image.cellSize, rowY } };
+					ui.assistPlot2D.lines.push_back(line);
+					runStart = -1;
+				}
+				if (filled && runStart < 0) {
+					runStart = x;
+					runColor = color;
+				}
+			}
+		}
+	}
+
+	// states have no path, draw the outgoing rays of an evenly spaced subset
+	stateIndex = 0;
+	states.forEach([&](const RayState& s) {
+		if (stateIndex++ % stateStride != 0)
+			return;
 		AssistPlot2D::Line line;
-		line.color = r.getWavelengthColor();
-		line.points = r.path;
-		line.extendDirection = r.direction;
+		line.color = palette.normalized(s.wavelength, s.intensity);
+		line.points = { s.origin };
+		line.extendDirection = s.direction;
 		ui.assistPlot2D.lines.push_back(line);
+	});
+
+	if (streamSample) {
+		for (const RayState& s : *streamSample) {
+			AssistPlot2D::Line line;
+			line.color = palette.normalized(s.wavelength, s.intensity);
+			line.points = { s.origin };
+			line.extendDirection = s.direction;
+			ui.assistPlot2D.lines.push_back(line);
+		}
 	}
-	for (auto& l : lenses) {
+
+	lensOutlines.forEach([&](const vector<Vec2>& outline) {
 		AssistPlot2D::Line line;
-		const int segments = 36;
-		Vec2 center = l.center + Vec2{ l.radius,0 };
-		for (int i = 0; i <= segments; i++) {
-			double angle = (double)i / segments * 3.14159;
-			Vec2 pointOnLens = center + Vec2{ -sin(angle),cos(angle) } * l.radius;
-			line.points.push_back(pointOnLens);
-		}
+		line.points = outline;
 		line.color = tRGB{ 150,150,250 };
 		ui.assistPlot2D.lines.push_back(line);
-	}
-
+	});
 }
 
 bool OpticsSourceNode::bake()
 {
+	OPTICS_PROFILE_SCOPE("OpticsSourceNode::bake", "bake");
+	ProfileCounterScope profileCounters;
 	output.clear();
+	recordInputs();
 	if (inputNode[0] != nullptr) {
 		if (dynamic_pointer_cast<OpticsSourceNode>(inputNode[0].lock()) == nullptr)
 			return false; // only accept source node as input, otherwise show error
@@ -41,25 +216,78 @@ bool OpticsSourceNode::bake()
 			output += inputNode[0]->getOutput();
 	}
 
-	// generate rays
-	for (int i = 0; i < rayCount; i++) {
-		Vec2 aperturePoint = { apertureX, rayCount != 1 ? ((double)i / (rayCount - 1) - 0.5) * apertureSize : 0 };
-		Vec2 startPoint;
-		if (sourceType == PointSource)
-			startPoint = center;
-		else {
-			double angleRad = parallelAngle * 3.14159 / 180.0;
-			startPoint = Vec2{ -parallelStartOffset * cos(angleRad), -parallelStartOffset * sin(angleRad) } + aperturePoint;
+	// generate rays, adaptive sampling traces them through the lenses on the second pin
+	setPinInfo(0, L"light source");
+	setPinInfo(1, L"Lenses (adaptive sampling)");
+	bool adaptive = source.sampling == SourceDescription::AdaptiveSampling
+		&& inputNode[1] != nullptr && !inputNode[1]->getOutput<OpticsNodeOutputData>()->data.lenses.empty();
+	source.customSpectrum.clear();
+	for (auto& p : spectrumPoints) {
+		if (p.x > 0)
+			source.customSpectrum.push_back(p);
+	}
+	BakeKey key("Optics Source");
+	key.add(source.sourceType).add(source.rayCount).add(source.wavelength).add(source.apertureX).add(source.apertureSize)
+		.add(source.center).add(source.parallelAngle).add(source.parallelStartOffset).add(adaptive);
+	// streamed rays are traced without paths downstream, so the storage is part of the result
+	bool onDemand = generatesOnDemand(source);
+	key.add(source.spectrum).add(onDemand);
+	if (source.spectrum != SourceDescription::Monochromatic) {
+		key.add(source.spectralBins).add(source.spectralRange).add(source.temperature);
+		for (auto& p : source.customSpectrum)
+			key.add(p);
+	}
+	if (inputNode[0] != nullptr)
+		key.addUpstream(inputNode[0]->getOutput<OpticsNodeOutputData>()->data.bakeKey);
+	if (adaptive) {
+		key.add(source.coarseRayCount).add(source.positionTolerance).add(source.angleTolerance);
+		key.addUpstream(inputNode[1]->getOutput<OpticsNodeOutputData>()->data.bakeKey);
+		// only adaptive sampling traces, uniform fans are quicker to generate than to load
+		if (loadBakeCache(key.value())) {
+			endBakeProfile(profileCounters, to_wstring(oOutput->data.rays.size()) + L" rays, loaded from the bake cache");
+			return true;
 		}
-		Ray r(startPoint, aperturePoint - startPoint, wavelength);
-		oOutput->data.rays.push_back(r);	
 	}
+
+	vector<Ray> rays;
+	size_t rayCount = 0;
+	wstring info;
+	if (onDemand) {
+		// only the description is kept, consumers generate the rays block by block
+		RayStream stream(source);
+		rayCount = stream.size();
+		info = to_wstring(rayCount) + L" rays generated on demand";
+		oOutput->data.streams.append(vector<RayStream>{ stream });
+	}
+	else if (adaptive) {
+		size_t unresolved = generateAdaptiveSourceRays(source, inputNode[1]->getOutput<OpticsNodeOutputData>()->data.lenses.flatten(), rays, 0);
+		info = to_wstring(rays.size()) + L" rays" + (unresolved > 0 ? L", " + to_wstring(unresolved) + L" intervals above tolerance" : L", within tolerance");
+	}
+	else {
+		generateSourceRays(source, rays);
+		if (source.sampling == SourceDescription::AdaptiveSampling)
+			info = L"No input lens data, sampled uniformly";
+	}
+	rayCount += rays.size();
+	if (source.spectrum != SourceDescription::Monochromatic) {
+		size_t bins = sampleSpectrum(source).size();
+		info += (info.empty() ? L"" : L"\n") + to_wstring(bins) + L" spectral bins of " + to_wstring(rayCount / bins) + L" rays";
+	}
+	oOutput->data.rays.append(std::move(rays));
+	if (adaptive)
+		storeBakeCache(key.value());
+	else
+		oOutput->data.bakeKey = key.value();
+	endBakeProfile(profileCounters, info);
     return true;
 }
 
 bool OpticsLensNode::bake()
 {
+	OPTICS_PROFILE_SCOPE("OpticsLensNode::bake", "bake");
+	ProfileCounterScope profileCounters;
 	output.clear();
+	recordInputs();
 	if (inputNode[0] != nullptr) {
 		if(dynamic_cast<OpticsLensNode*>(inputNode[0].get()) == nullptr)
 			return false; // only accept source/lens node as input, otherwise show error
@@ -68,19 +296,49 @@ bool OpticsLensNode::bake()
 	}
 
 	// add lens
-	SphereLens lens{ Vec2{ positionX, 0 }, curvatureRadius, refractiveIndex, isEntrance, dispersiveCoefficient };
-	oOutput->data.lenses.push_back(lens);
+	SphereLens lens{ Vec2{ positionX, positionY }, curvatureRadius, refractiveIndex, isEntrance, dispersiveCoefficient };
+	lens.surfaceType = surfaceType;
+	lens.conicConstant = conicConstant;
+	copy(begin(asphericCoefficients), end(asphericCoefficients), lens.asphericCoefficients);
+	lens.semiAperture = semiAperture;
+	lens.isMirror = isMirror;
+	oOutput->data.lenses.append(vector<SphereLens>{ lens });
+	oOutput->data.lensOutlines.append(vector<vector<Vec2>>{ OpticsData::tessellateLens(lens) });
+	BakeKey key("Optics Lens");
+	key.add(positionX).add(positionY).add(curvatureRadius).add(refractiveIndex).add(dispersiveCoefficient).add(isEntrance);
+	key.add(surfaceType).add(conicConstant).add(asphericCoefficients[0]).add(asphericCoefficients[1]).add(asphericCoefficients[2])
+		.add(semiAperture).add(isMirror);
+	if (inputNode[0] != nullptr)
+		key.addUpstream(inputNode[0]->getOutput<OpticsNodeOutputData>()->data.bakeKey);
+	oOutput->data.bakeKey = key.value();
+	endBakeProfile(profileCounters);
 	return true;
 }
 
+void OpticsLensNode::setDesignParameter(int parameter, double value)
+{
+	switch (parameter) {
+	case LensVariable::PositionX: positionX = value; break;
+	case LensVariable::PositionY: positionY = value; break;
+	case LensVariable::CurvatureRadius: curvatureRadius = value; break;
+	case LensVariable::RefractiveIndex: refractiveIndex = value; break;
+	}
+}
+
 bool RefractNode::bake()
 {
+	OPTICS_PROFILE_SCOPE("RefractNode::bake", "bake");
+	ProfileCounterScope profileCounters;
 	output.clear();
+	recordInputs();
 	setPinInfo(0, L"light source");
 	setPinInfo(1, L"Lenses");
+	previewPending = false;
+	previewInput = OpticsData();
+	cancelBackgroundTrace(); // stale as soon as anything changed
 
 	// check inputs
-	if (inputNode[0] == nullptr || inputNode[0]->getOutput<OpticsNodeOutputData>()->data.rays.empty()) {
+	if (inputNode[0] == nullptr || !inputNode[0]->getOutput<OpticsNodeOutputData>()->data.hasLight()) {
 		setWarningFlag(true);
 		setUIInfo(L"No input light data");
 		return true;
@@ -91,25 +349,754 @@ bool RefractNode::bake()
 		return true;
 	}
 	
-	// get input data
-	vector<Ray> rays = inputNode[0]->getOutput<OpticsNodeOutputData>()->data.rays;
-	vector<SphereLens> lenses = inputNode[1]->getOutput<OpticsNodeOutputData>()->data.lenses;
+	// get input data, the lens list is small and flattened for the tracer
+	const OpticsData& lightData = inputNode[0]->getOutput<OpticsNodeOutputData>()->data;
+	const OpticsData& lensData = inputNode[1]->getOutput<OpticsNodeOutputData>()->data;
+	if (waitForInputs()) {
+		oOutput->data.lenses.append(lensData.lenses);
+		oOutput->data.lensOutlines.append(lensData.lensOutlines);
+		return true;
+	}
+
+	// thread count, surface index and background bake do not change the traced result
+	BakeKey key("Optics Refract");
+	key.add(engine == ParaxialEngine).add(traceMode).add(recordPaths);
+	if (traceMode == NonSequentialTrace)
+		key.add(nonSequential.rouletteThreshold).add(nonSequential.maxDepth);
+	else if (recordPaths)
+		key.add(pathPrecision);
+	else
+		key.add(tracePrecision);
+	key.addUpstream(lightData.bakeKey).addUpstream(lensData.bakeKey);
+	exactKey = key.value();
+	// the background trace reads large entries itself, loading them costs as much as copying the rays
+	size_t rayCount = lightData.rays.size() + lightData.pathRayCount() + lightData.states.size();
+	bool loadInBackground = engine != ParaxialEngine && shouldTraceInBackground(rayCount);
+	if (!loadInBackground && loadBakeCache(exactKey)) {
+		endBakeProfile(profileCounters, L"Loaded from the bake cache");
+		return true;
+	}
+	shared_ptr<const LensSystem> system = compileLenses(lensData);
+	const vector<SphereLens>& lenses = system->getLenses();
+
+	// generated rays stay lazy, the lenses are traced in sequence as downstream nodes pull the rays
+	if (!lightData.streams.empty()) {
+		auto stage = make_shared<const vector<SphereLens>>(lenses);
+		vector<RayStream> streams;
+		size_t streamed = 0;
+		lightData.streams.forEach([&](const RayStream& s) {
+			streams.push_back(s);
+			streams.back().addStage(stage);
+			streamed += s.size();
+		});
+		oOutput->data.streams.append(std::move(streams));
+		if (lightData.rays.empty() && lightData.paths.empty() && lightData.states.empty()) {
+			oOutput->data.lenses.append(lensData.lenses);
+			oOutput->data.lensOutlines.append(lensData.lensOutlines);
+			oOutput->data.bakeKey = exactKey;
+			// whatever the engine and trace mode, streams are traced exactly in sequence
+			endBakeProfile(profileCounters, to_wstring(streamed) + L" rays traced on demand, in sequence without paths");
+			return true;
+		}
+	}
+
+	// path-free trace, the preview engines are not needed at this cost
+	if (!recordPaths && engine != ParaxialEngine && traceMode == SequentialTrace) {
+		oOutput->data.lenses.append(lensData.lenses);
+		oOutput->data.lensOutlines.append(lensData.lensOutlines);
+		if (shouldTraceInBackground(rayCount)) {
+			startBackgroundTrace(lightData, system);
+			endBakeProfile(profileCounters, L"Tracing in background");
+			return true;
+		}
+		wstring info;
+		oOutput->data.states.append(traceStates(lightData, lenses, info));
+		storeBakeCache(exactKey);
+		endBakeProfile(profileCounters, info);
+		return true;
+	}
+
+	// paths of an upstream trace go on in their arenas, path-free input rays start again from their last hit
+	TraceInput input = lightData.traceInput();
+
+	// a quick succession of bakes means a parameter is being dragged
+	auto now = chrono::steady_clock::now();
+	bool editing = now - lastBakeTime < previewSettleTime;
+	lastBakeTime = now;
+	bool paraxialApplies = ParaxialSystem::isApplicable(lenses);
+	bool usePreview = paraxialApplies && (engine == ParaxialEngine || (engine == AutoEngine && editing));
 
 	// process rays through lenses
-	for (auto& r : rays) {
-		double refractiveIndexBefore = 1.0; // assume air
-		for (auto& l : lenses) {
-			if (intersectAndUpdateRay(r, l, refractiveIndexBefore)) {
-				refractRay(r, l);
-				if (l.isEntrance)
-					refractiveIndexBefore = l.getRefractiveIndexAtWavelength(r.wavelength);
-				else
-					refractiveIndexBefore = 1.0;
+	// the traced rays are shared with the tracer cache, the lenses with the input
+	wstring info;
+	if (usePreview)
+		oOutput->data.rays.append(traceParaxial(input, lenses, info));
+	else if (shouldTraceInBackground(input.size())) {
+		startBackgroundTrace(lightData, system);
+		info = L"Tracing in background";
+	}
+	else
+		traceExact(input, *system, oOutput->data, info);
+	if (engine == ParaxialEngine && !paraxialApplies)
+		info = L"Not an on-axis sequential stack, traced exactly";
+	oOutput->data.lenses.append(lensData.lenses);
+	oOutput->data.lensOutlines.append(lensData.lensOutlines);
+	// the Auto engine's preview is not the result the key stands for
+	if (usePreview ? engine == ParaxialEngine : !shouldTraceInBackground(input.size()))
+		storeBakeCache(exactKey);
+
+	// the exact trace replaces the preview once the drag stops, see getAssistUI
+	if (usePreview && engine == AutoEngine) {
+		previewPending = true;
+		previewInput.rays = lightData.rays;
+		previewInput.paths = lightData.paths;
+		previewInput.states = lightData.states;
+		previewInput.lenses.append(lensData.lenses);
+		previewInput.lensOutlines.append(lensData.lensOutlines);
+	}
+
+	endBakeProfile(profileCounters, info);
+	return true;
+}
+
+void RefractNode::traceExact(const TraceInput& input, const LensSystem& system, OpticsData& output, wstring& info)
+{
+	const vector<SphereLens>& lenses = system.getLenses();
+	bool useIndex = shouldUseSurfaceIndex(input, lenses);
+	// the non-sequential tracer only knows refracting spheres
+	bool spherical = all_of(lenses.begin(), lenses.end(), isSphericalRefractor);
+	if (traceMode == NonSequentialTrace && !spherical)
+		info = L"Non-sequential tracing needs spherical refracting surfaces, traced in sequence";
+	if (traceMode == NonSequentialTrace && spherical) {
+		// reflected branches multiply the ray count, report where the energy went
+		NonSequentialSettings settings = nonSequential;
+		settings.threadCount = threadCount;
+		NonSequentialStats stats;
+		auto rays = make_shared<vector<Ray>>();
+		traceNonSequential(input.toRays().flatten(), system, settings, *rays, &stats, useIndex ? &surfaceIndex : nullptr);
+		double ghostEnergy = stats.escapedEnergy - stats.energyByReflections[0];
+		info = to_wstring(stats.outputRays) + L" paths, " + to_wstring(stats.sourceEnergy > 0 ? ghostEnergy / stats.sourceEnergy * 100 : 0) + L"% reflected";
+		output.rays.append(rays);
+		return;
+	}
+	if (useIndex) {
+		// each ray only visits the surfaces it can reach
+		auto rays = make_shared<vector<Ray>>(input.toRays().flatten());
+		traceRaysIndexed(*rays, system, surfaceIndex, threadCount);
+		output.rays.append(rays);
+		return;
+	}
+	// only surfaces from the first edited one are re-traced, the paths go into the tracer's arena
+	lock_guard<mutex> lock(tracerMutex);
+	output.paths.push_back(tracer.trace(input, lenses, threadCount, pathPrecision));
+}
+
+shared_ptr<const vector<RayState>> RefractNode::traceStates(const OpticsData& input, const vector<SphereLens>& lenses, wstring& info)
+{
+	// 56 bytes per ray whatever the surface count, nothing is cached between bakes
+	auto states = make_shared<vector<RayState>>(input.flattenStates());
+	// a sample is traced again in double to show what the reduced precision costs
+	PrecisionError error;
+	if (tracePrecision != DoublePrecision)
+		error = measurePrecisionError(*states, lenses, tracePrecision, 4096, threadCount);
+	traceRayStates(*states, lenses, threadCount, tracePrecision);
+	info = to_wstring(states->size()) + L" rays, paths not recorded";
+	if (tracePrecision != DoublePrecision) {
+		wchar_t text[160];
+		swprintf(text, 160, L"\n%ls precision, max error %.3g in position, %.3g rad in direction over %zu rays",
+			tracePrecision == FloatPrecision ? L"Float" : L"Mixed", error.maxPosition, error.maxAngle, error.rays);
+		info += text;
+		if (error.hitMismatches > 0)
+			info += L", " + to_wstring(error.hitMismatches) + L" hit different surfaces";
+		if (!error.within()) {
+			setWarningFlag(true);
+			info += L"\nAbove the error tolerance, Double precision traces exactly";
+		}
+	}
+	return states;
+}
+
+shared_ptr<const vector<Ray>> RefractNode::traceParaxial(const TraceInput& input, const vector<SphereLens>& lenses, wstring& info)
+{
+	paraxial.setLenses(lenses);
+	auto rays = make_shared<vector<Ray>>(input.toRays().flatten());
+	paraxial.trace(*rays, threadCount);
+
+	// focal data at the shortest and longest input wavelength
+	double shortest = DBL_MAX, longest = 0;
+	for (auto& r : *rays) {
+		shortest = min(shortest, r.wavelength);
+		longest = max(longest, r.wavelength);
+	}
+	wchar_t text[160];
+	if (shortest == longest)
+		swprintf(text, 160, L"Paraxial preview, EFL %.4g, BFD %.4g", paraxial.effectiveFocalLength(shortest), paraxial.backFocalDistance(shortest));
+	else
+		swprintf(text, 160, L"Paraxial preview, EFL %.4g to %.4g, BFD %.4g to %.4g (%g to %g nm)",
+			paraxial.effectiveFocalLength(shortest), paraxial.effectiveFocalLength(longest),
+			paraxial.backFocalDistance(shortest), paraxial.backFocalDistance(longest), shortest, longest);
+	info = text;
+	return rays;
+}
+
+void RefractNode::getAssistUI(NodeAssistUI& upstreamUI)
+{
+	bakeIfInputsReplaced();
+	// parameters settled, replace the paraxial preview by the exact trace
+	if (previewPending && chrono::steady_clock::now() - lastBakeTime >= previewSettleTime) {
+		previewPending = false;
+		// the preview was baked with the current lens system
+		if (shouldTraceInBackground(previewInput.traceInput().size())) {
+			// the preview stays on screen until the background trace publishes, nodes downstream wait for it
+			startBackgroundTrace(previewInput, lensSystem);
+		}
+		else {
+			wstring info;
+			OpticsData exact;
+			traceExact(previewInput.traceInput(), *lensSystem, exact, info);
+			exact.lenses.append(previewInput.lenses);
+			exact.lensOutlines.append(previewInput.lensOutlines);
+			exact.streams = oOutput->data.streams;
+			// the key may be 0, the revision tells nodes downstream that the preview is gone
+			exact.revision = OpticsData::nextRevision();
+			oOutput->data = exact;
+			storeBakeCache(exactKey);
+			setUIInfo(info);
+		}
+		previewInput = OpticsData();
+	}
+	publishBackgroundTrace();
+	if (Node::isTurnOn())
+		oOutput->data.displayOnViewport(upstreamUI, displaySettings);
+}
+
+bool RefractNode::shouldTraceInBackground(size_t rayCount) const
+{
+	return backgroundBake == UseBackground || (backgroundBake == AutoBackground && rayCount > backgroundRayThreshold);
+}
+
+void RefractNode::startBackgroundTrace(const OpticsData& light, const shared_ptr<const LensSystem>& system)
+{
+	// the job runs on the background thread and only uses copies made here: the input lists share their
+	// immutable segments and arenas, the lens system is shared since it is never modified once compiled
+	using Job = BackgroundJob<OpticsData>;
+	const vector<SphereLens>& lenses = system->getLenses();
+	TraceInput input = light.traceInput();
+	uint64_t key = exactKey;
+	int threads = threadCount;
+	std::function<void(Job::Context&)> job;
+	if (!recordPaths && traceMode == SequentialTrace) {
+		int precision = tracePrecision;
+		job = [input, system, threads, precision](Job::Context& context) {
+			SegmentList<RayState> states = input.states;
+			if (!input.rays.empty() || !input.paths.empty()) {
+				states.clear();
+				states.append(input.toStates());
 			}
+			traceProgressively<RayState>(states,
+				[&](vector<RayState>& block) { traceRayStates(block, system->getLenses(), threads, precision); },
+				[&](const SegmentList<RayState>& items, size_t traced) {
+					OpticsData result;
+					result.states = items;
+					return context.publish(std::move(result), traced, states.size(), traced == states.size());
+				},
+				[&]() { return context.cancelled(); });
+		};
+	}
+	else if (!shouldUseSurfaceIndex(input, lenses) && (traceMode == SequentialTrace || !all_of(lenses.begin(), lenses.end(), isSphericalRefractor))) {
+		// the incremental tracer restarts from the first changed surface, as in the foreground. The background
+		// member is declared after the tracer, so its destructor joins the thread before the tracer goes
+		IncrementalTracer* incremental = &tracer;
+		mutex* incrementalMutex = &tracerMutex;
+		int precision = pathPrecision;
+		job = [input, system, threads, precision, incremental, incrementalMutex](Job::Context& context) {
+			const vector<SphereLens>& lenses = system->getLenses();
+			size_t total = input.size();
+			lock_guard<mutex> lock(*incrementalMutex);
+			// a trace from the first surface shows every 16th ray first
+			if (incremental->restartSurfaceFor(input, lenses, precision) == 0 && total > 16) {
+				SegmentList<Ray> sample;
+				sample.append(input.sample(total / 16));
+				auto preview = make_shared<RayPaths>();
+				preview->assign(sample, precision);
+				if (!traceRayPaths(*preview, lenses, nullptr, threads, 0, nullptr, [&](size_t) { return !context.cancelled(); }))
+					return;
+				OpticsData result;
+				result.paths.push_back(preview);
+				if (!context.publish(std::move(result), 0, total, false))
+					return;
+			}
+			atomic<size_t> traced{ 0 };
+			auto paths = incremental->trace(input, lenses, threads, precision, [&](size_t rays) {
+				return context.publishProgress(traced += rays, total);
+			});
+			if (!paths)
+				return;
+			OpticsData result;
+			result.paths.push_back(paths);
+			context.publish(std::move(result), total, total, true);
+		};
+	}
+	else {
+		std::function<void(vector<Ray>&)> trace;
+		shared_ptr<const SurfaceIndex> index = shouldUseSurfaceIndex(input, lenses) ? make_shared<const SurfaceIndex>(surfaceIndex) : nullptr;
+		if (traceMode == NonSequentialTrace && all_of(lenses.begin(), lenses.end(), isSphericalRefractor)) {
+			NonSequentialSettings settings = nonSequential;
+			settings.threadCount = threads;
+			trace = [system, settings, index](vector<Ray>& rays) {
+				vector<Ray> paths;
+				traceNonSequential(rays, *system, settings, paths, nullptr, index.get());
+				rays = std::move(paths);
+			};
+		}
+		else if (index)
+			trace = [system, index, threads](vector<Ray>& rays) { traceRaysIndexed(rays, *system, *index, threads); };
+		else
+			trace = [system, threads](vector<Ray>& rays) { traceRays(rays, system->getLenses(), threads); };
+		job = [input, trace](Job::Context& context) {
+			SegmentList<Ray> rays = input.toRays();
+			traceProgressively<Ray>(rays, trace,
+				[&](const SegmentList<Ray>& items, size_t traced) {
+					OpticsData result;
+					result.rays = items;
+					return context.publish(std::move(result), traced, rays.size(), traced == rays.size());
+				},
+				[&]() { return context.cancelled(); });
+		};
+	}
+	backgroundStartTime = chrono::steady_clock::now();
+	oOutput->data.pending = true;
+	background.start([key, job](Job::Context& context) {
+		// a result loaded from the cache keeps its key, so it is not stored again
+		BakeRecord record;
+		if (key != 0 && BakeCache::instance().load(key, record)) {
+			OpticsData loaded;
+			loaded.rays = record.rays;
+			loaded.states = record.states;
+			loaded.paths = record.paths;
+			loaded.bakeKey = key;
+			size_t count = loaded.rays.size() + loaded.pathRayCount() + loaded.states.size();
+			context.publish(std::move(loaded), count, count, true);
+			return;
+		}
+		job(context);
+	});
+}
+
+void RefractNode::cancelBackgroundTrace()
+{
+	background.cancel();
+}
+
+void RefractNode::publishBackgroundTrace()
+{
+	// swap in whatever the background trace finished since the last frame
+	BackgroundJob<OpticsData>::Progress progress;
+	if (!background.poll(progress))
+		return;
+	if (!progress.hasResult) {
+		setUIInfo(L"Tracing in background, " + to_wstring(progress.done) + L" of " + to_wstring(progress.total) + L" rays");
+		return;
+	}
+	OpticsData published = std::move(progress.result);
+	bool loaded = published.bakeKey != 0;
+	published.lenses = oOutput->data.lenses;
+	published.lensOutlines = oOutput->data.lensOutlines;
+	published.streams = oOutput->data.streams;
+	// a partial trace cannot be reproduced from a key and is not analysed downstream, the finished one is
+	// the result exactKey stands for and gives downstream nodes a valid upstream key for their own bake cache entries
+	published.bakeKey = progress.complete ? exactKey : 0;
+	published.pending = !progress.complete;
+	published.revision = OpticsData::nextRevision();
+	oOutput->data = published;
+
+	if (!progress.complete)
+		setUIInfo(L"Tracing in background, " + to_wstring(progress.done) + L" of " + to_wstring(progress.total) + L" rays");
+	else if (loaded)
+		setUIInfo(to_wstring(progress.total) + L" rays loaded from the bake cache");
+	else {
+		storeBakeCache(exactKey);
+		wchar_t text[128];
+		swprintf(text, 128, L"%zu rays traced in the background in %.3g s", progress.total,
+			chrono::duration<double>(chrono::steady_clock::now() - backgroundStartTime).count());
+		setUIInfo(text);
+	}
+}
+
+shared_ptr<const LensSystem> RefractNode::compileLenses(const OpticsData& lensData)
+{
+	// while only the sources change the lens key stays the same and the compiled records are reused,
+	// a lens input without a key is compared surface by surface
+	if (lensSystem && lensData.bakeKey != 0 && lensData.bakeKey == lensSystemKey)
+		return lensSystem;
+	vector<SphereLens> lenses = lensData.lenses.flatten();
+	if (!lensSystem || !lensSystem->matches(lenses))
+		lensSystem = make_shared<const LensSystem>(lenses);
+	lensSystemKey = lensData.bakeKey;
+	return lensSystem;
+}
+
+bool RefractNode::shouldUseSurfaceIndex(const TraceInput& input, const vector<SphereLens>& lenses)
+{
+	const size_t minSurfaces = 32;
+	if (!all_of(lenses.begin(), lenses.end(), isSphericalRefractor))
+		return false; // bounds and per-ray tracing are written for refracting spheres
+	if (surfaceIndexMode == NoIndex || (surfaceIndexMode == AutoIndex && lenses.size() < minSurfaces))
+		return false;
+	surfaceIndex.update(lenses);
+	if (surfaceIndexMode == UseIndex)
+		return true;
+	// worth it when rays can only reach a small part of a large surface set, sampled over the input
+	if (input.empty())
+		return false;
+	return surfaceIndex.averageCandidates(input.sample(64), 64) < lenses.size() / 4.0;
+}
+
+bool SpotAnalysisNode::bake()
+{
+	OPTICS_PROFILE_SCOPE("SpotAnalysisNode::bake", "bake");
+	ProfileCounterScope profileCounters;
+	output.clear();
+	recordInputs();
+	setPinInfo(0, L"Traced light");
+	analysis = SpotAnalysis();
+	if (inputNode[0] == nullptr) {
+		setWarningFlag(true);
+		setUIInfo(L"No input light data");
+		return true;
+	}
+	// rays pass through, the analysis only adds markers
+	output += inputNode[0]->getOutput();
+	oOutput->data.bakeKey = inputNode[0]->getOutput<OpticsNodeOutputData>()->data.bakeKey;
+	if (waitForInputs())
+		return true;
+
+	// rays are reduced segment by segment, no per-ray data is kept
+	SpotAnalyzer analyzer(planeX);
+	for (auto& segment : oOutput->data.rays.segments())
+		analyzer.add(*segment, threadCount);
+	for (auto& p : oOutput->data.paths)
+		analyzer.add(*p, threadCount);
+	for (auto& segment : oOutput->data.states.segments())
+		analyzer.add(*segment, threadCount);
+	oOutput->data.streams.forEach([&](const RayStream& stream) { analyzer.add(stream, threadCount); });
+	analysis = analyzer.result();
+	if (analysis.total.rays == 0) {
+		setWarningFlag(true);
+		setUIInfo(L"No traced rays reach the plane");
+		return true;
+	}
+
+	wchar_t text[256];
+	swprintf(text, 256, L"RMS spot %.4g, centroid %.4g, best focus x = %.4g (RMS %.4g)",
+		analysis.total.rmsRadius, analysis.total.centroid, analysis.total.bestFocus, analysis.total.bestFocusRms);
+	wstring info = text;
+	if (analysis.wavelengths.size() > 1) {
+		swprintf(text, 256, L"\nLongitudinal chromatic aberration %.4g (%g to %g nm)",
+			analysis.longitudinalChromatic, analysis.wavelengths.front().wavelength, analysis.wavelengths.back().wavelength);
+		info += text;
+	}
+	if (analysis.skippedRays > 0)
+		info += L"\n" + to_wstring(analysis.skippedRays) + L" rays skipped";
+	endBakeProfile(profileCounters, info);
+	return true;
+}
+
+void SpotAnalysisNode::getAssistUI(NodeAssistUI& upstreamUI)
+{
+	OpticsNodeType<SpotAnalysisNode>::getAssistUI(upstreamUI);
+	if (!Node::isTurnOn() || analysis.total.rays == 0)
+		return;
+
+	// the analysis plane across the spot, and a tick at the best focus of each wavelength
+	double halfHeight = analysis.total.rmsRadius * 3 + 1;
+	auto marker = [&](double x, double centroid, double half, tRGB color) {
+		AssistPlot2D::Line line;
+		line.color = color;
+		line.points = { Vec2{ x, centroid - half }, Vec2{ x, centroid + half } };
+		upstreamUI.assistPlot2D.lines.push_back(line);
+	};
+	marker(analysis.planeX, analysis.total.centroid, halfHeight, tRGB{ 120,120,120 });
+	for (auto& w : analysis.wavelengths)
+		marker(w.bestFocus, w.centroid, halfHeight * 0.25, wavelengthColor(w.wavelength));
+}
+
+bool DetectorNode::bake()
+{
+	OPTICS_PROFILE_SCOPE("DetectorNode::bake", "bake");
+	ProfileCounterScope profileCounters;
+	output.clear();
+	recordInputs();
+	setPinInfo(0, L"Traced light");
+	profile = IrradianceProfile();
+	if (inputNode[0] == nullptr) {
+		setWarningFlag(true);
+		setUIInfo(L"No input light data");
+		return true;
+	}
+	if (start.x == end.x && start.y == end.y) {
+		setWarningFlag(true);
+		setUIInfo(L"Start and End are the same point");
+		return true;
+	}
+	// rays pass through, the detector only adds its profile
+	output += inputNode[0]->getOutput();
+	oOutput->data.bakeKey = inputNode[0]->getOutput<OpticsNodeOutputData>()->data.bakeKey;
+	if (waitForInputs())
+		return true;
+
+	// one histogram per worker, merged once every ray is in
+	IrradianceDetector detector(start, end, (size_t)binCount);
+	for (auto& segment : oOutput->data.rays.segments())
+		detector.add(*segment, threadCount);
+	for (auto& p : oOutput->data.paths)
+		detector.add(*p, threadCount);
+	for (auto& segment : oOutput->data.states.segments())
+		detector.add(*segment, threadCount);
+	oOutput->data.streams.forEach([&](const RayStream& stream) { detector.add(stream, threadCount); });
+	profile = detector.result();
+	if (profile.rays == 0) {
+		setWarningFlag(true);
+		setUIInfo(L"No traced rays reach the detector");
+		return true;
+	}
+
+	size_t peakBin = max_element(profile.total.begin(), profile.total.end()) - profile.total.begin();
+	wchar_t text[256];
+	swprintf(text, 256, L"%zu rays, power %.4g, peak irradiance %.4g at %.4g from Start",
+		profile.rays, profile.power, profile.peak, profile.binPosition(peakBin));
+	wstring info = text;
+	if (profile.wavelengths.size() > 1) {
+		swprintf(text, 256, L"\n%zu wavelengths (%g to %g nm)", profile.wavelengths.size(), profile.wavelengths.front(), profile.wavelengths.back());
+		info += text;
+	}
+	if (profile.missedRays > 0)
+		info += L"\n" + to_wstring(profile.missedRays) + L" rays miss the detector";
+	if (exportCsv) {
+		exportCsv = false;
+		info += L"\n" + writeCsv();
+	}
+	endBakeProfile(profileCounters, info);
+	return true;
+}
+
+wstring DetectorNode::writeCsv() const
+{
+	// earlier exports are kept, the file name is numbered instead
+	filesystem::path path = "irradiance.csv";
+	for (int n = 1; filesystem::exists(path); n++)
+		path = "irradiance-" + to_string(n) + ".csv";
+	ofstream os(path);
+	os << irradianceCsvColumns << '\n';
+	writeIrradianceCsv(os, profile);
+	if (!os)
+		return L"Could not write " + path.wstring();
+	return L"Written to " + filesystem::absolute(path).wstring();
+}
+
+void DetectorNode::getAssistUI(NodeAssistUI& upstreamUI)
+{
+	OpticsNodeType<DetectorNode>::getAssistUI(upstreamUI);
+	if (!Node::isTurnOn() || profile.rays == 0 || profile.peak <= 0)
+		return;
+
+	// the detector line, and the profile plotted behind it with the peak at a quarter of its length
+	Vec2 edge = profile.end - profile.start;
+	Vec2 normal = Vec2{ edge.y, -edge.x } * (0.25 / profile.peak);
+	auto plot = [&](const vector<double>& bins, tRGB color) {
+		AssistPlot2D::Line line;
+		line.color = color;
+		line.points.reserve(bins.size() + 2);
+		line.points.push_back(profile.start);
+		for (size_t i = 0; i < bins.size(); i++)
+			line.points.push_back(profile.binCenter(i) + normal * bins[i]);
+		line.points.push_back(profile.end);
+		upstreamUI.assistPlot2D.lines.push_back(line);
+	};
+	AssistPlot2D::Line detectorLine;
+	detectorLine.color = tRGB{ 120,120,120 };
+	detectorLine.points = { profile.start, profile.end };
+	upstreamUI.assistPlot2D.lines.push_back(detectorLine);
+	if (profile.wavelengths.size() > 1 && profile.wavelengths.size() <= maxPlottedWavelengths) {
+		for (size_t k = 0; k < profile.wavelengths.size(); k++)
+			plot(profile.spectral[k], wavelengthColor(profile.wavelengths[k]));
+	}
+	plot(profile.total, tRGB{ 230,230,230 });
+}
+
+bool LensOptimizerNode::bake()
+{
+	OPTICS_PROFILE_SCOPE("LensOptimizerNode::bake", "bake");
+	ProfileCounterScope profileCounters;
+	output.clear();
+	recordInputs();
+	setPinInfo(0, L"light source");
+	setPinInfo(1, L"Lenses");
+	search.cancel();
+
+	// check inputs
+	if (inputNode[0] == nullptr || !inputNode[0]->getOutput<OpticsNodeOutputData>()->data.hasLight()) {
+		setWarningFlag(true);
+		setUIInfo(L"No input light data");
+		return true;
+	}
+	if (inputNode[1] == nullptr || inputNode[1]->getOutput<OpticsNodeOutputData>()->data.lenses.empty()) {
+		setWarningFlag(true);
+		setUIInfo(L"No input lens data");
+		return true;
+	}
+	if (waitForInputs())
+		return true;
+	const OpticsData& lightData = inputNode[0]->getOutput<OpticsNodeOutputData>()->data;
+	const OpticsData& lensData = inputNode[1]->getOutput<OpticsNodeOutputData>()->data;
+	vector<SphereLens> lenses = lensData.lenses.flatten();
+
+	vector<LensVariable> variables;
+	for (auto& slot : slots) {
+		if (slot.parameter != 0)
+			variables.push_back(LensVariable{ (size_t)slot.lens, slot.parameter - 1, min(slot.range.x, slot.range.y), max(slot.range.x, slot.range.y) });
+	}
+	// the optimizer drops variables it cannot move, see LensOptimizer
+	if (any_of(variables.begin(), variables.end(), [&](const LensVariable& v) { return v.lens >= lenses.size() || v.maximum <= v.minimum; })) {
+		setWarningFlag(true);
+		setUIInfo(L"Variables need an existing lens and a non-empty range");
+		return true;
+	}
+	// every design traces the whole source, generated rays are sampled down for the search
+	size_t streamRays = 0;
+	lightData.streams.forEach([&](const RayStream& s) { streamRays += s.size(); });
+	size_t sourceRays = lightData.rays.size() + lightData.pathRayCount() + lightData.states.size() + min(streamRays, LensOptimizer::maxStreamSample);
+	int maxSteps = LensOptimizer::maxGridSteps(variables.size(), sourceRays);
+	if (mode != NelderMeadMode && gridSteps > maxSteps) {
+		setWarningFlag(true);
+		setUIInfo(L"Grid Steps gives " + to_wstring(gridSteps) + L"^" + to_wstring(variables.size()) + L" designs, at most "
+			+ to_wstring(maxSteps) + L" steps with " + to_wstring(variables.size()) + L" variables and " + to_wstring(sourceRays) + L" rays");
+		return true;
+	}
+
+	// keyed for the nodes downstream, the optimizer itself is not cached since its report is not in the record
+	BakeKey key("Lens Optimizer");
+	key.add(mode).add(merit.planeX).add(merit.lostRayPenalty).add(gridSteps).add(nelderMead.maxIterations);
+	for (auto& v : variables)
+		key.add((int)v.lens).add(v.parameter).add(v.minimum).add(v.maximum);
+	key.addUpstream(lightData.bakeKey).addUpstream(lensData.bakeKey);
+	searchKey = key.value();
+	searchVariables = variables;
+	searchLensCount = lenses.size();
+
+	// the input lenses stand in until the search finishes, nodes downstream wait for it
+	oOutput->data.lenses.append(lensData.lenses);
+	oOutput->data.lensOutlines.append(lensData.lensOutlines);
+	oOutput->data.pending = true;
+
+	// the job loads the source and traces the best design itself, both cost O(rays)
+	using Job = BackgroundJob<SearchResult>;
+	TraceInput input = lightData.traceInput();
+	vector<RayStream> streams = lightData.streams.flatten();
+	int searchMode = mode, steps = gridSteps, threads = threadCount;
+	MeritSettings meritSettings = merit;
+	NelderMeadSettings nelderMeadSettings = nelderMead;
+	search.start([=](Job::Context& context) {
+		auto start = chrono::steady_clock::now();
+		vector<RayState> sourceStates = input.toStates();
+		vector<RayState> sample = sampleStreams(streams, LensOptimizer::maxStreamSample, threads);
+		sourceStates.insert(sourceStates.end(), sample.begin(), sample.end());
+		LensOptimizer optimizer(sourceStates, lenses, variables, meritSettings);
+		optimizer.setCancelCheck([&]() { return context.cancelled(); });
+		SearchResult result;
+		if (searchMode == NelderMeadMode)
+			result.best = optimizer.nelderMead(optimizer.initialValues(), nelderMeadSettings, threads);
+		else {
+			result.best = optimizer.gridSweep(steps, threads);
+			if (searchMode == GridNelderMeadMode)
+				result.best = optimizer.nelderMead(result.best.values, nelderMeadSettings, threads);
 		}
+		if (context.cancelled())
+			return;
+		result.evaluations = optimizer.getEvaluationCount();
+		result.sourceRays = sourceStates.size();
+
+		// the best design traced with paths
+		result.design = optimizer.apply(result.best.values);
+		auto paths = make_shared<RayPaths>();
+		paths->assign(input);
+		if (!traceRayPaths(*paths, result.design, nullptr, threads, 0, nullptr, [&](size_t) { return !context.cancelled(); }))
+			return;
+		result.paths = paths;
+		result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		context.publish(std::move(result), 1, 1, true);
+	});
+	endBakeProfile(profileCounters, L"Optimizing in background");
+	return true;
+}
+
+void LensOptimizerNode::getAssistUI(NodeAssistUI& upstreamUI)
+{
+	bakeIfInputsReplaced();
+	publishSearch();
+	if (Node::isTurnOn())
+		oOutput->data.displayOnViewport(upstreamUI, displaySettings);
+}
+
+void LensOptimizerNode::publishSearch()
+{
+	BackgroundJob<SearchResult>::Progress progress;
+	if (!search.poll(progress) || !progress.complete)
+		return;
+	const SearchResult& result = progress.result;
+
+	// output the best design, generated rays get it as their next stage
+	OpticsData published;
+	if (result.paths && !result.paths->empty())
+		published.paths.push_back(result.paths);
+	auto designStage = make_shared<const vector<SphereLens>>(result.design);
+	const OpticsData& lightData = inputNode[0]->getOutput<OpticsNodeOutputData>()->data;
+	vector<RayStream> streams;
+	lightData.streams.forEach([&](const RayStream& s) {
+		streams.push_back(s);
+		streams.back().addStage(designStage);
+	});
+	published.streams.append(std::move(streams));
+	vector<vector<Vec2>> outlines;
+	for (auto& l : result.design)
+		outlines.push_back(OpticsData::tessellateLens(l));
+	published.lenses.append(vector<SphereLens>(result.design));
+	published.lensOutlines.append(std::move(outlines));
+	published.bakeKey = searchKey;
+	published.revision = OpticsData::nextRevision();
+	oOutput->data = published;
+
+	wchar_t text[256];
+	swprintf(text, 256, L"Merit %.4g (RMS %.4g, %.3g%% transmitted), %zu designs of %zu rays in %.3g s",
+		result.best.merit, result.best.rmsRadius, result.best.transmission * 100, result.evaluations, result.sourceRays, result.seconds);
+	wstring info = text;
+	const wchar_t* parameterNames[] = { L"Position X", L"Position Y", L"Curvature Radius", L"Refractive Index" };
+	for (size_t i = 0; i < searchVariables.size(); i++) {
+		swprintf(text, 256, L"\nLens %zu %ls = %.6g", searchVariables[i].lens, parameterNames[searchVariables[i].parameter], result.best.values[i]);
+		info += text;
 	}
-	oOutput->data.rays = rays;
-	oOutput->data.lenses = lenses;
+	if (writeBack) {
+		writeBack = false;
+		info += writeBackToLenses(searchVariables, result.best.values, searchLensCount) ? L"\nWritten back to the lens nodes" : L"\nLens chain not found, nothing written back";
+	}
+	setUIInfo(info);
+}
 
+bool LensOptimizerNode::writeBackToLenses(const vector<LensVariable>& variables, const vector<double>& values, size_t lensCount)
+{
+	// each lens node adds one lens, so the chain read bottom-up gives the lens list in reverse
+	vector<OpticsLensNode*> chain;
+	for (auto node = dynamic_cast<OpticsLensNode*>(inputNode[1].get()); node != nullptr; node = node->upstreamLens())
+		chain.push_back(node);
+	if (chain.size() != lensCount)
+		return false;
+	reverse(chain.begin(), chain.end());
+	for (size_t i = 0; i < variables.size(); i++)
+		chain[variables[i].lens]->setDesignParameter(variables[i].parameter, values[i]);
+	// the lens outputs are baked again from the top of the chain, nodes using them notice the new keys on their
+	// next frame. This node's design does not change with the values it wrote, so it keeps its result
+	for (auto node : chain)
+		node->bake();
+	recordInputs();
 	return true;
 }
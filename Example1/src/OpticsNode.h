@@ -1,17 +1,72 @@
 #pragma once
 #include "BaseNodeType.h"
 #include "RayOptics.h"
+#include "OpticsSource.h"
+#include "IncrementalTrace.h"
+#include "SegmentList.h"
+#include "DensityImage.h"
+#include "LensSystem.h"
+#include "SurfaceIndex.h"
+#include "NonSequentialTrace.h"
+#include "OpticsProfiler.h"
+#include "ParaxialSystem.h"
+#include "SpotAnalysis.h"
+#include "LensOptimizer.h"
+#include "ProgressiveTrace.h"
+#include "BakeCache.h"
+#include "SurfaceKernels.h"
+#include "RayStream.h"
+#include "PrecisionTrace.h"
+#include "IrradianceDetector.h"
 
 using namespace NodeWeft;
 using namespace Optics;
 using namespace std;
 
+// How rays are drawn on the viewport
+struct OpticsDisplaySettings {
+	enum DisplayModeEnum {
+		AutoDisplay = 0,	// lines for small scenes, density above densityRayThreshold rays
+		LineDisplay,		// one line per ray
+		DensityDisplay,		// accumulated density image
+	};
+	int displayMode{ AutoDisplay };
+	int densityResolution{ 256 };
+
+	static constexpr size_t densityRayThreshold = 20000;
+};
+
+// Rays and lenses are shared, immutable segments: appending a node's own elements
+// adds one segment on top of the upstream data instead of copying it
 struct OpticsData {
-	vector<Ray> rays;
-	vector<SphereLens> lenses;
+	SegmentList<Ray> rays;
+	SegmentList<RayState> states; // rays traced without paths, drawn from their last hit
+	SegmentList<RayStream> streams; // rays generated and traced when they are pulled, drawn from a sample
+	vector<shared_ptr<const RayPaths>> paths; // exact sequential traces, one arena per trace
+	SegmentList<SphereLens> lenses;
+	SegmentList<vector<Vec2>> lensOutlines; // tessellated once per lens bake, parallel to lenses
+	uint64_t bakeKey{ 0 }; // BakeKey of the bake that produced this data, 0 if it cannot be reproduced
+	bool pending{ false }; // partial result of a background trace, nodes downstream wait for the finished one
+	uint64_t revision{ 0 }; // from nextRevision whenever a node replaces its output outside of bake, 0 for a bake's own output
 
 	OpticsData& operator+=(const OpticsData& b);
-	void displayOnViewport(NodeAssistUI& ui);
+	void displayOnViewport(NodeAssistUI& ui, const OpticsDisplaySettings& settings);
+
+	static vector<Vec2> tessellateLens(const SphereLens& l);
+	// rays, paths and states as one list of states, streams are not included
+	vector<RayState> flattenStates() const;
+	// rays, paths and states as the input of a further trace, the arenas are shared as they are
+	TraceInput traceInput() const;
+	size_t pathRayCount() const;
+	static uint64_t nextRevision();
+	bool hasLight() const { return !rays.empty() || !states.empty() || !streams.empty() || !paths.empty(); }
+
+private:
+	// density image of rays, built on first display and dropped when the data changes
+	shared_ptr<DensityImage> densityImage;
+	int densityResolution{ 0 };
+	// traced subset of the streams, built on first display like the density image
+	shared_ptr<const vector<RayState>> streamSample;
 };
 
 using OpticsNodeOutputData = SimpleNodeOutputData<OpticsData>;
@@ -20,12 +75,99 @@ template<typename DeriveClass>
 class OpticsNodeType :public NodeTypeRegister<DeriveClass> {
 protected:
 	ref_ptr<OpticsNodeOutputData> oOutput;
+	OpticsDisplaySettings displaySettings;
 	virtual void getAssistUI(NodeAssistUI& upstreamUI) override { 
+		bakeIfInputsReplaced();
 		if(Node::isTurnOn())
-			oOutput->data.displayOnViewport(upstreamUI);// for display element
+			oOutput->data.displayOnViewport(upstreamUI, displaySettings);// for display element
+	}
+	// inputs as the last bake saw them
+	// background traces and exact traces replacing a preview change a node's output after its bake,
+	// so nodes downstream compare on every frame
+	struct InputStamp {
+		uint64_t bakeKey{ 0 };
+		bool pending{ false };
+		uint64_t revision{ 0 };
+		bool operator!=(const InputStamp& b) const { return bakeKey != b.bakeKey || pending != b.pending || revision != b.revision; }
+	};
+	int inputCount;
+	vector<InputStamp> bakedInputs;
+	InputStamp inputStamp(int i) {
+		if (this->inputNode[i] == nullptr)
+			return InputStamp();
+		const OpticsData& data = this->inputNode[i]->template getOutput<OpticsNodeOutputData>()->data;
+		return InputStamp{ data.bakeKey, data.pending, data.revision };
+	}
+	// called at the start of bake
+	void recordInputs() {
+		bakedInputs.clear();
+		for (int i = 0; i < inputCount; i++)
+			bakedInputs.push_back(inputStamp(i));
+	}
+	void bakeIfInputsReplaced() {
+		for (int i = 0; i < (int)bakedInputs.size(); i++) {
+			if (inputStamp(i) != bakedInputs[i]) {
+				this->bake();
+				return;
+			}
+		}
+	}
+	// nodes that analyse or trace their input skip partial results, they are baked again once the trace finishes
+	bool waitForInputs() {
+		for (int i = 0; i < (int)bakedInputs.size(); i++) {
+			if (bakedInputs[i].pending) {
+				oOutput->data.pending = true;
+				this->setUIInfo(L"Waiting for the upstream background trace");
+				return true;
+			}
+		}
+		return false;
+	}
+	// bake statistics, shown in the node info while profiling is enabled
+	// counters is a ProfileCounterScope opened at the start of bake, so the numbers are this bake's only
+	void endBakeProfile(const ProfileCounterScope& counters, wstring info = L"") {
+		if (RAYOPTICS_PROFILING && counters.active()) {
+			RayStatistics rays;
+			for (auto& segment : oOutput->data.rays.segments())
+				rays.add(*segment);
+			for (auto& p : oOutput->data.paths)
+				rays.add(*p);
+			wstring statistics = formatBakeStatistics(counters, rays);
+			info = info.empty() ? statistics : info + L"\n" + statistics;
+		}
+		if (!info.empty())
+			this->setUIInfo(info);
+	}
+	// bake cache, the output is replaced by the cached result of key if there is one
+	// bake results keyed by BakeKey, key 0 is never cached
+	bool loadBakeCache(uint64_t key) {
+		BakeRecord record;
+		if (key == 0 || !BakeCache::instance().load(key, record))
+			return false;
+		OpticsData& data = oOutput->data;
+		data = OpticsData();
+		data.rays = record.rays;
+		data.states = record.states;
+		data.paths = record.paths;
+		data.lenses = record.lenses;
+		data.lensOutlines = record.lensOutlines;
+		data.bakeKey = key;
+		return true;
+	}
+	void storeBakeCache(uint64_t key) {
+		OpticsData& data = oOutput->data;
+		data.bakeKey = key;
+		// streams are not stored, they are cheaper to generate again than to load
+		if (key != 0 && data.streams.empty())
+			BakeCache::instance().storeInBackground(key, BakeRecord{ data.rays, data.states, data.lenses, data.lensOutlines, data.paths });
+	}
+	// display parameters, added last by nodes that output rays
+	void addDisplayParams() {
+		this->nodeParameter.addParams(L"Display Mode", { L"Auto", L"Lines", L"Density" }, &displaySettings.displayMode);
+		this->nodeParameter.addParams(L"Density Resolution", &displaySettings.densityResolution, { 16,4096 }, [&]() {return displaySettings.displayMode != OpticsDisplaySettings::LineDisplay; });
 	}
 public:
-	OpticsNodeType(int numberOfInput): NodeTypeRegister<DeriveClass>(numberOfInput) {
+	OpticsNodeType(int numberOfInput): NodeTypeRegister<DeriveClass>(numberOfInput), inputCount(numberOfInput) {
 		oOutput = this->template addOutputData<OpticsNodeOutputData>();
 	}
 };
@@ -33,36 +175,36 @@ public:
 class OpticsSourceNode :public OpticsNodeType<OpticsSourceNode> {
 protected:
 	// variables
-	enum SourceTypeEnum {
-		PointSource = 0,
-		ParallelSource,
-	};
-	int sourceType{ PointSource };
-
-	int rayCount{ 10 };
-	double wavelength{ 550 }; // in nm
-	double apertureX{ 0 };
-	double apertureSize{ 1 };
-
-	Vec2 center{ -10,0 };
-
-	double parallelAngle{ 0 }; // in degree
-	double parallelStartOffset{ 10 };
+	SourceDescription source;
+	static constexpr int spectrumPointCount = 6;
+	Vec2 spectrumPoints[spectrumPointCount]; // custom spectrum (wavelength, power), points at wavelength 0 are unused
 
 public:
 	static wstring getClassName() { return L"Optics Source"; }
 	static vector<wstring> getCategoryName() { return { L"Element" }; }
 	static ImageHandle getClassIcon() { return ImageHandle(WindowManager::resourceIconDir + L"OpticsSourceNode.jpg", true); }
-	OpticsSourceNode() : OpticsNodeType<OpticsSourceNode>(1) {
+	OpticsSourceNode() : OpticsNodeType<OpticsSourceNode>(2) {
 		// setup parameters
-		nodeParameter.addParams(L"Source Type", { L"Point Source", L"Parallel Source" }, &sourceType);
-		nodeParameter.addParams(L"Ray Count", &rayCount, { 1,INT_MAX });
-		nodeParameter.addParams(L"Wavelength (nm)", &wavelength, { 380,750 });
-		nodeParameter.addParams(L"Aperture X", &apertureX);
-		nodeParameter.addParams(L"Aperture Size", &apertureSize, {0,DBL_MAX});
-		nodeParameter.addParams(L"Center", &center, {}, [&]() {return sourceType == PointSource; });
-		nodeParameter.addParams(L"Angle", &parallelAngle, {}, [&]() {return sourceType == ParallelSource; });
-		nodeParameter.addParams(L"Start Offset", &parallelStartOffset, {}, [&]() {return sourceType == ParallelSource; });
+		nodeParameter.addParams(L"Source Type", { L"Point Source", L"Parallel Source" }, &source.sourceType);
+		nodeParameter.addParams(L"Ray Count", &source.rayCount, { 1,INT_MAX });
+		nodeParameter.addParams(L"Wavelength (nm)", &source.wavelength, { 380,750 });
+		nodeParameter.addParams(L"Aperture X", &source.apertureX);
+		nodeParameter.addParams(L"Aperture Size", &source.apertureSize, {0,DBL_MAX});
+		nodeParameter.addParams(L"Center", &source.center, {}, [&]() {return source.sourceType == SourceDescription::PointSource; });
+		nodeParameter.addParams(L"Angle", &source.parallelAngle, {}, [&]() {return source.sourceType == SourceDescription::ParallelSource; });
+		nodeParameter.addParams(L"Start Offset", &source.parallelStartOffset, {}, [&]() {return source.sourceType == SourceDescription::ParallelSource; });
+		nodeParameter.addParams(L"Sampling", { L"Uniform", L"Adaptive" }, &source.sampling);
+		nodeParameter.addParams(L"Ray Storage", { L"Auto", L"Stored", L"On Demand" }, &source.storage, [&]() {return source.sampling == SourceDescription::UniformSampling; });
+		nodeParameter.addParams(L"Coarse Ray Count", &source.coarseRayCount, { 2,INT_MAX }, [&]() {return source.sampling == SourceDescription::AdaptiveSampling; });
+		nodeParameter.addParams(L"Position Tolerance", &source.positionTolerance, { 1e-9,DBL_MAX }, [&]() {return source.sampling == SourceDescription::AdaptiveSampling; });
+		nodeParameter.addParams(L"Angle Tolerance", &source.angleTolerance, { 1e-9,180 }, [&]() {return source.sampling == SourceDescription::AdaptiveSampling; });
+		nodeParameter.addParams(L"Spectrum", { L"Monochromatic", L"Blackbody", L"D65", L"Custom" }, &source.spectrum);
+		nodeParameter.addParams(L"Spectral Bins", &source.spectralBins, { 1,4096 }, [&]() {return source.spectrum != SourceDescription::Monochromatic; });
+		nodeParameter.addParams(L"Spectral Range (nm)", &source.spectralRange, { 1,DBL_MAX }, [&]() {return source.spectrum != SourceDescription::Monochromatic; });
+		nodeParameter.addParams(L"Temperature (K)", &source.temperature, { 1,DBL_MAX }, [&]() {return source.spectrum == SourceDescription::BlackbodySpectrum; });
+		for (int i = 0; i < spectrumPointCount; i++)
+			nodeParameter.addParams(L"Spectrum Point " + to_wstring(i + 1), &spectrumPoints[i], {}, [&]() {return source.spectrum == SourceDescription::CustomSpectrum; });
+		addDisplayParams();
 	}
 	virtual bool bake()override;
 };
@@ -71,10 +213,16 @@ class OpticsLensNode :public OpticsNodeType<OpticsLensNode> {
 protected:
 	// variables
 	double positionX{ 0 };
+	double positionY{ 0 };
 	double curvatureRadius{ 10 };
 	double refractiveIndex{ 1.5 };
 	double dispersiveCoefficient{ 0 };
 	bool isEntrance{ true };
+	int surfaceType{ SphereLens::SphericalSurface };
+	double conicConstant{ 0 };
+	double asphericCoefficients[3]{ 0, 0, 0 };
+	double semiAperture{ 0 };
+	bool isMirror{ false };
 
 public:
 	static wstring getClassName() { return L"Optics Lens"; }
@@ -83,20 +231,223 @@ public:
 	OpticsLensNode() : OpticsNodeType<OpticsLensNode>(1) {
 		// setup parameters
 		nodeParameter.addParams(L"Position X", &positionX);
+		nodeParameter.addParams(L"Position Y", &positionY);
 		nodeParameter.addParams(L"Curvature Radius", &curvatureRadius);
 		nodeParameter.addParams(L"Refractive Index", &refractiveIndex, { 1.0,DBL_MAX });
 		nodeParameter.addParams(L"Dispersive Coefficient", &dispersiveCoefficient, { 0,DBL_MAX });
 		nodeParameter.addParams(L"Is Entrance", &isEntrance);
+		nodeParameter.addParams(L"Surface Type", { L"Sphere", L"Flat", L"Conic", L"Asphere" }, &surfaceType);
+		nodeParameter.addParams(L"Conic Constant", &conicConstant, {}, [&]() {return surfaceType >= SphereLens::ConicSurface; });
+		nodeParameter.addParams(L"A4", &asphericCoefficients[0], {}, [&]() {return surfaceType == SphereLens::AsphericSurface; });
+		nodeParameter.addParams(L"A6", &asphericCoefficients[1], {}, [&]() {return surfaceType == SphereLens::AsphericSurface; });
+		nodeParameter.addParams(L"A8", &asphericCoefficients[2], {}, [&]() {return surfaceType == SphereLens::AsphericSurface; });
+		nodeParameter.addParams(L"Semi-Aperture", &semiAperture, { 0,DBL_MAX }, [&]() {return surfaceType != SphereLens::SphericalSurface; });
+		nodeParameter.addParams(L"Mirror", &isMirror);
 	}
 	virtual bool bake()override;
+
+	// used by the optimizer to write results back, lenses are listed from the top of the chain
+	OpticsLensNode* upstreamLens() { return dynamic_cast<OpticsLensNode*>(inputNode[0].get()); }
+	void setDesignParameter(int parameter, double value);
 };
 
 class RefractNode :public OpticsNodeType<RefractNode> {
+protected:
+	// variables
+	int threadCount{ 0 }; // 0 = use all cores
+	enum SurfaceIndexEnum {
+		AutoIndex = 0,	// use the index for large, sparsely hit surface sets
+		NoIndex,
+		UseIndex,
+	};
+	int surfaceIndexMode{ AutoIndex };
+	enum TraceModeEnum {
+		SequentialTrace = 0,	// lenses in list order, refraction only
+		NonSequentialTrace,		// any order, Fresnel-split reflected and refracted rays
+	};
+	int traceMode{ SequentialTrace };
+	NonSequentialSettings nonSequential;
+	enum EngineEnum {
+		ExactEngine = 0,
+		ParaxialEngine,		// ABCD matrices, on-axis sequential stacks only
+		AutoEngine,			// paraxial while parameters are being dragged, exact once they settle
+	};
+	int engine{ ExactEngine };
+	bool recordPaths{ true }; // off: only the final state of each ray is kept
+	int pathPrecision{ RayPaths::DoublePoints }; // float halves the path memory of exact sequential traces
+	int tracePrecision{ DoublePrecision }; // float and mixed trade accuracy for speed when paths are not recorded
+	enum BackgroundBakeEnum {
+		AutoBackground = 0,	// in the background above backgroundRayThreshold input rays
+		NoBackground,
+		UseBackground,
+	};
+	int backgroundBake{ AutoBackground };
+	static constexpr size_t backgroundRayThreshold = 16384;
+
+	IncrementalTracer tracer; // keeps per-surface ray states between bakes
+	mutex tracerMutex; // the tracer is also used by background traces
+	SurfaceIndex surfaceIndex; // rebuilt or refit when the lens set changes
+	shared_ptr<const LensSystem> lensSystem; // recompiled when the lens input changes, shared with background traces
+	uint64_t lensSystemKey{ 0 }; // bake key of the lens input lensSystem was compiled from
+	ParaxialSystem paraxial; // system matrices per wavelength
+
+	// bakes closer together than this are treated as a parameter drag
+	static constexpr chrono::milliseconds previewSettleTime{ 300 };
+	chrono::steady_clock::time_point lastBakeTime;
+	bool previewPending{ false }; // output is a paraxial preview of previewInput
+	OpticsData previewInput;
+
+	// exact traces of large inputs run here, results are picked up in getAssistUI
+	// the job reads the bake cache and builds its input itself, both cost O(rays)
+	BackgroundJob<OpticsData> background;
+	chrono::steady_clock::time_point backgroundStartTime;
+	uint64_t exactKey{ 0 }; // bake key of the exact trace the preview or background trace stands in for
+	bool shouldTraceInBackground(size_t rayCount) const;
+	void startBackgroundTrace(const OpticsData& light, const shared_ptr<const LensSystem>& system);
+	void cancelBackgroundTrace();
+	void publishBackgroundTrace();
+
+	shared_ptr<const LensSystem> compileLenses(const OpticsData& lensData);
+	bool shouldUseSurfaceIndex(const TraceInput& input, const vector<SphereLens>& lenses);
+	void traceExact(const TraceInput& input, const LensSystem& system, OpticsData& output, wstring& info);
+	shared_ptr<const vector<Ray>> traceParaxial(const TraceInput& input, const vector<SphereLens>& lenses, wstring& info);
+	shared_ptr<const vector<RayState>> traceStates(const OpticsData& input, const vector<SphereLens>& lenses, wstring& info);
+	virtual void getAssistUI(NodeAssistUI& upstreamUI) override;
+
 public:
 	static wstring getClassName() { return L"Optics Refract"; }
 	static vector<wstring> getCategoryName() { return { L"Operation" }; }
 	static ImageHandle getClassIcon() { return ImageHandle(WindowManager::resourceIconDir + L"OpticsRefractNode.jpg", true); }
 	RefractNode() : OpticsNodeType<RefractNode>(2) {
+		// setup parameters
+		nodeParameter.addParams(L"Thread Count", &threadCount, { 0,1024 });
+		nodeParameter.addParams(L"Surface Index", { L"Auto", L"Off", L"On" }, &surfaceIndexMode);
+		nodeParameter.addParams(L"Engine", { L"Exact", L"Paraxial", L"Auto" }, &engine);
+		nodeParameter.addParams(L"Trace Mode", { L"Sequential", L"Non-Sequential" }, &traceMode, [&]() {return engine != ParaxialEngine; });
+		nodeParameter.addParams(L"Roulette Threshold", &nonSequential.rouletteThreshold, { 1e-9,1 }, [&]() {return traceMode == NonSequentialTrace; });
+		nodeParameter.addParams(L"Max Depth", &nonSequential.maxDepth, { 1,64 }, [&]() {return traceMode == NonSequentialTrace; });
+		nodeParameter.addParams(L"Record Paths", &recordPaths, [&]() {return engine != ParaxialEngine && traceMode == SequentialTrace; });
+		nodeParameter.addParams(L"Path Precision", { L"Double", L"Float" }, &pathPrecision, [&]() {return engine != ParaxialEngine && traceMode == SequentialTrace && recordPaths; });
+		nodeParameter.addParams(L"Trace Precision", { L"Double", L"Float", L"Mixed" }, &tracePrecision, [&]() {return engine != ParaxialEngine && traceMode == SequentialTrace && !recordPaths; });
+		nodeParameter.addParams(L"Background Bake", { L"Auto", L"Off", L"On" }, &backgroundBake);
+		addDisplayParams();
+	}
+	virtual bool bake()override;
+};
+
+class SpotAnalysisNode :public OpticsNodeType<SpotAnalysisNode> {
+protected:
+	// variables
+	double planeX{ 100 };
+	int threadCount{ 0 }; // 0 = use all cores
+	SpotAnalysis analysis;
+
+	virtual void getAssistUI(NodeAssistUI& upstreamUI) override;
+
+public:
+	static wstring getClassName() { return L"Spot Analysis"; }
+	static vector<wstring> getCategoryName() { return { L"Analysis" }; }
+	static ImageHandle getClassIcon() { return ImageHandle(WindowManager::resourceIconDir + L"OpticsRefractNode.jpg", true); }
+	SpotAnalysisNode() : OpticsNodeType<SpotAnalysisNode>(1) {
+		// setup parameters
+		nodeParameter.addParams(L"Plane X", &planeX);
+		nodeParameter.addParams(L"Thread Count", &threadCount, { 0,1024 });
+		addDisplayParams();
+	}
+	virtual bool bake()override;
+};
+
+class DetectorNode :public OpticsNodeType<DetectorNode> {
+protected:
+	// variables
+	Vec2 start{ 100,-10 };
+	Vec2 end{ 100,10 };
+	int binCount{ 256 };
+	int threadCount{ 0 }; // 0 = use all cores
+	bool exportCsv{ false }; // one shot, cleared once the file is written
+	IrradianceProfile profile;
+	static constexpr size_t maxPlottedWavelengths = 16; // more are only plotted in total
+
+	virtual void getAssistUI(NodeAssistUI& upstreamUI) override;
+	// Write the profile to irradiance.csv in the working directory, or irradiance-N.csv if that exists
+	wstring writeCsv() const;
+
+public:
+	static wstring getClassName() { return L"Optics Detector"; }
+	static vector<wstring> getCategoryName() { return { L"Analysis" }; }
+	static ImageHandle getClassIcon() { return ImageHandle(WindowManager::resourceIconDir + L"OpticsRefractNode.jpg", true); }
+	DetectorNode() : OpticsNodeType<DetectorNode>(1) {
+		// setup parameters
+		nodeParameter.addParams(L"Start", &start);
+		nodeParameter.addParams(L"End", &end);
+		nodeParameter.addParams(L"Bin Count", &binCount, { 1,65536 });
+		nodeParameter.addParams(L"Thread Count", &threadCount, { 0,1024 });
+		nodeParameter.addParams(L"Export CSV", &exportCsv);
+		addDisplayParams();
+	}
+	virtual bool bake()override;
+};
+
+class LensOptimizerNode :public OpticsNodeType<LensOptimizerNode> {
+protected:
+	// variables
+	enum ModeEnum {
+		GridMode = 0,		// every combination of Grid Steps values per variable
+		NelderMeadMode,		// from the current lens values
+		GridNelderMeadMode,	// from the best grid design
+	};
+	int mode{ GridNelderMeadMode };
+	MeritSettings merit;
+	struct VariableSlot {
+		int parameter{ 0 }; // 0 = off, otherwise LensVariable::ParameterEnum + 1
+		int lens{ 0 };
+		Vec2 range{ 0,0 };
+	};
+	static constexpr int variableSlotCount = 3;
+	VariableSlot slots[variableSlotCount];
+	int gridSteps{ 16 };
+	NelderMeadSettings nelderMead;
+	int threadCount{ 0 }; // 0 = use all cores
+	bool writeBack{ false }; // one shot, cleared once the values are written
+
+	// the search runs in the background, its best design replaces the output in getAssistUI
+	struct SearchResult {
+		DesignResult best;
+		size_t evaluations{ 0 };
+		size_t sourceRays{ 0 };
+		double seconds{ 0 };
+		vector<SphereLens> design;
+		shared_ptr<const RayPaths> paths; // rays and arenas of the light input traced through the design
+	};
+	BackgroundJob<SearchResult> search;
+	vector<LensVariable> searchVariables;
+	size_t searchLensCount{ 0 };
+	uint64_t searchKey{ 0 };
+	void publishSearch();
+	bool writeBackToLenses(const vector<LensVariable>& variables, const vector<double>& values, size_t lensCount);
+	virtual void getAssistUI(NodeAssistUI& upstreamUI) override;
+
+public:
+	static wstring getClassName() { return L"Lens Optimizer"; }
+	static vector<wstring> getCategoryName() { return { L"Operation" }; }
+	static ImageHandle getClassIcon() { return ImageHandle(WindowManager::resourceIconDir + L"OpticsRefractNode.jpg", true); }
+	LensOptimizerNode() : OpticsNodeType<LensOptimizerNode>(2) {
+		// setup parameters
+		nodeParameter.addParams(L"Mode", { L"Grid Sweep", L"Nelder-Mead", L"Grid + Nelder-Mead" }, &mode);
+		nodeParameter.addParams(L"Plane X", &merit.planeX);
+		nodeParameter.addParams(L"Lost Ray Penalty", &merit.lostRayPenalty, { 0,DBL_MAX });
+		for (int i = 0; i < variableSlotCount; i++) {
+			wstring name = L"Variable " + to_wstring(i + 1);
+			VariableSlot& slot = slots[i];
+			nodeParameter.addParams(name, { L"Off", L"Position X", L"Position Y", L"Curvature Radius", L"Refractive Index" }, &slot.parameter);
+			nodeParameter.addParams(name + L" Lens", &slot.lens, { 0,INT_MAX }, [&slot]() {return slot.parameter != 0; });
+			nodeParameter.addParams(name + L" Range", &slot.range, {}, [&slot]() {return slot.parameter != 0; });
+		}
+		nodeParameter.addParams(L"Grid Steps", &gridSteps, { 1,256 }, [&]() {return mode != NelderMeadMode; });
+		nodeParameter.addParams(L"Max Iterations", &nelderMead.maxIterations, { 1,100000 }, [&]() {return mode != GridMode; });
+		nodeParameter.addParams(L"Thread Count", &threadCount, { 0,1024 });
+		nodeParameter.addParams(L"Write Back", &writeBack);
+		addDisplayParams();
 	}
 	virtual bool bake()override;
 };
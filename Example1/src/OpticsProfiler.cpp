@@ -0,0 +1,250 @@
+#include "OpticsProfiler.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+namespace Optics {
+
+    namespace {
+        const char* counterNames[(int)ProfileCounter::Count] = { "raysTraced", "surfaceTests", "hits", "totalInternalReflections", "queuedPoolJobs",
+            "misses", "bytesAllocated" };
+
+        // a plain pointer, so reading it never runs a thread_local initialiser or allocates
+        thread_local ProfileCounterScope* currentScope = nullptr;
+
+        // small stable thread numbers for trace viewers
+        int currentThreadNumber()
+        {
+            static std::atomic<int> nextThread{ 0 };
+            thread_local int number = nextThread.fetch_add(1);
+            return number;
+        }
+
+        void writeJsonString(std::ostream& os, const char* s)
+        {
+            os << '"';
+            for (; *s; s++) {
+                if (*s == '"' || *s == '\\')
+                    os << '\\';
+                os << *s;
+            }
+            os << '"';
+        }
+    }
+
+    Profiler& Profiler::instance()
+    {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    Profiler::Profiler() : origin(std::chrono::steady_clock::now())
+    {
+        const char* path = std::getenv("OPTICS_PROFILE");
+        if (path && *path) {
+            exitTracePath = path;
+            setEnabled(true);
+        }
+    }
+
+    Profiler::~Profiler()
+    {
+        if (!exitTracePath.empty())
+            writeChromeTrace(exitTracePath);
+    }
+
+    void Profiler::add(ProfileCounter c, size_t n)
+    {
+        counters[(int)c].fetch_add(n, std::memory_order_relaxed);
+        if (currentScope)
+            currentScope->add(c, n);
+    }
+
+    ProfileSnapshot Profiler::snapshot() const
+    {
+        ProfileSnapshot s;
+        s.time = std::chrono::steady_clock::now();
+        for (int i = 0; i < (int)ProfileCounter::Count; i++)
+            s.counters[i] = counters[i].load(std::memory_order_relaxed);
+        return s;
+    }
+
+    void Profiler::recordScope(const char* name, const char* category,
+        std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+    {
+        Event e{ name, category,
+            std::chrono::duration<double, std::micro>(start - origin).count(),
+            std::chrono::duration<double, std::micro>(end - start).count(),
+            currentThreadNumber() };
+        std::lock_guard<std::mutex> lock(eventMutex);
+        if (events.size() >= maxEvents) {
+            droppedEvents++;
+            return;
+        }
+        events.push_back(e);
+    }
+
+    bool Profiler::writeChromeTrace(const std::string& path) const
+    {
+        std::ofstream os(path);
+        if (!os)
+            return false;
+        std::lock_guard<std::mutex> lock(eventMutex);
+        os << std::fixed;
+        os.precision(3);
+        os << "{\"traceEvents\":[";
+        double lastTime = 0;
+        for (size_t i = 0; i < events.size(); i++) {
+            const Event& e = events[i];
+            os << (i ? ",\n" : "\n") << "{\"name\":";
+            writeJsonString(os, e.name);
+            os << ",\"cat\":";
+            writeJsonString(os, e.category);
+            os << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread << ",\"ts\":" << e.startMicroseconds << ",\"dur\":" << e.durationMicroseconds << "}";
+            lastTime = (std::max)(lastTime, e.startMicroseconds + e.durationMicroseconds);
+        }
+        // counter totals as one counter event at the end of the trace
+        os << (events.empty() ? "\n" : ",\n") << "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":" << lastTime << ",\"args\":{";
+        for (int i = 0; i < (int)ProfileCounter::Count; i++)
+            os << (i ? "," : "") << "\"" << counterNames[i] << "\":" << counters[i].load(std::memory_order_relaxed);
+        os << "}}\n],\"otherData\":{\"droppedEvents\":" << droppedEvents << "}}\n";
+        return (bool)os;
+    }
+
+    void Profiler::clear()
+    {
+        for (auto& c : counters)
+            c.store(0, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(eventMutex);
+        events.clear();
+        droppedEvents = 0;
+    }
+
+    ProfileCounterScope::ProfileCounterScope() : start(std::chrono::steady_clock::now())
+    {
+        if (!Profiler::instance().enabled())
+            return;
+        isActive = true;
+        previous = currentScope;
+        currentScope = this;
+    }
+
+    ProfileCounterScope::~ProfileCounterScope()
+    {
+        if (!isActive)
+            return;
+        currentScope = previous;
+        // the enclosing scope counts nested work too, allocations only reach the process-wide total here
+        if (previous) {
+            for (int i = 0; i < (int)ProfileCounter::Count; i++)
+                previous->counters[i].fetch_add(counters[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        else {
+            size_t bytes = counters[(int)ProfileCounter::BytesAllocated].load(std::memory_order_relaxed);
+            Profiler::instance().counters[(int)ProfileCounter::BytesAllocated].fetch_add(bytes, std::memory_order_relaxed);
+        }
+    }
+
+    ProfileSnapshot ProfileCounterScope::begin() const
+    {
+        ProfileSnapshot s;
+        s.time = start;
+        return s;
+    }
+
+    ProfileSnapshot ProfileCounterScope::snapshot() const
+    {
+        ProfileSnapshot s;
+        s.time = std::chrono::steady_clock::now();
+        for (int i = 0; i < (int)ProfileCounter::Count; i++)
+            s.counters[i] = counters[i].load(std::memory_order_relaxed);
+        return s;
+    }
+
+    ProfileCounterScope* ProfileCounterScope::current()
+    {
+        return currentScope;
+    }
+
+    void ProfileCounterScope::setCurrent(ProfileCounterScope* scope)
+    {
+        currentScope = scope;
+    }
+
+    void countAllocation(size_t bytes)
+    {
+        if (currentScope)
+            currentScope->add(ProfileCounter::BytesAllocated, bytes);
+    }
+
+    void RayStatistics::add(const std::vector<Ray>& input)
+    {
+        rays += input.size();
+        for (auto& r : input) {
+            hits += r.hits.size();
+            rayBytes += sizeof(Ray) + r.path.capacity() * sizeof(NodeWeft::Vec2) + r.hits.capacity() * sizeof(RayHit);
+            if (hitHistogram.size() <= r.hits.size())
+                hitHistogram.resize(r.hits.size() + 1, 0);
+            hitHistogram[r.hits.size()]++;
+        }
+    }
+
+    void RayStatistics::add(const RayPaths& paths)
+    {
+        rays += paths.size();
+        rayBytes += paths.memoryBytes();
+        for (size_t i = 0; i < paths.size(); i++) {
+            size_t count = paths.hitCount(i);
+            hits += count;
+            if (hitHistogram.size() <= count)
+                hitHistogram.resize(count + 1, 0);
+            hitHistogram[count]++;
+        }
+    }
+
+    std::wstring formatBakeStatistics(const ProfileSnapshot& begin, const ProfileSnapshot& end, const RayStatistics& rays)
+    {
+        auto delta = [&](ProfileCounter c) { return end[c] - begin[c]; };
+        double milliseconds = std::chrono::duration<double, std::milli>(end.time - begin.time).count();
+        size_t tests = delta(ProfileCounter::SurfaceTests);
+
+        wchar_t buffer[256];
+        std::swprintf(buffer, 256, L"%.2f ms", milliseconds);
+        std::wstring text = buffer;
+        if (rays.rays > 0) {
+            std::swprintf(buffer, 256, L", %zu rays (%.1f MB held)", rays.rays, rays.rayBytes / 1048576.0);
+            text += buffer;
+        }
+        if (delta(ProfileCounter::BytesAllocated) > 0) {
+            std::swprintf(buffer, 256, L", %.1f MB allocated", delta(ProfileCounter::BytesAllocated) / 1048576.0);
+            text += buffer;
+        }
+        if (tests > 0) {
+            std::swprintf(buffer, 256, L", traced %zu: %zu tests, %zu hits, %zu misses, %zu TIR", delta(ProfileCounter::RaysTraced),
+                tests, delta(ProfileCounter::Hits), delta(ProfileCounter::Misses), delta(ProfileCounter::TotalInternalReflections));
+            text += buffer;
+        }
+        if (delta(ProfileCounter::QueuedPoolJobs) > 0) {
+            std::swprintf(buffer, 256, L", %zu loops waited for the thread pool", delta(ProfileCounter::QueuedPoolJobs));
+            text += buffer;
+        }
+        // hits per ray, only the populated bins
+        if (!rays.hitHistogram.empty()) {
+            text += L", hits/ray";
+            for (size_t i = 0; i < rays.hitHistogram.size(); i++) {
+                if (rays.hitHistogram[i] == 0)
+                    continue;
+                std::swprintf(buffer, 256, L" %zu:%zu", i, rays.hitHistogram[i]);
+                text += buffer;
+            }
+        }
+        return text;
+    }
+
+    std::wstring formatBakeStatistics(const ProfileCounterScope& scope, const RayStatistics& rays)
+    {
+        return formatBakeStatistics(scope.begin(), scope.snapshot(), rays);
+    }
+
+} // namespace Optics
@@ -0,0 +1,172 @@
+#pragma once
+#include "RayOptics.h"
+#include "RayPaths.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Instrumentation is compiled in unless RAYOPTICS_PROFILING is defined to 0, and only records while
+// the profiler is enabled (Profiler::setEnabled, or the OPTICS_PROFILE environment variable naming a
+// Chrome trace file written at exit). Compiled out, the macros below generate no code
+#ifndef RAYOPTICS_PROFILING
+#define RAYOPTICS_PROFILING 1
+#endif
+
+namespace Optics {
+
+    enum class ProfileCounter {
+        RaysTraced,
+        SurfaceTests,               // ray-surface intersection tests
+        Hits,
+        TotalInternalReflections,
+        QueuedPoolJobs,             // parallel loops that waited for another thread's loop to finish
+        Misses,                     // intersection tests that found no hit
+        BytesAllocated,             // operator new, only counted inside a ProfileCounterScope, see OpticsAllocationCounter.h
+        Count
+    };
+
+    // Counter values and a timestamp, differences of two snapshots give the cost of the work in between
+    struct ProfileSnapshot {
+        std::chrono::steady_clock::time_point time;
+        size_t counters[(int)ProfileCounter::Count]{};
+
+        size_t operator[](ProfileCounter c) const { return counters[(int)c]; }
+    };
+
+    class ProfileCounterScope;
+
+    // Process-wide counters and timed events
+    class Profiler {
+    public:
+        static Profiler& instance();
+
+        bool enabled() const { return enabledFlag.load(std::memory_order_relaxed); }
+        void setEnabled(bool enable) { enabledFlag.store(enable, std::memory_order_relaxed); }
+
+        // Adds to the process-wide counter and to the counter scope current on this thread
+        void add(ProfileCounter c, size_t n);
+        ProfileSnapshot snapshot() const;
+
+        // Record a finished scope, events beyond maxEvents are dropped
+        void recordScope(const char* name, const char* category,
+            std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+        // Write the recorded scopes and the counter totals in Chrome trace event format
+        // (chrome://tracing, Perfetto)
+        bool writeChromeTrace(const std::string& path) const;
+
+        void clear();
+
+        static constexpr size_t maxEvents = 1 << 20;
+
+        Profiler(const Profiler&) = delete;
+        Profiler& operator=(const Profiler&) = delete;
+
+    private:
+        friend class ProfileCounterScope;
+        Profiler();
+        ~Profiler();
+
+        struct Event {
+            const char* name;
+            const char* category;
+            double startMicroseconds;
+            double durationMicroseconds;
+            int thread;
+        };
+
+        std::atomic<bool> enabledFlag{ false };
+        std::atomic<size_t> counters[(int)ProfileCounter::Count]{};
+        std::chrono::steady_clock::time_point origin;
+        mutable std::mutex eventMutex;
+        std::vector<Event> events;
+        size_t droppedEvents{ 0 };
+        std::string exitTracePath;
+    };
+
+    // Records the enclosing scope as one event while the profiler is enabled
+    class ProfileScope {
+    public:
+        ProfileScope(const char* name, const char* category)
+            : name(name), category(category), active(Profiler::instance().enabled())
+        {
+            if (active)
+                start = std::chrono::steady_clock::now();
+        }
+        ~ProfileScope()
+        {
+            if (active)
+                Profiler::instance().recordScope(name, category, start, std::chrono::steady_clock::now());
+        }
+
+    private:
+        const char* name;
+        const char* category;
+        bool active;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    // Counters of one piece of work, such as a node's bake. While the scope is current, counts made on its
+    // thread, and on the pool threads running the parallel loops it issues, also go to the scope, so work
+    // done meanwhile on other threads (another node's background trace) is not included
+    // The scope is only made current while the profiler is enabled, scopes on one thread must nest
+    class ProfileCounterScope {
+    public:
+        ProfileCounterScope();
+        ~ProfileCounterScope();
+
+        void add(ProfileCounter c, size_t n) { counters[(int)c].fetch_add(n, std::memory_order_relaxed); }
+        // Counts since the scope was opened, begin() holds zeros and the opening time
+        ProfileSnapshot begin() const;
+        ProfileSnapshot snapshot() const;
+        bool active() const { return isActive; }
+
+        // Scope of the calling thread, nullptr if none; TracePool hands it on to its workers
+        static ProfileCounterScope* current();
+        static void setCurrent(ProfileCounterScope* scope);
+
+        ProfileCounterScope(const ProfileCounterScope&) = delete;
+        ProfileCounterScope& operator=(const ProfileCounterScope&) = delete;
+
+    private:
+        std::atomic<size_t> counters[(int)ProfileCounter::Count]{};
+        std::chrono::steady_clock::time_point start;
+        ProfileCounterScope* previous{ nullptr };
+        bool isActive{ false };
+    };
+
+    // Adds bytes to the current counter scope, called by the operator new of OpticsAllocationCounter.h
+    // Does not allocate and does not touch the profiler, so it is safe during static initialisation
+    void countAllocation(size_t bytes);
+
+    // Ray counts, storage and hits-per-ray histogram of a set of traced rays
+    struct RayStatistics {
+        size_t rays{ 0 };
+        size_t hits{ 0 };
+        size_t rayBytes{ 0 };                       // storage held by the rays: Ray objects with their path and hit vectors, or arenas
+        std::vector<size_t> hitHistogram;           // rays by number of hits
+
+        void add(const std::vector<Ray>& rays);
+        void add(const RayPaths& paths);            // rayBytes is the arena's size
+    };
+
+    // One-line summary of the work between two snapshots, for node infos and logs
+    std::wstring formatBakeStatistics(const ProfileSnapshot& begin, const ProfileSnapshot& end, const RayStatistics& rays);
+    // Same for the work counted by a scope so far
+    std::wstring formatBakeStatistics(const ProfileCounterScope& scope, const RayStatistics& rays);
+
+} // namespace Optics
+
+#define OPTICS_PROFILE_CONCAT_(a, b) a##b
+#define OPTICS_PROFILE_CONCAT(a, b) OPTICS_PROFILE_CONCAT_(a, b)
+
+#if RAYOPTICS_PROFILING
+#define OPTICS_PROFILE_SCOPE(name, category) Optics::ProfileScope OPTICS_PROFILE_CONCAT(profileScope, __LINE__)(name, category)
+#define OPTICS_PROFILE_COUNT(counter, n) \
+    do { if (Optics::Profiler::instance().enabled()) Optics::Profiler::instance().add(Optics::ProfileCounter::counter, n); } while (0)
+#else
+#define OPTICS_PROFILE_SCOPE(name, category) ((void)0)
+#define OPTICS_PROFILE_COUNT(counter, n) ((void)sizeof(n))
+#endif
@@ -0,0 +1,236 @@
+#include "OpticsSource.h"
+#include "OpticsProfiler.h"
+#include <algorithm>
+#include <cmath>
+
+namespace Optics {
+
+    namespace {
+
+        void samplePoints(const SourceDescription& source, double t, NodeWeft::Vec2& startPoint, NodeWeft::Vec2& aperturePoint)
+        {
+            aperturePoint = { source.apertureX, (t - 0.5) * source.apertureSize };
+            if (source.sourceType == SourceDescription::PointSource)
+                startPoint = source.center;
+            else {
+                double angleRad = source.parallelAngle * 3.14159 / 180.0;
+                startPoint = NodeWeft::Vec2{ -source.parallelStartOffset * cos(angleRad), -source.parallelStartOffset * sin(angleRad) } + aperturePoint;
+            }
+        }
+
+    } // namespace
+
+    Ray SourceDescription::sampleRay(double t) const
+    {
+        NodeWeft::Vec2 startPoint, aperturePoint;
+        samplePoints(*this, t, startPoint, aperturePoint);
+        return Ray(startPoint, aperturePoint - startPoint, wavelength);
+    }
+
+    RayState SourceDescription::sampleState(double t) const
+    {
+        NodeWeft::Vec2 startPoint, aperturePoint;
+        samplePoints(*this, t, startPoint, aperturePoint);
+        RayState state;
+        state.origin = startPoint;
+        state.direction = NodeWeft::normalize(aperturePoint - startPoint);
+        state.wavelength = wavelength;
+        return state;
+    }
+
+    namespace {
+
+        // CIE D65 relative spectral power, 380 to 780 nm in 10 nm steps
+        const double d65Power[] = {
+            49.98, 54.65, 82.75, 91.49, 93.43, 86.68, 104.86, 117.01, 117.81, 114.86, 115.92,
+            108.81, 109.35, 107.80, 104.79, 107.69, 104.41, 104.05, 100.00, 96.33, 95.79,
+            88.69, 90.01, 89.60, 87.70, 83.29, 83.70, 80.03, 80.21, 82.28, 78.28,
+            69.72, 71.61, 74.35, 61.60, 69.89, 75.09, 63.59, 46.42, 66.81, 63.38,
+        };
+
+        double spectralPower(const SourceDescription& source, double wavelength)
+        {
+            switch (source.spectrum) {
+            case SourceDescription::BlackbodySpectrum: {
+                // Planck's law, constant factors cancel when the bins are normalised
+                const double hcOverK = 1.4387769e7; // in nm K
+                double wl = wavelength / 1000.0;
+                return 1.0 / (wl * wl * wl * wl * wl * (std::exp(hcOverK / (wavelength * (std::max)(source.temperature, 1.0))) - 1.0));
+            }
+            case SourceDescription::D65Spectrum: {
+                const int count = sizeof(d65Power) / sizeof(d65Power[0]);
+                double x = (wavelength - 380.0) / 10.0;
+                if (x < 0 || x > count - 1)
+                    return 0;
+                int i = (std::min)((int)x, count - 2);
+                return d65Power[i] + (d65Power[i + 1] - d65Power[i]) * (x - i);
+            }
+            case SourceDescription::CustomSpectrum: {
+                std::vector<NodeWeft::Vec2> table = source.customSpectrum;
+                std::sort(table.begin(), table.end(), [](const NodeWeft::Vec2& a, const NodeWeft::Vec2& b) { return a.x < b.x; });
+                if (table.empty() || wavelength < table.front().x || wavelength > table.back().x)
+                    return 0;
+                for (size_t i = 0; i + 1 < table.size(); i++) {
+                    if (wavelength <= table[i + 1].x) {
+                        double width = table[i + 1].x - table[i].x;
+                        double f = width > 0 ? (wavelength - table[i].x) / width : 1;
+                        return (std::max)(table[i].y + (table[i + 1].y - table[i].y) * f, 0.0);
+                    }
+                }
+                return (std::max)(table.back().y, 0.0);
+            }
+            default:
+                return 0;
+            }
+        }
+
+        // Emit the fan at aperture positions t once per bin, intensity scaled by the bin weight
+        void emitSpectralFan(const SourceDescription& source, const std::vector<double>& t, const std::vector<double>& intensity,
+            std::vector<Ray>& rays)
+        {
+            std::vector<SpectralBin> bins = sampleSpectrum(source);
+            rays.reserve(rays.size() + t.size() * bins.size());
+            for (const SpectralBin& bin : bins) {
+                for (size_t i = 0; i < t.size(); i++) {
+                    Ray r = source.sampleRay(t[i]);
+                    r.wavelength = bin.wavelength;
+                    r.intensity = intensity[i] * bin.weight;
+                    rays.push_back(std::move(r));
+                }
+            }
+        }
+
+    } // namespace
+
+    std::vector<SpectralBin> sampleSpectrum(const SourceDescription& source)
+    {
+        if (source.spectrum == SourceDescription::Monochromatic || source.spectralBins <= 0)
+            return { SpectralBin{ source.wavelength, 1.0 } };
+        double low = (std::min)(source.spectralRange.x, source.spectralRange.y);
+        double high = (std::max)(source.spectralRange.x, source.spectralRange.y);
+        double width = (high - low) / source.spectralBins;
+        std::vector<SpectralBin> bins;
+        double total = 0;
+        for (int i = 0; i < source.spectralBins; i++) {
+            double wavelength = low + width * (i + 0.5);
+            double power = spectralPower(source, wavelength);
+            if (power > 0 && std::isfinite(power)) {
+                bins.push_back(SpectralBin{ wavelength, power });
+                total += power;
+            }
+        }
+        // no power in the range, fall back to the single wavelength
+        if (bins.empty())
+            return { SpectralBin{ source.wavelength, 1.0 } };
+        for (SpectralBin& bin : bins)
+            bin.weight /= total;
+        return bins;
+    }
+
+    void generateSourceRays(const SourceDescription& source, std::vector<Ray>& rays)
+    {
+        if (source.rayCount <= 0)
+            return;
+        std::vector<double> t(source.rayCount);
+        for (int i = 0; i < source.rayCount; i++)
+            t[i] = source.rayCount != 1 ? (double)i / (source.rayCount - 1) : 0.5;
+        emitSpectralFan(source, t, std::vector<double>(t.size(), 1.0), rays);
+    }
+
+    size_t generateAdaptiveSourceRays(const SourceDescription& source, const std::vector<SphereLens>& lenses,
+        std::vector<Ray>& rays, int threadCount)
+    {
+        OPTICS_PROFILE_SCOPE("generateAdaptiveSourceRays", "trace");
+        const size_t budget = (size_t)(std::max)(source.rayCount, 0);
+        const size_t coarse = (std::min)((size_t)(std::max)(source.coarseRayCount, 2), budget);
+        if (coarse < 2 || lenses.empty()) {
+            generateSourceRays(source, rays);
+            return 0;
+        }
+
+        // samples are kept in creation order, intervals refer to them by index
+        std::vector<double> t;
+        std::vector<RayState> states;
+        struct Interval {
+            size_t a, b;
+            double error;   // largest difference relative to its tolerance, above 1 needs splitting
+        };
+        const double positionTolerance = (std::max)(source.positionTolerance, 1e-12);
+        const double angleTolerance = (std::max)(source.angleTolerance, 1e-12) * 3.14159 / 180.0;
+        auto difference = [&](size_t a, size_t b) {
+            const RayState& ra = states[a];
+            const RayState& rb = states[b];
+            if (ra.hitCount != rb.hitCount)
+                return 1e9; // edge of a surface or of the aperture between them
+            double position = NodeWeft::length(ra.origin - rb.origin) / positionTolerance;
+            double angle = std::abs(std::atan2(ra.direction.x * rb.direction.y - ra.direction.y * rb.direction.x,
+                ra.direction.x * rb.direction.x + ra.direction.y * rb.direction.y)) / angleTolerance;
+            return (std::max)(position, angle);
+        };
+        // refined at the power-weighted mean wavelength
+        SourceDescription reference = source;
+        double meanWavelength = 0;
+        for (const SpectralBin& bin : sampleSpectrum(source))
+            meanWavelength += bin.wavelength * bin.weight;
+        reference.wavelength = meanWavelength;
+        auto traceFrom = [&](size_t first) {
+            std::vector<RayState> traced;
+            traced.reserve(states.size() - first);
+            for (size_t i = first; i < states.size(); i++)
+                traced.push_back(RayState(reference.sampleRay(t[i])));
+            traceRayStates(traced, lenses, threadCount);
+            std::copy(traced.begin(), traced.end(), states.begin() + first);
+        };
+
+        for (size_t i = 0; i < coarse; i++)
+            t.push_back((double)i / (coarse - 1));
+        states.resize(coarse);
+        traceFrom(0);
+        std::vector<Interval> intervals;
+        for (size_t i = 0; i + 1 < coarse; i++)
+            intervals.push_back(Interval{ i, i + 1, difference(i, i + 1) });
+
+        // each round splits the worst intervals the budget allows and traces their midpoints together
+        const double minimumWidth = 1e-9;
+        while (t.size() < budget) {
+            std::vector<size_t> split;
+            for (size_t i = 0; i < intervals.size(); i++) {
+                if (intervals[i].error > 1 && t[intervals[i].b] - t[intervals[i].a] > minimumWidth)
+                    split.push_back(i);
+            }
+            if (split.empty())
+                break;
+            std::stable_sort(split.begin(), split.end(), [&](size_t x, size_t y) { return intervals[x].error > intervals[y].error; });
+            split.resize((std::min)(split.size(), budget - t.size()));
+
+            size_t first = t.size();
+            for (size_t i : split)
+                t.push_back((t[intervals[i].a] + t[intervals[i].b]) * 0.5);
+            states.resize(t.size());
+            traceFrom(first);
+            for (size_t k = 0; k < split.size(); k++) {
+                Interval interval = intervals[split[k]];
+                size_t middle = first + k;
+                intervals[split[k]] = Interval{ interval.a, middle, difference(interval.a, middle) };
+                intervals.push_back(Interval{ middle, interval.b, difference(middle, interval.b) });
+            }
+        }
+        size_t unresolved = 0;
+        for (auto& interval : intervals)
+            unresolved += interval.error > 1;
+
+        // emit in aperture order, weighted by half the distance to both neighbours
+        // the weights add up to the ray count, the power of a uniform fan of the same source,
+        // so adaptive and uniform sources draw at the same brightness next to each other
+        std::sort(t.begin(), t.end());
+        std::vector<double> intensity(t.size());
+        for (size_t i = 0; i < t.size(); i++) {
+            double lower = i > 0 ? t[i - 1] : t[i];
+            double upper = i + 1 < t.size() ? t[i + 1] : t[i];
+            intensity[i] = (upper - lower) * 0.5 * budget;
+        }
+        emitSpectralFan(source, t, intensity, rays);
+        return unresolved;
+    }
+
+} // namespace Optics
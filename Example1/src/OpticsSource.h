@@ -0,0 +1,82 @@
+#pragma once
+#include "RayOptics.h"
+
+namespace Optics {
+
+    // Parameters of a light source, shared by OpticsSourceNode and the headless tools
+    struct SourceDescription {
+        enum SourceType {
+            PointSource = 0,
+            ParallelSource,
+        };
+        int sourceType{ PointSource };
+
+        int rayCount{ 10 };
+        double wavelength{ 550 };           // in nm
+        double apertureX{ 0 };
+        double apertureSize{ 1 };
+
+        NodeWeft::Vec2 center{ -10,0 };     // point source position
+
+        double parallelAngle{ 0 };          // in degree
+        double parallelStartOffset{ 10 };
+
+        enum Sampling {
+            UniformSampling = 0,
+            AdaptiveSampling,               // rayCount is the budget, refined where traced neighbours diverge
+        };
+        int sampling{ UniformSampling };
+        int coarseRayCount{ 16 };
+        double positionTolerance{ 0.1 };    // between neighbouring exit points
+        double angleTolerance{ 0.5 };       // between neighbouring exit directions, in degree
+
+        enum Spectrum {
+            Monochromatic = 0,              // wavelength only
+            BlackbodySpectrum,
+            D65Spectrum,                    // CIE standard daylight
+            CustomSpectrum,
+        };
+        int spectrum{ Monochromatic };
+        int spectralBins{ 16 };             // the fan is repeated once per bin
+        NodeWeft::Vec2 spectralRange{ 380, 700 };   // in nm
+        double temperature{ 5500 };         // blackbody, in K
+        std::vector<NodeWeft::Vec2> customSpectrum; // (wavelength in nm, relative power), interpolated linearly
+
+        enum Storage {
+            AutoStorage = 0,                // generated on demand above RayStream::autoRayThreshold rays
+            StoredRays,
+            GeneratedRays,                  // uniform sampling only, see RayStream
+        };
+        int storage{ AutoStorage };
+
+        // Ray through the aperture at t in [0, 1], from the bottom to the top edge
+        Ray sampleRay(double t) const;
+        // Same ray without a path
+        RayState sampleState(double t) const;
+    };
+
+    // One wavelength of a spectral source, weights of all bins add up to 1
+    struct SpectralBin {
+        double wavelength;
+        double weight;
+    };
+
+    // Equal-width bins over the spectral range, each at its centre wavelength and weighted by the
+    // spectrum's power there. A monochromatic source is one bin at its wavelength
+    std::vector<SpectralBin> sampleSpectrum(const SourceDescription& source);
+
+    // Append the rays of a source, evenly spaced across the aperture
+    // Spectral sources repeat the fan once per bin, so the rays of a wavelength are contiguous
+    void generateSourceRays(const SourceDescription& source, std::vector<Ray>& rays);
+
+    // Append the rays of a source sampled adaptively against a lens stack: a coarse fan of coarseRayCount rays
+    // is traced, then intervals whose neighbouring rays leave the last surface further apart than the tolerances,
+    // or hit different surfaces, are split at their midpoint, largest difference first, until rayCount rays
+    // Ray intensity is the aperture share the ray stands for relative to a uniform fan of rayCount rays: the
+    // weights add up to rayCount, above 1 where the fan stayed coarse and below 1 where it was refined, so
+    // weighted results match a uniform fan. Spectral sources are refined at their mean wavelength and the fan is
+    // repeated once per bin, times the bin weight. Returns the number of intervals still above the tolerances
+    size_t generateAdaptiveSourceRays(const SourceDescription& source, const std::vector<SphereLens>& lenses,
+        std::vector<Ray>& rays, int threadCount = 1);
+
+} // namespace Optics
@@ -0,0 +1,116 @@
+#include "ParaxialSystem.h"
+#include "OpticsProfiler.h"
+#include "TracePool.h"
+#include <cmath>
+#include <limits>
+
+namespace Optics {
+
+    bool ParaxialSystem::isApplicable(const std::vector<SphereLens>& lenses)
+    {
+        if (lenses.empty())
+            return false;
+        for (size_t i = 0; i < lenses.size(); i++) {
+            if (lenses[i].isMirror)
+                return false; // folds the axis back
+            if (i > 0 && (lenses[i].center.y != lenses[0].center.y || lenses[i].center.x < lenses[i - 1].center.x))
+                return false;
+        }
+        return true;
+    }
+
+    void ParaxialSystem::setLenses(const std::vector<SphereLens>& newLenses)
+    {
+        bool same = newLenses.size() == lenses.size();
+        for (size_t i = 0; same && i < lenses.size(); i++)
+            same = sameLens(newLenses[i], lenses[i]);
+        if (same)
+            return;
+        lenses = newLenses;
+        entries.clear();
+    }
+
+    const ParaxialSystem::Entry& ParaxialSystem::entry(double wavelength)
+    {
+        auto found = entries.find(wavelength);
+        if (found != entries.end())
+            return found->second;
+
+        Entry e{ RayTransferMatrix(), 1.0, 1.0 };
+        double medium = 1.0;
+        for (size_t i = 0; i < lenses.size(); i++) {
+            const SphereLens& l = lenses[i];
+            if (i > 0)
+                e.matrix = RayTransferMatrix{ 1, (l.center.x - lenses[i - 1].center.x) / medium, 0, 1 } * e.matrix;
+            double glass = l.getRefractiveIndexAtWavelength(wavelength);
+            double n1 = l.isEntrance ? medium : glass;
+            double n2 = l.isEntrance ? glass : 1.0;
+            // conics and aspheres have the vertex curvature of a sphere near the axis
+            double power = l.surfaceType == SphereLens::FlatSurface ? 0.0 : -(n2 - n1) / l.radius;
+            e.matrix = RayTransferMatrix{ 1, 0, power, 1 } * e.matrix;
+            medium = n2;
+            if (i == 0)
+                e.firstIndex = n2;
+        }
+        e.finalIndex = medium;
+        return entries.emplace(wavelength, e).first->second;
+    }
+
+    const RayTransferMatrix& ParaxialSystem::matrix(double wavelength)
+    {
+        return entry(wavelength).matrix;
+    }
+
+    double ParaxialSystem::effectiveFocalLength(double wavelength)
+    {
+        const Entry& e = entry(wavelength);
+        return -e.finalIndex / e.matrix.C;
+    }
+
+    double ParaxialSystem::backFocalDistance(double wavelength)
+    {
+        const Entry& e = entry(wavelength);
+        return -e.finalIndex * e.matrix.A / e.matrix.C;
+    }
+
+    void ParaxialSystem::trace(std::vector<Ray>& rays, int threadCount)
+    {
+        OPTICS_PROFILE_SCOPE("ParaxialSystem::trace", "trace");
+        OPTICS_PROFILE_COUNT(RaysTraced, rays.size());
+        if (lenses.empty())
+            return;
+
+        // matrices are built up front so the parallel part only reads the cache
+        for (auto& r : rays)
+            entry(r.wavelength);
+
+        const double axisY = lenses.front().center.y;
+        const double firstX = lenses.front().center.x, lastX = lenses.back().center.x;
+        const SphereLens& first = lenses.front();
+        const double firstAperture = first.surfaceType == SphereLens::SphericalSurface ? std::abs(first.radius)
+            : (first.semiAperture > 0 ? first.semiAperture : std::numeric_limits<double>::infinity());
+        TracePool::instance().parallelFor(rays.size(), 4096, threadCount, [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; i++) {
+                Ray& r = rays[i];
+                NodeWeft::Vec2 origin = r.getOrigin();
+                if (r.direction.x <= 0 || origin.x >= firstX)
+                    continue;
+                double slope = r.direction.y / r.direction.x;
+                double y = origin.y - axisY + slope * (firstX - origin.x);
+                if (std::abs(y) >= firstAperture)
+                    continue; // outside the first surface, the exact trace misses it as well
+
+                const Entry& e = entries.find(r.wavelength)->second;
+                double exitY = e.matrix.A * y + e.matrix.B * slope;
+                double exitSlope = (e.matrix.C * y + e.matrix.D * slope) / e.finalIndex;
+
+                const NodeWeft::Vec2 planeNormal{ -1, 0 };
+                r.addHit(NodeWeft::Vec2{ firstX, y + axisY }, planeNormal, 1.0, e.firstIndex);
+                if (lastX > firstX)
+                    r.addHit(NodeWeft::Vec2{ lastX, exitY + axisY }, planeNormal, e.firstIndex, e.finalIndex);
+                r.direction = NodeWeft::normalize(NodeWeft::Vec2{ 1, exitSlope });
+            }
+        });
+    }
+
+} // namespace Optics
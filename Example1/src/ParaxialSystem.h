@@ -0,0 +1,50 @@
+#pragma once
+#include "RayOptics.h"
+#include <unordered_map>
+
+namespace Optics {
+
+    // 2x2 ray-transfer matrix acting on (height, refractive index * slope)
+    struct RayTransferMatrix {
+        double A{ 1 }, B{ 0 }, C{ 0 }, D{ 1 };
+
+        RayTransferMatrix operator*(const RayTransferMatrix& m) const
+        {
+            return RayTransferMatrix{ A * m.A + B * m.C, A * m.B + B * m.D, C * m.A + D * m.C, C * m.B + D * m.D };
+        }
+    };
+
+    // Paraxial model of a sequential on-axis lens stack, one system matrix per wavelength
+    // Surfaces refract with the same media as refractRay (entrance: medium -> n(wavelength), exit: n(wavelength) -> air)
+    // and the matrix runs from the first to the last vertex plane
+    class ParaxialSystem {
+    public:
+        // True when all vertices lie on one horizontal axis in increasing x order and no surface is a mirror
+        static bool isApplicable(const std::vector<SphereLens>& lenses);
+
+        // Set the lens stack, cached matrices are dropped when it changed
+        void setLenses(const std::vector<SphereLens>& lenses);
+
+        const RayTransferMatrix& matrix(double wavelength);
+
+        // Distances along the axis, measured in the medium after the last surface
+        double effectiveFocalLength(double wavelength);
+        double backFocalDistance(double wavelength);   // last vertex to rear focal point
+
+        // Move rays from their origin to the last vertex plane in O(1) per ray, recording the
+        // entry and exit points as hits. Rays not heading into the stack are left unchanged
+        void trace(std::vector<Ray>& rays, int threadCount = 1);
+
+    private:
+        struct Entry {
+            RayTransferMatrix matrix;
+            double firstIndex;      // medium after the first surface
+            double finalIndex;      // medium after the last surface
+        };
+        const Entry& entry(double wavelength);
+
+        std::vector<SphereLens> lenses;
+        std::unordered_map<double, Entry> entries;
+    };
+
+} // namespace Optics
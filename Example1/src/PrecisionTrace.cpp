@@ -0,0 +1,586 @@
+#include "PrecisionTrace.h"
+#include "OpticsProfiler.h"
+#include "TracePool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define OPTICS_HAS_AVX2_KERNELS 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define OPTICS_AVX2_TARGET
+#else
+#define OPTICS_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#else
+#define OPTICS_HAS_AVX2_KERNELS 0
+#endif
+
+namespace Optics {
+
+    namespace {
+
+        // Rays per block, as in traceRayStates
+        constexpr size_t traceBlockSize = 256;
+
+        // Mixed precision refracts rays in double when the incident or refracted cosine is below this,
+        // where float rounding of the angles is amplified the most
+        constexpr double mixedGrazingCosine = 0.25;
+
+        // Running ray state in float, loaded from and stored to a double RayBatch that also holds the
+        // wavelength buckets and runs the surfaces the float kernels do not cover
+        struct FloatBatch {
+            std::vector<float> originX, originY;
+            std::vector<float> directionX, directionY;
+            std::vector<float> mediumIndex;
+            std::vector<float> normalX, normalY;
+            std::vector<double> rayIndex;       // n(wavelength) of each ray at the current surface
+            std::vector<uint8_t> hitMask;
+
+            size_t size() const { return originX.size(); }
+
+            void load(const RayBatch& batch)
+            {
+                size_t count = batch.size();
+                originX.resize(count);
+                originY.resize(count);
+                directionX.resize(count);
+                directionY.resize(count);
+                mediumIndex.resize(count);
+                normalX.resize(count);
+                normalY.resize(count);
+                rayIndex.resize(count);
+                hitMask.resize(count);
+                for (size_t j = 0; j < count; j++) {
+                    originX[j] = (float)batch.originX[j];
+                    originY[j] = (float)batch.originY[j];
+                    directionX[j] = (float)batch.directionX[j];
+                    directionY[j] = (float)batch.directionY[j];
+                    mediumIndex[j] = (float)batch.mediumIndex[j];
+                    hitMask[j] = 0;
+                }
+            }
+
+            void store(RayBatch& batch) const
+            {
+                for (size_t j = 0; j < size(); j++) {
+                    batch.originX[j] = originX[j];
+                    batch.originY[j] = originY[j];
+                    batch.directionX[j] = directionX[j];
+                    batch.directionY[j] = directionY[j];
+                    batch.mediumIndex[j] = mediumIndex[j];
+                }
+            }
+
+            // Refractive index of every ray at surface, once per wavelength bucket when the batch has them
+            void setIndices(RayBatch& batch, const SphereLens& surface)
+            {
+                if (batch.bucketed()) {
+                    batch.bucketIndex.resize(batch.bucketWavelength.size());
+                    for (size_t b = 0; b < batch.bucketWavelength.size(); b++)
+                        batch.bucketIndex[b] = surface.getRefractiveIndexAtWavelength(batch.bucketWavelength[b]);
+                    for (size_t j = 0; j < size(); j++)
+                        rayIndex[j] = batch.bucketIndex[batch.bucket[j]];
+                }
+                else {
+                    for (size_t j = 0; j < size(); j++)
+                        rayIndex[j] = surface.getRefractiveIndexAtWavelength(batch.wavelength[j]);
+                }
+            }
+        };
+
+        // intersectBatchScalar in float
+        size_t intersectSphereScalar(FloatBatch& batch, const SphereLens& sphere, size_t begin, size_t end)
+        {
+            const float cx = (float)(sphere.center.x + sphere.radius);
+            const float cy = (float)sphere.center.y;
+            const float rr = (float)(sphere.radius * sphere.radius);
+            const float minT = 0.0001f;
+            size_t hitCount = 0;
+            for (size_t i = begin; i < end; i++) {
+                float ox = batch.originX[i], oy = batch.originY[i];
+                float dx = batch.directionX[i], dy = batch.directionY[i];
+                float ocx = ox - cx, ocy = oy - cy;
+
+                float a = dx * dx + dy * dy;
+                float b = 2 * (ocx * dx + ocy * dy);
+                float c = (ocx * ocx + ocy * ocy) - rr;
+                float discriminant = b * b - 4 * a * c;
+
+                batch.hitMask[i] = 0;
+                if (discriminant < 0)
+                    continue;
+
+                float sqrtDisc = std::sqrt(discriminant);
+                float t1 = (-b - sqrtDisc) / (2 * a);
+                float t2 = (-b + sqrtDisc) / (2 * a);
+
+                bool isHit = false;
+                float hx = 0, hy = 0;
+                if (t1 > minT) {
+                    hx = ox + dx * t1;
+                    hy = oy + dy * t1;
+                    isHit = (sphere.radius > 0 && hx < cx) || (sphere.radius < 0 && hx > cx);
+                }
+                if (!isHit && t2 > minT) {
+                    hx = ox + dx * t2;
+                    hy = oy + dy * t2;
+                    isHit = (sphere.radius > 0 && hx < cx) || (sphere.radius < 0 && hx > cx);
+                }
+                if (!isHit)
+                    continue;
+
+                float nx = hx - cx, ny = hy - cy;
+                float len = std::sqrt(nx * nx + ny * ny);
+                nx /= len;
+                ny /= len;
+                if (!(sphere.radius > 0)) {
+                    nx = -nx;
+                    ny = -ny;
+                }
+                batch.originX[i] = hx;
+                batch.originY[i] = hy;
+                batch.normalX[i] = nx;
+                batch.normalY[i] = ny;
+                batch.hitMask[i] = 1;
+                hitCount++;
+            }
+            return hitCount;
+        }
+
+        // One Newton step in double along each hit ray onto the sphere, then the normal in double
+        // Mixed precision uses this to take the float rounding of the quadratic out of the hit points and normals
+        void refineHits(FloatBatch& batch, const SphereLens& sphere, size_t begin, size_t end)
+        {
+            const double cx = sphere.center.x + sphere.radius;
+            const double cy = sphere.center.y;
+            const double rr = sphere.radius * sphere.radius;
+            const double normalSign = sphere.radius > 0 ? 1.0 : -1.0;
+            for (size_t i = begin; i < end; i++) {
+                if (!batch.hitMask[i])
+                    continue;
+                double dx = batch.directionX[i], dy = batch.directionY[i];
+                double vx = batch.originX[i] - cx, vy = batch.originY[i] - cy;
+                double slope = 2.0 * (dx * vx + dy * vy);
+                if (slope != 0.0) {
+                    double t = -(vx * vx + vy * vy - rr) / slope;
+                    vx += dx * t;
+                    vy += dy * t;
+                }
+                double len = std::sqrt(vx * vx + vy * vy);
+                batch.originX[i] = (float)(cx + vx);
+                batch.originY[i] = (float)(cy + vy);
+                batch.normalX[i] = (float)(normalSign * vx / len);
+                batch.normalY[i] = (float)(normalSign * vy / len);
+            }
+        }
+
+        // refractBatchScalar for one entry in Compute arithmetic, returns true for total internal reflection
+        template<typename Compute>
+        bool refractEntry(FloatBatch& batch, size_t i, bool isEntrance)
+        {
+            Compute nLambda = (Compute)batch.rayIndex[i];
+            Compute n1 = isEntrance ? (Compute)batch.mediumIndex[i] : nLambda;
+            Compute n2 = isEntrance ? nLambda : (Compute)1;
+            batch.mediumIndex[i] = (float)(isEntrance ? nLambda : (Compute)1);
+
+            Compute eta = n1 / n2;
+            Compute dx = batch.directionX[i], dy = batch.directionY[i];
+            Compute nx = batch.normalX[i], ny = batch.normalY[i];
+            Compute cosI = -(dx * nx + dy * ny);
+            if (cosI < 0) {
+                cosI = -cosI;
+                nx = -nx;
+                ny = -ny;
+            }
+            Compute sinT2 = eta * eta * (1 - cosI * cosI);
+            if (sinT2 > 1)
+                return true;
+            Compute cosT = std::sqrt(1 - sinT2);
+            Compute k = eta * cosI - cosT;
+            Compute rx = dx * eta + nx * k;
+            Compute ry = dy * eta + ny * k;
+            Compute len = std::sqrt(rx * rx + ry * ry);
+            batch.directionX[i] = (float)(rx / len);
+            batch.directionY[i] = (float)(ry / len);
+            return false;
+        }
+
+        // True when the incident or refracted cosine is below grazingCosine, evaluated in float
+        bool nearGrazing(const FloatBatch& batch, size_t i, bool isEntrance, double grazingCosine)
+        {
+            float nLambda = (float)batch.rayIndex[i];
+            float eta = isEntrance ? (float)batch.mediumIndex[i] / nLambda : nLambda;
+            float cosI = std::abs((float)(batch.directionX[i] * batch.normalX[i] + batch.directionY[i] * batch.normalY[i]));
+            float cosT2 = 1 - eta * eta * (1 - cosI * cosI);
+            float g = (float)grazingCosine;
+            return cosI < g || std::abs(cosT2) < g * g;
+        }
+
+        size_t refractSphereScalar(FloatBatch& batch, const SphereLens& surface, size_t begin, size_t end, double grazingCosine)
+        {
+            size_t tirCount = 0;
+            for (size_t i = begin; i < end; i++) {
+                if (!batch.hitMask[i])
+                    continue;
+                bool tir = grazingCosine > 0 && nearGrazing(batch, i, surface.isEntrance, grazingCosine)
+                    ? refractEntry<double>(batch, i, surface.isEntrance)
+                    : refractEntry<float>(batch, i, surface.isEntrance);
+                tirCount += tir;
+            }
+            return tirCount;
+        }
+
+#if OPTICS_HAS_AVX2_KERNELS
+        bool cpuHasAVX2()
+        {
+#if defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 0);
+            if (info[0] < 7)
+                return false;
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+#else
+            return __builtin_cpu_supports("avx2");
+#endif
+        }
+
+        const bool useAVX2 = cpuHasAVX2();
+
+        // 8-wide float versions of the scalar kernels, the tail is left to the scalar kernels
+        OPTICS_AVX2_TARGET
+        size_t intersectSphereAVX2(FloatBatch& batch, const SphereLens& sphere, size_t begin, size_t end)
+        {
+            const __m256 cx = _mm256_set1_ps((float)(sphere.center.x + sphere.radius));
+            const __m256 cy = _mm256_set1_ps((float)sphere.center.y);
+            const __m256 rr = _mm256_set1_ps((float)(sphere.radius * sphere.radius));
+            const __m256 two = _mm256_set1_ps(2.0f);
+            const __m256 four = _mm256_set1_ps(4.0f);
+            const __m256 zero = _mm256_setzero_ps();
+            const __m256 minT = _mm256_set1_ps(0.0001f);
+            const __m256 signBit = _mm256_set1_ps(-0.0f);
+            const __m256 sideValid = _mm256_castsi256_ps(_mm256_set1_epi32(sphere.radius != 0 ? -1 : 0));
+            const __m256 flipNormal = sphere.radius > 0 ? zero : signBit;
+
+            size_t hitCount = 0;
+            size_t i = begin;
+            for (; i + 8 <= end; i += 8) {
+                __m256 ox = _mm256_loadu_ps(&batch.originX[i]);
+                __m256 oy = _mm256_loadu_ps(&batch.originY[i]);
+                __m256 dx = _mm256_loadu_ps(&batch.directionX[i]);
+                __m256 dy = _mm256_loadu_ps(&batch.directionY[i]);
+                __m256 ocx = _mm256_sub_ps(ox, cx);
+                __m256 ocy = _mm256_sub_ps(oy, cy);
+
+                __m256 a = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+                __m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)));
+                __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), rr);
+                __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_mul_ps(four, a), c));
+                __m256 valid = _mm256_cmp_ps(disc, zero, _CMP_GE_OQ);
+
+                __m256 sqrtDisc = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+                __m256 negB = _mm256_xor_ps(b, signBit);
+                __m256 twoA = _mm256_mul_ps(two, a);
+                __m256 t1 = _mm256_div_ps(_mm256_sub_ps(negB, sqrtDisc), twoA);
+                __m256 t2 = _mm256_div_ps(_mm256_add_ps(negB, sqrtDisc), twoA);
+
+                __m256 h1x = _mm256_add_ps(ox, _mm256_mul_ps(dx, t1));
+                __m256 h2x = _mm256_add_ps(ox, _mm256_mul_ps(dx, t2));
+                __m256 side1 = sphere.radius > 0 ? _mm256_cmp_ps(h1x, cx, _CMP_LT_OQ) : _mm256_cmp_ps(h1x, cx, _CMP_GT_OQ);
+                __m256 side2 = sphere.radius > 0 ? _mm256_cmp_ps(h2x, cx, _CMP_LT_OQ) : _mm256_cmp_ps(h2x, cx, _CMP_GT_OQ);
+                __m256 ok1 = _mm256_and_ps(_mm256_and_ps(valid, sideValid), _mm256_and_ps(_mm256_cmp_ps(t1, minT, _CMP_GT_OQ), side1));
+                __m256 ok2 = _mm256_andnot_ps(ok1, _mm256_and_ps(_mm256_and_ps(valid, sideValid), _mm256_and_ps(_mm256_cmp_ps(t2, minT, _CMP_GT_OQ), side2)));
+                __m256 hit = _mm256_or_ps(ok1, ok2);
+                int hitBits = _mm256_movemask_ps(hit);
+                if (hitBits == 0) {
+                    for (int k = 0; k < 8; k++)
+                        batch.hitMask[i + k] = 0;
+                    continue;
+                }
+
+                __m256 t = _mm256_blendv_ps(t2, t1, ok1);
+                __m256 hx = _mm256_add_ps(ox, _mm256_mul_ps(dx, t));
+                __m256 hy = _mm256_add_ps(oy, _mm256_mul_ps(dy, t));
+
+                __m256 nx = _mm256_sub_ps(hx, cx);
+                __m256 ny = _mm256_sub_ps(hy, cy);
+                __m256 len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny)));
+                nx = _mm256_xor_ps(_mm256_div_ps(nx, len), flipNormal);
+                ny = _mm256_xor_ps(_mm256_div_ps(ny, len), flipNormal);
+
+                _mm256_storeu_ps(&batch.originX[i], _mm256_blendv_ps(ox, hx, hit));
+                _mm256_storeu_ps(&batch.originY[i], _mm256_blendv_ps(oy, hy, hit));
+                _mm256_storeu_ps(&batch.normalX[i], nx);
+                _mm256_storeu_ps(&batch.normalY[i], ny);
+                for (int k = 0; k < 8; k++) {
+                    batch.hitMask[i + k] = (hitBits >> k) & 1;
+                    hitCount += (hitBits >> k) & 1;
+                }
+            }
+            return hitCount + intersectSphereScalar(batch, sphere, i, end);
+        }
+
+        // refineHits 4 lanes at a time in double
+        OPTICS_AVX2_TARGET
+        void refineHitsAVX2(FloatBatch& batch, const SphereLens& sphere, size_t begin, size_t end)
+        {
+            const __m256d cx = _mm256_set1_pd(sphere.center.x + sphere.radius);
+            const __m256d cy = _mm256_set1_pd(sphere.center.y);
+            const __m256d rr = _mm256_set1_pd(sphere.radius * sphere.radius);
+            const __m256d two = _mm256_set1_pd(2.0);
+            const __m256d zero = _mm256_setzero_pd();
+            const __m256d normalSign = _mm256_set1_pd(sphere.radius > 0 ? 1.0 : -1.0);
+
+            size_t i = begin;
+            for (; i + 4 <= end; i += 4) {
+                int maskBits;
+                std::memcpy(&maskBits, &batch.hitMask[i], sizeof(maskBits));
+                if (maskBits == 0)
+                    continue;
+                __m128 hit = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(maskBits)), _mm_setzero_si128()));
+
+                __m128 ox = _mm_loadu_ps(&batch.originX[i]);
+                __m128 oy = _mm_loadu_ps(&batch.originY[i]);
+                __m256d dx = _mm256_cvtps_pd(_mm_loadu_ps(&batch.directionX[i]));
+                __m256d dy = _mm256_cvtps_pd(_mm_loadu_ps(&batch.directionY[i]));
+                __m256d vx = _mm256_sub_pd(_mm256_cvtps_pd(ox), cx);
+                __m256d vy = _mm256_sub_pd(_mm256_cvtps_pd(oy), cy);
+
+                __m256d slope = _mm256_mul_pd(two, _mm256_add_pd(_mm256_mul_pd(dx, vx), _mm256_mul_pd(dy, vy)));
+                __m256d f = _mm256_sub_pd(_mm256_add_pd(_mm256_mul_pd(vx, vx), _mm256_mul_pd(vy, vy)), rr);
+                __m256d t = _mm256_div_pd(f, slope);
+                t = _mm256_blendv_pd(t, zero, _mm256_cmp_pd(slope, zero, _CMP_EQ_OQ));
+                vx = _mm256_sub_pd(vx, _mm256_mul_pd(dx, t));
+                vy = _mm256_sub_pd(vy, _mm256_mul_pd(dy, t));
+
+                __m256d scale = _mm256_div_pd(normalSign, _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(vx, vx), _mm256_mul_pd(vy, vy))));
+                _mm_storeu_ps(&batch.originX[i], _mm_blendv_ps(ox, _mm256_cvtpd_ps(_mm256_add_pd(cx, vx)), hit));
+                _mm_storeu_ps(&batch.originY[i], _mm_blendv_ps(oy, _mm256_cvtpd_ps(_mm256_add_pd(cy, vy)), hit));
+                _mm_storeu_ps(&batch.normalX[i], _mm_blendv_ps(_mm_loadu_ps(&batch.normalX[i]), _mm256_cvtpd_ps(_mm256_mul_pd(vx, scale)), hit));
+                _mm_storeu_ps(&batch.normalY[i], _mm_blendv_ps(_mm_loadu_ps(&batch.normalY[i]), _mm256_cvtpd_ps(_mm256_mul_pd(vy, scale)), hit));
+            }
+            refineHits(batch, sphere, i, end);
+        }
+
+        // Lanes near grazing incidence are left to refractEntry<double> when grazingCosine > 0
+        OPTICS_AVX2_TARGET
+        size_t refractSphereAVX2(FloatBatch& batch, const SphereLens& surface, size_t begin, size_t end, double grazingCosine)
+        {
+            const __m256 one = _mm256_set1_ps(1.0f);
+            const __m256 zero = _mm256_setzero_ps();
+            const __m256 signBit = _mm256_set1_ps(-0.0f);
+            const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+            const __m256 grazing = _mm256_set1_ps((float)grazingCosine);
+            const __m256 grazingSquared = _mm256_set1_ps((float)(grazingCosine * grazingCosine));
+
+            size_t tirCount = 0;
+            size_t i = begin;
+            for (; i + 8 <= end; i += 8) {
+                __m128i maskBytes = _mm_loadl_epi64((const __m128i*)&batch.hitMask[i]);
+                __m256 hit = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_cvtepu8_epi32(maskBytes), _mm256_setzero_si256()));
+                int hitBits = _mm256_movemask_ps(hit);
+                if (hitBits == 0)
+                    continue;
+
+                __m256 nLambda = _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(&batch.rayIndex[i + 4])), _mm256_cvtpd_ps(_mm256_loadu_pd(&batch.rayIndex[i])));
+                __m256 medium = _mm256_loadu_ps(&batch.mediumIndex[i]);
+                __m256 n1 = surface.isEntrance ? medium : nLambda;
+                __m256 n2 = surface.isEntrance ? nLambda : one;
+
+                __m256 eta = _mm256_div_ps(n1, n2);
+                __m256 dx = _mm256_loadu_ps(&batch.directionX[i]);
+                __m256 dy = _mm256_loadu_ps(&batch.directionY[i]);
+                __m256 nx = _mm256_loadu_ps(&batch.normalX[i]);
+                __m256 ny = _mm256_loadu_ps(&batch.normalY[i]);
+                __m256 cosI = _mm256_xor_ps(_mm256_add_ps(_mm256_mul_ps(dx, nx), _mm256_mul_ps(dy, ny)), signBit);
+
+                // Make sure normal points against incident ray
+                __m256 flip = _mm256_and_ps(_mm256_cmp_ps(cosI, zero, _CMP_LT_OQ), signBit);
+                cosI = _mm256_xor_ps(cosI, flip);
+                nx = _mm256_xor_ps(nx, flip);
+                ny = _mm256_xor_ps(ny, flip);
+
+                __m256 sinT2 = _mm256_mul_ps(_mm256_mul_ps(eta, eta), _mm256_sub_ps(one, _mm256_mul_ps(cosI, cosI)));
+                __m256 cosT2 = _mm256_sub_ps(one, sinT2);
+                __m256 tir = _mm256_cmp_ps(sinT2, one, _CMP_GT_OQ);
+                __m256 cosT = _mm256_sqrt_ps(_mm256_max_ps(cosT2, zero));
+                __m256 k = _mm256_sub_ps(_mm256_mul_ps(eta, cosI), cosT);
+                __m256 rx = _mm256_add_ps(_mm256_mul_ps(dx, eta), _mm256_mul_ps(nx, k));
+                __m256 ry = _mm256_add_ps(_mm256_mul_ps(dy, eta), _mm256_mul_ps(ny, k));
+                __m256 len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(rx, rx), _mm256_mul_ps(ry, ry)));
+                rx = _mm256_div_ps(rx, len);
+                ry = _mm256_div_ps(ry, len);
+
+                // grazing lanes keep their state for the double pass below
+                int grazingBits = 0;
+                if (grazingCosine > 0) {
+                    __m256 nearGrazing = _mm256_or_ps(_mm256_cmp_ps(cosI, grazing, _CMP_LT_OQ),
+                        _mm256_cmp_ps(_mm256_and_ps(cosT2, absMask), grazingSquared, _CMP_LT_OQ));
+                    grazingBits = _mm256_movemask_ps(_mm256_and_ps(nearGrazing, hit));
+                    hit = _mm256_andnot_ps(nearGrazing, hit);
+                }
+
+                _mm256_storeu_ps(&batch.mediumIndex[i], _mm256_blendv_ps(medium, surface.isEntrance ? nLambda : one, hit));
+                // TIR rays keep their direction
+                __m256 update = _mm256_andnot_ps(tir, hit);
+                _mm256_storeu_ps(&batch.directionX[i], _mm256_blendv_ps(dx, rx, update));
+                _mm256_storeu_ps(&batch.directionY[i], _mm256_blendv_ps(dy, ry, update));
+
+                int tirBits = _mm256_movemask_ps(_mm256_and_ps(tir, hit));
+                for (int b = 0; b < 8; b++) {
+                    tirCount += (tirBits >> b) & 1;
+                    if ((grazingBits >> b) & 1)
+                        tirCount += refractEntry<double>(batch, i + b, surface.isEntrance);
+                }
+            }
+            return tirCount + refractSphereScalar(batch, surface, i, end, grazingCosine);
+        }
+#endif
+
+        // Per-worker state of a reduced-precision trace
+        struct PrecisionWorker {
+            RayBatch shadow;                // double state, buckets and the surfaces without float kernels
+            FloatBatch batch;
+        };
+
+        size_t intersectFloat(FloatBatch& batch, const SphereLens& sphere, bool mixed)
+        {
+            size_t hitCount;
+#if OPTICS_HAS_AVX2_KERNELS
+            if (useAVX2)
+                hitCount = intersectSphereAVX2(batch, sphere, 0, batch.size());
+            else
+#endif
+                hitCount = intersectSphereScalar(batch, sphere, 0, batch.size());
+            if (!mixed || hitCount == 0)
+                return hitCount;
+#if OPTICS_HAS_AVX2_KERNELS
+            if (useAVX2)
+                refineHitsAVX2(batch, sphere, 0, batch.size());
+            else
+#endif
+                refineHits(batch, sphere, 0, batch.size());
+            return hitCount;
+        }
+
+        size_t refractFloat(FloatBatch& batch, const SphereLens& surface, bool mixed)
+        {
+            double grazingCosine = mixed ? mixedGrazingCosine : 0.0;
+#if OPTICS_HAS_AVX2_KERNELS
+            if (useAVX2)
+                return refractSphereAVX2(batch, surface, 0, batch.size(), grazingCosine);
+#endif
+            return refractSphereScalar(batch, surface, 0, batch.size(), grazingCosine);
+        }
+
+    } // namespace
+
+    void traceRayStates(std::vector<RayState>& states, const std::vector<SphereLens>& lenses, int threadCount, int precision)
+    {
+        if (precision != FloatPrecision && precision != MixedPrecision) {
+            traceRayStates(states, lenses, threadCount);
+            return;
+        }
+        OPTICS_PROFILE_SCOPE("traceRayStates (reduced precision)", "trace");
+        OPTICS_PROFILE_COUNT(RaysTraced, states.size());
+        const bool mixed = precision == MixedPrecision;
+        TracePool& pool = TracePool::instance();
+        std::vector<PrecisionWorker> workers(pool.participantCount(states.size(), traceBlockSize, threadCount));
+
+        pool.parallelFor(states.size(), traceBlockSize, threadCount, [&](size_t blockBegin, size_t blockEnd, int worker) {
+            RayBatch& shadow = workers[worker].shadow;
+            FloatBatch& batch = workers[worker].batch;
+            size_t count = blockEnd - blockBegin;
+            shadow.load(states, blockBegin, blockEnd);
+            batch.load(shadow);
+
+            size_t hits = 0, totalInternalReflections = 0;
+            for (const SphereLens& l : lenses) {
+                size_t surfaceHits;
+                if (isSphericalRefractor(l)) {
+                    surfaceHits = intersectFloat(batch, l, mixed);
+                    if (surfaceHits != 0) {
+                        batch.setIndices(shadow, l);
+                        totalInternalReflections += refractFloat(batch, l, mixed);
+                    }
+                }
+                else {
+                    // other surface types and mirrors are traced by the double kernels
+                    batch.store(shadow);
+                    surfaceHits = intersectBatch(shadow, l, 0, count);
+                    if (surfaceHits != 0)
+                        totalInternalReflections += refractBatch(shadow, l, 0, count);
+                    batch.load(shadow);
+                    std::copy(shadow.hitMask.begin(), shadow.hitMask.begin() + count, batch.hitMask.begin());
+                }
+                hits += surfaceHits;
+                if (surfaceHits == 0)
+                    continue;
+                for (size_t j = 0; j < count; j++)
+                    states[blockBegin + j].hitCount += batch.hitMask[j];
+            }
+            size_t tests = count * lenses.size();
+            OPTICS_PROFILE_COUNT(SurfaceTests, tests);
+            OPTICS_PROFILE_COUNT(Hits, hits);
+            OPTICS_PROFILE_COUNT(Misses, tests - hits);
+            OPTICS_PROFILE_COUNT(TotalInternalReflections, totalInternalReflections);
+
+            for (size_t j = 0; j < count; j++) {
+                RayState& r = states[blockBegin + j];
+                r.origin = NodeWeft::Vec2{ batch.originX[j], batch.originY[j] };
+                r.direction = NodeWeft::Vec2{ batch.directionX[j], batch.directionY[j] };
+            }
+        });
+    }
+
+    bool PrecisionError::within(double positionTolerance, double angleTolerance) const
+    {
+        return maxPosition <= positionTolerance && maxAngle <= angleTolerance && hitMismatches * 1000 <= rays;
+    }
+
+    PrecisionError measurePrecisionError(const std::vector<RayState>& input, const std::vector<SphereLens>& lenses, int precision,
+        size_t sampleCount, int threadCount)
+    {
+        OPTICS_PROFILE_SCOPE("measurePrecisionError", "analysis");
+        PrecisionError error;
+        if (input.empty() || sampleCount == 0)
+            return error;
+        std::vector<RayState> reference;
+        size_t stride = (input.size() + sampleCount - 1) / sampleCount;
+        reference.reserve(input.size() / stride + 1);
+        for (size_t i = 0; i < input.size(); i += stride)
+            reference.push_back(input[i]);
+        std::vector<RayState> reduced = reference;
+        traceRayStates(reference, lenses, threadCount);
+        traceRayStates(reduced, lenses, threadCount, precision);
+
+        double positionSum = 0, angleSum = 0;
+        size_t compared = 0;
+        for (size_t i = 0; i < reference.size(); i++) {
+            const RayState& a = reference[i];
+            const RayState& b = reduced[i];
+            if (a.hitCount != b.hitCount) {
+                error.hitMismatches++;
+                continue;
+            }
+            double position = NodeWeft::length(b.origin - a.origin);
+            double angle = std::abs(std::atan2(a.direction.x * b.direction.y - a.direction.y * b.direction.x,
+                a.direction.x * b.direction.x + a.direction.y * b.direction.y));
+            error.maxPosition = (std::max)(error.maxPosition, position);
+            error.maxAngle = (std::max)(error.maxAngle, angle);
+            positionSum += position * position;
+            angleSum += angle * angle;
+            compared++;
+        }
+        error.rays = reference.size();
+        if (compared > 0) {
+            error.rmsPosition = std::sqrt(positionSum / compared);
+            error.rmsAngle = std::sqrt(angleSum / compared);
+        }
+        return error;
+    }
+
+} // namespace Optics
@@ -0,0 +1,35 @@
+#pragma once
+#include "RayOptics.h"
+
+namespace Optics {
+
+    // Arithmetic of the path-free sequential trace
+    enum TracePrecision {
+        DoublePrecision = 0,
+        FloatPrecision,             // float ray state and kernels, twice the rays per SIMD instruction
+        MixedPrecision,             // float ray state, hit points, normals and refraction near grazing angles in double
+    };
+
+    // traceRayStates in the given precision, the states are read and written in double
+    // Spherical refractors run the float kernels, other surface types and mirrors go through the double kernels
+    void traceRayStates(std::vector<RayState>& states, const std::vector<SphereLens>& lenses, int threadCount, int precision);
+
+    // Difference of a reduced-precision trace from the double trace of the same rays
+    struct PrecisionError {
+        static constexpr double defaultPositionTolerance = 1e-3;   // scene units
+        static constexpr double defaultAngleTolerance = 1e-4;      // radians
+
+        size_t rays{ 0 };               // rays compared
+        size_t hitMismatches{ 0 };      // rays that hit a different number of surfaces, left out of the errors below
+        double maxPosition{ 0 }, rmsPosition{ 0 };     // distance between the final origins
+        double maxAngle{ 0 }, rmsAngle{ 0 };           // angle between the final directions
+
+        // Errors within the tolerances and at most one ray in a thousand hitting different surfaces
+        bool within(double positionTolerance = defaultPositionTolerance, double angleTolerance = defaultAngleTolerance) const;
+    };
+
+    // Trace up to sampleCount evenly spaced input rays in precision and in double and compare the final states
+    PrecisionError measurePrecisionError(const std::vector<RayState>& input, const std::vector<SphereLens>& lenses, int precision,
+        size_t sampleCount = 4096, int threadCount = 1);
+
+} // namespace Optics
@@ -0,0 +1,286 @@
+#pragma once
+#include "SegmentList.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace Optics {
+
+    // Runs jobs on a background thread, one at a time, and hands what they publish to the thread that polls
+    // Starting a new job or cancelling makes the running one stale: it stops at its next check and
+    // nothing it publishes afterwards is seen
+    template<typename Result>
+    class BackgroundJob {
+    public:
+        struct Progress {
+            Result result;
+            size_t done{ 0 };       // e.g. input rays traced so far
+            size_t total{ 0 };
+            bool complete{ false };
+            bool hasResult{ false };    // false if only the counts changed since the last poll
+        };
+
+        // What a running job sees of its runner
+        class Context {
+        public:
+            bool cancelled() const { return owner.generation.load() != generation; }
+            // Replace the published progress, false once the job is stale
+            bool publish(Result result, size_t done, size_t total, bool complete)
+            {
+                return owner.publish(generation, Progress{ std::move(result), done, total, complete, true });
+            }
+            // Update the counts only, the result published before stays
+            bool publishProgress(size_t done, size_t total) { return owner.publishProgress(generation, done, total); }
+
+        private:
+            friend class BackgroundJob;
+            Context(BackgroundJob& owner, unsigned long long generation) : owner(owner), generation(generation) {}
+            BackgroundJob& owner;
+            unsigned long long generation;
+        };
+
+        // Runs on the background thread, so it must only use data it owns or that is immutable
+        using JobFunction = std::function<void(Context& context)>;
+
+        BackgroundJob() = default;
+        ~BackgroundJob()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopFlag = true;
+                generation++;
+            }
+            wake.notify_one();
+            if (thread.joinable())
+                thread.join();
+        }
+        BackgroundJob(const BackgroundJob&) = delete;
+        BackgroundJob& operator=(const BackgroundJob&) = delete;
+
+        // Start job, the running one is cancelled, returns at once
+        void start(JobFunction function)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job = std::move(function);
+                jobGeneration = ++generation;
+                hasJob = true;
+                fresh = false;
+                running = true;
+                if (!thread.joinable())
+                    thread = std::thread([this]() { run(); });
+            }
+            wake.notify_one();
+        }
+
+        void cancel()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            generation++;
+            job = nullptr;
+            hasJob = false;
+            running = false;
+            fresh = false;
+        }
+
+        // Latest progress published by the current job, false if nothing was published since the last call
+        bool poll(Progress& progress)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!fresh)
+                return false;
+            progress = std::move(published);
+            published = Progress();
+            fresh = false;
+            return true;
+        }
+
+        // True from start until the job completes, returns or is cancelled
+        bool busy()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return running;
+        }
+
+    private:
+        void run()
+        {
+            for (;;) {
+                JobFunction current;
+                unsigned long long currentGeneration;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [&]() { return hasJob || stopFlag; });
+                    if (stopFlag)
+                        return;
+                    current = std::move(job);
+                    job = nullptr;
+                    hasJob = false;
+                    currentGeneration = jobGeneration;
+                }
+                Context context(*this, currentGeneration);
+                current(context);
+                // the function is released here, so what it captured does not outlive the job
+                current = nullptr;
+                std::lock_guard<std::mutex> lock(mutex);
+                if (generation == currentGeneration)
+                    running = false;
+            }
+        }
+
+        bool publish(unsigned long long jobGeneration, Progress&& progress)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (generation != jobGeneration)
+                return false;
+            running = !progress.complete;
+            published = std::move(progress);
+            fresh = true;
+            return true;
+        }
+
+        bool publishProgress(unsigned long long jobGeneration, size_t done, size_t total)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (generation != jobGeneration)
+                return false;
+            published.done = done;
+            published.total = total;
+            fresh = true;
+            return true;
+        }
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::thread thread;
+        std::atomic<unsigned long long> generation{ 0 };
+        JobFunction job;
+        unsigned long long jobGeneration{ 0 };
+        bool hasJob{ false };
+        bool stopFlag{ false };
+        bool running{ false };
+        bool fresh{ false };
+        Progress published;
+    };
+
+    constexpr size_t progressiveMinimumBlockSize = 4096;
+
+    // Traces input in refinement levels, every 64th item first, then every 16th, every 4th and the rest, in blocks
+    // of at least progressiveMinimumBlockSize items, and hands everything traced so far to publish after each block
+    // The traced items are kept per range of one block of input items. When the last level of a range is traced,
+    // the range is put back in input order: its coarser levels are copied, they may already be shared by a published
+    // list, and the block just traced is moved in, so the whole result is never copied at once. Once complete the list
+    // is in input order, as a foreground trace returns it, unless trace changed the size of a block (non-sequential
+    // paths): then each range stays ordered by level
+    // trace traces one block in place and may replace it. publish gets the list and the number of input items traced
+    // so far, and returns false to stop, as cancelled does before each block. Returns false if the trace was stopped
+    template<typename T>
+    bool traceProgressively(const SegmentList<T>& input, const std::function<void(std::vector<T>& items)>& trace,
+        const std::function<bool(const SegmentList<T>& items, size_t traced)>& publish, const std::function<bool()>& cancelled)
+    {
+        // the input segments are read in place, items are only copied into the block being traced
+        const auto segments = input.segments();
+        const size_t total = input.size();
+        if (total == 0)
+            return publish(SegmentList<T>(), 0);
+        const size_t blockSize = (std::max)(progressiveMinimumBlockSize, total / 64);
+        const size_t strides[] = { 64, 16, 4, 1 };
+        auto levelOf = [](size_t i) { return i % 64 == 0 ? 0 : i % 16 == 0 ? 1 : i % 4 == 0 ? 2 : 3; };
+
+        // traced items of each range of blockSize input items, by level until the range is complete
+        std::vector<std::vector<std::shared_ptr<const std::vector<T>>>> ranges((total + blockSize - 1) / blockSize);
+        size_t traced = 0;
+        bool inPlace = true;
+        std::vector<T> block;
+        std::vector<size_t> order;  // input index of each item in block
+        size_t level = 0;
+
+        // range r once its last level is traced into block
+        auto putInOrder = [&](size_t r) {
+            size_t begin = r * blockSize, end = (std::min)(total, begin + blockSize);
+            std::vector<const T*> coarse;
+            size_t next[3] = {};
+            for (auto& piece : ranges[r])
+                for (auto& item : *piece)
+                    coarse.push_back(&item);
+            for (size_t i = begin; i < end; i++) {
+                int l = levelOf(i);
+                if (l < 2)
+                    next[l + 1]++;
+                if (l < 1)
+                    next[l + 2]++;
+            }
+            std::vector<T> items;
+            items.reserve(end - begin);
+            size_t fine = 0;
+            for (size_t i = begin; i < end; i++) {
+                int l = levelOf(i);
+                if (l == 3)
+                    items.push_back(std::move(block[fine++]));
+                else
+                    items.push_back(*coarse[next[l]++]);
+            }
+            ranges[r].clear();
+            ranges[r].push_back(std::make_shared<const std::vector<T>>(std::move(items)));
+        };
+
+        auto flush = [&]() {
+            if (cancelled())
+                return false;
+            traced += block.size();
+            size_t inputSize = block.size();
+            trace(block);
+            inPlace = inPlace && block.size() == inputSize;
+            if (inPlace && level == 3)
+                putInOrder(order.front() / blockSize);
+            else if (!inPlace)
+                ranges[order.front() / blockSize].push_back(std::make_shared<const std::vector<T>>(std::move(block)));
+            else {
+                // a coarse level spans several ranges, its items are moved out by range
+                for (size_t k = 0; k < block.size();) {
+                    size_t r = order[k] / blockSize, end = k;
+                    while (end < block.size() && order[end] / blockSize == r)
+                        end++;
+                    std::vector<T> piece(std::make_move_iterator(block.begin() + k), std::make_move_iterator(block.begin() + end));
+                    ranges[r].push_back(std::make_shared<const std::vector<T>>(std::move(piece)));
+                    k = end;
+                }
+            }
+            block = std::vector<T>();
+            order.clear();
+            SegmentList<T> items;
+            for (auto& pieces : ranges)
+                for (auto& piece : pieces)
+                    items.append(piece);
+            return publish(items, traced);
+        };
+
+        for (level = 0; level < 4; level++) {
+            size_t stride = strides[level];
+            size_t previousStride = level > 0 ? strides[level - 1] : 0;
+            size_t base = 0;
+            for (auto& segment : segments) {
+                for (size_t j = (stride - base % stride) % stride; j < segment->size(); j += stride) {
+                    if (previousStride > 0 && (base + j) % previousStride == 0)
+                        continue; // traced at a coarser level
+                    // the last level is traced range by range
+                    if (level == 3 && !block.empty() && (base + j) / blockSize != order.front() / blockSize && !flush())
+                        return false;
+                    block.push_back((*segment)[j]);
+                    order.push_back(base + j);
+                    if (level < 3 && block.size() >= blockSize && !flush())
+                        return false;
+                }
+                base += segment->size();
+            }
+            if (!block.empty() && !flush())
+                return false;
+        }
+        return true;
+    }
+
+} // namespace Optics
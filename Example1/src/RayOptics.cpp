@@ -1,83 +1,165 @@
 #include "RayOptics.h"
+#include "OpticsProfiler.h"
+#include "SurfaceKernels.h"
+#include "TracePool.h"
 #include <cmath>
 #include <algorithm>
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define OPTICS_HAS_AVX2_KERNELS 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define OPTICS_AVX2_TARGET
+#else
+#define OPTICS_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#else
+#define OPTICS_HAS_AVX2_KERNELS 0
+#endif
+
 namespace Optics {
 
     NodeWeft::tRGB Ray::getWavelengthColor() const
     {
-        double wl = wavelength;
-        double r = 0.0, g = 0.0, b = 0.0;
-        double gamma = 0.8;  // Gamma correction factor for color perception
+        return wavelengthColor(wavelength, intensity);
+    }
 
-        // Handle out-of-range wavelengths (infrared or ultraviolet)
-        if (wl < 380.0 || wl > 700.0) {
-            return NodeWeft::tRGB{ 0, 0, 0 };  // Return black for non-visible wavelengths
-        }
+    namespace {
 
-        // Calculate RGB components based on wavelength
-        // Using a simplified model of the visible spectrum
-        if (wl >= 380.0 && wl < 440.0) {
-            // Violet to Blue (380-440 nm)
-            r = -(wl - 440.0) / (440.0 - 380.0);
-            g = 0.0;
-            b = 1.0;
-        }
-        else if (wl >= 440.0 && wl < 490.0) {
-            // Blue to Cyan (440-490 nm)
-            r = 0.0;
-            g = (wl - 440.0) / (490.0 - 440.0);
-            b = 1.0;
-        }
-        else if (wl >= 490.0 && wl < 510.0) {
-            // Cyan to Green (490-510 nm)
-            r = 0.0;
-            g = 1.0;
-            b = -(wl - 510.0) / (510.0 - 490.0);
-        }
-        else if (wl >= 510.0 && wl < 580.0) {
-            // Green to Yellow (510-580 nm)
-            r = (wl - 510.0) / (580.0 - 510.0);
-            g = 1.0;
-            b = 0.0;
-        }
-        else if (wl >= 580.0 && wl < 645.0) {
-            // Yellow to Red (580-645 nm)
-            r = 1.0;
-            g = -(wl - 645.0) / (645.0 - 580.0);
-            b = 0.0;
-        }
-        else if (wl >= 645.0 && wl <= 700.0) {
-            // Deep Red (645-700 nm)
-            r = 1.0;
-            g = 0.0;
-            b = 0.0;
-        }
+        // Colour of a wavelength as 0 to 1 components, before the ray intensity is applied
+        void wavelengthResponse(double wavelength, double& r, double& g, double& b)
+        {
+            double wl = wavelength;
+            r = 0.0, g = 0.0, b = 0.0;
+            double gamma = 0.8;  // Gamma correction factor for color perception
+
+            // Handle out-of-range wavelengths (infrared or ultraviolet)
+            if (wl < 380.0 || wl > 700.0) {
+                return;  // Black for non-visible wavelengths
+            }
+
+            // Calculate RGB components based on wavelength
+            // Using a simplified model of the visible spectrum
+            if (wl >= 380.0 && wl < 440.0) {
+                // Violet to Blue (380-440 nm)
+                r = -(wl - 440.0) / (440.0 - 380.0);
+                g = 0.0;
+                b = 1.0;
+            }
+            else if (wl >= 440.0 && wl < 490.0) {
+                // Blue to Cyan (440-490 nm)
+                r = 0.0;
+                g = (wl - 440.0) / (490.0 - 440.0);
+                b = 1.0;
+            }
+            else if (wl >= 490.0 && wl < 510.0) {
+                // Cyan to Green (490-510 nm)
+                r = 0.0;
+                g = 1.0;
+                b = -(wl - 510.0) / (510.0 - 490.0);
+            }
+            else if (wl >= 510.0 && wl < 580.0) {
+                // Green to Yellow (510-580 nm)
+                r = (wl - 510.0) / (580.0 - 510.0);
+                g = 1.0;
+                b = 0.0;
+            }
+            else if (wl >= 580.0 && wl < 645.0) {
+                // Yellow to Red (580-645 nm)
+                r = 1.0;
+                g = -(wl - 645.0) / (645.0 - 580.0);
+                b = 0.0;
+            }
+            else if (wl >= 645.0 && wl <= 700.0) {
+                // Deep Red (645-700 nm)
+                r = 1.0;
+                g = 0.0;
+                b = 0.0;
+            }
+
+            // Apply intensity factor based on eye's photopic luminosity function
+            // The eye is most sensitive around 555 nm and less sensitive at spectrum edges
+            double factor = 1.0;
+            if (wl < 420.0 || wl > 700.0) {
+                factor = 0.3;  // Reduced brightness for edges
+            }
+            else if (wl > 645.0) {
+                factor = 0.8;  // Red region has lower luminosity
+            }
+            else if (wl < 420.0) {
+                factor = 0.4;  // Violet region has lower luminosity
+            }
 
-        // Apply intensity factor based on eye's photopic luminosity function
-        // The eye is most sensitive around 555 nm and less sensitive at spectrum edges
-        double factor = 1.0;
-        if (wl < 420.0 || wl > 700.0) {
-            factor = 0.3;  // Reduced brightness for edges
+            // Apply gamma correction for perceptually uniform color display
+            r = std::pow((std::max)(0.0, r), 1.0 / gamma) * factor;
+            g = std::pow((std::max)(0.0, g), 1.0 / gamma) * factor;
+            b = std::pow((std::max)(0.0, b), 1.0 / gamma) * factor;
         }
-        else if (wl > 645.0) {
-            factor = 0.8;  // Red region has lower luminosity
+
+        // Scale to 0-255 range and apply ray intensity
+        NodeWeft::tRGB scaleColor(double r, double g, double b, double intensity)
+        {
+            uint8_t r_byte = static_cast<uint8_t>((std::max)(0.0, (std::min)(255.0, r * 255.0 * intensity)));
+            uint8_t g_byte = static_cast<uint8_t>((std::max)(0.0, (std::min)(255.0, g * 255.0 * intensity)));
+            uint8_t b_byte = static_cast<uint8_t>((std::max)(0.0, (std::min)(255.0, b * 255.0 * intensity)));
+
+            return NodeWeft::tRGB{ r_byte, g_byte, b_byte };
         }
-        else if (wl < 420.0) {
-            factor = 0.4;  // Violet region has lower luminosity
+
+    } // namespace
+
+    NodeWeft::tRGB wavelengthColor(double wavelength, double intensity)
+    {
+        double r, g, b;
+        wavelengthResponse(wavelength, r, g, b);
+        return scaleColor(r, g, b, intensity);
+    }
+
+    WavelengthPalette::Entry* WavelengthPalette::find(double wavelength)
+    {
+        if (last < entries.size() && entries[last].wavelength == wavelength)
+            return &entries[last];
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].wavelength == wavelength) {
+                last = i;
+                return &entries[i];
+            }
         }
+        // a continuous spread of wavelengths would only grow the search
+        const size_t maxEntries = 256;
+        if (entries.size() == maxEntries)
+            return nullptr;
+        Entry e{ wavelength, 0, 0, 0, 0 };
+        wavelengthResponse(wavelength, e.r, e.g, e.b);
+        entries.push_back(e);
+        last = entries.size() - 1;
+        return &entries.back();
+    }
 
-        // Apply gamma correction for perceptually uniform color display
-        r = std::pow((std::max)(0.0, r), 1.0 / gamma) * factor;
-        g = std::pow((std::max)(0.0, g), 1.0 / gamma) * factor;
-        b = std::pow((std::max)(0.0, b), 1.0 / gamma) * factor;
+    NodeWeft::tRGB WavelengthPalette::operator()(double wavelength, double intensity)
+    {
+        Entry* e = find(wavelength);
+        if (!e)
+            return wavelengthColor(wavelength, intensity);
+        return scaleColor(e->r, e->g, e->b, intensity);
+    }
 
-        // Scale to 0-255 range and apply ray intensity
-        uint8_t r_byte = static_cast<uint8_t>((std::max)(0.0, (std::min)(255.0, r * 255.0 * intensity)));
-        uint8_t g_byte = static_cast<uint8_t>((std::max)(0.0, (std::min)(255.0, g * 255.0 * intensity)));
-        uint8_t b_byte = static_cast<uint8_t>((std::max)(0.0, (std::min)(255.0, b * 255.0 * intensity)));
+    void WavelengthPalette::addIntensity(double wavelength, double intensity)
+    {
+        Entry* e = find(wavelength);
+        double& maximum = e ? e->maxIntensity : overflowMaxIntensity;
+        maximum = (std::max)(maximum, intensity);
+    }
 
-        return NodeWeft::tRGB{ r_byte, g_byte, b_byte };
+    NodeWeft::tRGB WavelengthPalette::normalized(double wavelength, double intensity)
+    {
+        Entry* e = find(wavelength);
+        double maximum = e ? e->maxIntensity : overflowMaxIntensity;
+        double scale = maximum > 0 ? intensity / maximum : 1.0;
+        if (!e)
+            return wavelengthColor(wavelength, scale);
+        return scaleColor(e->r, e->g, e->b, scale);
     }
 
     bool intersectAndUpdateRay(Ray& ray, const SphereLens& sphere, double refractiveIndexBefore) {
@@ -211,4 +293,572 @@ namespace Optics {
         return (rs * rs + rp * rp) * 0.5;
     }
 
+    void RayBatch::resize(size_t count)
+    {
+        originX.resize(count);
+        originY.resize(count);
+        directionX.resize(count);
+        directionY.resize(count);
+        wavelength.resize(count);
+        intensity.resize(count);
+        mediumIndex.resize(count);
+        hitDistance.resize(count);
+        normalX.resize(count);
+        normalY.resize(count);
+        hitMask.resize(count);
+        bucket.resize(count);
+    }
+
+    void RayBatch::assignBuckets()
+    {
+        bucketWavelength.clear();
+        size_t current = 0;
+        for (size_t i = 0; i < size(); i++) {
+            double wl = wavelength[i];
+            if (current >= bucketWavelength.size() || bucketWavelength[current] != wl) {
+                current = std::find(bucketWavelength.begin(), bucketWavelength.end(), wl) - bucketWavelength.begin();
+                if (current == bucketWavelength.size()) {
+                    if (current == maxBuckets) {
+                        bucketWavelength.clear();
+                        return;
+                    }
+                    bucketWavelength.push_back(wl);
+                }
+            }
+            bucket[i] = (uint16_t)current;
+        }
+    }
+
+    void RayBatch::load(const std::vector<Ray>& rays, size_t begin, size_t end)
+    {
+        resize(end - begin);
+        for (size_t i = begin; i < end; i++) {
+            const Ray& r = rays[i];
+            NodeWeft::Vec2 origin = r.getOrigin();
+            size_t j = i - begin;
+            originX[j] = origin.x;
+            originY[j] = origin.y;
+            directionX[j] = r.direction.x;
+            directionY[j] = r.direction.y;
+            wavelength[j] = r.wavelength;
+            intensity[j] = r.intensity;
+            mediumIndex[j] = 1.0; // assume air
+            hitMask[j] = 0;
+        }
+        assignBuckets();
+    }
+
+    void RayBatch::load(const std::vector<Ray>& rays, size_t begin, size_t end, const std::vector<double>& medium)
+    {
+        load(rays, begin, end);
+        std::copy(medium.begin() + begin, medium.begin() + end, mediumIndex.begin());
+    }
+
+    void RayBatch::load(const std::vector<RayState>& states, size_t begin, size_t end)
+    {
+        resize(end - begin);
+        for (size_t i = begin; i < end; i++) {
+            const RayState& r = states[i];
+            size_t j = i - begin;
+            originX[j] = r.origin.x;
+            originY[j] = r.origin.y;
+            directionX[j] = r.direction.x;
+            directionY[j] = r.direction.y;
+            wavelength[j] = r.wavelength;
+            intensity[j] = r.intensity;
+            mediumIndex[j] = 1.0; // assume air
+            hitMask[j] = 0;
+        }
+        assignBuckets();
+    }
+
+    void TraceCheckpoint::restore(std::vector<Ray>& rays) const
+    {
+        for (size_t i = 0; i < rays.size(); i++) {
+            Ray& r = rays[i];
+            r.hits.resize(hitCount[i]);
+            r.path.resize(hitCount[i] + 1);
+            r.direction = NodeWeft::Vec2{ directionX[i], directionY[i] };
+        }
+    }
+
+    namespace {
+
+        // Scalar kernels, written with the same operation order as intersectAndUpdateRay/refractRay
+        // so the batched path reproduces the per-ray results
+        size_t intersectBatchScalar(RayBatch& batch, const SphereLens& sphere, size_t begin, size_t end)
+        {
+            const double cx = sphere.center.x + sphere.radius;
+            const double cy = sphere.center.y;
+            const double rr = sphere.radius * sphere.radius;
+            size_t hitCount = 0;
+            for (size_t i = begin; i < end; i++) {
+                double ox = batch.originX[i], oy = batch.originY[i];
+                double dx = batch.directionX[i], dy = batch.directionY[i];
+                double ocx = ox - cx, ocy = oy - cy;
+
+                double a = dx * dx + dy * dy;
+                double b = 2.0 * (ocx * dx + ocy * dy);
+                double c = (ocx * ocx + ocy * ocy) - rr;
+                double discriminant = b * b - 4 * a * c;
+
+                batch.hitMask[i] = 0;
+                if (discriminant < 0)
+                    continue;
+
+                double sqrtDisc = std::sqrt(discriminant);
+                double t1 = (-b - sqrtDisc) / (2.0 * a);
+                double t2 = (-b + sqrtDisc) / (2.0 * a);
+
+                bool isHit = false;
+                double t = 0.0, hx = 0.0, hy = 0.0;
+                if (t1 > 0.0001) {
+                    t = t1;
+                    hx = ox + dx * t1;
+                    hy = oy + dy * t1;
+                    isHit = (sphere.radius > 0 && hx < cx) || (sphere.radius < 0 && hx > cx);
+                }
+                if (!isHit && t2 > 0.0001) {
+                    t = t2;
+                    hx = ox + dx * t2;
+                    hy = oy + dy * t2;
+                    isHit = (sphere.radius > 0 && hx < cx) || (sphere.radius < 0 && hx > cx);
+                }
+                if (!isHit)
+                    continue;
+
+                double nx = hx - cx, ny = hy - cy;
+                double len = std::sqrt(nx * nx + ny * ny);
+                nx /= len;
+                ny /= len;
+                if (!(sphere.radius > 0)) {
+                    nx = -nx;
+                    ny = -ny;
+                }
+
+                batch.originX[i] = hx;
+                batch.originY[i] = hy;
+                batch.hitDistance[i] = t;
+                batch.normalX[i] = nx;
+                batch.normalY[i] = ny;
+                batch.hitMask[i] = 1;
+                hitCount++;
+            }
+            return hitCount;
+        }
+
+        size_t refractBatchScalar(RayBatch& batch, const SphereLens& surface, size_t begin, size_t end)
+        {
+            size_t tirCount = 0;
+            for (size_t i = begin; i < end; i++) {
+                if (!batch.hitMask[i])
+                    continue;
+
+                double nLambda = batch.bucketed() ? batch.bucketIndex[batch.bucket[i]] : surface.getRefractiveIndexAtWavelength(batch.wavelength[i]);
+                double n1 = surface.isEntrance ? batch.mediumIndex[i] : nLambda;
+                double n2 = surface.isEntrance ? nLambda : 1.0;
+                batch.mediumIndex[i] = surface.isEntrance ? nLambda : 1.0;
+
+                double eta = n1 / n2;
+                double dx = batch.directionX[i], dy = batch.directionY[i];
+                double nx = batch.normalX[i], ny = batch.normalY[i];
+                double cosI = -(dx * nx + dy * ny);
+                if (cosI < 0) {
+                    cosI = -cosI;
+                    nx = -nx;
+                    ny = -ny;
+                }
+
+                double sinT2 = eta * eta * (1.0 - cosI * cosI);
+                if (sinT2 > 1.0) {
+                    tirCount++;
+                    continue;
+                }
+
+                double cosT = std::sqrt(1.0 - sinT2);
+                double k = eta * cosI - cosT;
+                double rx = dx * eta + nx * k;
+                double ry = dy * eta + ny * k;
+                double len = std::sqrt(rx * rx + ry * ry);
+                batch.directionX[i] = rx / len;
+                batch.directionY[i] = ry / len;
+            }
+            return tirCount;
+        }
+
+#if OPTICS_HAS_AVX2_KERNELS
+        bool cpuHasAVX2()
+        {
+#if defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 0);
+            if (info[0] < 7)
+                return false;
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+#else
+            return __builtin_cpu_supports("avx2");
+#endif
+        }
+
+        const bool useAVX2 = cpuHasAVX2();
+
+        // 4-wide versions of the scalar kernels above, the tail is left to the scalar kernels
+        OPTICS_AVX2_TARGET
+        size_t intersectBatchAVX2(RayBatch& batch, const SphereLens& sphere, size_t begin, size_t end)
+        {
+            const __m256d cx = _mm256_set1_pd(sphere.center.x + sphere.radius);
+            const __m256d cy = _mm256_set1_pd(sphere.center.y);
+            const __m256d rr = _mm256_set1_pd(sphere.radius * sphere.radius);
+            const __m256d two = _mm256_set1_pd(2.0);
+            const __m256d four = _mm256_set1_pd(4.0);
+            const __m256d zero = _mm256_setzero_pd();
+            const __m256d minT = _mm256_set1_pd(0.0001);
+            const __m256d signBit = _mm256_set1_pd(-0.0);
+            // Hemisphere test: hit.x < cx for convex, hit.x > cx for concave, never for zero radius
+            const __m256d sideValid = _mm256_castsi256_pd(_mm256_set1_epi64x(sphere.radius != 0 ? -1 : 0));
+            const __m256d flipNormal = sphere.radius > 0 ? zero : signBit;
+
+            size_t hitCount = 0;
+            size_t i = begin;
+            for (; i + 4 <= end; i += 4) {
+                __m256d ox = _mm256_loadu_pd(&batch.originX[i]);
+                __m256d oy = _mm256_loadu_pd(&batch.originY[i]);
+                __m256d dx = _mm256_loadu_pd(&batch.directionX[i]);
+                __m256d dy = _mm256_loadu_pd(&batch.directionY[i]);
+                __m256d ocx = _mm256_sub_pd(ox, cx);
+                __m256d ocy = _mm256_sub_pd(oy, cy);
+
+                __m256d a = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+                __m256d b = _mm256_mul_pd(two, _mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)));
+                __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), rr);
+                __m256d disc = _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(_mm256_mul_pd(four, a), c));
+                __m256d valid = _mm256_cmp_pd(disc, zero, _CMP_GE_OQ);
+
+                __m256d sqrtDisc = _mm256_sqrt_pd(_mm256_max_pd(disc, zero));
+                __m256d negB = _mm256_xor_pd(b, signBit);
+                __m256d twoA = _mm256_mul_pd(two, a);
+                __m256d t1 = _mm256_div_pd(_mm256_sub_pd(negB, sqrtDisc), twoA);
+                __m256d t2 = _mm256_div_pd(_mm256_add_pd(negB, sqrtDisc), twoA);
+
+                __m256d h1x = _mm256_add_pd(ox, _mm256_mul_pd(dx, t1));
+                __m256d h2x = _mm256_add_pd(ox, _mm256_mul_pd(dx, t2));
+                __m256d side1 = sphere.radius > 0 ? _mm256_cmp_pd(h1x, cx, _CMP_LT_OQ) : _mm256_cmp_pd(h1x, cx, _CMP_GT_OQ);
+                __m256d side2 = sphere.radius > 0 ? _mm256_cmp_pd(h2x, cx, _CMP_LT_OQ) : _mm256_cmp_pd(h2x, cx, _CMP_GT_OQ);
+                __m256d ok1 = _mm256_and_pd(_mm256_and_pd(valid, sideValid), _mm256_and_pd(_mm256_cmp_pd(t1, minT, _CMP_GT_OQ), side1));
+                __m256d ok2 = _mm256_andnot_pd(ok1, _mm256_and_pd(_mm256_and_pd(valid, sideValid), _mm256_and_pd(_mm256_cmp_pd(t2, minT, _CMP_GT_OQ), side2)));
+                __m256d hit = _mm256_or_pd(ok1, ok2);
+                int hitBits = _mm256_movemask_pd(hit);
+                if (hitBits == 0) {
+                    batch.hitMask[i] = batch.hitMask[i + 1] = batch.hitMask[i + 2] = batch.hitMask[i + 3] = 0;
+                    continue;
+                }
+
+                __m256d t = _mm256_blendv_pd(t2, t1, ok1);
+                __m256d hx = _mm256_add_pd(ox, _mm256_mul_pd(dx, t));
+                __m256d hy = _mm256_add_pd(oy, _mm256_mul_pd(dy, t));
+
+                __m256d nx = _mm256_sub_pd(hx, cx);
+                __m256d ny = _mm256_sub_pd(hy, cy);
+                __m256d len = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(nx, nx), _mm256_mul_pd(ny, ny)));
+                nx = _mm256_xor_pd(_mm256_div_pd(nx, len), flipNormal);
+                ny = _mm256_xor_pd(_mm256_div_pd(ny, len), flipNormal);
+
+                _mm256_storeu_pd(&batch.originX[i], _mm256_blendv_pd(ox, hx, hit));
+                _mm256_storeu_pd(&batch.originY[i], _mm256_blendv_pd(oy, hy, hit));
+                _mm256_storeu_pd(&batch.hitDistance[i], t);
+                _mm256_storeu_pd(&batch.normalX[i], nx);
+                _mm256_storeu_pd(&batch.normalY[i], ny);
+                for (int k = 0; k < 4; k++) {
+                    batch.hitMask[i + k] = (hitBits >> k) & 1;
+                    hitCount += (hitBits >> k) & 1;
+                }
+            }
+            return hitCount + intersectBatchScalar(batch, sphere, i, end);
+        }
+
+        OPTICS_AVX2_TARGET
+        size_t refractBatchAVX2(RayBatch& batch, const SphereLens& surface, size_t begin, size_t end)
+        {
+            const __m256d one = _mm256_set1_pd(1.0);
+            const __m256d zero = _mm256_setzero_pd();
+            const __m256d thousand = _mm256_set1_pd(1000.0);
+            const __m256d n0 = _mm256_set1_pd(surface.refractiveIndex);
+            const __m256d dispersion = _mm256_set1_pd(surface.dispersiveCoefficient);
+            const __m256d signBit = _mm256_set1_pd(-0.0);
+            const bool singleBucket = batch.bucketWavelength.size() == 1;
+            const __m256d bucketIndex = _mm256_set1_pd(singleBucket ? batch.bucketIndex[0] : 0.0);
+
+            size_t tirCount = 0;
+            size_t i = begin;
+            for (; i + 4 <= end; i += 4) {
+                int hitBits = batch.hitMask[i] | (batch.hitMask[i + 1] << 1) | (batch.hitMask[i + 2] << 2) | (batch.hitMask[i + 3] << 3);
+                if (hitBits == 0)
+                    continue;
+                __m256d hit = _mm256_castsi256_pd(_mm256_set_epi64x(
+                    batch.hitMask[i + 3] ? -1 : 0, batch.hitMask[i + 2] ? -1 : 0,
+                    batch.hitMask[i + 1] ? -1 : 0, batch.hitMask[i] ? -1 : 0));
+
+                // Cauchy dispersion, looked up per bucket when the batch has them
+                // invalid wavelengths fall back to the base index
+                __m256d nLambda;
+                if (singleBucket)
+                    nLambda = bucketIndex;
+                else if (batch.bucketed()) {
+                    const double* table = batch.bucketIndex.data();
+                    const uint16_t* b = &batch.bucket[i];
+                    nLambda = _mm256_set_pd(table[b[3]], table[b[2]], table[b[1]], table[b[0]]);
+                }
+                else {
+                    __m256d wl = _mm256_loadu_pd(&batch.wavelength[i]);
+                    __m256d wlMicrons = _mm256_div_pd(wl, thousand);
+                    nLambda = _mm256_add_pd(n0, _mm256_div_pd(dispersion, _mm256_mul_pd(wlMicrons, wlMicrons)));
+                    nLambda = _mm256_blendv_pd(n0, nLambda, _mm256_cmp_pd(wl, zero, _CMP_GT_OQ));
+                }
+
+                __m256d medium = _mm256_loadu_pd(&batch.mediumIndex[i]);
+                __m256d n1 = surface.isEntrance ? medium : nLambda;
+                __m256d n2 = surface.isEntrance ? nLambda : one;
+                _mm256_storeu_pd(&batch.mediumIndex[i], _mm256_blendv_pd(medium, surface.isEntrance ? nLambda : one, hit));
+
+                __m256d eta = _mm256_div_pd(n1, n2);
+                __m256d dx = _mm256_loadu_pd(&batch.directionX[i]);
+                __m256d dy = _mm256_loadu_pd(&batch.directionY[i]);
+                __m256d nx = _mm256_loadu_pd(&batch.normalX[i]);
+                __m256d ny = _mm256_loadu_pd(&batch.normalY[i]);
+                __m256d cosI = _mm256_xor_pd(_mm256_add_pd(_mm256_mul_pd(dx, nx), _mm256_mul_pd(dy, ny)), signBit);
+
+                // Make sure normal points against incident ray
+                __m256d flip = _mm256_and_pd(_mm256_cmp_pd(cosI, zero, _CMP_LT_OQ), signBit);
+                cosI = _mm256_xor_pd(cosI, flip);
+                nx = _mm256_xor_pd(nx, flip);
+                ny = _mm256_xor_pd(ny, flip);
+
+                __m256d sinT2 = _mm256_mul_pd(_mm256_mul_pd(eta, eta), _mm256_sub_pd(one, _mm256_mul_pd(cosI, cosI)));
+                __m256d tir = _mm256_cmp_pd(sinT2, one, _CMP_GT_OQ);
+                __m256d cosT = _mm256_sqrt_pd(_mm256_max_pd(_mm256_sub_pd(one, sinT2), zero));
+                __m256d k = _mm256_sub_pd(_mm256_mul_pd(eta, cosI), cosT);
+                __m256d rx = _mm256_add_pd(_mm256_mul_pd(dx, eta), _mm256_mul_pd(nx, k));
+                __m256d ry = _mm256_add_pd(_mm256_mul_pd(dy, eta), _mm256_mul_pd(ny, k));
+                __m256d len = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(rx, rx), _mm256_mul_pd(ry, ry)));
+                rx = _mm256_div_pd(rx, len);
+                ry = _mm256_div_pd(ry, len);
+
+                // TIR rays keep their direction
+                __m256d update = _mm256_andnot_pd(tir, hit);
+                _mm256_storeu_pd(&batch.directionX[i], _mm256_blendv_pd(dx, rx, update));
+                _mm256_storeu_pd(&batch.directionY[i], _mm256_blendv_pd(dy, ry, update));
+
+                int tirBits = _mm256_movemask_pd(_mm256_and_pd(tir, hit));
+                for (int b = 0; b < 4; b++)
+                    tirCount += (tirBits >> b) & 1;
+            }
+            return tirCount + refractBatchScalar(batch, surface, i, end);
+        }
+#endif
+
+        // Rays per block, small enough for the batch to stay in L1/L2 while it visits every lens
+        constexpr size_t traceBlockSize = 256;
+
+        // Hits of one block, collected surface by surface and appended to the rays once the block is done,
+        // so each ray grows its path and hit list by one reservation instead of one push per surface
+        struct BlockHits {
+            std::vector<RayHit> hits;           // in surface order
+            std::vector<uint32_t> ray;          // block-relative ray of each hit
+            std::vector<uint32_t> perRay;       // hits collected so far per ray
+            std::vector<uint32_t> first;        // start of each ray's hits in sorted
+            std::vector<RayHit> sorted;         // hits grouped by ray, surface order kept within a ray
+
+            void reset(size_t count)
+            {
+                hits.clear();
+                ray.clear();
+                perRay.assign(count, 0);
+            }
+
+            // Append each ray's hits and path points with one reservation per ray
+            void flush(std::vector<Ray>& rays, size_t blockBegin)
+            {
+                size_t count = perRay.size();
+                first.resize(count + 1);
+                first[0] = 0;
+                for (size_t j = 0; j < count; j++)
+                    first[j + 1] = first[j] + perRay[j];
+                sorted.resize(hits.size());
+                for (size_t h = 0; h < hits.size(); h++)
+                    sorted[first[ray[h]]++] = hits[h];
+
+                // first[j] now points at the end of ray j's hits
+                size_t begin = 0;
+                for (size_t j = 0; j < count; j++) {
+                    size_t end = first[j];
+                    if (end == begin)
+                        continue;
+                    Ray& r = rays[blockBegin + j];
+                    r.path.reserve(r.path.size() + (end - begin));
+                    r.hits.reserve(r.hits.size() + (end - begin));
+                    for (size_t h = begin; h < end; h++) {
+                        RayHit& hit = sorted[h];
+                        // same fallback as Ray::addHit
+                        if (hit.distance < 0.0001)
+                            hit.distance = NodeWeft::length(hit.point - r.getOrigin());
+                        r.path.push_back(hit.point);
+                        r.hits.push_back(hit);
+                    }
+                    begin = end;
+                }
+            }
+        };
+
+    } // namespace
+
+    size_t intersectBatch(RayBatch& batch, const SphereLens& sphere, size_t begin, size_t end)
+    {
+        if (sphere.surfaceType != SphereLens::SphericalSurface)
+            return intersectShapeBatch(batch, sphere, begin, end);
+#if OPTICS_HAS_AVX2_KERNELS
+        if (useAVX2)
+            return intersectBatchAVX2(batch, sphere, begin, end);
+#endif
+        return intersectBatchScalar(batch, sphere, begin, end);
+    }
+
+    size_t refractBatch(RayBatch& batch, const SphereLens& surface, size_t begin, size_t end)
+    {
+        if (surface.isMirror)
+            return reflectBatch(batch, begin, end);
+        batch.bucketIndex.resize(batch.bucketWavelength.size());
+        for (size_t b = 0; b < batch.bucketWavelength.size(); b++)
+            batch.bucketIndex[b] = surface.getRefractiveIndexAtWavelength(batch.bucketWavelength[b]);
+#if OPTICS_HAS_AVX2_KERNELS
+        if (useAVX2)
+            return refractBatchAVX2(batch, surface, begin, end);
+#endif
+        return refractBatchScalar(batch, surface, begin, end);
+    }
+
+    void traceRays(std::vector<Ray>& rays, const std::vector<SphereLens>& lenses, int threadCount)
+    {
+        traceRays(rays, lenses, nullptr, threadCount, 0, nullptr);
+    }
+
+    void traceRays(std::vector<Ray>& rays, const std::vector<SphereLens>& lenses, const TraceCheckpoint* from,
+        int threadCount, size_t checkpointStride, std::vector<TraceCheckpoint>* checkpoints)
+    {
+        OPTICS_PROFILE_SCOPE("traceRays", "trace");
+        OPTICS_PROFILE_COUNT(RaysTraced, rays.size());
+        size_t firstSurface = from ? from->surface : 0;
+
+        // lay out the checkpoints up front so blocks can fill them in parallel
+        size_t firstNewCheckpoint = checkpoints ? checkpoints->size() : 0;
+        if (checkpoints) {
+            for (size_t s = firstSurface + 1; s <= lenses.size(); s++) {
+                if (s != lenses.size() && (checkpointStride == 0 || s % checkpointStride != 0))
+                    continue;
+                checkpoints->emplace_back();
+                TraceCheckpoint& c = checkpoints->back();
+                c.surface = s;
+                c.directionX.resize(rays.size());
+                c.directionY.resize(rays.size());
+                c.mediumIndex.resize(rays.size());
+                c.hitCount.resize(rays.size());
+            }
+        }
+
+        TracePool& pool = TracePool::instance();
+        std::vector<RayBatch> batches(pool.participantCount(rays.size(), traceBlockSize, threadCount));
+        std::vector<BlockHits> blockHits(batches.size());
+
+        pool.parallelFor(rays.size(), traceBlockSize, threadCount, [&](size_t blockBegin, size_t blockEnd, int worker) {
+            RayBatch& batch = batches[worker];
+            BlockHits& pending = blockHits[worker];
+            size_t count = blockEnd - blockBegin;
+            pending.reset(count);
+            if (from)
+                batch.load(rays, blockBegin, blockEnd, from->mediumIndex);
+            else
+                batch.load(rays, blockBegin, blockEnd);
+
+            size_t nextCheckpoint = firstNewCheckpoint;
+            auto saveCheckpoint = [&](size_t surface) {
+                if (!checkpoints || nextCheckpoint >= checkpoints->size() || (*checkpoints)[nextCheckpoint].surface != surface)
+                    return;
+                TraceCheckpoint& c = (*checkpoints)[nextCheckpoint++];
+                for (size_t j = 0; j < count; j++) {
+                    c.directionX[blockBegin + j] = batch.directionX[j];
+                    c.directionY[blockBegin + j] = batch.directionY[j];
+                    c.mediumIndex[blockBegin + j] = batch.mediumIndex[j];
+                    c.hitCount[blockBegin + j] = (uint32_t)rays[blockBegin + j].hits.size() + pending.perRay[j];
+                }
+            };
+
+            size_t hits = 0, totalInternalReflections = 0;
+            for (size_t s = firstSurface; s < lenses.size(); s++) {
+                const SphereLens& l = lenses[s];
+                size_t surfaceHits = intersectBatch(batch, l, 0, count);
+                hits += surfaceHits;
+                if (surfaceHits != 0) {
+                    // record hits before refraction overwrites the medium index
+                    double indexAfter = l.isEntrance ? l.refractiveIndex : 1.0;
+                    for (size_t j = 0; j < count; j++) {
+                        if (!batch.hitMask[j])
+                            continue;
+                        pending.hits.emplace_back(NodeWeft::Vec2{ batch.originX[j], batch.originY[j] },
+                            NodeWeft::Vec2{ batch.normalX[j], batch.normalY[j] },
+                            batch.hitDistance[j], batch.mediumIndex[j], l.isMirror ? batch.mediumIndex[j] : indexAfter);
+                        pending.ray.push_back((uint32_t)j);
+                        pending.perRay[j]++;
+                    }
+                    totalInternalReflections += refractBatch(batch, l, 0, count);
+                }
+                saveCheckpoint(s + 1);
+            }
+            size_t tests = count * (lenses.size() - firstSurface);
+            OPTICS_PROFILE_COUNT(SurfaceTests, tests);
+            OPTICS_PROFILE_COUNT(Hits, hits);
+            OPTICS_PROFILE_COUNT(Misses, tests - hits);
+            OPTICS_PROFILE_COUNT(TotalInternalReflections, totalInternalReflections);
+
+            pending.flush(rays, blockBegin);
+            for (size_t j = 0; j < count; j++)
+                rays[blockBegin + j].direction = NodeWeft::Vec2{ batch.directionX[j], batch.directionY[j] };
+        });
+    }
+
+    void traceRayStates(std::vector<RayState>& states, const std::vector<SphereLens>& lenses, int threadCount)
+    {
+        OPTICS_PROFILE_SCOPE("traceRayStates", "trace");
+        OPTICS_PROFILE_COUNT(RaysTraced, states.size());
+        TracePool& pool = TracePool::instance();
+        std::vector<RayBatch> batches(pool.participantCount(states.size(), traceBlockSize, threadCount));
+
+        pool.parallelFor(states.size(), traceBlockSize, threadCount, [&](size_t blockBegin, size_t blockEnd, int worker) {
+            RayBatch& batch = batches[worker];
+            size_t count = blockEnd - blockBegin;
+            batch.load(states, blockBegin, blockEnd);
+
+            size_t hits = 0, totalInternalReflections = 0;
+            for (const SphereLens& l : lenses) {
+                size_t surfaceHits = intersectBatch(batch, l, 0, count);
+                hits += surfaceHits;
+                if (surfaceHits == 0)
+                    continue;
+                for (size_t j = 0; j < count; j++)
+                    states[blockBegin + j].hitCount += batch.hitMask[j];
+                totalInternalReflections += refractBatch(batch, l, 0, count);
+            }
+            size_t tests = count * lenses.size();
+            OPTICS_PROFILE_COUNT(SurfaceTests, tests);
+            OPTICS_PROFILE_COUNT(Hits, hits);
+            OPTICS_PROFILE_COUNT(Misses, tests - hits);
+            OPTICS_PROFILE_COUNT(TotalInternalReflections, totalInternalReflections);
+
+            for (size_t j = 0; j < count; j++) {
+                RayState& r = states[blockBegin + j];
+                r.origin = NodeWeft::Vec2{ batch.originX[j], batch.originY[j] };
+                r.direction = NodeWeft::Vec2{ batch.directionX[j], batch.directionY[j] };
+            }
+        });
+    }
+
 } // namespace Optics
@@ -1,5 +1,6 @@
 #pragma once
-#include "mathStructure.h"
+#include "OpticsMath.h"
+#include <cstdint>
 #include <vector>
 
 namespace Optics {
@@ -77,6 +78,51 @@ namespace Optics {
         NodeWeft::tRGB getWavelengthColor() const;
     };
 
+    // Colour of a wavelength in nanometers scaled by intensity, black outside the visible range
+    NodeWeft::tRGB wavelengthColor(double wavelength, double intensity = 1.0);
+
+    // wavelengthColor with the colour of each distinct wavelength computed once
+    // Meant for drawing many rays of a few wavelengths, e.g. spectral bins, the same colours as wavelengthColor
+    // Each wavelength is also a bucket for normalised intensities: a spectral bin's weight, or an adaptive
+    // source's weights, then only darken rays relative to the brightest ray of their own wavelength
+    class WavelengthPalette {
+    public:
+        NodeWeft::tRGB operator()(double wavelength, double intensity = 1.0);
+
+        // Record a ray of the wavelength bucket before drawing with normalized
+        void addIntensity(double wavelength, double intensity);
+        // Colour scaled by intensity over the largest intensity added to the wavelength's bucket
+        NodeWeft::tRGB normalized(double wavelength, double intensity);
+
+    private:
+        struct Entry {
+            double wavelength;
+            double r, g, b;     // 0 to 1, before the intensity
+            double maxIntensity;
+        };
+        // nullptr once entries is full
+        Entry* find(double wavelength);
+
+        std::vector<Entry> entries;
+        size_t last{ 0 };       // rays usually come in runs of one wavelength
+        double overflowMaxIntensity{ 0 };  // bucket of the wavelengths beyond the entries
+    };
+
+    // Running state of a ray without its path history, a fixed 56 bytes whatever the surface count
+    struct RayState {
+        NodeWeft::Vec2 origin;          // Last hit point, or the start point
+        NodeWeft::Vec2 direction;
+        double wavelength;
+        double intensity;
+        uint32_t hitCount;              // Surfaces hit so far
+
+        RayState() : origin{0, 0}, direction{0, 1}, wavelength(550.0), intensity(1.0), hitCount(0) {}
+
+        explicit RayState(const Ray& r)
+            : origin(r.getOrigin()), direction(r.direction), wavelength(r.wavelength), intensity(r.intensity),
+              hitCount((uint32_t)r.hits.size()) {}
+    };
+
     // Circular lens/surface structure (2D)
     // In 2D, a sphere becomes a circle
     struct SphereLens {
@@ -90,6 +136,20 @@ namespace Optics {
         // where n0 is refractiveIndex, B is the dispersion coefficient
         double dispersiveCoefficient; // B coefficient for Cauchy's equation (nm^2)
 
+        // Non-spherical shapes, traced by the kernels in SurfaceKernels.h
+        // Sag from the vertex (center) at height h: c h^2 / (1 + sqrt(1 - (1 + k) c^2 h^2)) + A4 h^4 + A6 h^6 + A8 h^8, c = 1 / radius
+        enum SurfaceTypeEnum {
+            SphericalSurface = 0,
+            FlatSurface,            // plane through the vertex, radius is not used
+            ConicSurface,           // k = conicConstant
+            AsphericSurface,        // conic plus asphericCoefficients
+        };
+        int surfaceType{ SphericalSurface };
+        double conicConstant{ 0 };
+        double asphericCoefficients[3]{ 0, 0, 0 };  // A4, A6, A8
+        double semiAperture{ 0 };   // largest |h| hit on non-spherical surfaces, 0 = unlimited
+        bool isMirror{ false };     // reflects on either side, the medium does not change
+
         SphereLens() : center{0, 0}, radius(100.0), refractiveIndex(1.5), isEntrance(true), dispersiveCoefficient(0.0) {}
         
         SphereLens(const NodeWeft::Vec2& c, double r, double n, bool entrance = true) 
@@ -121,8 +181,24 @@ namespace Optics {
         }
     };
 
+    // True when two surfaces have identical parameters
+    inline bool sameLens(const SphereLens& a, const SphereLens& b) {
+        return a.center.x == b.center.x && a.center.y == b.center.y && a.radius == b.radius
+            && a.refractiveIndex == b.refractiveIndex && a.isEntrance == b.isEntrance
+            && a.dispersiveCoefficient == b.dispersiveCoefficient && a.surfaceType == b.surfaceType
+            && a.conicConstant == b.conicConstant && a.asphericCoefficients[0] == b.asphericCoefficients[0]
+            && a.asphericCoefficients[1] == b.asphericCoefficients[1] && a.asphericCoefficients[2] == b.asphericCoefficients[2]
+            && a.semiAperture == b.semiAperture && a.isMirror == b.isMirror;
+    }
+
+    // True for the refracting spheres every tracer handles, the others only go through the batch kernels
+    inline bool isSphericalRefractor(const SphereLens& l) {
+        return l.surfaceType == SphereLens::SphericalSurface && !l.isMirror;
+    }
+
     // Find intersection between ray and circular surface, returns true if hit occurred
     // Updates ray with hit information if intersection found
+    // Spherical refracting surfaces only, other types go through intersectBatch and refractBatch
     bool intersectAndUpdateRay(Ray& ray, const SphereLens& sphere, double refractiveIndexBefore = 1.0);
 
     // Calculate refraction of a ray and update ray direction
@@ -132,4 +208,80 @@ namespace Optics {
     // Calculate Fresnel reflectance (fraction of light reflected vs refracted)
     double fresnelReflectance(const NodeWeft::Vec2& incident, const NodeWeft::Vec2& normal, double n1, double n2);
 
+    // Structure-of-arrays ray state for batched tracing
+    // Only the running state of each ray is kept here, path history stays on Ray
+    struct RayBatch {
+        std::vector<double> originX, originY;
+        std::vector<double> directionX, directionY;
+        std::vector<double> wavelength;
+        std::vector<double> intensity;
+        std::vector<double> mediumIndex;    // Refractive index of the medium the ray travels in
+
+        // Distinct wavelengths of the batch, set on load, refractBatch evaluates n(wavelength) once per bucket
+        // instead of once per ray. Source rays come grouped by wavelength, so a batch has one or two buckets
+        std::vector<uint16_t> bucket;       // index into bucketWavelength
+        std::vector<double> bucketWavelength;
+        std::vector<double> bucketIndex;    // scratch, n of each bucket at the current surface
+        static constexpr size_t maxBuckets = 256;   // more distinct wavelengths are evaluated per ray
+        bool bucketed() const { return !bucketWavelength.empty(); }
+        void assignBuckets();
+
+        // Per-surface results, written by intersectBatch and read by refractBatch
+        std::vector<double> hitDistance;
+        std::vector<double> normalX, normalY;
+        std::vector<uint8_t> hitMask;
+
+        size_t size() const { return originX.size(); }
+        void resize(size_t count);
+
+        // Load rays [begin, end) into the batch, starting in air
+        void load(const std::vector<Ray>& rays, size_t begin, size_t end);
+
+        // Load path-free ray states [begin, end), starting in air
+        void load(const std::vector<RayState>& states, size_t begin, size_t end);
+
+        // Same, continuing in the medium indices saved for rays [begin, end)
+        void load(const std::vector<Ray>& rays, size_t begin, size_t end, const std::vector<double>& medium);
+    };
+
+    // Batched version of intersectAndUpdateRay over batch entries [begin, end)
+    // Hit rays get their origin moved onto the surface and hitMask set, returns the hit count
+    // Non-spherical surfaces are intersected by the kernels in SurfaceKernels.h
+    size_t intersectBatch(RayBatch& batch, const SphereLens& sphere, size_t begin, size_t end);
+
+    // Batched version of refractRay over the entries flagged by intersectBatch
+    // Updates direction and medium index, returns the number of total internal reflections
+    // Mirrors reflect instead and keep the medium index
+    size_t refractBatch(RayBatch& batch, const SphereLens& surface, size_t begin, size_t end);
+
+    // Trace rays through the lens list in order, recording every hit on the ray path
+    // Same result as calling intersectAndUpdateRay + refractRay per ray and lens
+    // Blocks of rays are spread over threadCount threads (0 = all cores), rays keep their order
+    // Hits are appended per ray once a block is done, but writing two heap vectors per ray still bounds this
+    // to about 1.5-2x the scalar loop at 16 surfaces; traceRayPaths and traceRayStates are the fast paths
+    void traceRays(std::vector<Ray>& rays, const std::vector<SphereLens>& lenses, int threadCount = 1);
+
+    // Path-free version of traceRays: only the running state of each ray is updated, nothing is recorded per hit
+    // Final origin, direction and hit count are the same as traceRays gives
+    void traceRayStates(std::vector<RayState>& states, const std::vector<SphereLens>& lenses, int threadCount = 1);
+
+    // Per-ray state before a surface, lets a trace resume part-way through the lens list
+    // The ray origin is the last point of the path once it is cut back to hitCount hits
+    struct TraceCheckpoint {
+        size_t surface{ 0 };                    // Index of the next surface to trace
+        std::vector<double> directionX, directionY;
+        std::vector<double> mediumIndex;
+        std::vector<uint32_t> hitCount;         // Hits recorded on each ray before this surface
+        std::vector<double> originX, originY;   // Only for paths stored in float, see RayPaths
+
+        // Cut rays back to this checkpoint
+        void restore(std::vector<Ray>& rays) const;
+    };
+
+    // Trace rays through lenses[from.surface ...], continuing from a checkpoint (nullptr = surface 0, in air)
+    // If checkpoints is given, the state before every surface s > from.surface with s % stride == 0,
+    // and after the last surface, is appended to it
+    void traceRays(std::vector<Ray>& rays, const std::vector<SphereLens>& lenses, const TraceCheckpoint* from,
+        int threadCount, size_t checkpointStride, std::vector<TraceCheckpoint>* checkpoints);
+
 } // namespace Optics
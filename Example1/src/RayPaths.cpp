@@ -0,0 +1,429 @@
+#include "RayPaths.h"
+#include "OpticsProfiler.h"
+#include "SurfaceKernels.h"
+#include "TracePool.h"
+#include <algorithm>
+#include <atomic>
+
+namespace Optics {
+
+    namespace {
+
+        constexpr size_t traceBatchSize = 256;  // rays in a RayBatch, as in traceRays
+
+        // A hit of the current block, in the order the surfaces are traced
+        struct BlockHit {
+            uint32_t ray;           // within the block
+            uint32_t surface;
+            double x, y;
+        };
+
+        // Per-worker memory, reused for every block the worker traces
+        struct TraceScratch {
+            RayBatch batch;
+            std::vector<BlockHit> hits, sorted;
+            std::vector<uint32_t> newHits;  // per ray of the block
+            std::vector<size_t> cursor;
+        };
+
+    } // namespace
+
+    void RayPaths::Block::resize(size_t count, int precision)
+    {
+        if (precision == FloatPoints) {
+            floatPoints.resize(count);
+            points.clear();
+        }
+        else {
+            points.resize(count);
+            floatPoints.clear();
+        }
+        surfaces.resize(count);
+    }
+
+    void RayPaths::assign(const SegmentList<Ray>& rays, int pointPrecision)
+    {
+        TraceInput input;
+        input.rays = rays;
+        assign(input, pointPrecision);
+    }
+
+    void RayPaths::assign(const TraceInput& input, int pointPrecision)
+    {
+        OPTICS_PROFILE_SCOPE("RayPaths::assign", "trace");
+        precision = pointPrecision;
+        lenses.clear();
+        entries.resize(input.size());
+        size_t blockCount = (entries.size() + blockSize - 1) / blockSize;
+        if (blocks.size() < blockCount)
+            blocks.resize(blockCount);
+
+        // the input points of each block first, so every block is sized once
+        std::vector<size_t> blockPoints(blockCount, 0);
+        size_t i = 0;
+        input.rays.forEach([&](const Ray& r) {
+            blockPoints[i++ / blockSize] += r.path.empty() ? 0 : r.path.size() - 1;
+        });
+        for (auto& p : input.paths) {
+            for (size_t j = 0; j < p->size(); j++)
+                blockPoints[i++ / blockSize] += p->hitCount(j);
+        }
+        for (size_t b = 0; b < blockCount; b++)
+            blocks[b].resize(blockPoints[b], precision);
+
+        // the entry of the next ray, its span starts after the previous ray's in the same block
+        i = 0;
+        size_t offset = 0;
+        auto next = [&](const NodeWeft::Vec2& origin, const NodeWeft::Vec2& direction, double wavelength, double intensity, size_t count) -> Entry& {
+            if (i % blockSize == 0)
+                offset = 0;
+            Entry& e = entries[i++];
+            e.origin = origin;
+            e.direction = direction;
+            e.wavelength = wavelength;
+            e.intensity = intensity;
+            e.firstPoint = (uint32_t)offset;
+            e.hitCount = (uint32_t)count;
+            return e;
+        };
+        auto setPoint = [&](size_t ray, const NodeWeft::Vec2& p) {
+            Block& block = blocks[ray / blockSize];
+            if (precision == FloatPoints)
+                block.floatPoints[offset] = FloatPoint{ (float)p.x, (float)p.y };
+            else
+                block.points[offset] = p;
+            block.surfaces[offset++] = noSurface;
+        };
+
+        input.rays.forEach([&](const Ray& r) {
+            size_t count = r.path.empty() ? 0 : r.path.size() - 1;
+            next(r.path.empty() ? NodeWeft::Vec2{ 0, 0 } : r.path.back(), r.direction, r.wavelength, r.intensity, count);
+            for (size_t k = 0; k < count; k++)
+                setPoint(i - 1, r.path[k]);
+        });
+        for (auto& p : input.paths) {
+            for (size_t j = 0; j < p->size(); j++) {
+                const Entry& from = p->entries[j];
+                next(from.origin, from.direction, from.wavelength, from.intensity, from.hitCount);
+                for (size_t k = 0; k < from.hitCount; k++)
+                    setPoint(i - 1, p->point(j, k));
+            }
+        }
+        // as Ray(origin, direction) would restart them
+        input.states.forEach([&](const RayState& s) {
+            next(s.origin, NodeWeft::normalize(s.direction), s.wavelength, s.intensity, 0);
+        });
+    }
+
+    void RayPaths::clear()
+    {
+        entries.clear();
+        lenses.clear();
+    }
+
+    RayState RayPaths::state(size_t i) const
+    {
+        const Entry& e = entries[i];
+        RayState s;
+        s.origin = e.origin;
+        s.direction = e.direction;
+        s.wavelength = e.wavelength;
+        s.intensity = e.intensity;
+        s.hitCount = e.hitCount;
+        return s;
+    }
+
+    NodeWeft::Vec2 RayPaths::point(size_t i, size_t k) const
+    {
+        const Entry& e = entries[i];
+        if (k >= e.hitCount)
+            return e.origin;
+        const Block& block = blocks[i / blockSize];
+        if (precision == FloatPoints) {
+            const FloatPoint& p = block.floatPoints[e.firstPoint + k];
+            return NodeWeft::Vec2{ p.x, p.y };
+        }
+        return block.points[e.firstPoint + k];
+    }
+
+    Ray RayPaths::ray(size_t i) const
+    {
+        const Entry& e = entries[i];
+        Ray r;
+        r.path[0] = point(i, 0);
+        r.direction = e.direction;
+        r.wavelength = e.wavelength;
+        r.intensity = e.intensity;
+        r.path.reserve(e.hitCount + 1);
+        r.hits.reserve(e.hitCount);
+
+        // the medium follows the rule of refractBatch, traced rays start in air
+        double medium = 1.0;
+        for (size_t k = 1; k <= e.hitCount; k++) {
+            NodeWeft::Vec2 p = point(i, k);
+            double distance = NodeWeft::length(p - r.path.back());
+            uint32_t s = surface(i, k);
+            r.path.push_back(p);
+            if (s == noSurface || s >= lenses.size()) {
+                r.hits.emplace_back(p, NodeWeft::Vec2{ 0, 1 }, distance, 1.0, 1.0);
+                continue;
+            }
+            const SphereLens& l = lenses[s];
+            double indexAfter = l.isMirror ? medium : (l.isEntrance ? l.refractiveIndex : 1.0);
+            r.hits.emplace_back(p, surfaceNormal(l, p), distance, medium, indexAfter);
+            if (!l.isMirror)
+                medium = l.isEntrance ? l.getRefractiveIndexAtWavelength(e.wavelength) : 1.0;
+        }
+        return r;
+    }
+
+    std::vector<Ray> RayPaths::toRays() const
+    {
+        std::vector<Ray> rays;
+        rays.reserve(size());
+        for (size_t i = 0; i < size(); i++)
+            rays.push_back(ray(i));
+        return rays;
+    }
+
+    size_t TraceInput::size() const
+    {
+        size_t count = rays.size() + states.size();
+        for (auto& p : paths)
+            count += p->size();
+        return count;
+    }
+
+    SegmentList<Ray> TraceInput::toRays() const
+    {
+        SegmentList<Ray> result = rays;
+        for (auto& p : paths)
+            result.append(p->toRays());
+        if (!states.empty()) {
+            std::vector<Ray> restarted;
+            restarted.reserve(states.size());
+            states.forEach([&](const RayState& s) { restarted.emplace_back(s.origin, s.direction, s.wavelength, s.intensity); });
+            result.append(std::move(restarted));
+        }
+        return result;
+    }
+
+    std::vector<RayState> TraceInput::toStates() const
+    {
+        std::vector<RayState> result;
+        result.reserve(size());
+        rays.forEach([&](const Ray& r) { result.emplace_back(r); });
+        for (auto& p : paths) {
+            for (size_t i = 0; i < p->size(); i++)
+                result.push_back(p->state(i));
+        }
+        states.forEach([&](const RayState& s) { result.push_back(s); });
+        return result;
+    }
+
+    std::vector<Ray> TraceInput::sample(size_t count) const
+    {
+        std::vector<Ray> result;
+        size_t stride = (std::max)((size_t)1, size() / (std::max)(count, (size_t)1));
+        // every stride-th ray, counted over the whole input, without visiting the others
+        size_t first = 0, nextRay = 0;
+        auto takeFrom = [&](size_t partSize, auto rayAt) {
+            for (; nextRay < first + partSize; nextRay += stride)
+                result.push_back(rayAt(nextRay - first));
+            first += partSize;
+        };
+        for (auto& items : rays.segments())
+            takeFrom(items->size(), [&](size_t j) { const Ray& r = (*items)[j]; return Ray(r.getOrigin(), r.direction, r.wavelength, r.intensity); });
+        for (auto& p : paths)
+            takeFrom(p->size(), [&](size_t j) { RayState s = p->state(j); return Ray(s.origin, s.direction, s.wavelength, s.intensity); });
+        for (auto& items : states.segments())
+            takeFrom(items->size(), [&](size_t j) { const RayState& s = (*items)[j]; return Ray(s.origin, s.direction, s.wavelength, s.intensity); });
+        return result;
+    }
+
+    size_t RayPaths::memoryBytes() const
+    {
+        size_t bytes = sizeof(RayPaths) + entries.capacity() * sizeof(Entry) + blocks.capacity() * sizeof(Block);
+        for (auto& b : blocks)
+            bytes += b.points.capacity() * sizeof(NodeWeft::Vec2) + b.floatPoints.capacity() * sizeof(FloatPoint) + b.surfaces.capacity() * sizeof(uint32_t);
+        return bytes;
+    }
+
+    void RayPaths::restore(const TraceCheckpoint& checkpoint)
+    {
+        for (size_t i = 0; i < entries.size(); i++) {
+            Entry& e = entries[i];
+            uint32_t count = checkpoint.hitCount[i];
+            if (!checkpoint.originX.empty())
+                e.origin = NodeWeft::Vec2{ checkpoint.originX[i], checkpoint.originY[i] };
+            else
+                e.origin = point(i, count);
+            e.hitCount = count;
+            e.direction = NodeWeft::Vec2{ checkpoint.directionX[i], checkpoint.directionY[i] };
+        }
+    }
+
+    bool traceRayPaths(RayPaths& paths, const std::vector<SphereLens>& lenses, const TraceCheckpoint* from,
+        int threadCount, size_t checkpointStride, std::vector<TraceCheckpoint>* checkpoints, const TraceProgressFunction& progress)
+    {
+        OPTICS_PROFILE_SCOPE("traceRayPaths", "trace");
+        const size_t rayCount = paths.size();
+        OPTICS_PROFILE_COUNT(RaysTraced, rayCount);
+        const size_t firstSurface = from ? from->surface : 0;
+        const bool floatPoints = paths.precision == RayPaths::FloatPoints;
+        paths.lenses = lenses;
+
+        // lay out the checkpoints up front so blocks can fill them in parallel
+        size_t firstNewCheckpoint = checkpoints ? checkpoints->size() : 0;
+        if (checkpoints) {
+            for (size_t s = firstSurface + 1; s <= lenses.size(); s++) {
+                if (s != lenses.size() && (checkpointStride == 0 || s % checkpointStride != 0))
+                    continue;
+                checkpoints->emplace_back();
+                TraceCheckpoint& c = checkpoints->back();
+                c.surface = s;
+                c.directionX.resize(rayCount);
+                c.directionY.resize(rayCount);
+                c.mediumIndex.resize(rayCount);
+                c.hitCount.resize(rayCount);
+                if (floatPoints) {
+                    // float points cannot give back the exact origin to resume from
+                    c.originX.resize(rayCount);
+                    c.originY.resize(rayCount);
+                }
+            }
+        }
+
+        TracePool& pool = TracePool::instance();
+        int participants = pool.participantCount(rayCount, RayPaths::blockSize, threadCount);
+        std::vector<TraceScratch> scratch(participants);
+        std::vector<RayPaths::Block> spares(participants);
+        std::atomic<bool> stopped{ false };
+
+        pool.parallelFor(rayCount, RayPaths::blockSize, threadCount, [&](size_t blockBegin, size_t blockEnd, int worker) {
+            if (stopped.load(std::memory_order_relaxed))
+                return;
+            TraceScratch& t = scratch[worker];
+            RayBatch& batch = t.batch;
+            t.hits.clear();
+            t.newHits.assign(blockEnd - blockBegin, 0);
+
+            size_t hits = 0, totalInternalReflections = 0;
+            for (size_t batchBegin = blockBegin; batchBegin < blockEnd; batchBegin += traceBatchSize) {
+                size_t count = (std::min)(traceBatchSize, blockEnd - batchBegin);
+                uint32_t firstRay = (uint32_t)(batchBegin - blockBegin);
+                batch.resize(count);
+                for (size_t j = 0; j < count; j++) {
+                    const RayPaths::Entry& e = paths.entries[batchBegin + j];
+                    batch.originX[j] = e.origin.x;
+                    batch.originY[j] = e.origin.y;
+                    batch.directionX[j] = e.direction.x;
+                    batch.directionY[j] = e.direction.y;
+                    batch.wavelength[j] = e.wavelength;
+                    batch.intensity[j] = e.intensity;
+                    batch.mediumIndex[j] = from ? from->mediumIndex[batchBegin + j] : 1.0;
+                    batch.hitMask[j] = 0;
+                }
+                batch.assignBuckets();
+
+                size_t nextCheckpoint = firstNewCheckpoint;
+                auto saveCheckpoint = [&](size_t surface) {
+                    if (!checkpoints || nextCheckpoint >= checkpoints->size() || (*checkpoints)[nextCheckpoint].surface != surface)
+                        return;
+                    TraceCheckpoint& c = (*checkpoints)[nextCheckpoint++];
+                    for (size_t j = 0; j < count; j++) {
+                        size_t i = batchBegin + j;
+                        c.directionX[i] = batch.directionX[j];
+                        c.directionY[i] = batch.directionY[j];
+                        c.mediumIndex[i] = batch.mediumIndex[j];
+                        c.hitCount[i] = paths.entries[i].hitCount + t.newHits[firstRay + j];
+                        if (floatPoints) {
+                            c.originX[i] = batch.originX[j];
+                            c.originY[i] = batch.originY[j];
+                        }
+                    }
+                };
+
+                for (size_t s = firstSurface; s < lenses.size(); s++) {
+                    const SphereLens& l = lenses[s];
+                    size_t surfaceHits = intersectBatch(batch, l, 0, count);
+                    hits += surfaceHits;
+                    if (surfaceHits != 0) {
+                        for (size_t j = 0; j < count; j++) {
+                            if (!batch.hitMask[j])
+                                continue;
+                            t.hits.push_back(BlockHit{ firstRay + (uint32_t)j, (uint32_t)s, batch.originX[j], batch.originY[j] });
+                            t.newHits[firstRay + j]++;
+                        }
+                        totalInternalReflections += refractBatch(batch, l, 0, count);
+                    }
+                    saveCheckpoint(s + 1);
+                }
+                for (size_t j = 0; j < count; j++)
+                    paths.entries[batchBegin + j].direction = NodeWeft::Vec2{ batch.directionX[j], batch.directionY[j] };
+            }
+            size_t tests = (blockEnd - blockBegin) * (lenses.size() - firstSurface);
+            OPTICS_PROFILE_COUNT(SurfaceTests, tests);
+            OPTICS_PROFILE_COUNT(Hits, hits);
+            OPTICS_PROFILE_COUNT(Misses, tests - hits);
+            OPTICS_PROFILE_COUNT(TotalInternalReflections, totalInternalReflections);
+
+            // group the hits by ray, a counting sort keeps each ray's hits in surface order
+            size_t rays = blockEnd - blockBegin;
+            t.cursor.resize(rays);
+            size_t sum = 0;
+            for (size_t r = 0; r < rays; r++) {
+                t.cursor[r] = sum;
+                sum += t.newHits[r];
+            }
+            t.sorted.resize(t.hits.size());
+            for (const BlockHit& h : t.hits)
+                t.sorted[t.cursor[h.ray]++] = h;
+
+            // new span list of the block: the kept points of each ray, its origin before this trace, then the new hits
+            RayPaths::Block& block = paths.blocks[blockBegin / RayPaths::blockSize];
+            RayPaths::Block& spare = spares[worker];
+            size_t total = 0;
+            for (size_t r = 0; r < rays; r++)
+                total += paths.entries[blockBegin + r].hitCount + t.newHits[r];
+            spare.resize(total, paths.precision);
+            auto setPoint = [&](size_t index, double x, double y) {
+                if (floatPoints)
+                    spare.floatPoints[index] = RayPaths::FloatPoint{ (float)x, (float)y };
+                else
+                    spare.points[index] = NodeWeft::Vec2{ x, y };
+            };
+            size_t offset = 0;
+            const BlockHit* next = t.sorted.data();
+            for (size_t r = 0; r < rays; r++) {
+                RayPaths::Entry& e = paths.entries[blockBegin + r];
+                size_t kept = e.hitCount, added = t.newHits[r];
+                if (floatPoints)
+                    std::copy_n(block.floatPoints.begin() + e.firstPoint, kept, spare.floatPoints.begin() + offset);
+                else
+                    std::copy_n(block.points.begin() + e.firstPoint, kept, spare.points.begin() + offset);
+                std::copy_n(block.surfaces.begin() + e.firstPoint, kept, spare.surfaces.begin() + offset);
+                e.firstPoint = (uint32_t)offset;
+                offset += kept;
+                if (added > 0) {
+                    setPoint(offset, e.origin.x, e.origin.y);
+                    for (size_t m = 0; m < added; m++, next++) {
+                        spare.surfaces[offset + m] = next->surface;
+                        if (m + 1 < added)
+                            setPoint(offset + m + 1, next->x, next->y);
+                        else
+                            e.origin = NodeWeft::Vec2{ next->x, next->y };
+                    }
+                    offset += added;
+                }
+                e.hitCount = (uint32_t)(kept + added);
+            }
+            // the old list becomes this worker's spare for its next block
+            std::swap(block, spare);
+            if (progress && !progress(rays))
+                stopped = true;
+        });
+        return !stopped;
+    }
+
+} // namespace Optics
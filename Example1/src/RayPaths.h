@@ -0,0 +1,121 @@
+#pragma once
+#include "RayOptics.h"
+#include "SegmentList.h"
+#include <functional>
+
+namespace Optics {
+
+    struct TraceInput;
+
+    // Called by the workers of traceRayPaths after each block with its ray count, false stops the trace
+    using TraceProgressFunction = std::function<bool(size_t rays)>;
+
+    // Traced rays with their paths in one arena per trace, instead of a path and a hit vector per Ray
+    // Each ray owns a span of points in the block of the arena it belongs to: the path before its final origin.
+    // A hit is stored as the index of the surface it is on, its normal, distance and refractive indices follow
+    // from the lens list the paths were traced through. Final origins and directions always stay in double so the
+    // rays can be traced further, the path points before them can be stored in float when they are only drawn
+    class RayPaths {
+    public:
+        enum Precision {
+            DoublePoints = 0,
+            FloatPoints,
+        };
+        static constexpr size_t blockSize = 1024;               // rays per arena block, a block is traced and laid out at once
+        static constexpr uint32_t noSurface = 0xffffffffu;      // hits the input rays already had
+
+        // Start again from rays, their path points are kept as hits on noSurface
+        // Arena memory from an earlier trace is reused, so a new bake does not allocate once it has been warmed up
+        void assign(const SegmentList<Ray>& rays, int precision = DoublePoints);
+        // Same for the rays, arenas and states of a node input, the arenas' points are copied span by span
+        void assign(const TraceInput& input, int precision = DoublePoints);
+
+        // Drop all rays in one step, the arena memory is kept for the next assign
+        void clear();
+
+        size_t size() const { return entries.size(); }
+        bool empty() const { return entries.empty(); }
+        int getPrecision() const { return precision; }
+        const std::vector<SphereLens>& getLenses() const { return lenses; }
+
+        // Final origin, direction and hit count, the same as RayState(Ray) of the traced Ray
+        RayState state(size_t i) const;
+        size_t hitCount(size_t i) const { return entries[i].hitCount; }
+        // Path point k in [0, hitCount(i)], the last one is the final origin
+        NodeWeft::Vec2 point(size_t i, size_t k) const;
+        // Surface of path point k in [1, hitCount(i)], an index into getLenses() or noSurface
+        uint32_t surface(size_t i, size_t k) const { return blocks[i / blockSize].surfaces[entries[i].firstPoint + k - 1]; }
+
+        // The ray as traceRays gives it, with hits rebuilt from the lens list
+        // Hits of the input rays only keep their points
+        Ray ray(size_t i) const;
+        std::vector<Ray> toRays() const;
+
+        // Bytes allocated for the rays and the arena
+        size_t memoryBytes() const;
+
+        // Cut the rays back to a checkpoint saved by traceRayPaths
+        void restore(const TraceCheckpoint& checkpoint);
+
+    private:
+        friend class BakeCache;
+        friend bool traceRayPaths(RayPaths& paths, const std::vector<SphereLens>& lenses, const TraceCheckpoint* from,
+            int threadCount, size_t checkpointStride, std::vector<TraceCheckpoint>* checkpoints, const TraceProgressFunction& progress);
+
+        struct Entry {
+            NodeWeft::Vec2 origin;
+            NodeWeft::Vec2 direction;
+            double wavelength;
+            double intensity;
+            uint32_t firstPoint;        // offset of the span in its block
+            uint32_t hitCount;          // span length
+        };
+        struct FloatPoint {
+            float x, y;
+        };
+        // Spans of the rays of one block back to back, only the point list of the current precision is used
+        // surfaces[firstPoint + k] is the surface of path point k + 1
+        struct Block {
+            std::vector<NodeWeft::Vec2> points;
+            std::vector<FloatPoint> floatPoints;
+            std::vector<uint32_t> surfaces;
+
+            size_t size(int precision) const { return precision == FloatPoints ? floatPoints.size() : points.size(); }
+            void resize(size_t count, int precision);
+        };
+
+        int precision{ DoublePoints };
+        std::vector<Entry> entries;
+        std::vector<Block> blocks;      // blocks past the ray count only keep their memory
+        std::vector<SphereLens> lenses;
+    };
+
+    // Rays as a node hands them on to a further trace, in this order: rays with paths, arenas of upstream traces
+    // and path-free states, which start again from their last hit. Arenas are not expanded to Ray on the way
+    struct TraceInput {
+        SegmentList<Ray> rays;
+        std::vector<std::shared_ptr<const RayPaths>> paths;
+        SegmentList<RayState> states;
+
+        size_t size() const;
+        bool empty() const { return size() == 0; }
+
+        // Every ray as Ray, for the tracers that only take Ray; hits of the arenas are rebuilt from their lens lists
+        SegmentList<Ray> toRays() const;
+        // Every ray as its final state, for the path-free tracers
+        std::vector<RayState> toStates() const;
+        // About count rays spread over the input, each one restarted at its current origin
+        std::vector<Ray> sample(size_t count) const;
+    };
+
+    // traceRays for an arena: hits of each block are collected surface by surface in per-worker scratch memory,
+    // then laid out ray by ray in the block's span list, nothing is allocated per ray
+    // The result is the same as traceRays on paths.toRays(). Checkpoints work as for traceRays and
+    // also hold the ray origins when the points are stored in float
+    // Once progress returns false the blocks not started yet are skipped and false is returned, the rays and
+    // checkpoints are then partly traced and only good for assigning new rays
+    bool traceRayPaths(RayPaths& paths, const std::vector<SphereLens>& lenses, const TraceCheckpoint* from = nullptr,
+        int threadCount = 1, size_t checkpointStride = 0, std::vector<TraceCheckpoint>* checkpoints = nullptr,
+        const TraceProgressFunction& progress = nullptr);
+
+} // namespace Optics
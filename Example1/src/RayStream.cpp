@@ -0,0 +1,104 @@
+#include "RayStream.h"
+#include "OpticsProfiler.h"
+#include "TracePool.h"
+#include <algorithm>
+
+namespace Optics {
+
+    RayStream::RayStream(const SourceDescription& source)
+        : source(source), bins(sampleSpectrum(source))
+    {
+        rayCount = (size_t)(std::max)(source.rayCount, 0) * bins.size();
+    }
+
+    void RayStream::addStage(std::shared_ptr<const std::vector<SphereLens>> lenses)
+    {
+        if (lenses && !lenses->empty())
+            stages.push_back(std::move(lenses));
+    }
+
+    RayState RayStream::sourceState(size_t i) const
+    {
+        // bin-major like emitSpectralFan, the fan position within a bin is i % rayCount
+        const size_t fan = (size_t)source.rayCount;
+        const SpectralBin& bin = bins[i / fan];
+        size_t k = i % fan;
+        RayState state = source.sampleState(fan != 1 ? (double)k / (fan - 1) : 0.5);
+        state.wavelength = bin.wavelength;
+        state.intensity = bin.weight;
+        return state;
+    }
+
+    void RayStream::traceStages(std::vector<RayState>& states, int threadCount) const
+    {
+        for (auto& lenses : stages)
+            traceRayStates(states, *lenses, threadCount);
+    }
+
+    void RayStream::generate(size_t begin, size_t end, std::vector<RayState>& states, int threadCount) const
+    {
+        end = (std::min)(end, rayCount);
+        states.resize(end > begin ? end - begin : 0);
+        for (size_t i = 0; i < states.size(); i++)
+            states[i] = sourceState(begin + i);
+        traceStages(states, threadCount);
+    }
+
+    int RayStream::participantCount(int threadCount) const
+    {
+        return TracePool::instance().participantCount(rayCount, blockSize, threadCount);
+    }
+
+    void RayStream::forEachBlock(int threadCount, const BlockFunction& body) const
+    {
+        OPTICS_PROFILE_SCOPE("RayStream::forEachBlock", "trace");
+        TracePool& pool = TracePool::instance();
+        // one block buffer per worker, reused for all its blocks
+        std::vector<std::vector<RayState>> blocks(participantCount(threadCount));
+        pool.parallelFor(rayCount, blockSize, threadCount, [&](size_t begin, size_t end, int worker) {
+            std::vector<RayState>& states = blocks[worker];
+            generate(begin, end, states); // nested trace loops run inline on this worker
+            body(states, worker);
+        });
+    }
+
+    std::vector<RayState> RayStream::sample(size_t count, int threadCount) const
+    {
+        std::vector<RayState> states;
+        if (count == 0)
+            return states;
+        size_t stride = rayCount / count + 1;
+        states.reserve(rayCount / stride + 1);
+        for (size_t i = 0; i < rayCount; i += stride)
+            states.push_back(sourceState(i));
+        traceStages(states, threadCount);
+        return states;
+    }
+
+    std::vector<RayState> sampleStreams(const std::vector<RayStream>& streams, size_t count, int threadCount)
+    {
+        size_t total = 0;
+        for (auto& stream : streams)
+            total += stream.size();
+        std::vector<RayState> states;
+        for (auto& stream : streams) {
+            std::vector<RayState> part;
+            if (total <= count)
+                stream.generate(0, stream.size(), part, threadCount);
+            else
+                part = stream.sample((std::max)((size_t)1, (size_t)((double)count * stream.size() / total)), threadCount);
+            states.insert(states.end(), part.begin(), part.end());
+        }
+        return states;
+    }
+
+    bool generatesOnDemand(const SourceDescription& source)
+    {
+        if (source.sampling != SourceDescription::UniformSampling || source.storage == SourceDescription::StoredRays)
+            return false;
+        if (source.storage == SourceDescription::GeneratedRays)
+            return true;
+        return RayStream(source).size() > RayStream::autoRayThreshold;
+    }
+
+} // namespace Optics
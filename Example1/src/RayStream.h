@@ -0,0 +1,57 @@
+#pragma once
+#include "OpticsSource.h"
+#include <functional>
+#include <memory>
+
+namespace Optics {
+
+    // Rays of a uniformly sampled source that are generated when they are used instead of being stored
+    // Lens stacks added to the stream are traced in sequence, without paths, as the rays are generated.
+    // Consumers pull the rays in blocks, so memory grows with the block size and the thread count
+    // instead of the ray count, and a stream of any size is copied in O(number of stacks)
+    class RayStream {
+    public:
+        static constexpr size_t blockSize = 16384;                  // rays generated, traced and consumed together, 900 KB of states
+        static constexpr size_t autoRayThreshold = size_t(1) << 22; // SourceDescription::AutoStorage streams above this many rays
+
+        RayStream() = default;
+        explicit RayStream(const SourceDescription& source);
+
+        // Trace the rays through lenses after the stacks added before, nothing is traced until the rays are pulled
+        void addStage(std::shared_ptr<const std::vector<SphereLens>> lenses);
+
+        size_t size() const { return rayCount; }
+        bool empty() const { return rayCount == 0; }
+        size_t stageCount() const { return stages.size(); }
+        const SourceDescription& getSource() const { return source; }
+
+        // Rays [begin, end) in emission order, the same states generateSourceRays and traceRayStates give
+        void generate(size_t begin, size_t end, std::vector<RayState>& states, int threadCount = 1) const;
+
+        // body(states, worker) for every block, blocks run in parallel on the trace pool in no particular order
+        // and worker is in [0, participantCount(threadCount)) to index per-thread results
+        using BlockFunction = std::function<void(const std::vector<RayState>& states, int worker)>;
+        void forEachBlock(int threadCount, const BlockFunction& body) const;
+        int participantCount(int threadCount) const;
+
+        // Every stride-th ray, at most count of them, for drawing
+        std::vector<RayState> sample(size_t count, int threadCount = 1) const;
+
+    private:
+        RayState sourceState(size_t i) const;
+        void traceStages(std::vector<RayState>& states, int threadCount) const;
+
+        SourceDescription source;
+        std::vector<SpectralBin> bins;  // the fan is repeated once per bin
+        size_t rayCount{ 0 };
+        std::vector<std::shared_ptr<const std::vector<SphereLens>>> stages;
+    };
+
+    // About count rays spread over all streams, each stream's share in proportion to its size, for searches that
+    // trace the same rays many times. Streams with fewer rays than their share give all of them
+    std::vector<RayState> sampleStreams(const std::vector<RayStream>& streams, size_t count, int threadCount = 1);
+
+    // True when a source's rays are to be streamed rather than stored, adaptive sampling is always stored
+    bool generatesOnDemand(const SourceDescription& source);
+
+} // namespace Optics
@@ -0,0 +1,78 @@
+#pragma once
+#include <memory>
+#include <vector>
+
+namespace Optics {
+
+    // Persistent list made of immutable, reference-counted segments
+    // Appending creates one new segment that points back at the existing ones, so copies of a list
+    // and lists built on top of it share all their data instead of duplicating it
+    template<typename T>
+    class SegmentList {
+    public:
+        using Items = std::vector<T>;
+
+        size_t size() const { return tail ? tail->totalSize : 0; }
+        bool empty() const { return size() == 0; }
+        void clear() { tail.reset(); }
+
+        // Append a segment, O(1)
+        void append(std::shared_ptr<const Items> items)
+        {
+            if (!items || items->empty())
+                return;
+            size_t totalSize = size() + items->size();
+            tail = std::make_shared<const Segment>(Segment{ tail, std::move(items), totalSize });
+        }
+        void append(Items&& items) { append(std::make_shared<const Items>(std::move(items))); }
+
+        // Append all segments of another list, sharing their items
+        // O(1) when this list is empty, otherwise O(number of segments in other)
+        void append(const SegmentList& other)
+        {
+            if (empty()) {
+                tail = other.tail;
+                return;
+            }
+            for (auto& items : other.segments())
+                append(items);
+        }
+
+        // Segments from first to last
+        std::vector<std::shared_ptr<const Items>> segments() const
+        {
+            std::vector<std::shared_ptr<const Items>> result;
+            for (const Segment* s = tail.get(); s; s = s->previous.get())
+                result.push_back(s->items);
+            return std::vector<std::shared_ptr<const Items>>(result.rbegin(), result.rend());
+        }
+
+        // Visit every item in order
+        template<typename Function>
+        void forEach(Function f) const
+        {
+            for (auto& items : segments())
+                for (auto& item : *items)
+                    f(item);
+        }
+
+        // Copy all items into one vector
+        Items flatten() const
+        {
+            Items result;
+            result.reserve(size());
+            for (auto& items : segments())
+                result.insert(result.end(), items->begin(), items->end());
+            return result;
+        }
+
+    private:
+        struct Segment {
+            std::shared_ptr<const Segment> previous;
+            std::shared_ptr<const Items> items;
+            size_t totalSize;
+        };
+        std::shared_ptr<const Segment> tail;
+    };
+
+} // namespace Optics
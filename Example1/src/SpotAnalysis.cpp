@@ -0,0 +1,166 @@
+#include "SpotAnalysis.h"
+#include "OpticsProfiler.h"
+#include "TracePool.h"
+#include <cmath>
+
+namespace Optics {
+
+    void SpotMoments::add(double height, double slope, double w)
+    {
+        if (w <= 0)
+            return;
+        weight += w;
+        double dHeight = height - meanHeight;
+        double dSlope = slope - meanSlope;
+        meanHeight += dHeight * w / weight;
+        meanSlope += dSlope * w / weight;
+        heightHeight += w * dHeight * (height - meanHeight);
+        heightSlope += w * dHeight * (slope - meanSlope);
+        slopeSlope += w * dSlope * (slope - meanSlope);
+    }
+
+    void SpotMoments::merge(const SpotMoments& m)
+    {
+        if (m.weight <= 0)
+            return;
+        if (weight <= 0) {
+            *this = m;
+            return;
+        }
+        double total = weight + m.weight;
+        double dHeight = m.meanHeight - meanHeight;
+        double dSlope = m.meanSlope - meanSlope;
+        double f = weight * m.weight / total;
+        heightHeight += m.heightHeight + dHeight * dHeight * f;
+        heightSlope += m.heightSlope + dHeight * dSlope * f;
+        slopeSlope += m.slopeSlope + dSlope * dSlope * f;
+        meanHeight += dHeight * m.weight / total;
+        meanSlope += dSlope * m.weight / total;
+        weight = total;
+    }
+
+    double SpotMoments::rmsRadius(double dx) const
+    {
+        if (weight <= 0)
+            return 0;
+        double variance = (heightHeight + 2 * dx * heightSlope + dx * dx * slopeSlope) / weight;
+        return std::sqrt((std::max)(variance, 0.0));
+    }
+
+    double SpotMoments::bestFocusOffset() const
+    {
+        // the spot variance is a parabola in dx with its minimum at -cov(height, slope) / var(slope)
+        return slopeSlope > 0 ? -heightSlope / slopeSlope : 0;
+    }
+
+    void SpotAnalyzer::Partial::add(const RayState& r, double planeX)
+    {
+        if (r.hitCount == 0 || r.direction.x <= 0 || r.intensity <= 0) {
+            skipped++;
+            return;
+        }
+        if (!last || lastWavelength != r.wavelength) {
+            last = &wavelengths[r.wavelength];
+            lastWavelength = r.wavelength;
+        }
+        double slope = r.direction.y / r.direction.x;
+        last->moments.add(r.origin.y + slope * (planeX - r.origin.x), slope, r.intensity);
+        last->rays++;
+    }
+
+    void SpotAnalyzer::Partial::merge(const Partial& p)
+    {
+        for (auto& w : p.wavelengths) {
+            Bucket& b = wavelengths[w.first];
+            b.moments.merge(w.second.moments);
+            b.rays += w.second.rays;
+        }
+        skipped += p.skipped;
+        last = nullptr;
+    }
+
+    namespace {
+
+        RayState stateOf(const std::vector<RayState>& states, size_t i) { return states[i]; }
+        RayState stateOf(const std::vector<Ray>& rays, size_t i) { return RayState(rays[i]); }
+        RayState stateOf(const RayPaths& paths, size_t i) { return paths.state(i); }
+
+    } // namespace
+
+    template<typename Items>
+    void SpotAnalyzer::addItems(const Items& items, int threadCount)
+    {
+        OPTICS_PROFILE_SCOPE("SpotAnalyzer::add", "analysis");
+        TracePool& pool = TracePool::instance();
+        const size_t chunkSize = 4096;
+        std::vector<Partial> partials(pool.participantCount(items.size(), chunkSize, threadCount));
+        pool.parallelFor(items.size(), chunkSize, threadCount, [&](size_t begin, size_t end, int worker) {
+            Partial& partial = partials[worker];
+            for (size_t i = begin; i < end; i++)
+                partial.add(stateOf(items, i), planeX);
+        });
+        // merge in worker order so the result does not depend on scheduling more than rounding
+        for (auto& p : partials)
+            merged.merge(p);
+    }
+
+    void SpotAnalyzer::add(const std::vector<RayState>& states, int threadCount)
+    {
+        addItems(states, threadCount);
+    }
+
+    void SpotAnalyzer::add(const std::vector<Ray>& rays, int threadCount)
+    {
+        addItems(rays, threadCount);
+    }
+
+    void SpotAnalyzer::add(const RayPaths& paths, int threadCount)
+    {
+        addItems(paths, threadCount);
+    }
+
+    void SpotAnalyzer::add(const RayStream& stream, int threadCount)
+    {
+        OPTICS_PROFILE_SCOPE("SpotAnalyzer::add", "analysis");
+        std::vector<Partial> partials(stream.participantCount(threadCount));
+        stream.forEachBlock(threadCount, [&](const std::vector<RayState>& states, int worker) {
+            Partial& partial = partials[worker];
+            for (const RayState& s : states)
+                partial.add(s, planeX);
+        });
+        for (auto& p : partials)
+            merged.merge(p);
+    }
+
+    SpotAnalysis SpotAnalyzer::result() const
+    {
+        SpotAnalysis analysis;
+        analysis.planeX = planeX;
+        analysis.skippedRays = merged.skipped;
+
+        auto toResult = [&](double wavelength, const SpotMoments& m, size_t rays) {
+            SpotResult r;
+            r.wavelength = wavelength;
+            r.rays = rays;
+            r.weight = m.weight;
+            r.centroid = m.centroid(0);
+            r.rmsRadius = m.rmsRadius(0);
+            r.bestFocus = planeX + m.bestFocusOffset();
+            r.bestFocusRms = m.rmsRadius(m.bestFocusOffset());
+            return r;
+        };
+
+        SpotMoments total;
+        size_t totalRays = 0;
+        for (auto& w : merged.wavelengths) {
+            analysis.wavelengths.push_back(toResult(w.first, w.second.moments, w.second.rays));
+            total.merge(w.second.moments);
+            totalRays += w.second.rays;
+        }
+        analysis.total = toResult(0, total, totalRays);
+        if (analysis.wavelengths.size() > 1)
+            analysis.longitudinalChromatic = analysis.wavelengths.back().bestFocus - analysis.wavelengths.front().bestFocus;
+        return analysis;
+    }
+
+} // namespace Optics
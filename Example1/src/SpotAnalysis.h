@@ -0,0 +1,81 @@
+#pragma once
+#include "RayOptics.h"
+#include "RayPaths.h"
+#include "RayStream.h"
+#include <map>
+
+namespace Optics {
+
+    // Weighted mean and co-moments of ray height and slope at a reference plane
+    // Partial moments of different rays merge exactly, so rays can be reduced in any grouping
+    // and the RMS spot at any other plane follows from the same five numbers
+    struct SpotMoments {
+        double weight{ 0 };
+        double meanHeight{ 0 }, meanSlope{ 0 };
+        double heightHeight{ 0 }, heightSlope{ 0 }, slopeSlope{ 0 };   // weighted sums of products of deviations
+
+        void add(double height, double slope, double w);
+        void merge(const SpotMoments& m);
+
+        // Centroid height and RMS spot radius at offset dx from the reference plane
+        double centroid(double dx) const { return meanHeight + meanSlope * dx; }
+        double rmsRadius(double dx) const;
+
+        // Offset of the plane with the smallest RMS spot, 0 for a collimated beam
+        double bestFocusOffset() const;
+    };
+
+    struct SpotResult {
+        double wavelength{ 0 };     // 0 for the result over all wavelengths
+        size_t rays{ 0 };
+        double weight{ 0 };
+        double centroid{ 0 };       // at the analysis plane
+        double rmsRadius{ 0 };      // at the analysis plane
+        double bestFocus{ 0 };      // x of the plane with the smallest RMS spot
+        double bestFocusRms{ 0 };
+    };
+
+    struct SpotAnalysis {
+        double planeX{ 0 };
+        SpotResult total;
+        std::vector<SpotResult> wavelengths;    // by increasing wavelength
+        double longitudinalChromatic{ 0 };      // best focus of the longest minus the shortest wavelength
+        size_t skippedRays{ 0 };                // rays that hit no surface or do not travel towards +x
+    };
+
+    // Streaming spot diagram: ray final states are reduced into per-wavelength moments as they are added,
+    // in parallel with one partial result per worker, and no per-ray data is kept
+    class SpotAnalyzer {
+    public:
+        explicit SpotAnalyzer(double planeX) : planeX(planeX) {}
+
+        void add(const std::vector<RayState>& states, int threadCount = 1);
+        void add(const std::vector<Ray>& rays, int threadCount = 1);
+        void add(const RayPaths& paths, int threadCount = 1);
+        // Pulled block by block, the stream's rays are never stored
+        void add(const RayStream& stream, int threadCount = 1);
+
+        SpotAnalysis result() const;
+
+    private:
+        struct Bucket {
+            SpotMoments moments;
+            size_t rays{ 0 };
+        };
+        struct Partial {
+            std::map<double, Bucket> wavelengths;
+            size_t skipped{ 0 };
+            Bucket* last{ nullptr };        // rays mostly come in runs of one wavelength
+            double lastWavelength{ 0 };
+
+            void add(const RayState& r, double planeX);
+            void merge(const Partial& p);
+        };
+        template<typename Items>
+        void addItems(const Items& items, int threadCount);
+
+        double planeX;
+        Partial merged;
+    };
+
+} // namespace Optics
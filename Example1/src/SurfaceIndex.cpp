@@ -0,0 +1,219 @@
+#include "SurfaceIndex.h"
+#include "OpticsProfiler.h"
+#include "TracePool.h"
+#include <algorithm>
+#include <cmath>
+
+namespace Optics {
+
+    namespace {
+
+        constexpr uint32_t leafSize = 4;
+
+    } // namespace
+
+    SurfaceIndex::Box SurfaceIndex::surfaceBox(const SphereLens& l)
+    {
+        // the surface is the half circle between its vertex (center) and its circle center
+        double circleX = l.center.x + l.radius;
+        double r = std::abs(l.radius);
+        // small padding so rounding in the box test never rejects a real hit
+        double pad = 1e-9 * (r + std::abs(l.center.x) + std::abs(l.center.y)) + 1e-9;
+        return Box{ (std::min)(l.center.x, circleX) - pad, l.center.y - r - pad,
+                    (std::max)(l.center.x, circleX) + pad, l.center.y + r + pad };
+    }
+
+    void SurfaceIndex::buildNode(uint32_t node, uint32_t begin, uint32_t end)
+    {
+        if (end - begin <= leafSize) {
+            nodes[node].first = begin;
+            nodes[node].count = end - begin;
+            return;
+        }
+
+        // median split along the longer axis of the box centres
+        double minX = 1e300, minY = 1e300, maxX = -1e300, maxY = -1e300;
+        for (uint32_t i = begin; i < end; i++) {
+            const Box& b = boxes[primitives[i]];
+            double cx = (b.minX + b.maxX) * 0.5, cy = (b.minY + b.maxY) * 0.5;
+            minX = (std::min)(minX, cx); maxX = (std::max)(maxX, cx);
+            minY = (std::min)(minY, cy); maxY = (std::max)(maxY, cy);
+        }
+        bool splitX = maxX - minX >= maxY - minY;
+        uint32_t mid = begin + (end - begin) / 2;
+        std::nth_element(primitives.begin() + begin, primitives.begin() + mid, primitives.begin() + end, [&](uint32_t a, uint32_t b) {
+            const Box& ba = boxes[a];
+            const Box& bb = boxes[b];
+            return splitX ? ba.minX + ba.maxX < bb.minX + bb.maxX : ba.minY + ba.maxY < bb.minY + bb.maxY;
+        });
+
+        // children are stored next to each other, left first
+        uint32_t left = (uint32_t)nodes.size();
+        nodes.push_back(BVHNode{});
+        nodes.push_back(BVHNode{});
+        nodes[node].first = left;
+        nodes[node].count = 0;
+        buildNode(left, begin, mid);
+        buildNode(left + 1, mid, end);
+    }
+
+    void SurfaceIndex::refitNode(uint32_t node)
+    {
+        BVHNode& n = nodes[node];
+        Box box{ 1e300, 1e300, -1e300, -1e300 };
+        auto grow = [&](const Box& b) {
+            box.minX = (std::min)(box.minX, b.minX);
+            box.minY = (std::min)(box.minY, b.minY);
+            box.maxX = (std::max)(box.maxX, b.maxX);
+            box.maxY = (std::max)(box.maxY, b.maxY);
+        };
+        if (n.count > 0) {
+            for (uint32_t i = n.first; i < n.first + n.count; i++)
+                grow(boxes[primitives[i]]);
+        }
+        else {
+            refitNode(n.first);
+            refitNode(n.first + 1);
+            grow(nodes[n.first].box);
+            grow(nodes[n.first + 1].box);
+        }
+        nodes[node].box = box;
+    }
+
+    void SurfaceIndex::update(const std::vector<SphereLens>& lenses)
+    {
+        bool sameCount = lenses.size() == indexedLenses.size();
+        if (sameCount && std::equal(lenses.begin(), lenses.end(), indexedLenses.begin(), sameLens))
+            return;
+
+        indexedLenses = lenses;
+        boxes.resize(lenses.size());
+        for (size_t i = 0; i < lenses.size(); i++)
+            boxes[i] = surfaceBox(lenses[i]);
+
+        if (sameCount && !nodes.empty()) {
+            // same surfaces, moved or reshaped: keep the tree and recompute the boxes
+            refitNode(0);
+            return;
+        }
+
+        nodes.clear();
+        primitives.resize(lenses.size());
+        for (uint32_t i = 0; i < (uint32_t)lenses.size(); i++)
+            primitives[i] = i;
+        if (!lenses.empty()) {
+            nodes.reserve(lenses.size() * 2);
+            nodes.push_back(BVHNode{});
+            buildNode(0, 0, (uint32_t)lenses.size());
+            refitNode(0);
+        }
+    }
+
+    void SurfaceIndex::query(const NodeWeft::Vec2& origin, const NodeWeft::Vec2& direction, size_t firstSurface, std::vector<uint32_t>& result) const
+    {
+        result.clear();
+        if (nodes.empty())
+            return;
+
+        double invX = 1.0 / direction.x, invY = 1.0 / direction.y;
+        auto hitBox = [&](const Box& b) {
+            // slab test against the half-line t >= 0, a zero direction component gives +-inf
+            double tx1 = (b.minX - origin.x) * invX, tx2 = (b.maxX - origin.x) * invX;
+            double ty1 = (b.minY - origin.y) * invY, ty2 = (b.maxY - origin.y) * invY;
+            if (direction.x == 0) {
+                if (origin.x < b.minX || origin.x > b.maxX)
+                    return false;
+                tx1 = -1e300;
+                tx2 = 1e300;
+            }
+            if (direction.y == 0) {
+                if (origin.y < b.minY || origin.y > b.maxY)
+                    return false;
+                ty1 = -1e300;
+                ty2 = 1e300;
+            }
+            double tNear = (std::max)((std::min)(tx1, tx2), (std::min)(ty1, ty2));
+            double tFar = (std::min)((std::max)(tx1, tx2), (std::max)(ty1, ty2));
+            return tFar >= (std::max)(tNear, 0.0);
+        };
+
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const BVHNode& n = nodes[stack[--top]];
+            if (!hitBox(n.box))
+                continue;
+            if (n.count > 0) {
+                for (uint32_t i = n.first; i < n.first + n.count; i++) {
+                    uint32_t surface = primitives[i];
+                    if (surface >= firstSurface && hitBox(boxes[surface]))
+                        result.push_back(surface);
+                }
+            }
+            else {
+                stack[top++] = n.first;
+                stack[top++] = n.first + 1;
+            }
+        }
+        std::sort(result.begin(), result.end());
+    }
+
+    double SurfaceIndex::averageCandidates(const std::vector<Ray>& rays, size_t sampleCount) const
+    {
+        if (rays.empty() || sampleCount == 0)
+            return 0;
+        std::vector<uint32_t> candidates;
+        size_t stride = (std::max)((size_t)1, rays.size() / sampleCount);
+        size_t samples = 0, total = 0;
+        for (size_t i = 0; i < rays.size(); i += stride, samples++) {
+            query(rays[i].getOrigin(), rays[i].direction, 0, candidates);
+            total += candidates.size();
+        }
+        return (double)total / samples;
+    }
+
+    void traceRaysIndexed(std::vector<Ray>& rays, const LensSystem& system, const SurfaceIndex& index, int threadCount)
+    {
+        OPTICS_PROFILE_SCOPE("traceRaysIndexed", "trace");
+        OPTICS_PROFILE_COUNT(RaysTraced, rays.size());
+        TracePool& pool = TracePool::instance();
+        const size_t chunkSize = 256;
+        std::vector<std::vector<uint32_t>> candidateLists(pool.participantCount(rays.size(), chunkSize, threadCount));
+
+        pool.parallelFor(rays.size(), chunkSize, threadCount, [&](size_t begin, size_t end, int worker) {
+            std::vector<uint32_t>& candidates = candidateLists[worker];
+            size_t tests = 0, hits = 0, totalInternalReflections = 0;
+            for (size_t i = begin; i < end; i++) {
+                Ray& r = rays[i];
+                double refractiveIndexBefore = 1.0; // assume air
+                size_t nextSurface = 0;
+                // surfaces a ray misses leave it unchanged, so skipping the ones outside
+                // its candidate list gives the same result as visiting every surface in order
+                while (nextSurface < system.size()) {
+                    index.query(r.getOrigin(), r.direction, nextSurface, candidates);
+                    bool hit = false;
+                    for (uint32_t s : candidates) {
+                        const CompiledSurface& l = system[s];
+                        tests++;
+                        if (!intersectAndUpdateRay(r, l, refractiveIndexBefore))
+                            continue;
+                        hits++;
+                        totalInternalReflections += !refractRay(r, l);
+                        refractiveIndexBefore = l.isEntrance ? l.refractiveIndexAt(r.wavelength) : 1.0;
+                        nextSurface = s + 1;
+                        hit = true;
+                        break;
+                    }
+                    if (!hit)
+                        break;
+                }
+            }
+            OPTICS_PROFILE_COUNT(SurfaceTests, tests);
+            OPTICS_PROFILE_COUNT(Hits, hits);
+            OPTICS_PROFILE_COUNT(Misses, tests - hits);
+            OPTICS_PROFILE_COUNT(TotalInternalReflections, totalInternalReflections);
+        });
+    }
+
+} // namespace Optics
@@ -0,0 +1,47 @@
+#pragma once
+#include "LensSystem.h"
+
+namespace Optics {
+
+    // Bounding volume hierarchy over lens surfaces
+    // Each surface is boxed by the half circle it occupies, so a ray only needs to be tested
+    // against the surfaces whose box its half-line crosses
+    class SurfaceIndex {
+    public:
+        // Rebuild when the surface count changes, refit the boxes when only parameters changed,
+        // do nothing when the lenses are unchanged
+        void update(const std::vector<SphereLens>& lenses);
+
+        // Indices (ascending) of surfaces >= firstSurface whose box the half-line origin + t*direction crosses
+        void query(const NodeWeft::Vec2& origin, const NodeWeft::Vec2& direction, size_t firstSurface, std::vector<uint32_t>& result) const;
+
+        // Average number of candidate surfaces for the initial segments of a sample of rays
+        double averageCandidates(const std::vector<Ray>& rays, size_t sampleCount) const;
+
+        size_t surfaceCount() const { return boxes.size(); }
+
+    private:
+        struct Box {
+            double minX, minY, maxX, maxY;
+        };
+        struct BVHNode {
+            Box box;
+            uint32_t first;     // first primitive (leaf) or left child (inner)
+            uint32_t count;     // primitive count, 0 for inner nodes (right child is first + 1)
+        };
+
+        static Box surfaceBox(const SphereLens& l);
+        void buildNode(uint32_t node, uint32_t begin, uint32_t end);
+        void refitNode(uint32_t node);
+
+        std::vector<SphereLens> indexedLenses;
+        std::vector<Box> boxes;             // per surface
+        std::vector<uint32_t> primitives;   // surface indices in leaf order
+        std::vector<BVHNode> nodes;
+    };
+
+    // Same result as traceRays, but each ray only visits the surfaces the index reports for it
+    // index must be up to date with system.getLenses()
+    void traceRaysIndexed(std::vector<Ray>& rays, const LensSystem& system, const SurfaceIndex& index, int threadCount = 1);
+
+} // namespace Optics
@@ -0,0 +1,217 @@
+#include "SurfaceKernels.h"
+#include <algorithm>
+#include <cmath>
+
+namespace Optics {
+
+    bool FlatShape::intersect(double ox, double oy, double dx, double dy, double& t, double& nx, double& ny) const
+    {
+        t = (vertexX - ox) / dx;
+        if (!(t > 0.0001) || !std::isfinite(t))
+            return false;
+        double h = oy + dy * t - vertexY;
+        if (semiAperture > 0 && std::abs(h) > semiAperture)
+            return false;
+        nx = -1;
+        ny = 0;
+        return true;
+    }
+
+    bool ConicShape::intersect(double ox, double oy, double dx, double dy, double& t, double& nx, double& ny) const
+    {
+        // c (h^2 + (1 + k) z^2) - 2 z = 0 along the ray, z and h relative to the vertex
+        const double c = curvature, q = conic;
+        double z = ox - vertexX, h = oy - vertexY;
+        double a = c * (dy * dy + q * dx * dx);
+        double b = 2.0 * (c * (h * dy + q * z * dx) - dx);
+        double k = c * (h * h + q * z * z) - 2.0 * z;
+        double t1, t2;
+        if (std::abs(a) <= 1e-12 * std::abs(b))
+            t1 = t2 = -k / b; // flat, or a ray parallel to a parabola's axis
+        else {
+            double discriminant = b * b - 4.0 * a * k;
+            if (discriminant < 0)
+                return false;
+            // stable form of the two roots
+            double s = -0.5 * (b + std::copysign(std::sqrt(discriminant), b));
+            double r1 = s / a, r2 = k / s;
+            t1 = (std::min)(r1, r2);
+            t2 = (std::max)(r1, r2);
+        }
+        auto accept = [&](double candidate) {
+            double hz = z + dx * candidate, hh = h + dy * candidate;
+            if (!(candidate > 0.0001) || !(1.0 - c * q * hz > 0))
+                return false;
+            if (semiAperture > 0 && std::abs(hh) > semiAperture)
+                return false;
+            double gx = c * q * hz - 1.0, gy = c * hh;
+            double length = std::sqrt(gx * gx + gy * gy);
+            t = candidate;
+            nx = gx / length;
+            ny = gy / length;
+            return true;
+        };
+        return accept(t1) || accept(t2);
+    }
+
+    double ConicShape::sag(double h, double& slope) const
+    {
+        double root = std::sqrt(1.0 - conic * curvature * curvature * h * h); // NaN outside the conic
+        slope = curvature * h / root;
+        return curvature * h * h / (1.0 + root);
+    }
+
+    double AsphereShape::sag(double h, double& slope) const
+    {
+        double h2 = h * h;
+        double z = base.sag(h, slope);
+        slope += h * h2 * (4.0 * a4 + h2 * (6.0 * a6 + h2 * 8.0 * a8));
+        return z + h2 * h2 * (a4 + h2 * (a6 + h2 * a8));
+    }
+
+    SurfaceShape surfaceShape(const SphereLens& surface)
+    {
+        ConicShape conic{ surface.center.x, surface.center.y, 1.0 / surface.radius, 1.0 + surface.conicConstant, surface.semiAperture };
+        switch (surface.surfaceType) {
+        case SphereLens::FlatSurface:
+            return FlatShape{ surface.center.x, surface.center.y, surface.semiAperture };
+        case SphereLens::AsphericSurface:
+            return AsphereShape{ conic, surface.asphericCoefficients[0], surface.asphericCoefficients[1], surface.asphericCoefficients[2] };
+        case SphereLens::SphericalSurface:
+            conic.conic = 1.0;
+            conic.semiAperture = 0;
+            return conic;
+        default:
+            return conic;
+        }
+    }
+
+    double surfaceSag(const SphereLens& surface, double h, double& slope)
+    {
+        SurfaceShape shape = surfaceShape(surface);
+        if (const ConicShape* conic = std::get_if<ConicShape>(&shape))
+            return conic->sag(h, slope);
+        if (const AsphereShape* asphere = std::get_if<AsphereShape>(&shape))
+            return asphere->sag(h, slope);
+        slope = 0;
+        return 0;
+    }
+
+    NodeWeft::Vec2 surfaceNormal(const SphereLens& surface, const NodeWeft::Vec2& point)
+    {
+        if (surface.surfaceType == SphereLens::SphericalSurface) {
+            // from the centre of curvature, turned to face -x for concave surfaces like intersectBatch does
+            NodeWeft::Vec2 normal = NodeWeft::normalize(point - NodeWeft::Vec2{ surface.center.x + surface.radius, surface.center.y });
+            return surface.radius > 0 ? normal : -normal;
+        }
+        double slope;
+        surfaceSag(surface, point.y - surface.center.y, slope);
+        double length = std::sqrt(1.0 + slope * slope);
+        return NodeWeft::Vec2{ -1.0 / length, slope / length };
+    }
+
+    namespace {
+
+        void storeHit(RayBatch& batch, size_t i, double t, double nx, double ny)
+        {
+            batch.originX[i] += batch.directionX[i] * t;
+            batch.originY[i] += batch.directionY[i] * t;
+            batch.hitDistance[i] = t;
+            batch.normalX[i] = nx;
+            batch.normalY[i] = ny;
+        }
+
+        // Shapes with an analytic hit, one ray at a time
+        template<typename Shape>
+        size_t intersectKernel(RayBatch& batch, const Shape& shape, size_t begin, size_t end)
+        {
+            size_t hitCount = 0;
+            for (size_t i = begin; i < end; i++) {
+                double t, nx, ny;
+                bool hit = shape.intersect(batch.originX[i], batch.originY[i], batch.directionX[i], batch.directionY[i], t, nx, ny);
+                batch.hitMask[i] = hit;
+                if (!hit)
+                    continue;
+                storeHit(batch, i, t, nx, ny);
+                hitCount++;
+            }
+            return hitCount;
+        }
+
+        // Aspheres: every ray starts at its hit on the base conic, or on the vertex plane where it misses the conic,
+        // then Newton steps on z(t) - sag(h(t)) are applied pass by pass to the rays that have not converged yet
+        size_t intersectKernel(RayBatch& batch, const AsphereShape& shape, size_t begin, size_t end)
+        {
+            const ConicShape& base = shape.base;
+            for (size_t i = begin; i < end; i++) {
+                double ox = batch.originX[i], oy = batch.originY[i], dx = batch.directionX[i], dy = batch.directionY[i];
+                double t, nx, ny;
+                if (!base.intersect(ox, oy, dx, dy, t, nx, ny))
+                    t = (base.vertexX - ox) / dx;
+                batch.hitDistance[i] = t;
+                batch.hitMask[i] = std::isfinite(t) ? 1 : 0; // 1 = iterating, 2 = converged
+            }
+
+            const double tolerance = 1e-12;
+            size_t iterating = 1;
+            for (int iteration = 0; iteration < AsphereShape::maxIterations && iterating > 0; iteration++) {
+                iterating = 0;
+                for (size_t i = begin; i < end; i++) {
+                    if (batch.hitMask[i] != 1)
+                        continue;
+                    double dx = batch.directionX[i], dy = batch.directionY[i];
+                    double t = batch.hitDistance[i];
+                    double slope;
+                    double z = batch.originX[i] + dx * t - base.vertexX;
+                    double f = z - shape.sag(batch.originY[i] + dy * t - base.vertexY, slope);
+                    double step = f / (dx - slope * dy);
+                    t -= step;
+                    batch.hitDistance[i] = t;
+                    if (std::abs(step) > tolerance * (1.0 + std::abs(t)))
+                        iterating++;
+                    else
+                        batch.hitMask[i] = 2; // also NaN steps, rejected below
+                }
+            }
+
+            size_t hitCount = 0;
+            for (size_t i = begin; i < end; i++) {
+                double t = batch.hitDistance[i];
+                double h = batch.originY[i] + batch.directionY[i] * t - base.vertexY;
+                double slope;
+                double z = batch.originX[i] + batch.directionX[i] * t - base.vertexX;
+                double residual = z - shape.sag(h, slope);
+                bool hit = batch.hitMask[i] == 2 && t > 0.0001 && std::abs(residual) <= 1e-9 * (1.0 + std::abs(z))
+                    && (base.semiAperture <= 0 || std::abs(h) <= base.semiAperture);
+                batch.hitMask[i] = hit;
+                if (!hit)
+                    continue;
+                double length = std::sqrt(1.0 + slope * slope);
+                storeHit(batch, i, t, -1.0 / length, slope / length);
+                hitCount++;
+            }
+            return hitCount;
+        }
+
+    } // namespace
+
+    size_t intersectShapeBatch(RayBatch& batch, const SphereLens& surface, size_t begin, size_t end)
+    {
+        return std::visit([&](const auto& shape) { return intersectKernel(batch, shape, begin, end); }, surfaceShape(surface));
+    }
+
+    size_t reflectBatch(RayBatch& batch, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++) {
+            if (!batch.hitMask[i])
+                continue;
+            double dx = batch.directionX[i], dy = batch.directionY[i];
+            double nx = batch.normalX[i], ny = batch.normalY[i];
+            double k = 2.0 * (dx * nx + dy * ny);
+            batch.directionX[i] = dx - nx * k;
+            batch.directionY[i] = dy - ny * k;
+        }
+        return 0;
+    }
+
+} // namespace Optics
@@ -0,0 +1,57 @@
+#pragma once
+#include "RayOptics.h"
+#include <variant>
+
+namespace Optics {
+
+    // Shapes of the non-spherical surface types, in coordinates relative to the vertex
+    // Each gives the nearest valid hit of one ray, the batch kernels are instantiated once per shape
+    // so the per-ray loop has no branches on the surface type
+
+    // Plane through the vertex, normal along -x
+    struct FlatShape {
+        double vertexX, vertexY;
+        double semiAperture;        // 0 = unlimited
+
+        bool intersect(double ox, double oy, double dx, double dy, double& t, double& nx, double& ny) const;
+    };
+
+    // Conic of revolution c (h^2 + (1 + k) z^2) = 2 z, solved analytically
+    // Only the branch through the vertex is hit, where 1 - c (1 + k) z > 0 (for a sphere, the hemisphere facing -x)
+    struct ConicShape {
+        double vertexX, vertexY;
+        double curvature;           // 1 / radius
+        double conic;               // 1 + k
+        double semiAperture;
+
+        bool intersect(double ox, double oy, double dx, double dy, double& t, double& nx, double& ny) const;
+        double sag(double h, double& slope) const;  // slope = dz/dh, NaN outside the conic
+    };
+
+    // Conic plus even polynomial terms, intersected by Newton iteration from the conic (or vertex plane) hit
+    struct AsphereShape {
+        ConicShape base;
+        double a4, a6, a8;
+        static constexpr int maxIterations = 16;
+
+        double sag(double h, double& slope) const;
+    };
+
+    using SurfaceShape = std::variant<FlatShape, ConicShape, AsphereShape>;
+
+    // Shape of a non-spherical surface, spheres are traced by intersectBatch's own kernels
+    SurfaceShape surfaceShape(const SphereLens& surface);
+
+    // Sag and slope of any surface type at height h from the vertex, NaN where the surface does not exist
+    double surfaceSag(const SphereLens& surface, double h, double& slope);
+
+    // Normal at a point on any surface type, the one intersectBatch reports for a hit there
+    NodeWeft::Vec2 surfaceNormal(const SphereLens& surface, const NodeWeft::Vec2& point);
+
+    // intersectBatch for non-spherical surfaces, one kernel per shape chosen once per call
+    size_t intersectShapeBatch(RayBatch& batch, const SphereLens& surface, size_t begin, size_t end);
+
+    // refractBatch for mirrors: entries flagged by intersectBatch are reflected about their normal
+    size_t reflectBatch(RayBatch& batch, size_t begin, size_t end);
+
+} // namespace Optics
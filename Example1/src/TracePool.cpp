@@ -0,0 +1,149 @@
+#include "TracePool.h"
+#include "OpticsProfiler.h"
+#include <algorithm>
+
+namespace Optics {
+
+    namespace {
+        thread_local bool insidePoolJob = false;
+    }
+
+    TracePool& TracePool::instance()
+    {
+        static TracePool pool;
+        return pool;
+    }
+
+    int TracePool::resolveThreadCount(int requested)
+    {
+        int hardwareThreads = (std::max)(1, (int)std::thread::hardware_concurrency());
+        return requested <= 0 ? hardwareThreads : requested;
+    }
+
+    TracePool::TracePool()
+    {
+        // the calling thread always participates, so one worker less than the core count
+        int workerCount = resolveThreadCount(0) - 1;
+        ranges.reset(new ChunkRange[workerCount + 1]);
+        for (int i = 0; i < workerCount; i++)
+            workers.emplace_back(&TracePool::workerLoop, this, i);
+    }
+
+    TracePool::~TracePool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            stopFlag = true;
+        }
+        wakeCondition.notify_all();
+        for (auto& t : workers)
+            t.join();
+    }
+
+    int TracePool::participantCount(size_t count, size_t chunkSize, int threadCount) const
+    {
+        size_t chunkCount = (count + chunkSize - 1) / chunkSize;
+        size_t threads = (std::min)((size_t)resolveThreadCount(threadCount), workers.size() + 1);
+        return (int)(std::max)((size_t)1, (std::min)(threads, chunkCount));
+    }
+
+    void TracePool::parallelFor(size_t count, size_t chunkSize, int threadCount, const ChunkFunction& body)
+    {
+        if (count == 0)
+            return;
+        chunkSize = (std::max)((size_t)1, chunkSize);
+        int participants = participantCount(count, chunkSize, threadCount);
+
+        // run inline for tiny loops and for loops issued from inside a job
+        if (participants == 1 || insidePoolJob) {
+            for (size_t begin = 0; begin < count; begin += chunkSize)
+                body(begin, (std::min)(begin + chunkSize, count), 0);
+            return;
+        }
+
+        // wait for the loops of other threads issued before this one
+        {
+            std::unique_lock<std::mutex> lock(stateMutex);
+            unsigned long long ticket = nextTicket++;
+            if (ticket != servedTicket) {
+                OPTICS_PROFILE_COUNT(QueuedPoolJobs, 1);
+                queueCondition.wait(lock, [&]() { return servedTicket == ticket; });
+            }
+        }
+
+        // give every participant a contiguous share of the chunks
+        size_t chunkCount = (count + chunkSize - 1) / chunkSize;
+        for (int p = 0; p < participants; p++) {
+            ranges[p].next.store(chunkCount * p / participants, std::memory_order_relaxed);
+            ranges[p].end = chunkCount * (p + 1) / participants;
+        }
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            jobBody = &body;
+            jobCount = count;
+            jobChunkSize = chunkSize;
+            jobParticipants = participants;
+            jobScope = ProfileCounterScope::current();
+            pendingWorkers = participants - 1;
+            generation++;
+        }
+        wakeCondition.notify_all();
+
+        insidePoolJob = true;
+        runChunks(0);
+        insidePoolJob = false;
+
+        {
+            std::unique_lock<std::mutex> lock(stateMutex);
+            doneCondition.wait(lock, [&]() { return pendingWorkers == 0; });
+            jobBody = nullptr;
+            servedTicket++;
+        }
+        queueCondition.notify_all();
+    }
+
+    void TracePool::runChunks(int participant)
+    {
+        // own range first, then steal from the others in round-robin order
+        for (int k = 0; k < jobParticipants; k++) {
+            ChunkRange& range = ranges[(participant + k) % jobParticipants];
+            while (true) {
+                size_t chunk = range.next.fetch_add(1, std::memory_order_relaxed);
+                if (chunk >= range.end)
+                    break;
+                size_t begin = chunk * jobChunkSize;
+                (*jobBody)(begin, (std::min)(begin + jobChunkSize, jobCount), participant);
+            }
+        }
+    }
+
+    void TracePool::workerLoop(int workerIndex)
+    {
+        insidePoolJob = true;
+        unsigned long long seenGeneration = 0;
+        while (true) {
+            ProfileCounterScope* scope;
+            {
+                std::unique_lock<std::mutex> lock(stateMutex);
+                wakeCondition.wait(lock, [&]() { return stopFlag || generation != seenGeneration; });
+                if (stopFlag)
+                    return;
+                seenGeneration = generation;
+                // workers beyond the requested thread count sit this job out
+                if (workerIndex + 1 >= jobParticipants)
+                    continue;
+                scope = jobScope;
+            }
+            // counts and allocations of this job go to the caller's scope
+            ProfileCounterScope::setCurrent(scope);
+            runChunks(workerIndex + 1);
+            ProfileCounterScope::setCurrent(nullptr);
+            {
+                std::lock_guard<std::mutex> lock(stateMutex);
+                pendingWorkers--;
+            }
+            doneCondition.notify_one();
+        }
+    }
+
+} // namespace Optics
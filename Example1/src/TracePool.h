@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Optics {
+
+    class ProfileCounterScope;
+
+    // Persistent worker pool running chunked loops with work stealing
+    // Chunks are split into one contiguous range per participant, idle participants steal
+    // chunks from the others, so every chunk is processed exactly once whatever the timing
+    class TracePool {
+    public:
+        // body(begin, end, worker) is called for every chunk, worker is in [0, participants)
+        // and can be used to index per-thread scratch data
+        using ChunkFunction = std::function<void(size_t begin, size_t end, int worker)>;
+
+        static TracePool& instance();
+
+        // Number of threads used for a requested count, 0 or less means all hardware threads
+        static int resolveThreadCount(int requested);
+
+        // Number of participants parallelFor will use for this loop (including the caller)
+        int participantCount(size_t count, size_t chunkSize, int threadCount) const;
+
+        // Run body over [0, count) in chunks of chunkSize, returns when all chunks are done
+        // Single-chunk loops and nested calls run inline on the calling thread
+        // The pool runs one loop at a time: a loop issued from another thread while one is running
+        // waits for it, loops are served in the order they arrive and each gets all its participants,
+        // so a foreground bake waits for at most one block of a background trace instead of running
+        // on one core. Waiting loops are counted by the QueuedPoolJobs profiler counter
+        void parallelFor(size_t count, size_t chunkSize, int threadCount, const ChunkFunction& body);
+
+        TracePool(const TracePool&) = delete;
+        TracePool& operator=(const TracePool&) = delete;
+
+    private:
+        TracePool();
+        ~TracePool();
+
+        struct alignas(64) ChunkRange {
+            std::atomic<size_t> next{ 0 };
+            size_t end{ 0 };
+        };
+
+        void workerLoop(int workerIndex);
+        void runChunks(int participant);
+
+        std::vector<std::thread> workers;
+        std::mutex stateMutex;
+        std::condition_variable wakeCondition;
+        std::condition_variable doneCondition;
+        std::condition_variable queueCondition;
+        // one parallel loop at a time, callers take a ticket and run when it is served
+        unsigned long long nextTicket{ 0 };
+        unsigned long long servedTicket{ 0 };
+        bool stopFlag{ false };
+        unsigned long long generation{ 0 };
+
+        // current job
+        const ChunkFunction* jobBody{ nullptr };
+        size_t jobCount{ 0 };
+        size_t jobChunkSize{ 1 };
+        int jobParticipants{ 0 };
+        ProfileCounterScope* jobScope{ nullptr };  // the caller's, current on the workers while they run the job
+        std::unique_ptr<ChunkRange[]> ranges;
+        int pendingWorkers{ 0 };
+    };
+
+} // namespace Optics
@@ -0,0 +1,122 @@
+// IncrementalTracer against a fresh traceRayPaths after random lens edits, compared bit for bit
+#include "IncrementalTrace.h"
+#include "OpticsSource.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+using namespace Optics;
+
+namespace {
+
+    bool sameBits(double a, double b) { return std::memcmp(&a, &b, sizeof(double)) == 0; }
+    bool sameBits(const NodeWeft::Vec2& a, const NodeWeft::Vec2& b) { return sameBits(a.x, b.x) && sameBits(a.y, b.y); }
+
+    // Index of the first ray that differs, size of the longer list if none does
+    size_t firstDifference(const RayPaths& a, const RayPaths& b)
+    {
+        if (a.size() != b.size())
+            return (std::min)(a.size(), b.size());
+        for (size_t i = 0; i < a.size(); i++) {
+            RayState sa = a.state(i), sb = b.state(i);
+            if (!sameBits(sa.origin, sb.origin) || !sameBits(sa.direction, sb.direction) || !sameBits(sa.wavelength, sb.wavelength)
+                || !sameBits(sa.intensity, sb.intensity) || sa.hitCount != sb.hitCount)
+                return i;
+            for (size_t k = 0; k <= sa.hitCount; k++) {
+                if (!sameBits(a.point(i, k), b.point(i, k)) || (k > 0 && a.surface(i, k) != b.surface(i, k)))
+                    return i;
+            }
+        }
+        return a.size();
+    }
+
+    // An entrance and an exit surface 2 apart, 8 after the last element
+    void appendElement(std::vector<SphereLens>& lenses, std::mt19937& random)
+    {
+        std::uniform_real_distribution<double> radius(30, 120), index(1.4, 1.8);
+        double x = lenses.empty() ? 0 : lenses.back().center.x + 8;
+        double n = index(random);
+        lenses.emplace_back(NodeWeft::Vec2{ x, 0 }, radius(random), n, true, 0.004);
+        lenses.emplace_back(NodeWeft::Vec2{ x + 2, 0 }, -radius(random), n, false, 0.004);
+    }
+
+    // Returns the number of traces that restarted after the first surface, -1 on a difference
+    int run(int precision)
+    {
+        std::mt19937 random(12345 + precision);
+        SourceDescription source;
+        source.sourceType = SourceDescription::ParallelSource;
+        source.rayCount = 5000;     // several arena blocks
+        source.apertureX = -5;
+        source.apertureSize = 8;
+        source.parallelAngle = 5;
+        source.parallelStartOffset = 10;
+        source.spectrum = SourceDescription::BlackbodySpectrum;
+        source.spectralBins = 3;
+        std::vector<Ray> rays;
+        generateSourceRays(source, rays);
+        TraceInput input;
+        input.rays.append(std::move(rays));
+
+        std::vector<SphereLens> lenses;
+        for (int i = 0; i < 6; i++)
+            appendElement(lenses, random);
+
+        IncrementalTracer tracer;
+        int partialTraces = 0;
+        for (int edit = 0; edit < 40; edit++) {
+            std::shared_ptr<const RayPaths> incremental = tracer.trace(input, lenses, 4, precision);
+            RayPaths fresh;
+            fresh.assign(input, precision);
+            traceRayPaths(fresh, lenses, nullptr, 2);
+            size_t difference = firstDifference(*incremental, fresh);
+            if (difference != fresh.size() || incremental->size() != fresh.size()) {
+                std::printf("precision %d, edit %d: ray %zu differs after restarting at surface %zu of %zu\n",
+                    precision, edit, difference, tracer.getRestartSurface(), lenses.size());
+                return -1;
+            }
+            partialTraces += tracer.getRestartSurface() > 0;
+
+            // one random edit: a curvature, a position or an index, or a surface pair added or removed at the end
+            std::uniform_int_distribution<size_t> pick(0, lenses.size() - 1);
+            SphereLens& lens = lenses[pick(random)];
+            switch (std::uniform_int_distribution<int>(0, 4)(random)) {
+            case 0:
+                lens.radius *= std::uniform_real_distribution<double>(0.8, 1.25)(random);
+                break;
+            case 1:
+                lens.center.x += std::uniform_real_distribution<double>(-0.5, 0.5)(random);
+                break;
+            case 2:
+                lens.refractiveIndex = std::uniform_real_distribution<double>(1.4, 1.8)(random);
+                break;
+            case 3:
+                appendElement(lenses, random);
+                break;
+            default:
+                if (lenses.size() > 2)
+                    lenses.resize(lenses.size() - 2);
+                break;
+            }
+        }
+        return partialTraces;
+    }
+
+} // namespace
+
+int main()
+{
+    for (int precision : { RayPaths::DoublePoints, RayPaths::FloatPoints }) {
+        int partialTraces = run(precision);
+        if (partialTraces < 0)
+            return 1;
+        // the edits must have exercised the restart, not only full traces
+        if (partialTraces == 0) {
+            std::printf("precision %d: no trace restarted after the first surface\n", precision);
+            return 1;
+        }
+        std::printf("precision %d: 40 traces match, %d restarted after the first surface\n", precision, partialTraces);
+    }
+    return 0;
+}
@@ -0,0 +1,82 @@
+// traceNonSequential on 1 and on several threads, the sorted outputs compared bit for bit
+#include "NonSequentialTrace.h"
+#include "OpticsSource.h"
+#include <cstdio>
+#include <cstring>
+
+using namespace Optics;
+
+namespace {
+
+    bool sameBits(double a, double b) { return std::memcmp(&a, &b, sizeof(double)) == 0; }
+    bool sameBits(const NodeWeft::Vec2& a, const NodeWeft::Vec2& b) { return sameBits(a.x, b.x) && sameBits(a.y, b.y); }
+
+    bool sameRay(const Ray& a, const Ray& b)
+    {
+        if (!sameBits(a.direction, b.direction) || !sameBits(a.wavelength, b.wavelength) || !sameBits(a.intensity, b.intensity)
+            || a.path.size() != b.path.size() || a.hits.size() != b.hits.size())
+            return false;
+        for (size_t k = 0; k < a.path.size(); k++) {
+            if (!sameBits(a.path[k], b.path[k]))
+                return false;
+        }
+        return true;
+    }
+
+} // namespace
+
+int main()
+{
+    // a stack with a strongly curved element, so rays reflect back and forth and hit total internal reflection
+    std::vector<SphereLens> lenses;
+    for (int i = 0; i < 4; i++) {
+        double x = i * 12.0;
+        lenses.emplace_back(NodeWeft::Vec2{ x, 0 }, i == 2 ? 12.0 : 60.0, 1.7, true, 0.004);
+        lenses.emplace_back(NodeWeft::Vec2{ x + 3, 0 }, i == 2 ? -12.0 : -60.0, 1.7, false, 0.004);
+    }
+    LensSystem system(lenses);
+
+    SourceDescription source;
+    source.sourceType = SourceDescription::ParallelSource;
+    source.rayCount = 4000;
+    source.apertureX = -5;
+    source.apertureSize = 10;
+    source.parallelAngle = 8;
+    source.parallelStartOffset = 10;
+    std::vector<Ray> rays;
+    generateSourceRays(source, rays);
+
+    NonSequentialSettings settings;
+    settings.maxDepth = 16;
+    settings.rouletteThreshold = 1e-2;
+    settings.queueCapacity = 64;    // small, so threads also follow branches on their own stacks
+    settings.threadCount = 1;
+    std::vector<Ray> single;
+    NonSequentialStats singleStats;
+    traceNonSequential(rays, system, settings, single, &singleStats);
+
+    for (int threads : { 2, 3, 8 }) {
+        settings.threadCount = threads;
+        std::vector<Ray> parallel;
+        NonSequentialStats stats;
+        traceNonSequential(rays, system, settings, parallel, &stats);
+        if (parallel.size() != single.size()) {
+            std::printf("%d threads: %zu rays, 1 thread: %zu\n", threads, parallel.size(), single.size());
+            return 1;
+        }
+        for (size_t i = 0; i < single.size(); i++) {
+            if (!sameRay(single[i], parallel[i])) {
+                std::printf("%d threads: ray %zu differs\n", threads, i);
+                return 1;
+            }
+        }
+        if (stats.interactions != singleStats.interactions || stats.rouletteKills != singleStats.rouletteKills) {
+            std::printf("%d threads: %zu interactions and %zu roulette kills, 1 thread: %zu and %zu\n", threads,
+                stats.interactions, stats.rouletteKills, singleStats.interactions, singleStats.rouletteKills);
+            return 1;
+        }
+    }
+    std::printf("%zu rays from %zu sources, %zu paths ended by roulette, the same on 1 to 8 threads\n",
+        single.size(), rays.size(), singleStats.rouletteKills);
+    return 0;
+}